@@ -10,53 +10,165 @@
 
 #pragma once
 
-#include <string>
-#include <mutex>
-#include <unordered_map>
+#include <atomic>
+#include <functional>
 #include <memory>
-
-#include <folly/MapUtil.h>
+#include <mutex>
+#include <vector>
 
 namespace {
 
-template<typename Key, typename Val>
+// Process-wide registry of named objects, owned by the registry.
+//
+// Lookups (get(), and getOrCreate() when the key exists) are lock-free, as
+// they're on the hot path of worker threads; only creating and erasing
+// entries takes a lock. The table is open-addressed over nodes that stay
+// put once published: an erased key keeps its node (with no value), which
+// is reused if the key is created again, and growing the table copies the
+// node pointers into a new table, keeping the old one for readers that
+// may still be probing it. Nodes and tables are freed when the registry is
+// destroyed; the old tables add up to less than the current one.
+//
+// As before, erase() destroys the value right away: callers must not erase
+// values that other threads may still be using.
+template<typename Key, typename Val, typename Hash = std::hash<Key>>
 class CrossThreadRegistry {
-  std::mutex m_mutex;
-  typedef std::unordered_map<Key, std::unique_ptr<Val>> Registry;
-  Registry  m_registry;
+  struct Node {
+    explicit Node(const Key& k) : key(k), val(nullptr) { }
+    const Key key;
+    std::atomic<Val*> val;
+  };
+
+  struct Table {
+    explicit Table(size_t capacity)
+      : mask(capacity - 1),
+        slots(new std::atomic<Node*>[capacity]) {
+      for (size_t i = 0; i < capacity; i++) {
+        slots[i].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+    size_t capacity() const {
+      return mask + 1;
+    }
+    const size_t mask;
+    std::unique_ptr<std::atomic<Node*>[]> slots;
+  };
+
+  static constexpr size_t kInitialCapacity = 16;
+
+  std::mutex m_mutex;  // serializes writers
+  std::atomic<Table*> m_table;
+  // Protected by m_mutex: all tables ever used (the current one last), and
+  // the number of nodes in the current one.
+  std::vector<std::unique_ptr<Table>> m_tables;
+  size_t m_nodes;
 
 public:
+  CrossThreadRegistry() : m_nodes(0) {
+    m_tables.emplace_back(new Table(kInitialCapacity));
+    m_table.store(m_tables.back().get());
+  }
+
+  ~CrossThreadRegistry() {
+    auto table = m_table.load();
+    for (size_t i = 0; i < table->capacity(); i++) {
+      if (auto node = table->slots[i].load()) {
+        delete node->val.load();
+        delete node;
+      }
+    }
+  }
+
+  CrossThreadRegistry(const CrossThreadRegistry&) = delete;
+  CrossThreadRegistry& operator=(const CrossThreadRegistry&) = delete;
+
   template <typename Lambda>
   Val* getOrCreate(const Key& key, Lambda factory) {
+    if (auto val = get(key)) {
+      return val;
+    }
     std::lock_guard<std::mutex> l(m_mutex);
-    auto pos = m_registry.find(key);
-    if (pos == m_registry.end()) {
-      pos = m_registry.emplace(key, factory()).first;
+    auto node = findOrInsert(key);
+    auto val = node->val.load();
+    if (!val) {
+      val = factory().release();
+      node->val.store(val);
     }
-    return pos->second.get();
+    return val;
   }
 
   template<typename Lambda>
   bool create(const Key& key, Lambda factory) {
     std::lock_guard<std::mutex> l(m_mutex);
-    if (folly::get_ptr(m_registry, key)) {
+    auto node = findOrInsert(key);
+    if (node->val.load()) {
       return false;
     }
-    m_registry[key] = factory();
+    node->val.store(factory().release());
     return true;
   }
 
   bool erase(const Key& key) {
     std::lock_guard<std::mutex> l(m_mutex);
-    return m_registry.erase(key);
+    auto node = find(m_table.load(), key);
+    if (!node) {
+      return false;
+    }
+    auto val = node->val.exchange(nullptr);
+    delete val;
+    return val != nullptr;
   }
 
-  Val* get(const Key& key) {
-    std::lock_guard<std::mutex> l(m_mutex);
-    if (auto valp = folly::get_ptr(m_registry, key)) {
-      return valp->get();
+  Val* get(const Key& key) const {
+    auto node = find(m_table.load(), key);
+    return node ? node->val.load() : nullptr;
+  }
+
+private:
+  static Node* find(const Table* table, const Key& key) {
+    for (size_t i = Hash()(key) & table->mask;; i = (i + 1) & table->mask) {
+      auto node = table->slots[i].load();
+      if (!node || node->key == key) {
+        return node;
+      }
+    }
+  }
+
+  // Must hold m_mutex.
+  Node* findOrInsert(const Key& key) {
+    auto table = m_table.load();
+    if (auto node = find(table, key)) {
+      return node;
+    }
+    // Keep the load factor at most 1/2, so probes stay short.
+    if ((m_nodes + 1) * 2 > table->capacity()) {
+      table = grow(table);
+    }
+    std::unique_ptr<Node> node(new Node(key));
+    insert(table, node.get());
+    m_nodes++;
+    return node.release();
+  }
+
+  static void insert(Table* table, Node* node) {
+    auto i = Hash()(node->key) & table->mask;
+    while (table->slots[i].load(std::memory_order_relaxed)) {
+      i = (i + 1) & table->mask;
+    }
+    table->slots[i].store(node);
+  }
+
+  // Must hold m_mutex.
+  Table* grow(Table* old) {
+    std::unique_ptr<Table> table(new Table(old->capacity() * 2));
+    for (size_t i = 0; i < old->capacity(); i++) {
+      if (auto node = old->slots[i].load(std::memory_order_relaxed)) {
+        insert(table.get(), node);
+      }
     }
-    return nullptr;
+    m_tables.push_back(std::move(table));
+    m_table.store(m_tables.back().get());
+    return m_tables.back().get();
   }
 };
 
@@ -161,6 +161,9 @@ inline int luaRealIndex(lua_State* L, int index) {
   return index;
 }
 
+// lua_type() of LuaJIT cdata objects (LUA_TCDATA is internal to LuaJIT)
+constexpr int kLuaTypeCData = 10;
+
 // Helper functions to store and load C pointers (lightuserdata) in the
 // Lua registry. The key must be the address of a static variable in your
 // code, or some other address-space-unique key.
@@ -0,0 +1,355 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "AtomicMap.h"
+#include "TensorTraits.h"
+#include <fblualib/CrossThreadRegistry.h>
+
+#include <lua.hpp>
+#include <fblualib/LuaUtils.h>
+#include <folly/Format.h>
+#include <folly/Memory.h>
+#include <cstring>
+#include <memory>
+
+using namespace fblualib;
+using namespace std;
+
+namespace {
+
+constexpr const char* kTypeName = "fblualib.atomicmap";
+
+struct TorchAtomicMapIf {
+  virtual ~TorchAtomicMapIf() { }
+
+  virtual int luaRead(lua_State* L) = 0;
+  virtual int luaWrite(lua_State* L) = 0;
+  virtual int luaSize(lua_State* L) = 0;
+  virtual int luaGetOrCreate(lua_State* L) = 0;
+  virtual int luaReadBatch(lua_State* L) = 0;
+  virtual int luaKeys(lua_State* L) = 0;
+  virtual int luaSave(lua_State* L) = 0;
+  virtual int luaLoad(lua_State* L) = 0;
+};
+
+TorchAtomicMapIf*
+checkAtomicMap(lua_State* L, int idx) {
+  auto am = static_cast<TorchAtomicMapIf**>
+    (luaL_checkudata(L, idx, kTypeName));
+  DCHECK(am);
+  return *am;
+}
+
+// Getting keys to and from Lua. Keys are strict: the number 1 and the
+// string "1" are different keys, and neither converts to the other.
+template<typename K> struct LuaKey;
+
+template<> struct LuaKey<int64_t> {
+  static int64_t check(lua_State* L, int idx) {
+    return luaGetNumberChecked<int64_t>(L, idx, true);
+  }
+  static void push(lua_State* L, int64_t k) {
+    lua_pushnumber(L, k);
+  }
+  // A Lua table of numbers, or a contiguous 1-dimensional torch.LongTensor.
+  static std::vector<int64_t> checkBatch(lua_State* L, int idx) {
+    std::vector<int64_t> keys;
+    if (lua_istable(L, idx)) {
+      auto n = lua_objlen(L, idx);
+      keys.reserve(n);
+      for (size_t i = 1; i <= n; i++) {
+        lua_rawgeti(L, idx, i);
+        keys.push_back(check(L, -1));
+        lua_pop(L, 1);
+      }
+      return keys;
+    }
+    auto t = luaGetTensorChecked<long>(L, idx);
+    auto n = t->size();
+    if (n != 0 && (t->ndims() != 1 || !t->isContiguous())) {
+      luaL_error(L, "keys must be a table or a contiguous 1-d LongTensor");
+    }
+    keys.assign(t->data(), t->data() + n);
+    return keys;
+  }
+};
+
+template<> struct LuaKey<std::string> {
+  static folly::StringPiece check(lua_State* L, int idx) {
+    return luaGetStringChecked(L, idx, true);
+  }
+  static void push(lua_State* L, const std::string& k) {
+    lua_pushlstring(L, k.data(), k.size());
+  }
+  // A Lua table of strings; the returned pieces point into the strings in
+  // the table, so they're valid as long as the table is on the stack.
+  static std::vector<folly::StringPiece> checkBatch(lua_State* L, int idx) {
+    luaL_checktype(L, idx, LUA_TTABLE);
+    std::vector<folly::StringPiece> keys;
+    auto n = lua_objlen(L, idx);
+    keys.reserve(n);
+    for (size_t i = 1; i <= n; i++) {
+      lua_rawgeti(L, idx, i);
+      keys.push_back(check(L, -1));
+      lua_pop(L, 1);
+    }
+    return keys;
+  }
+};
+
+template<typename Real, typename K>
+class TorchAtomicMap : public TorchAtomicMapIf {
+  typedef typename thpp::Tensor<Real>::THType Tensor;
+  typedef LuaKey<K> Key;
+
+  AtomicMap<K, Tensor*> m_am;
+
+  Tensor* checkTensor(lua_State* L, int idx) {
+    auto t = static_cast<Tensor**>(
+      luaL_checkudata(L, idx, kTensorTypeName));
+    DCHECK(t);
+    return *t;
+  }
+
+  // Push val, whose reference Lua takes over, or nil if null.
+  void pushTensor(lua_State* L, Tensor* val) {
+    if (val) {
+      luaT_pushudata(L, val, kTensorTypeName);
+    } else {
+      lua_pushnil(L);
+    }
+  }
+
+ public:
+  constexpr static const char* kTensorTypeName =
+    thpp::Tensor<Real>::kLuaTypeName;
+
+  virtual ~TorchAtomicMap() { }
+
+  // Missing keys read as nil.
+  virtual int luaRead(lua_State* L) {
+    pushTensor(L, m_am.read(Key::check(L, 2)));
+    return 1;
+  }
+
+  virtual int luaWrite(lua_State* L) {
+    auto key = Key::check(L, 2);
+    m_am.write(key, checkTensor(L, 3));
+    return 0;
+  }
+
+  virtual int luaSize(lua_State* L) {
+    lua_pushnumber(L, m_am.size());
+    return 1;
+  }
+
+  // get_or_create(key, init): return the tensor at key, first setting it to
+  // init(key) if absent. init is called without holding any locks (so it
+  // may create other entries); if several threads race to create the same
+  // key, they may all call init, but they all get the same tensor.
+  virtual int luaGetOrCreate(lua_State* L) {
+    auto key = Key::check(L, 2);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    auto val = m_am.getOrCreate(key, [&] {
+      lua_pushvalue(L, 3);
+      lua_pushvalue(L, 2);
+      lua_call(L, 1, 1);
+      auto t = checkTensor(L, -1);
+      Refcount<Tensor*>().inc(t);  // the map's (stack slot goes away)
+      lua_pop(L, 1);
+      return t;
+    });
+    pushTensor(L, val);
+    return 1;
+  }
+
+  // read_batch(keys): return a table with the tensors at keys, in the same
+  // order; missing keys leave holes.
+  virtual int luaReadBatch(lua_State* L) {
+    auto keys = Key::checkBatch(L, 2);
+    std::vector<Tensor*> vals(keys.size());
+    m_am.readBatch(keys.data(), keys.size(), vals.data());
+    lua_createtable(L, vals.size(), 0);
+    for (size_t i = 0; i < vals.size(); i++) {
+      if (vals[i]) {
+        luaT_pushudata(L, vals[i], kTensorTypeName);
+        lua_rawseti(L, -2, i + 1);
+      }
+    }
+    return 1;
+  }
+
+  virtual int luaKeys(lua_State* L) {
+    lua_createtable(L, m_am.size(), 0);
+    int i = 0;
+    m_am.forEach([&] (const K& key, Tensor* /*val*/) {
+      Key::push(L, key);
+      lua_rawseti(L, -2, ++i);
+    });
+    return 1;
+  }
+
+  virtual int luaSave(lua_State* L) {
+    auto file = luaDecodeFILE(L, 2);
+    try {
+      m_am.save(file);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic map error: %s", err.what());
+    }
+    return 0;
+  }
+
+  virtual int luaLoad(lua_State* L) {
+    auto file = luaDecodeFILE(L, 2);
+    try {
+      m_am.load(file);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic map error: %s", err.what());
+    }
+    return 0;
+  }
+};
+
+CrossThreadRegistry<string, TorchAtomicMapIf> g_mapTab;
+
+// create_<type>(name, [key_type]); key_type is "int64" (default) or
+// "string".
+template<typename Real>
+int create(lua_State* L) {
+  auto name = luaL_checkstring(L, 1);
+  auto keyType = luaL_optstring(L, 2, "int64");
+  bool created;
+  if (!strcmp(keyType, "int64")) {
+    created = g_mapTab.create(name, [] {
+      return folly::make_unique<TorchAtomicMap<Real, int64_t>>();
+    });
+  } else if (!strcmp(keyType, "string")) {
+    created = g_mapTab.create(name, [] {
+      return folly::make_unique<TorchAtomicMap<Real, std::string>>();
+    });
+  } else {
+    return luaL_error(L, "invalid atomic map key type \"%s\"", keyType);
+  }
+  if (created) {
+    lua_pushboolean(L, true);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+int createDouble(lua_State* L) {
+  return create<double>(L);
+}
+
+int createFloat(lua_State* L) {
+  return create<float>(L);
+}
+
+int createInt(lua_State* L) {
+  return create<int>(L);
+}
+
+int destroy(lua_State* L) {
+  auto name = luaL_checkstring(L, 1);
+  auto removed = g_mapTab.erase(name);
+  if (removed) {
+    lua_pushboolean(L, true);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+int get(lua_State* L) {
+  auto name = luaL_checkstring(L, 1);
+  auto ptr = g_mapTab.get(name);
+  if (!ptr) {
+    luaL_error(L, "no such atomic map: \"%s\"", name);
+  }
+  auto luaPtr = (TorchAtomicMapIf**)
+    lua_newuserdata(L, sizeof(TorchAtomicMapIf*));
+  *luaPtr = ptr;
+  if (!luaT_pushmetatable(L, kTypeName)) {
+    assert(false);
+  }
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+int read(lua_State* L) {
+  return checkAtomicMap(L, 1)->luaRead(L);
+}
+
+int write(lua_State* L) {
+  return checkAtomicMap(L, 1)->luaWrite(L);
+}
+
+int size(lua_State* L) {
+  return checkAtomicMap(L, 1)->luaSize(L);
+}
+
+int getOrCreate(lua_State* L) {
+  return checkAtomicMap(L, 1)->luaGetOrCreate(L);
+}
+
+int readBatch(lua_State* L) {
+  return checkAtomicMap(L, 1)->luaReadBatch(L);
+}
+
+int keys(lua_State* L) {
+  return checkAtomicMap(L, 1)->luaKeys(L);
+}
+
+int save(lua_State* L) {
+  return checkAtomicMap(L, 1)->luaSave(L);
+}
+
+int load(lua_State* L) {
+  return checkAtomicMap(L, 1)->luaLoad(L);
+}
+
+const struct luaL_reg moduleFuncs[] = {
+  { "create_float", createFloat },
+  { "create_double", createDouble },
+  { "create_int", createInt },
+  { "destroy", destroy },
+  { "get", get },
+  { "get_or_create", getOrCreate },
+  { "read_batch", readBatch },
+  { "keys", keys },
+
+  { "load", load },
+  { "save",  save },
+
+  { nullptr, nullptr },
+};
+
+const struct luaL_reg mapOps[] = {
+  { "__index", read },
+  { "__newindex", write },
+  { "__len" , size },
+  { nullptr, nullptr },
+};
+
+} // namespace
+
+extern "C" int LUAOPEN(lua_State* L) {
+  // Map ops.
+  if (luaL_newmetatable(L, kTypeName)) {
+    luaL_register(L, nullptr, mapOps);
+    lua_pop(L, 1);
+  }
+
+  // Return module table.
+  lua_newtable(L);
+  luaL_register(L, nullptr, moduleFuncs);
+  return 1;
+}
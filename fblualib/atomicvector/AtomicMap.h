@@ -0,0 +1,435 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include "AtomicVector.h"
+
+#include <string>
+
+#include <folly/Hash.h>
+#include <folly/Range.h>
+#include <folly/SharedMutex.h>
+
+namespace fblualib {
+
+// How AtomicMap hashes, compares and serializes keys. Lookup is the type
+// used to look keys up, so that looking up a string doesn't require
+// allocating a std::string.
+template<typename K> struct MapKey;
+
+template<> struct MapKey<int64_t> {
+  typedef int64_t Lookup;
+
+  static uint64_t hash(int64_t k) {
+    return folly::hash::twang_mix64(uint64_t(k));
+  }
+  static bool equal(int64_t a, int64_t b) {
+    return a == b;
+  }
+  static int64_t make(int64_t k) {
+    return k;
+  }
+  static folly::ByteRange bytes(const int64_t& k) {
+    return folly::ByteRange(reinterpret_cast<const uint8_t*>(&k), sizeof(k));
+  }
+  static int64_t load(folly::ByteRange br) {
+    int64_t k;
+    if (br.size() != sizeof(k)) {
+      throw std::runtime_error("bad int64 key loading atomicmap");
+    }
+    memcpy(&k, br.data(), sizeof(k));
+    return k;
+  }
+};
+
+template<> struct MapKey<std::string> {
+  typedef folly::StringPiece Lookup;
+
+  static uint64_t hash(folly::StringPiece k) {
+    return folly::hash::fnv64_buf(k.data(), k.size());
+  }
+  static bool equal(const std::string& a, folly::StringPiece b) {
+    return folly::StringPiece(a) == b;
+  }
+  static std::string make(folly::StringPiece k) {
+    return k.str();
+  }
+  static folly::ByteRange bytes(const std::string& k) {
+    return folly::ByteRange(folly::StringPiece(k));
+  }
+  static std::string load(folly::ByteRange br) {
+    return std::string(reinterpret_cast<const char*>(br.data()), br.size());
+  }
+};
+
+// Hash map from keys (int64_t or std::string; see MapKey) to refcounted
+// values, meant to be shared by many threads; the companion of AtomicVector,
+// with the same requirements on T (Refcount<T>, Serde<T>, 0 is not a valid
+// value).
+//
+// Reads are lock-free: the table is open-addressed (linear probing) over
+// stable, never-freed nodes, and replaced tables and values are reclaimed
+// with epochs, as in AtomicVector. Writers serialize per key, on striped
+// spinlocks; growing the table (at load factor 1/2) excludes writers, but
+// not readers. There is no erase.
+template<typename K, typename T>
+class AtomicMap {
+  typedef MapKey<K> Key;
+  typedef typename Key::Lookup Lookup;
+
+  struct Node {
+    Node(K k, uint64_t h, T v) : key(std::move(k)), hash(h), value(v) { }
+    const K key;
+    const uint64_t hash;
+    std::atomic<T> value;
+  };
+
+  struct Table {
+    explicit Table(size_t capacity)
+      : mask(capacity - 1),
+        slots(static_cast<std::atomic<Node*>*>(
+            calloc(capacity, sizeof(std::atomic<Node*>)))) {
+      assert((capacity & mask) == 0);
+      if (!slots) {
+        throw std::bad_alloc();
+      }
+    }
+    ~Table() {
+      free(slots);
+    }
+    Table(const Table&) = delete;
+    Table& operator=(const Table&) = delete;
+
+    size_t capacity() const {
+      return mask + 1;
+    }
+
+    const size_t mask;
+    std::atomic<Node*>* const slots;
+  };
+
+ public:
+  static const int kMagic = 0x0408197a;
+
+  explicit AtomicMap(size_t initialCapacity = 16)
+    : m_table(new Table(folly::nextPowTwo(std::max(initialCapacity,
+                                                   size_t(2))))),
+      m_size(0) {
+  }
+
+  ~AtomicMap() {
+    // As for AtomicVector: nobody may be using the map anymore.
+    assert(m_epochs.appearsQuiescent());
+    m_epochs.drain();
+    auto table = m_table.load();
+    Refcount<T> rc;
+    for (size_t i = 0; i < table->capacity(); i++) {
+      auto node = table->slots[i].load();
+      if (node) {
+        rc.dec(node->value.load());
+        delete node;
+      }
+    }
+    delete table;
+  }
+
+  AtomicMap(const AtomicMap&) = delete;
+  AtomicMap& operator=(const AtomicMap&) = delete;
+
+  size_t size() const {
+    return m_size.load();
+  }
+
+  // Return the value for key, increffed, or 0 if absent.
+  T read(Lookup key) const {
+    T val = 0;
+    borrow(key, [&] (T v) {
+      Refcount<T>().inc(v);
+      val = v;
+    });
+    return val;
+  }
+
+  // Call fn(value) without touching the refcount, if key is present; the
+  // value is only guaranteed to stay alive during the call. Returns
+  // whether key was present.
+  template<typename Fn>
+  bool borrow(Lookup key, Fn fn) const {
+    detail::EpochGuard guard(&m_epochs);
+    auto node = find(m_table.load(), key, Key::hash(key));
+    if (!node) {
+      return false;
+    }
+    fn(node->value.load());
+    return true;
+  }
+
+  // Look up n keys under a single epoch guard; out[i] is the increffed
+  // value for keys[i], or 0 if absent.
+  void readBatch(const Lookup* keys, size_t n, T* out) const {
+    Refcount<T> rc;
+    detail::EpochGuard guard(&m_epochs);
+    auto table = m_table.load();
+    for (size_t i = 0; i < n; i++) {
+      auto node = find(table, keys[i], Key::hash(keys[i]));
+      out[i] = node ? node->value.load() : 0;
+      if (out[i]) {
+        rc.inc(out[i]);
+      }
+    }
+  }
+
+  // Insert or replace. The replaced value is decref'ed once no reader may
+  // still be using it.
+  void write(Lookup key, T val) {
+    assert(val);
+    Refcount<T>().inc(val);
+    bool inserted;
+    auto node = insert(key, val, &inserted);
+    if (!inserted) {
+      auto old = node->value.exchange(val);
+      retire(old);
+    }
+  }
+
+  // Return the (increffed) value for key, first inserting init() if key is
+  // absent. init() returns a new reference, which the map takes over; it
+  // is called without holding any locks, so it may run more than once if
+  // several threads race to create the same key, and only one result wins.
+  template<typename Init>
+  T getOrCreate(Lookup key, Init init) {
+    auto val = read(key);
+    if (val) {
+      return val;
+    }
+    val = init();
+    assert(val);
+    Refcount<T> rc;
+    rc.inc(val);  // The map's reference, if we win; ours is returned
+    bool inserted;
+    insert(key, val, &inserted);
+    if (inserted) {
+      return val;
+    }
+    rc.dec(val);
+    rc.dec(val);
+    return read(key);
+  }
+
+  // As for AtomicVector: decref the values replaced by write() that no
+  // reader can still be using. Normally not needed.
+  void flushRetired() {
+    m_epochs.reclaimAll();
+  }
+
+  // Call fn(key, value) for all entries (without touching refcounts), in
+  // no particular order. Entries inserted concurrently may or may not be
+  // visited.
+  template<typename Fn>
+  void forEach(Fn fn) const {
+    detail::EpochGuard guard(&m_epochs);
+    auto table = m_table.load();
+    for (size_t i = 0; i < table->capacity(); i++) {
+      auto node = table->slots[i].load();
+      if (node) {
+        fn(node->key, node->value.load());
+      }
+    }
+  }
+
+  // Save / load, in AtomicVector's framing (see detail::saveFramed()), with
+  // a different magic value. Each entry is the key's length, the key, then
+  // the value as encoded by Serde<T>. Entries are encoded and decoded in
+  // parallel. Like AtomicVector::save(), save() is racy with respect to
+  // concurrent writers. load() merges into the current contents.
+  void save(FILE* file) const {
+    // Nodes are never freed, so they may be used outside the guard.
+    std::vector<Node*> nodes;
+    nodes.reserve(size());
+    {
+      detail::EpochGuard guard(&m_epochs);
+      auto table = m_table.load();
+      for (size_t i = 0; i < table->capacity(); i++) {
+        auto node = table->slots[i].load();
+        if (node) {
+          nodes.push_back(node);
+        }
+      }
+    }
+
+    detail::saveFramed(file, kMagic, nodes.size(),
+                       [&] (size_t i, std::vector<uint8_t>& buf) {
+      appendEntry(nodes[i], buf);
+    });
+  }
+
+  void load(FILE* file) {
+    detail::loadFramed(
+      file, kMagic,
+      [this] (size_t n) {
+        reserve(size() + n);
+      },
+      [this] (size_t /*i*/, folly::ByteRange range) {
+        size_t keySz;
+        if (range.size() < sizeof(keySz)) {
+          throw std::runtime_error("truncated atomicmap entry");
+        }
+        memcpy(&keySz, range.data(), sizeof(keySz));
+        range.advance(sizeof(keySz));
+        if (range.size() < keySz) {
+          throw std::runtime_error("truncated atomicmap entry");
+        }
+        auto key = Key::load(range.subpiece(0, keySz));
+        range.advance(keySz);
+        auto val = Serde<T>::load(&range);
+        SCOPE_EXIT {
+          Refcount<T>().dec(val);
+        };
+        write(key, val);
+      });
+  }
+
+  // Make room for n entries without growing.
+  void reserve(size_t n) {
+    folly::SharedMutex::WriteHolder g(m_resizeLock);
+    auto capacity = m_table.load()->capacity();
+    if (n * 2 > capacity) {
+      rehash(folly::nextPowTwo(n * 2));
+    }
+  }
+
+ private:
+  static Node* find(const Table* table, Lookup key, uint64_t hash) {
+    for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+      auto node = table->slots[i].load();
+      if (!node) {
+        return nullptr;
+      }
+      if (node->hash == hash && Key::equal(node->key, key)) {
+        return node;
+      }
+    }
+  }
+
+  // Find the node for key, inserting one (holding val, whose reference the
+  // map takes over) if absent; *inserted says which.
+  Node* insert(Lookup key, T val, bool* inserted) {
+    auto hash = Key::hash(key);
+    for (;;) {
+      {
+        folly::SharedMutex::ReadHolder resizeGuard(m_resizeLock);
+        // Inserters of the same key serialize here, so they can't both
+        // insert it.
+        m_keyLocks.lock(hash);
+        SCOPE_EXIT {
+          m_keyLocks.unlock(hash);
+        };
+
+        auto table = m_table.load();
+        auto node = find(table, key, hash);
+        if (node) {
+          *inserted = false;
+          return node;
+        }
+
+        // Reserve room, so that the table never fills up.
+        if ((m_size.fetch_add(1) + 1) * 2 <= table->capacity()) {
+          node = new Node(Key::make(key), hash, val);
+          // Inserters of other keys may race with us for empty slots.
+          for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+            Node* expected = nullptr;
+            if (table->slots[i].compare_exchange_strong(expected, node)) {
+              break;
+            }
+          }
+          *inserted = true;
+          return node;
+        }
+        m_size.fetch_sub(1);
+      }
+
+      folly::SharedMutex::WriteHolder g(m_resizeLock);
+      auto capacity = m_table.load()->capacity();
+      if ((m_size + 1) * 2 > capacity) {
+        rehash(capacity * 2);
+      }
+    }
+  }
+
+  // Replace the table with one of the given capacity. Must hold
+  // m_resizeLock exclusively, so there are no concurrent inserters;
+  // readers may still be using the old table.
+  void rehash(size_t capacity) {
+    auto old = m_table.load();
+    std::unique_ptr<Table> table(new Table(capacity));
+    for (size_t i = 0; i < old->capacity(); i++) {
+      auto node = old->slots[i].load(std::memory_order_relaxed);
+      if (!node) continue;
+      auto j = node->hash & table->mask;
+      while (table->slots[j].load(std::memory_order_relaxed)) {
+        j = (j + 1) & table->mask;
+      }
+      table->slots[j].store(node, std::memory_order_relaxed);
+    }
+    m_table.store(table.release());
+    m_epochs.retire(reinterpret_cast<uintptr_t>(old), &freeTable);
+  }
+
+  static void freeTable(uintptr_t p) {
+    delete reinterpret_cast<Table*>(p);
+  }
+
+  static void decrefRetired(uintptr_t val) {
+    Refcount<T>().dec((T)val);
+  }
+
+  void retire(T val) {
+    m_epochs.retire((uintptr_t)val, &AtomicMap::decrefRetired);
+  }
+
+  void appendEntry(Node* node, std::vector<uint8_t>& buf) const {
+    T val;
+    {
+      detail::EpochGuard guard(&m_epochs);
+      val = node->value.load();
+      Refcount<T>().inc(val);
+    }
+    SCOPE_EXIT {
+      Refcount<T>().dec(val);
+    };
+    fblualib::thrift::StringWriter sw;
+    auto str = Serde<T>::save(val, sw);
+    auto key = Key::bytes(node->key);
+    size_t keySz = key.size();
+    size_t entrySz = sizeof(keySz) + keySz + str.size();
+    auto pos = buf.size();
+    buf.resize(pos + sizeof(entrySz) + entrySz);
+    auto p = &buf[pos];
+    memcpy(p, &entrySz, sizeof(entrySz));
+    p += sizeof(entrySz);
+    memcpy(p, &keySz, sizeof(keySz));
+    p += sizeof(keySz);
+    memcpy(p, key.data(), keySz);
+    p += keySz;
+    memcpy(p, str.data(), str.size());
+  }
+
+  static_assert(sizeof(T) <= sizeof(uintptr_t),
+                "AtomicMap values must fit in a uintptr_t");
+
+  std::atomic<Table*> m_table;
+  std::atomic<size_t> m_size;
+  folly::SharedMutex m_resizeLock;
+  detail::StripedSpinLock m_keyLocks;
+  mutable detail::EpochManager m_epochs;
+};
+
+} // namespace fblualib
@@ -0,0 +1,255 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "AtomicMap.h"
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <string>
+#include <thread>
+
+using namespace std;
+using namespace fblualib;
+
+// As in AtomicVectorTest: integers stand in for tensors.
+template<>
+struct Refcount<int> {
+  constexpr static int kMaxInt = 1000;
+  static atomic<int> m_counts[kMaxInt];
+
+  static void _check(int i) {
+    assert(i > 0 && i <= kMaxInt);
+  }
+
+  void inc(int i) {
+    _check(i);
+    m_counts[i - 1]++;
+  }
+
+  void dec(int i) {
+    _check(i);
+    assert(m_counts[i - 1] > 0);
+    m_counts[i - 1]--;
+  }
+
+  int get(int i) const {
+    _check(i);
+    return m_counts[i - 1];
+  }
+
+  void assertClear() const {
+    for (int i = 0; i < kMaxInt; i++) {
+      ASSERT_EQ(m_counts[i], 0);
+    }
+  }
+};
+
+atomic<int> Refcount<int>::m_counts[Refcount<int>::kMaxInt];
+
+template<>
+struct Serde<int> {
+  static folly::StringPiece save(int i, thrift::StringWriter& sw) {
+    sw(folly::IOBuf::copyBuffer(&i, sizeof(i)));
+    return folly::StringPiece(sw.finish());
+  }
+
+  static int load(folly::ByteRange* br) {
+    int i;
+    assert(br->size() == sizeof(i));
+    memcpy(&i, br->data(), sizeof(i));
+    Refcount<int>().inc(i);  // caller's job to decref
+    return i;
+  }
+};
+
+template<typename Lambda>
+int mptest(Lambda l) {
+  vector<thread> threads;
+  auto nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 0; i < nprocs; i++) {
+    threads.push_back(thread([l, i] {
+      l(i);
+    }));
+  }
+
+  for (auto& t: threads) {
+    t.join();
+  }
+  return nprocs;
+}
+
+TEST(AtomicMap, readWrite) {
+  Refcount<int> rc;
+  {
+    AtomicMap<int64_t, int> map;
+    ASSERT_EQ(map.read(42), 0);
+    // Enough keys to grow the table a few times
+    const int N = 500;
+    for (int i = 0; i < N; i++) {
+      map.write(int64_t(i) << 32, i + 1);
+    }
+    ASSERT_EQ(map.size(), N);
+    for (int i = 0; i < N; i++) {
+      auto val = map.read(int64_t(i) << 32);
+      ASSERT_EQ(val, i + 1);
+      ASSERT_EQ(rc.get(val), 2);
+      rc.dec(val);
+    }
+
+    map.write(0, 7);
+    ASSERT_EQ(map.size(), N);
+    ASSERT_EQ(rc.get(1), 0);
+    ASSERT_EQ(rc.get(7), 2);
+
+    int64_t keys[] = { 1LL << 32, 3, 2LL << 32 };
+    int vals[3];
+    map.readBatch(keys, 3, vals);
+    ASSERT_EQ(vals[0], 2);
+    ASSERT_EQ(vals[1], 0);
+    ASSERT_EQ(vals[2], 3);
+    rc.dec(vals[0]);
+    rc.dec(vals[2]);
+  }
+  rc.assertClear();
+}
+
+TEST(AtomicMap, stringKeys) {
+  Refcount<int> rc;
+  {
+    AtomicMap<string, int> map;
+    map.write("foo", 1);
+    map.write(string("bar"), 2);
+    ASSERT_EQ(map.read("baz"), 0);
+    auto val = map.read("foo");
+    ASSERT_EQ(val, 1);
+    rc.dec(val);
+
+    int count = 0;
+    map.forEach([&] (const string& key, int v) {
+      ASSERT_EQ(key == "foo" ? 1 : 2, v);
+      count++;
+    });
+    ASSERT_EQ(count, 2);
+  }
+  rc.assertClear();
+}
+
+TEST(AtomicMap, mpGetOrCreate) {
+  Refcount<int> rc;
+  // Every thread creates every key; exactly one init per key wins, and
+  // everybody agrees on the winner.
+  {
+    AtomicMap<int64_t, int> map;
+    const int N = 200;
+    atomic<int> results[N];
+    for (int i = 0; i < N; i++) {
+      results[i] = 0;
+    }
+    auto numThreads = mptest([&](int idx) {
+      for (int i = 0; i < N; i++) {
+        auto val = map.getOrCreate(i, [&] {
+          auto v = (i * 4 + idx % 4) % Refcount<int>::kMaxInt + 1;
+          rc.inc(v);
+          return v;
+        });
+        int expected = 0;
+        if (!results[i].compare_exchange_strong(expected, val)) {
+          ASSERT_EQ(expected, val);
+        }
+        rc.dec(val);
+      }
+    });
+    ASSERT_GT(numThreads, 0);
+    ASSERT_EQ(map.size(), N);
+    for (int i = 0; i < N; i++) {
+      auto val = map.read(i);
+      ASSERT_EQ(val, results[i]);
+      rc.dec(val);
+    }
+  }
+  rc.assertClear();
+}
+
+TEST(AtomicMap, mpReadWrite) {
+  Refcount<int> rc;
+  // Concurrent inserters, overwriters and readers, while the table grows.
+  {
+    AtomicMap<int64_t, int> map(2);
+    const int N = 4096;
+    auto numThreads = mptest([&](int idx) {
+      for (int i = 0; i < N; i++) {
+        auto key = (i * 7 + idx) % N;
+        if (i % 3 == 0) {
+          map.write(key, (i + idx) % Refcount<int>::kMaxInt + 1);
+        } else {
+          auto val = map.read(key);
+          if (val) {
+            ASSERT_GT(rc.get(val), 0);
+            rc.dec(val);
+          }
+        }
+      }
+    });
+    ASSERT_LE(map.size(), N);
+    size_t count = 0;
+    map.forEach([&] (int64_t key, int /*val*/) {
+      ASSERT_TRUE(key >= 0 && key < N);
+      count++;
+    });
+    ASSERT_EQ(count, map.size());
+    ASSERT_GT(numThreads, 0);
+  }
+  rc.assertClear();
+}
+
+TEST(AtomicMap, saveLoad) {
+  Refcount<int> rc;
+  {
+    // Enough entries for several parallel save rounds
+    const int N = 100000;
+    AtomicMap<string, int> map;
+    for (int i = 0; i < N; i++) {
+      map.write(to_string(i), i % Refcount<int>::kMaxInt + 1);
+    }
+
+    auto file = tmpfile();
+    ASSERT_TRUE(file);
+    fputs("prefix", file);
+    map.save(file);
+    auto end = ftell(file);
+    fputs("suffix", file);
+
+    fseek(file, 6, SEEK_SET);
+    AtomicMap<string, int> loaded;
+    loaded.write("extra", 1);
+    loaded.load(file);
+    ASSERT_EQ(ftell(file), end);
+    ASSERT_EQ(loaded.size(), N + 1);
+    for (int i = 0; i < N; i++) {
+      auto val = loaded.read(to_string(i));
+      ASSERT_EQ(val, i % Refcount<int>::kMaxInt + 1);
+      rc.dec(val);
+    }
+
+    // Not an AtomicVector file, and vice versa
+    rewind(file);
+    AtomicVector<int> vec;
+    fputs("prefix", file);
+    vec.save(file);
+    fseek(file, 6, SEEK_SET);
+    EXPECT_THROW(loaded.load(file), runtime_error);
+    fclose(file);
+  }
+  rc.assertClear();
+}
@@ -9,10 +9,20 @@
  */
 
 #include "AtomicVector.h"
+#include "SharedAtomicVector.h"
+#include "TensorTraits.h"
 #include <fblualib/CrossThreadRegistry.h>
 
 #include <lua.hpp>
 #include <fblualib/LuaUtils.h>
+#include <fblualib/thrift/Serialization.h>
+#include <folly/Format.h>
+#include <folly/ScopeGuard.h>
+#include <folly/io/Compression.h>
+#include <thpp/if/gen-cpp2/Tensor_types.h>
+#include <cmath>
+#include <cstring>
+#include <limits>
 #include <memory>
 
 using namespace fblualib;
@@ -20,95 +30,1582 @@ using namespace fblualib::detail;
 using namespace fblualib::thrift;
 using namespace std;
 
-// Teach AtomicVector how to refcount and serialize our tensors.
-#define TENSOR_IMPL(T, Real)                          \
-template<> struct Refcount<T*> {                      \
-  void inc(T* t) {                                    \
-    T ## _retain(t);                                  \
-  }                                                   \
-  void dec(T* t) {                                    \
-    T ## _free(t);                                    \
-  }                                                   \
-};                                                    \
-                                                      \
-template<> struct Serde<T*> {                         \
-  static folly::StringPiece save(T* t, StringWriter& sw) { \
-    auto thpp = thpp::Tensor<Real>(t);                \
-    auto luaObj = make(thpp);                         \
-    const auto codec = thpp.size() > 1024 ?           \
-      folly::io::CodecType::LZ4 :                     \
-      folly::io::CodecType::NO_COMPRESSION;           \
-    cppEncode(luaObj, codec, sw);                     \
-    return folly::StringPiece(sw.finish());           \
-  }                                                   \
-  static T* load(folly::ByteRange* br) {              \
-    StringReader sr(br);                              \
-    auto decoded = cppDecode(sr);                     \
-    auto thppTensor = getTensor<Real>(std::move(decoded)); \
-    auto retval = thppTensor.moveAsTH();              \
-    /* refcount=1; caller's job to decref. */         \
-    return retval;                                    \
-  }                                                   \
-}
-
-TENSOR_IMPL(THFloatTensor, float);
-TENSOR_IMPL(THDoubleTensor, double);
-TENSOR_IMPL(THIntTensor, int);
-
-#undef TENSOR_IMPL
+// Atomic vectors of serialized values hold immutable, refcounted blobs.
+// Each blob gets a version, unique across all blobs, so that caches of
+// decoded values can tell whether they're still current.
+uint64_t nextBlobVersion() {
+  static std::atomic<uint64_t> next(1);
+  return next.fetch_add(1);
+}
+
+template<typename Blob> struct BlobRefcount {
+  void inc(Blob* b) {
+    b->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  void dec(Blob* b) {
+    if (b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete b;
+    }
+  }
+};
+
+// A serialized, compressed tensor, as held by compressed atomic vectors.
+// The bytes are in the same format that Serde<THTensor*>::save() produces,
+// so compressed and regular atomic vectors of the same type can load each
+// other's files.
+struct CompressedBlob {
+  explicit CompressedBlob(folly::ByteRange data)
+    : refs(1),
+      version(nextBlobVersion()),
+      bytes(reinterpret_cast<const char*>(data.data()), data.size()) { }
+
+  std::atomic<int> refs;
+  const uint64_t version;
+  const std::string bytes;
+};
+
+template<> struct Refcount<CompressedBlob*>
+  : public BlobRefcount<CompressedBlob> { };
+
+template<> struct Serde<CompressedBlob*> {
+  static folly::StringPiece save(CompressedBlob* b, StringWriter& /*sw*/) {
+    return folly::StringPiece(b->bytes);
+  }
+  static CompressedBlob* load(folly::ByteRange* br) {
+    /* refcount=1; caller's job to decref. */
+    return new CompressedBlob(*br);
+  }
+};
+
+// An arbitrary Lua value, serialized, as held by object atomic vectors.
+// Always fully serialized (portable), and sharing no memory with the Lua
+// objects it came from or is deserialized into, so it really is
+// immutable.
+struct ObjectBlob {
+  ObjectBlob(LuaPrimitiveObject v, MemSerializedData d)
+    : refs(1),
+      version(nextBlobVersion()),
+      value(std::move(v)),
+      data(std::move(d)) { }
+
+  std::atomic<int> refs;
+  const uint64_t version;
+  const LuaPrimitiveObject value;
+  const MemSerializedData data;
+};
+
+template<> struct Refcount<ObjectBlob*>
+  : public BlobRefcount<ObjectBlob> { };
+
+template<> struct Serde<ObjectBlob*> {
+  static folly::StringPiece save(ObjectBlob* b, StringWriter& sw) {
+    LuaObject obj;
+    obj.value = b->value;
+    obj.refs = b->data.portableRefs();
+    cppEncode(obj, folly::io::CodecType::LZ4, sw);
+    return folly::StringPiece(sw.finish());
+  }
+  static ObjectBlob* load(folly::ByteRange* br) {
+    // Decode from our own copy, as the decoded references point into it.
+    auto buf = folly::IOBuf::copyBuffer(br->data(), br->size());
+    IOBufReader reader(buf.get());
+    auto obj = cppDecode(reader);
+    /* refcount=1; caller's job to decref. */
+    return new ObjectBlob(std::move(obj.value),
+                          MemSerializedData(std::move(obj.refs)));
+  }
+};
+
+namespace {
+
+constexpr const char* kTypeName = "fblualib.atomicvector";
+constexpr const char* kSnapshotTypeName = "fblualib.atomicvector.snapshot";
+
+struct TorchAtomicVectorIf {
+  typedef int BucketIndex;
+  virtual ~TorchAtomicVectorIf() { }
+
+  virtual int luaRead(lua_State* L) = 0;
+  virtual int luaReadInto(lua_State* L) = 0;
+  virtual int luaReadCached(lua_State* L) = 0;
+  virtual int luaWrite(lua_State* L) = 0;
+  virtual int luaAppend(lua_State* L) = 0;
+  virtual int luaSize(lua_State* L) = 0;
+  virtual int luaSave(lua_State* L) = 0;
+  virtual int luaLoad(lua_State* L) = 0;
+  virtual int luaLoadLazy(lua_State* L) = 0;
+  virtual int luaSaveIncremental(lua_State* L) = 0;
+  virtual int luaLoadIncremental(lua_State* L) = 0;
+  virtual int luaReadBatch(lua_State* L) = 0;
+  virtual int luaWriteBatch(lua_State* L) = 0;
+  virtual int luaAppendBatch(lua_State* L) = 0;
+  virtual int luaGather(lua_State* L) = 0;
+  virtual int luaScatterAdd(lua_State* L) = 0;
+  virtual int luaAtomicAdd(lua_State* L) = 0;
+  virtual int luaAtomicAddRows(lua_State* L) = 0;
+  virtual int luaSetAllocPolicy(lua_State* L) = 0;
+  virtual int luaReadCounts(lua_State* L) = 0;
+  virtual int luaErase(lua_State* L) = 0;
+  virtual int luaIsErased(lua_State* L) = 0;
+  virtual int luaCompact(lua_State* L) = 0;
+  virtual int luaFlushRetired(lua_State* L) = 0;
+  virtual int luaSnapshot(lua_State* L) = 0;
+  virtual int luaParallelForEach(lua_State* L) = 0;
+};
+
+struct TorchSnapshotIf {
+  virtual ~TorchSnapshotIf() { }
+
+  virtual int luaRead(lua_State* L) = 0;
+  virtual int luaSize(lua_State* L) = 0;
+  virtual int luaParallelForEach(lua_State* L) = 0;
+};
+
+// Convert a 1-based index to a (0-based) slot, raising an error if it's
+// out of the range of slots.
+uint32_t toSlot(lua_State* L, long index) {
+  if (index < 1 || index > long(std::numeric_limits<uint32_t>::max()) + 1) {
+    luaL_error(L, "invalid atomic vector index %ld", index);
+  }
+  return index - 1;
+}
+
+// Decode a list of 1-based indices (a Lua table of numbers, or a contiguous
+// 1-dimensional torch.LongTensor) at the given stack index into 0-based
+// indices.
+std::vector<uint32_t> getIndices(lua_State* L, int idx) {
+  std::vector<uint32_t> indices;
+  if (lua_istable(L, idx)) {
+    auto n = lua_objlen(L, idx);
+    indices.reserve(n);
+    for (size_t i = 1; i <= n; i++) {
+      lua_rawgeti(L, idx, i);
+      auto v = luaGetNumberChecked<long>(L, -1);
+      lua_pop(L, 1);
+      indices.push_back(toSlot(L, v));
+    }
+    return indices;
+  }
+
+  auto t = luaGetTensorChecked<long>(L, idx);
+  auto n = t->size();
+  if (n != 0 && (t->ndims() != 1 || !t->isContiguous())) {
+    luaL_error(L, "indices must be a table or a contiguous 1-d LongTensor");
+  }
+  indices.reserve(n);
+  auto data = t->data();
+  for (long i = 0; i < n; i++) {
+    indices.push_back(toSlot(L, data[i]));
+  }
+  return indices;
+}
+
+// Decode an allocation policy table: { numa = "first_touch" | "interleave" |
+// "bind", node = n, huge_pages = "none" | "transparent" | "explicit",
+// place_tensors = bool, count_reads = bool }; all fields are optional.
+AllocPolicy getAllocPolicy(lua_State* L, int idx) {
+  luaL_checktype(L, idx, LUA_TTABLE);
+  AllocPolicy policy;
+  auto numa = luaGetFieldIfString(L, idx, "numa");
+  if (numa) {
+    if (*numa == "first_touch") {
+      policy.numa = AllocPolicy::Numa::FIRST_TOUCH;
+    } else if (*numa == "interleave") {
+      policy.numa = AllocPolicy::Numa::INTERLEAVE;
+    } else if (*numa == "bind") {
+      policy.numa = AllocPolicy::Numa::BIND;
+    } else {
+      luaL_error(L, "invalid numa policy \"%s\"", numa->str().c_str());
+    }
+  }
+  policy.node = luaGetFieldIfNumber<int>(L, idx, "node").value_or(0);
+  auto hugePages = luaGetFieldIfString(L, idx, "huge_pages");
+  if (hugePages) {
+    if (*hugePages == "none") {
+      policy.hugePages = AllocPolicy::HugePages::NONE;
+    } else if (*hugePages == "transparent") {
+      policy.hugePages = AllocPolicy::HugePages::TRANSPARENT;
+    } else if (*hugePages == "explicit") {
+      policy.hugePages = AllocPolicy::HugePages::EXPLICIT;
+    } else {
+      luaL_error(L, "invalid huge_pages policy \"%s\"",
+                 hugePages->str().c_str());
+    }
+  }
+  policy.placeValues =
+    luaGetFieldIfBoolean(L, idx, "place_tensors").value_or(false);
+  policy.countReads =
+    luaGetFieldIfBoolean(L, idx, "count_reads").value_or(false);
+  return policy;
+}
+
+int unsupported(lua_State* L, const char* fn, const char* kind) {
+  return luaL_error(L, "%s is not supported on %s atomic vectors", fn, kind);
+}
+
+TorchAtomicVectorIf*
+checkAtomicVec(lua_State* L, int idx) {
+  auto av = static_cast<TorchAtomicVectorIf**>
+    (luaL_checkudata(L, idx, kTypeName));
+  DCHECK(av);
+  return *av;
+}
+
+// The batch operations are the same for all kinds of atomic vectors, except
+// for how they convert values, which they take as hooks. Values (of type
+// V, a pointer) are collected in a vector before the vector is modified,
+// and the caller's release hook is called on those we still own if we
+// raise a Lua error halfway.
+
+// Run fn, turning std::runtime_error into a Lua error prefixed by what
+template<typename Fn>
+void luaTry(lua_State* L, const char* what, Fn&& fn) {
+  try {
+    fn();
+  } catch (std::runtime_error &err) {
+    luaL_error(L, "%s: %s", what, err.what());
+  }
+}
+
+// Convert the n values of the table at idx with check(L, -1) (which raises
+// a Lua error if the value is invalid), appending them to vals.
+template<typename V, typename Check>
+void checkValueTable(lua_State* L, int idx, size_t n, std::vector<V>& vals,
+                     Check&& check) {
+  vals.reserve(n);
+  for (size_t i = 1; i <= n; i++) {
+    lua_rawgeti(L, idx, i);
+    vals.push_back(check(L, -1));
+    lua_pop(L, 1);
+  }
+}
+
+// Push a table of the values in vals, converted with push(L, val), which
+// takes over val; those are set to nullptr.
+template<typename V, typename Push>
+void pushValueTable(lua_State* L, std::vector<V>& vals, Push&& push) {
+  lua_createtable(L, vals.size(), 0);
+  for (size_t i = 0; i < vals.size(); i++) {
+    auto val = vals[i];
+    vals[i] = nullptr;
+    push(L, val);
+    lua_rawseti(L, -2, i + 1);
+  }
+}
+
+// read_batch(indices): read(indices, vals) fills vals (with owned values,
+// or nullptr where it stopped), which we push with push(L, val).
+template<typename V, typename Read, typename Push, typename Release>
+int readBatch(lua_State* L, Read&& read, Push&& push, Release&& release) {
+  auto indices = getIndices(L, 2);
+  std::vector<V> vals(indices.size(), nullptr);
+  SCOPE_EXIT {
+    for (auto val : vals) {
+      if (val) {
+        release(val);
+      }
+    }
+  };
+  luaTry(L, "atomic vector error", [&] {
+    read(indices, vals.data());
+  });
+  pushValueTable(L, vals, push);
+  return 1;
+}
+
+// write_batch(indices, values): check all values (with check(L, idx))
+// before writing any with write(slot, val). what names the values.
+template<typename V, typename Check, typename Write, typename Release>
+int writeBatch(lua_State* L, const char* what, Check&& check, Write&& write,
+               Release&& release) {
+  auto indices = getIndices(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  if (lua_objlen(L, 3) != indices.size()) {
+    luaL_error(L, "write_batch: got %d indices but %d %s",
+               int(indices.size()), int(lua_objlen(L, 3)), what);
+  }
+  std::vector<V> vals;
+  SCOPE_EXIT {
+    for (auto val : vals) {
+      release(val);
+    }
+  };
+  checkValueTable(L, 3, indices.size(), vals, check);
+  luaTry(L, "bad atomic vector index", [&] {
+    for (size_t i = 0; i < indices.size(); i++) {
+      write(indices[i], vals[i]);
+    }
+  });
+  return 0;
+}
+
+// append_batch(values): like write_batch, with append(val) returning the
+// new slot; returns the table of (1-based) positions.
+template<typename V, typename Check, typename Append, typename Release>
+int appendBatch(lua_State* L, Check&& check, Append&& append,
+                Release&& release) {
+  luaL_checktype(L, 2, LUA_TTABLE);
+  auto n = lua_objlen(L, 2);
+  std::vector<V> vals;
+  SCOPE_EXIT {
+    for (auto val : vals) {
+      release(val);
+    }
+  };
+  checkValueTable(L, 2, n, vals, check);
+  lua_createtable(L, n, 0);
+  luaTry(L, "atomic vector error", [&] {
+    for (size_t i = 0; i < n; i++) {
+      lua_pushnumber(L, append(vals[i]) + 1); // To lua
+      lua_rawseti(L, -2, i + 1);
+    }
+  });
+  return 1;
+}
+
+// Check that the contiguous tensor t can be split in n rows; return the
+// row size.
+template<typename Real>
+ptrdiff_t checkRows(lua_State* L, const thpp::Tensor<Real>& t, size_t n,
+                    const char* fn) {
+  if (!t.isContiguous()) {
+    luaL_error(L, "%s: tensor must be contiguous", fn);
+  }
+  if (n == 0) {
+    return 0;
+  }
+  if (t.size() % n != 0) {
+    luaL_error(L, "%s: tensor size %ld is not a multiple of %ld", fn,
+               long(t.size()), long(n));
+  }
+  return t.size() / n;
+}
+
+void checkRowSize(ptrdiff_t n, ptrdiff_t rowSize) {
+  if (n != rowSize) {
+    throw std::runtime_error(folly::sformat(
+        "slot tensor has {} elements, expected {}", n, rowSize));
+  }
+}
+
+// Copy the tensor t, which must have rowSize elements, to dst
+template<typename Real>
+void copyRow(typename thpp::Tensor<Real>::THType* t, ptrdiff_t rowSize,
+             Real* dst) {
+  typedef RawTensor<Real> Raw;
+  checkRowSize(Raw::nElement(t), rowSize);
+  auto c = Raw::isContiguous(t) ? t : Raw::newContiguous(t);
+  memcpy(dst, Raw::data(c), rowSize * sizeof(Real));
+  if (c != t) {
+    Raw::free(c);
+  }
+}
+
+// gather(indices, out): copy the tensors at the given indices into
+// consecutive rows of out (which must be contiguous, with as many elements
+// as all the gathered tensors together), with copy(indices, rowSize, dst);
+// return out.
+template<typename Real, typename Copy>
+int gatherRows(lua_State* L, Copy&& copy) {
+  auto indices = getIndices(L, 2);
+  auto out = luaGetTensorChecked<Real>(L, 3);
+  auto rowSize = checkRows(L, *out, indices.size(), "gather");
+  auto dst = out->data();
+  luaTry(L, "atomic vector error", [&] {
+    copy(indices, rowSize, dst);
+  });
+  lua_pushvalue(L, 3);
+  return 1;
+}
+
+// The parts of a Lua atomic vector that don't depend on the kind of values
+// it holds: its size, and the on-disk operations (delegated to Serde<V>).
+template<typename V>
+class BasicTorchAtomicVector : public TorchAtomicVectorIf {
+ protected:
+  AtomicVector<V> m_av;
+
+ public:
+  virtual int luaSize(lua_State* L) {
+    lua_pushnumber(L, m_av.size());
+    return 1;
+  }
+
+  // Only vectors that decode values on read have anything to cache.
+  virtual int luaReadCached(lua_State* L) {
+    return luaRead(L);
+  }
+
+  virtual int luaLoad(lua_State* L) {
+    auto file = luaDecodeFILE(L, 2);
+    m_av.load(file);
+    return 0;
+  }
+
+  virtual int luaLoadLazy(lua_State* L) {
+    auto file = luaDecodeFILE(L, 2);
+    bool prefetch = lua_toboolean(L, 3);
+    try {
+      m_av.loadLazy(file, prefetch);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s", err.what());
+    }
+    return 0;
+  }
+
+  virtual int luaSave(lua_State* L) {
+    auto file = luaDecodeFILE(L, 2);
+    m_av.save(file);
+    return 0;
+  }
+
+  virtual int luaSaveIncremental(lua_State* L) {
+    auto file = luaDecodeFILE(L, 2);
+    auto base = luaDecodeFILE(L, 3);
+    try {
+      m_av.saveIncremental(file, base);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s", err.what());
+    }
+    return 0;
+  }
+
+  virtual int luaLoadIncremental(lua_State* L) {
+    auto base = luaDecodeFILE(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    std::vector<FILE*> deltas;
+    auto n = lua_objlen(L, 3);
+    for (size_t i = 1; i <= n; i++) {
+      lua_rawgeti(L, 3, i);
+      deltas.push_back(luaDecodeFILE(L, -1));
+      lua_pop(L, 1);
+    }
+    try {
+      m_av.loadIncremental(base, deltas);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s", err.what());
+    }
+    return 0;
+  }
+
+  virtual int luaSetAllocPolicy(lua_State* L) {
+    auto policy = getAllocPolicy(L, 2);
+    try {
+      m_av.setAllocPolicy(policy);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s", err.what());
+    }
+    return 0;
+  }
+
+  // A table of read counts keyed by (0-based) NUMA node; empty unless the
+  // policy counts reads.
+  virtual int luaReadCounts(lua_State* L) {
+    auto counts = m_av.readCounts();
+    lua_newtable(L);
+    for (size_t i = 0; i < counts.size(); i++) {
+      if (detail::onlineNumaNodes() & (uint64_t(1) << i)) {
+        lua_pushnumber(L, counts[i]);
+        lua_rawseti(L, -2, i);
+      }
+    }
+    return 1;
+  }
+
+  // erase(i): drop the value at index i; return true unless it was already
+  // erased. The slot is reused by a later append().
+  virtual int luaErase(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    bool erased = false;
+    try {
+      erased = m_av.erase(idx - 1);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "bad atomic vector index: %s %d", err.what(), idx);
+    }
+    lua_pushboolean(L, erased);
+    return 1;
+  }
+
+  virtual int luaIsErased(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    bool erased = false;
+    try {
+      erased = m_av.isErased(idx - 1);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "bad atomic vector index: %s %d", err.what(), idx);
+    }
+    lua_pushboolean(L, erased);
+    return 1;
+  }
+
+  // compact(): close the holes left by erase(); return a table mapping old
+  // indices to new ones (0 for erased entries). Offline.
+  virtual int luaCompact(lua_State* L) {
+    std::vector<int64_t> mapping;
+    try {
+      mapping = m_av.compact();
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s", err.what());
+    }
+    lua_createtable(L, mapping.size(), 0);
+    for (size_t i = 0; i < mapping.size(); i++) {
+      lua_pushnumber(L, mapping[i] + 1);
+      lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+  }
+
+  virtual int luaFlushRetired(lua_State* L) {
+    m_av.flushRetired();
+    return 0;
+  }
+};
+
+// Snapshot userdata own their snapshot; release() drops it early.
+void pushSnapshot(lua_State* L, std::unique_ptr<TorchSnapshotIf> snap) {
+  auto luaPtr = (TorchSnapshotIf**)
+    lua_newuserdata(L, sizeof(TorchSnapshotIf*));
+  *luaPtr = snap.release();
+  if (!luaT_pushmetatable(L, kSnapshotTypeName)) {
+    assert(false);
+  }
+  lua_setmetatable(L, -2);
+}
+
+TorchSnapshotIf** checkSnapshotPtr(lua_State* L, int idx) {
+  auto snap = static_cast<TorchSnapshotIf**>
+    (luaL_checkudata(L, idx, kSnapshotTypeName));
+  DCHECK(snap);
+  return snap;
+}
+
+TorchSnapshotIf* checkSnapshot(lua_State* L, int idx) {
+  auto snap = *checkSnapshotPtr(L, idx);
+  if (!snap) {
+    luaL_error(L, "atomic vector snapshot already released");
+  }
+  return snap;
+}
+
+bool isSnapshot(lua_State* L, int idx) {
+  if (!lua_getmetatable(L, idx)) {
+    return false;
+  }
+  luaL_getmetatable(L, kSnapshotTypeName);
+  bool result = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return result;
+}
+
+// Native callback for parallel_for_each: fn(arg, index, tensor), with a
+// 1-based index and a borrowed TH tensor. Called concurrently from several
+// threads.
+typedef void (*ForEachFn)(void* arg, long index, void* tensor);
+
+// The pointer held by the pointer cdata at idx (nullptr for nil). LuaJIT's
+// lua_topointer() returns the address of a cdata's payload, which, for a
+// pointer cdata, is the pointer.
+void* luaGetPointer(lua_State* L, int idx, const char* what) {
+  if (lua_isnoneornil(L, idx)) {
+    return nullptr;
+  }
+  if (lua_type(L, idx) != kLuaTypeCData) {
+    luaL_error(L, "parallel_for_each: %s must be a pointer cdata", what);
+  }
+  return *static_cast<void* const*>(lua_topointer(L, idx));
+}
+
+// parallel_for_each(op, [nthreads, [arg]]) over snap: op is a ForEachFn
+// (a void* cdata; called with arg, a void* cdata), or a reduction over all
+// elements of all
+// tensors ("sum", "norm", "max" or "min"), whose result is returned (nil
+// for "max" and "min" if there are no elements). nthreads defaults to the
+// number of cores.
+template<typename Real, typename Snapshot>
+int forEachInSnapshot(lua_State* L, const Snapshot& snap) {
+  typedef typename thpp::Tensor<Real>::THType Tensor;
+  typedef RawTensor<Real> Raw;
+
+  long nThreads = luaGetNumber<long>(L, 3).value_or(
+    std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)));
+  if (nThreads < 1) {
+    luaL_error(L, "parallel_for_each: invalid number of threads");
+  }
+
+  if (lua_type(L, 2) == kLuaTypeCData) {
+    auto fn = reinterpret_cast<ForEachFn>(luaGetPointer(L, 2, "op"));
+    if (!fn) {
+      luaL_error(L, "parallel_for_each: op is NULL");
+    }
+    auto arg = luaGetPointer(L, 4, "arg");
+    try {
+      snap.parallelForEach(nThreads, [&] (size_t, uint32_t i, Tensor* t) {
+        fn(arg, long(i) + 1, t);
+      });
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s", err.what());
+    }
+    return 0;
+  }
+
+  enum Op { SUM, NORM, MAX, MIN };
+  auto name = luaL_checkstring(L, 2);
+  Op op;
+  double init = 0;
+  if (!strcmp(name, "sum")) {
+    op = SUM;
+  } else if (!strcmp(name, "norm")) {
+    op = NORM;
+  } else if (!strcmp(name, "max")) {
+    op = MAX;
+    init = -std::numeric_limits<double>::infinity();
+  } else if (!strcmp(name, "min")) {
+    op = MIN;
+    init = std::numeric_limits<double>::infinity();
+  } else {
+    return luaL_error(L, "parallel_for_each: invalid reduction \"%s\"",
+                      name);
+  }
+
+  struct alignas(kCacheLineSize) Partial {
+    double acc;
+    size_t n;
+  };
+  std::vector<Partial> partials(nThreads, Partial{init, 0});
+  try {
+    snap.parallelForEach(nThreads, [&] (size_t tid, uint32_t, Tensor* t) {
+      // Only copy if we must
+      auto c = Raw::isContiguous(t) ? t : Raw::newContiguous(t);
+      SCOPE_EXIT {
+        if (c != t) {
+          Raw::free(c);
+        }
+      };
+      auto data = Raw::data(c);
+      auto n = Raw::nElement(c);
+      auto acc = partials[tid].acc;
+      switch (op) {
+      case SUM:
+        for (ptrdiff_t j = 0; j < n; j++) acc += data[j];
+        break;
+      case NORM:
+        for (ptrdiff_t j = 0; j < n; j++) acc += double(data[j]) * data[j];
+        break;
+      case MAX:
+        for (ptrdiff_t j = 0; j < n; j++) acc = std::max(acc, double(data[j]));
+        break;
+      case MIN:
+        for (ptrdiff_t j = 0; j < n; j++) acc = std::min(acc, double(data[j]));
+        break;
+      }
+      partials[tid].acc = acc;
+      partials[tid].n += n;
+    });
+  } catch (std::runtime_error &err) {
+    luaL_error(L, "atomic vector error: %s", err.what());
+  }
+
+  double result = init;
+  size_t n = 0;
+  for (auto& p : partials) {
+    switch (op) {
+    case SUM:
+    case NORM:
+      result += p.acc;
+      break;
+    case MAX:
+      result = std::max(result, p.acc);
+      break;
+    case MIN:
+      result = std::min(result, p.acc);
+      break;
+    }
+    n += p.n;
+  }
+  if (op == NORM) {
+    result = std::sqrt(result);
+  }
+  if ((op == MAX || op == MIN) && n == 0) {
+    lua_pushnil(L);
+  } else {
+    lua_pushnumber(L, result);
+  }
+  return 1;
+}
+
+template<typename Real>
+class TorchSnapshot : public TorchSnapshotIf {
+  typedef typename thpp::Tensor<Real>::THType Tensor;
+  typedef typename AtomicVector<Tensor*>::Snapshot Snapshot;
+
+  std::unique_ptr<Snapshot> m_snap;
+
+ public:
+  explicit TorchSnapshot(std::unique_ptr<Snapshot> snap)
+    : m_snap(std::move(snap)) { }
+
+  virtual int luaRead(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    try {
+      auto val = m_snap->get(idx - 1);
+      Refcount<Tensor*>().inc(val);  // Lua's
+      luaT_pushudata(L, val, thpp::Tensor<Real>::kLuaTypeName);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s %d", err.what(), idx);
+    }
+    return 1;
+  }
+
+  virtual int luaSize(lua_State* L) {
+    lua_pushnumber(L, m_snap->size());
+    return 1;
+  }
+
+  virtual int luaParallelForEach(lua_State* L) {
+    return forEachInSnapshot<Real>(L, *m_snap);
+  }
+};
+
+template<typename Real>
+class TorchAtomicVector
+  : public BasicTorchAtomicVector<typename thpp::Tensor<Real>::THType*> {
+  typedef typename thpp::Tensor<Real>::THType Tensor;
+  using BasicTorchAtomicVector<Tensor*>::m_av;
+  typedef RawTensor<Real> Raw;
+
+  // Serializes locked in-place updates to the same slot
+  StripedSpinLock m_slotLocks;
+
+  virtual Tensor*
+  checkTensor(lua_State* L, int idx) {
+    auto t = static_cast<Tensor**>(
+      luaL_checkudata(L, idx, kTensorTypeName));
+    DCHECK(t);
+    return *t;
+  }
+
+  static void axpy(Real* __restrict__ dst, const Real* __restrict__ src,
+                   ptrdiff_t n, Real scale) {
+    for (ptrdiff_t j = 0; j < n; j++) {
+      dst[j] += scale * src[j];
+    }
+  }
+
+  // Add scale * (consecutive rows of src) into the tensors at the given
+  // slots, in place; if locked, updates to the same slot are serialized,
+  // otherwise they race (Hogwild). Doesn't allocate.
+  void addRows(const uint32_t* indices, size_t n, const Real* src,
+               ptrdiff_t rowSize, Real scale, bool locked) {
+    m_av.borrowBatch(indices, n, [&] (size_t i, Tensor* t) {
+      checkRowSize(Raw::nElement(t), rowSize);
+      if (!Raw::isContiguous(t)) {
+        throw std::runtime_error("slot tensor not contiguous");
+      }
+      if (locked) {
+        m_slotLocks.lock(indices[i]);
+      }
+      axpy(Raw::data(t), src + i * rowSize, rowSize, scale);
+      if (locked) {
+        m_slotLocks.unlock(indices[i]);
+      }
+      m_av.markDirty(indices[i]);
+    });
+  }
+
+  // Move the storage of a tensor we're taking according to the NUMA policy,
+  // if the policy says so. The storage may be shared with other tensors,
+  // which move with it.
+  void place(Tensor* t) {
+    auto storage = Raw::storage(t);
+    m_av.placeValue(storage.data(), storage.size());
+  }
+
+ public:
+  constexpr static const char* kTensorTypeName =
+    thpp::Tensor<Real>::kLuaTypeName;
+
+  virtual ~TorchAtomicVector() { }
+
+  static void pushTensor(lua_State* L, Tensor* t) {
+    luaT_pushudata(L, t, kTensorTypeName);
+  }
+
+  virtual int luaRead(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    try {
+      auto val = m_av.read(idx - 1);
+      luaT_pushudata(L, val, kTensorTypeName);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s %d", err.what(),
+                 idx);
+    }
+    return 1;
+  }
+
+  // read_into(i, out): copy the tensor at index i into out (resizing it);
+  // return out
+  virtual int luaReadInto(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    auto out = checkTensor(L, 3);
+    try {
+      m_av.borrow(idx - 1, [&] (Tensor* t) {
+        Raw::copy(out, t);
+      });
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s %d", err.what(), idx);
+    }
+    lua_pushvalue(L, 3);
+    return 1;
+  }
+
+  virtual int luaWrite(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    auto val = checkTensor(L, 3);
+    try {
+      m_av.write(idx - 1, val);
+    } catch (std::runtime_error &err) {
+       luaL_error(L, "bad atomic vector index: %s %d", err.what(), idx);
+    }
+    place(val);
+    return 0;
+  }
+
+  virtual int luaAppend(lua_State* L) {
+    auto val = checkTensor(L, 2);
+    size_t sz = m_av.append(val);
+    place(val);
+    lua_pushnumber(L, sz + 1); // To lua
+    return 1;
+  }
+
+  virtual int luaSnapshot(lua_State* L) {
+    pushSnapshot(L, std::make_unique<TorchSnapshot<Real>>(m_av.snapshot()));
+    return 1;
+  }
+
+  // Over a snapshot taken for the occasion
+  virtual int luaParallelForEach(lua_State* L) {
+    auto snap = m_av.snapshot();
+    return forEachInSnapshot<Real>(L, *snap);
+  }
+
+  virtual int luaReadBatch(lua_State* L) {
+    return readBatch<Tensor*>(
+        L,
+        [&] (const std::vector<uint32_t>& indices, Tensor** out) {
+          m_av.readBatch(indices.data(), indices.size(), out);
+        },
+        pushTensor, Raw::free);
+  }
+
+  virtual int luaWriteBatch(lua_State* L) {
+    return writeBatch<Tensor*>(
+        L, "tensors",
+        [&] (lua_State* L, int idx) { return checkTensor(L, idx); },
+        [&] (uint32_t slot, Tensor* t) {
+          m_av.write(slot, t);
+          place(t);
+        },
+        [] (Tensor*) { });
+  }
+
+  virtual int luaAppendBatch(lua_State* L) {
+    return appendBatch<Tensor*>(
+        L,
+        [&] (lua_State* L, int idx) { return checkTensor(L, idx); },
+        [&] (Tensor* t) {
+          auto slot = m_av.append(t);
+          place(t);
+          return slot;
+        },
+        [] (Tensor*) { });
+  }
+
+  // gather(indices, out): see gatherRows. No refcounts are touched.
+  virtual int luaGather(lua_State* L) {
+    return gatherRows<Real>(
+        L,
+        [&] (const std::vector<uint32_t>& indices, ptrdiff_t rowSize,
+             Real* dst) {
+          m_av.borrowBatch(indices.data(), indices.size(),
+                           [&] (size_t i, Tensor* t) {
+            copyRow(t, rowSize, dst + i * rowSize);
+          });
+        });
+  }
+
+  // scatter_add(indices, src, [scale]): add scale * (consecutive rows of
+  // src) into the tensors at the given indices, in place. This is racy
+  // (Hogwild-style) with respect to other threads updating the same
+  // tensors; the tensors must be contiguous.
+  virtual int luaScatterAdd(lua_State* L) {
+    return doAddRows(L, "scatter_add", false);
+  }
+
+  // atomic_add(i, src, [scale, [locked]]): add scale * src into the tensor
+  // at index i, in place. src must be contiguous, with the same number of
+  // elements. If locked is true, concurrent locked updates to the same
+  // slot are serialized; otherwise, they race (Hogwild).
+  virtual int luaAtomicAdd(lua_State* L) {
+    auto idx = luaGetNumberChecked<long>(L, 2);
+    uint32_t index = toSlot(L, idx);
+    auto src = luaGetTensorChecked<Real>(L, 3);
+    auto scale = Real(luaGetNumber<double>(L, 4).value_or(1.0));
+    bool locked = lua_toboolean(L, 5);
+    auto rowSize = checkRows(L, *src, 1, "atomic_add");
+    try {
+      addRows(&index, 1, src->data(), rowSize, scale, locked);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s %ld", err.what(), idx);
+    }
+    return 0;
+  }
+
+  // atomic_add_rows(indices, src, [scale, [locked]]): like scatter_add,
+  // optionally locked (see atomic_add)
+  virtual int luaAtomicAddRows(lua_State* L) {
+    return doAddRows(L, "atomic_add_rows", lua_toboolean(L, 5));
+  }
+
+  int doAddRows(lua_State* L, const char* fn, bool locked) {
+    auto indices = getIndices(L, 2);
+    auto src = luaGetTensorChecked<Real>(L, 3);
+    auto scale = Real(luaGetNumber<double>(L, 4).value_or(1.0));
+    auto rowSize = checkRows(L, *src, indices.size(), fn);
+    try {
+      addRows(indices.data(), indices.size(), src->data(), rowSize, scale,
+              locked);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s: %s", fn, err.what());
+    }
+    return 0;
+  }
+};
+
+// An atomic vector that holds its tensors compressed. Reads decompress
+// into a new tensor (read) or a caller-provided one (read_into); a small
+// direct-mapped cache of decompressed tensors, indexed by slot, saves
+// decompressing hot entries over and over. Readers of the cache are
+// protected by epochs, just like readers of AtomicVector, so cache hits
+// take no locks and touch no refcounts.
+//
+// Tensors returned by reads are always copies; modifying them doesn't
+// modify the vector, so in-place updates (scatter_add, atomic_add, ...)
+// aren't supported.
+template<typename Real>
+class CompressedTorchAtomicVector
+  : public BasicTorchAtomicVector<CompressedBlob*> {
+  typedef typename thpp::Tensor<Real>::THType Tensor;
+  typedef RawTensor<Real> Raw;
+
+  struct CacheEntry {
+    uint32_t slot;
+    uint64_t version;  // of the blob that tensor was decompressed from
+    Tensor* tensor;
+  };
+
+  folly::io::CodecType m_codec;
+  size_t m_cacheMask;
+  std::unique_ptr<std::atomic<CacheEntry*>[]> m_cache;
+  detail::EpochManager m_cacheEpochs;
+
+  static void freeEntry(uintptr_t p) {
+    auto entry = reinterpret_cast<CacheEntry*>(p);
+    Raw::free(entry->tensor);
+    delete entry;
+  }
+
+  Tensor* checkTensor(lua_State* L, int idx) {
+    auto t = static_cast<Tensor**>(
+      luaL_checkudata(L, idx, kTensorTypeName));
+    DCHECK(t);
+    return *t;
+  }
+
+  CompressedBlob* compress(Tensor* t) {
+    thpp::Tensor<Real> thpp(t);
+    StringWriter sw;
+    cppEncode(make(thpp), m_codec, sw);
+    return new CompressedBlob(sw.finish());
+  }
+
+  static Tensor* decompress(CompressedBlob* blob) {
+    folly::ByteRange range(
+        reinterpret_cast<const uint8_t*>(blob->bytes.data()),
+        blob->bytes.size());
+    return Serde<Tensor*>::load(&range);
+  }
+
+  // Call fn(t), where t is the (decompressed) tensor at slot. t is only
+  // valid during the call, and must not be modified.
+  template<typename Fn>
+  void withTensor(uint32_t slot, Fn fn) {
+    m_av.borrow(slot, [&] (CompressedBlob* blob) {
+      if (!m_cache) {
+        auto t = decompress(blob);
+        SCOPE_EXIT {
+          Raw::free(t);
+        };
+        fn(t);
+        return;
+      }
+
+      auto& cell = m_cache[slot & m_cacheMask];
+      {
+        detail::EpochGuard guard(&m_cacheEpochs);
+        auto entry = cell.load(std::memory_order_acquire);
+        if (entry && entry->slot == slot && entry->version == blob->version) {
+          fn(entry->tensor);
+          return;
+        }
+      }
+
+      // Miss. Use the tensor while it's still private to us, then publish
+      // it, evicting whatever was in the cell.
+      std::unique_ptr<CacheEntry> entry(
+          new CacheEntry{slot, blob->version, decompress(blob)});
+      SCOPE_FAIL {
+        Raw::free(entry->tensor);
+      };
+      fn(entry->tensor);
+      auto old = cell.exchange(entry.release(), std::memory_order_acq_rel);
+      if (old) {
+        m_cacheEpochs.retire(reinterpret_cast<uintptr_t>(old), &freeEntry);
+      }
+    });
+  }
+
+ public:
+  constexpr static const char* kTensorTypeName =
+    thpp::Tensor<Real>::kLuaTypeName;
+
+  // cacheSize is rounded up to a power of two; 0 disables the cache.
+  CompressedTorchAtomicVector(folly::io::CodecType codec, size_t cacheSize)
+    : m_codec(codec),
+      m_cacheMask(0) {
+    if (cacheSize) {
+      cacheSize = folly::nextPowTwo(cacheSize);
+      m_cacheMask = cacheSize - 1;
+      m_cache.reset(new std::atomic<CacheEntry*>[cacheSize]);
+      for (size_t i = 0; i < cacheSize; i++) {
+        m_cache[i].store(nullptr);
+      }
+    }
+  }
+
+  static void pushTensor(lua_State* L, Tensor* t) {
+    luaT_pushudata(L, t, kTensorTypeName);
+  }
+
+  virtual ~CompressedTorchAtomicVector() {
+    m_cacheEpochs.drain();
+    if (m_cache) {
+      for (size_t i = 0; i <= m_cacheMask; i++) {
+        auto entry = m_cache[i].load();
+        if (entry) {
+          freeEntry(reinterpret_cast<uintptr_t>(entry));
+        }
+      }
+    }
+  }
+
+  virtual int luaFlushRetired(lua_State* L) {
+    m_cacheEpochs.reclaimAll();
+    return BasicTorchAtomicVector<CompressedBlob*>::luaFlushRetired(L);
+  }
+
+  virtual int luaRead(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    Tensor* val = nullptr;
+    try {
+      withTensor(idx - 1, [&] (Tensor* t) {
+        val = Raw::newClone(t);
+      });
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s %d", err.what(), idx);
+    }
+    luaT_pushudata(L, val, kTensorTypeName);
+    return 1;
+  }
+
+  virtual int luaReadInto(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    auto out = checkTensor(L, 3);
+    try {
+      withTensor(idx - 1, [&] (Tensor* t) {
+        Raw::copy(out, t);
+      });
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s %d", err.what(), idx);
+    }
+    lua_pushvalue(L, 3);
+    return 1;
+  }
+
+  virtual int luaWrite(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    auto blob = compress(checkTensor(L, 3));
+    SCOPE_EXIT {
+      Refcount<CompressedBlob*>().dec(blob);
+    };
+    try {
+      m_av.write(idx - 1, blob);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "bad atomic vector index: %s %d", err.what(), idx);
+    }
+    return 0;
+  }
+
+  virtual int luaAppend(lua_State* L) {
+    auto blob = compress(checkTensor(L, 2));
+    size_t sz = m_av.append(blob);
+    Refcount<CompressedBlob*>().dec(blob);
+    lua_pushnumber(L, sz + 1); // To lua
+    return 1;
+  }
+
+  virtual int luaReadBatch(lua_State* L) {
+    return readBatch<Tensor*>(
+        L,
+        [&] (const std::vector<uint32_t>& indices, Tensor** out) {
+          for (size_t i = 0; i < indices.size(); i++) {
+            withTensor(indices[i], [&] (Tensor* t) {
+              out[i] = Raw::newClone(t);
+            });
+          }
+        },
+        pushTensor, Raw::free);
+  }
+
+  virtual int luaWriteBatch(lua_State* L) {
+    return writeBatch<Tensor*>(
+        L, "tensors",
+        [&] (lua_State* L, int idx) { return checkTensor(L, idx); },
+        [&] (uint32_t slot, Tensor* t) {
+          auto blob = compress(t);
+          SCOPE_EXIT {
+            Refcount<CompressedBlob*>().dec(blob);
+          };
+          m_av.write(slot, blob);
+        },
+        [] (Tensor*) { });
+  }
+
+  virtual int luaAppendBatch(lua_State* L) {
+    return appendBatch<Tensor*>(
+        L,
+        [&] (lua_State* L, int idx) { return checkTensor(L, idx); },
+        [&] (Tensor* t) {
+          auto blob = compress(t);
+          SCOPE_EXIT {
+            Refcount<CompressedBlob*>().dec(blob);
+          };
+          return m_av.append(blob);
+        },
+        [] (Tensor*) { });
+  }
+
+  virtual int luaGather(lua_State* L) {
+    return gatherRows<Real>(
+        L,
+        [&] (const std::vector<uint32_t>& indices, ptrdiff_t rowSize,
+             Real* dst) {
+          for (size_t i = 0; i < indices.size(); i++) {
+            withTensor(indices[i], [&] (Tensor* t) {
+              copyRow(t, rowSize, dst + i * rowSize);
+            });
+          }
+        });
+  }
+
+  virtual int luaScatterAdd(lua_State* L) {
+    return unsupported(L, "scatter_add", "compressed");
+  }
+
+  virtual int luaAtomicAdd(lua_State* L) {
+    return unsupported(L, "atomic_add", "compressed");
+  }
+
+  virtual int luaAtomicAddRows(lua_State* L) {
+    return unsupported(L, "atomic_add_rows", "compressed");
+  }
+
+  virtual int luaSnapshot(lua_State* L) {
+    return unsupported(L, "snapshot", "compressed");
+  }
+
+  virtual int luaParallelForEach(lua_State* L) {
+    return unsupported(L, "parallel_for_each", "compressed");
+  }
+};
+
+// An atomic vector of arbitrary (serializable) Lua values. Values are
+// serialized on write, and deserialized into the reading lua_State on read,
+// so each read returns a new copy.
+//
+// read_cached() saves decoding: it keeps the decoded values in a cache
+// attached to the vector's Lua handle (the object returned by get()), and
+// returns the cached value as long as the slot hasn't been written since.
+// Values returned by read_cached() are thus shared between readers using
+// the same handle, and must not be modified.
+class ObjectAtomicVector : public BasicTorchAtomicVector<ObjectBlob*> {
+  static ObjectBlob* serialize(lua_State* L, int idx) {
+    SerializerOptions options;
+    options.sharing = thpp::SHARE_NONE;
+    Serializer serializer(L, options);
+    auto value = serializer.serialize(luaRealIndex(L, idx));
+    return new ObjectBlob(std::move(value), serializer.finishLocal());
+  }
+
+  // Push a new copy of the value in blob
+  static void push(lua_State* L, ObjectBlob* blob) {
+    DeserializerOptions options;
+    options.sharing = thpp::SHARE_NONE;
+    Deserializer deserializer(L, options);
+    deserializer.start(&blob->data);
+    deserializer.deserialize(blob->value);
+    deserializer.finish();
+  }
+
+  static void release(ObjectBlob* blob) {
+    Refcount<ObjectBlob*>().dec(blob);
+  }
+
+  // Serialize the value at idx, or raise a Lua error
+  static ObjectBlob* checkSerialize(lua_State* L, int idx) {
+    ObjectBlob* blob = nullptr;
+    try {
+      blob = serialize(L, idx);
+    } catch (const std::exception& e) {
+      luaL_error(L, "atomic vector error: cannot serialize: %s", e.what());
+    }
+    return blob;
+  }
+
+  ObjectBlob* checkRead(lua_State* L, uint32_t slot) {
+    ObjectBlob* blob = nullptr;
+    try {
+      blob = m_av.read(slot);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s %d", err.what(), int(slot + 1));
+    }
+    return blob;
+  }
+
+  // Push the decode cache for the handle at index 1 (a table: 1-based slot
+  // -> {version, value}), creating it if needed. The caches of all handles
+  // live in a weak-keyed table in the registry, so they go away with the
+  // handles.
+  static void pushDecodeCache(lua_State* L) {
+    static const char kCachesKey = 0;
+    lua_pushlightuserdata(L, const_cast<char*>(&kCachesKey));
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_createtable(L, 0, 1);
+      lua_pushstring(L, "k");
+      lua_setfield(L, -2, "__mode");
+      lua_setmetatable(L, -2);
+      lua_pushlightuserdata(L, const_cast<char*>(&kCachesKey));
+      lua_pushvalue(L, -2);
+      lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_pushvalue(L, 1);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, -4);
+    }
+    lua_remove(L, -2);
+  }
+
+ public:
+  virtual int luaRead(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    auto blob = checkRead(L, idx - 1);
+    SCOPE_EXIT {
+      Refcount<ObjectBlob*>().dec(blob);
+    };
+    push(L, blob);
+    return 1;
+  }
+
+  virtual int luaReadCached(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    auto blob = checkRead(L, idx - 1);
+    SCOPE_EXIT {
+      Refcount<ObjectBlob*>().dec(blob);
+    };
+    auto version = lua_Number(blob->version);
+    pushDecodeCache(L);
+    lua_rawgeti(L, -1, idx);
+    if (lua_istable(L, -1)) {
+      lua_rawgeti(L, -1, 1);
+      bool current = lua_tonumber(L, -1) == version;
+      lua_pop(L, 1);
+      if (current) {
+        lua_rawgeti(L, -1, 2);
+        return 1;
+      }
+    }
+    lua_pop(L, 1);
 
-namespace {
+    // cache; push a new entry {version, value}
+    lua_createtable(L, 2, 0);
+    lua_pushnumber(L, version);
+    lua_rawseti(L, -2, 1);
+    push(L, blob);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, 2);
+    // cache, entry, value
+    lua_insert(L, -3);
+    lua_rawseti(L, -2, idx);
+    lua_pop(L, 1);
+    return 1;
+  }
 
-constexpr const char* kTypeName = "fblualib.atomicvector";
+  virtual int luaWrite(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    auto blob = checkSerialize(L, 3);
+    SCOPE_EXIT {
+      Refcount<ObjectBlob*>().dec(blob);
+    };
+    try {
+      m_av.write(idx - 1, blob);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "bad atomic vector index: %s %d", err.what(), idx);
+    }
+    return 0;
+  }
 
-struct TorchAtomicVectorIf {
-  typedef int BucketIndex;
-  virtual ~TorchAtomicVectorIf() { }
+  virtual int luaAppend(lua_State* L) {
+    auto blob = checkSerialize(L, 2);
+    size_t sz = m_av.append(blob);
+    Refcount<ObjectBlob*>().dec(blob);
+    lua_pushnumber(L, sz + 1); // To lua
+    return 1;
+  }
 
-  virtual int luaRead(lua_State* L) = 0;
-  virtual int luaWrite(lua_State* L) = 0;
-  virtual int luaAppend(lua_State* L) = 0;
-  virtual int luaSize(lua_State* L) = 0;
-  virtual int luaSave(lua_State* L) = 0;
-  virtual int luaLoad(lua_State* L) = 0;
+  virtual int luaReadBatch(lua_State* L) {
+    return readBatch<ObjectBlob*>(
+        L,
+        [&] (const std::vector<uint32_t>& indices, ObjectBlob** out) {
+          m_av.readBatch(indices.data(), indices.size(), out);
+        },
+        [] (lua_State* L, ObjectBlob* blob) {
+          SCOPE_EXIT {
+            release(blob);
+          };
+          push(L, blob);
+        },
+        release);
+  }
+
+  virtual int luaWriteBatch(lua_State* L) {
+    return writeBatch<ObjectBlob*>(
+        L, "values", checkSerialize,
+        [&] (uint32_t slot, ObjectBlob* blob) {
+          m_av.write(slot, blob);
+        },
+        release);
+  }
+
+  virtual int luaAppendBatch(lua_State* L) {
+    return appendBatch<ObjectBlob*>(
+        L, checkSerialize,
+        [&] (ObjectBlob* blob) { return m_av.append(blob); },
+        release);
+  }
+
+  virtual int luaReadInto(lua_State* L) {
+    return unsupported(L, "read_into", "object");
+  }
+
+  virtual int luaGather(lua_State* L) {
+    return unsupported(L, "gather", "object");
+  }
+
+  virtual int luaScatterAdd(lua_State* L) {
+    return unsupported(L, "scatter_add", "object");
+  }
+
+  virtual int luaAtomicAdd(lua_State* L) {
+    return unsupported(L, "atomic_add", "object");
+  }
+
+  virtual int luaAtomicAddRows(lua_State* L) {
+    return unsupported(L, "atomic_add_rows", "object");
+  }
+
+  virtual int luaSnapshot(lua_State* L) {
+    return unsupported(L, "snapshot", "object");
+  }
+
+  virtual int luaParallelForEach(lua_State* L) {
+    return unsupported(L, "parallel_for_each", "object");
+  }
 };
 
-TorchAtomicVectorIf*
-checkAtomicVec(lua_State* L, int idx) {
-  auto av = static_cast<TorchAtomicVectorIf**>
-    (luaL_checkudata(L, idx, kTypeName));
-  DCHECK(av);
-  return *av;
-}
+// Element type tags for the tensors of shared atomic vectors
+template<typename Real> struct SharedTensorType;
+template<> struct SharedTensorType<float> {
+  static constexpr auto value = thpp::ThriftTensorDataType::FLOAT;
+};
+template<> struct SharedTensorType<double> {
+  static constexpr auto value = thpp::ThriftTensorDataType::DOUBLE;
+};
+template<> struct SharedTensorType<int> {
+  static constexpr auto value = thpp::ThriftTensorDataType::INT32;
+};
 
+// An atomic vector whose tensors live in a SharedAtomicVector segment, so
+// that several processes on the same host share one copy. Each blob holds
+// a tensor's number of dimensions and sizes, then its (contiguous) data,
+// 64-byte aligned.
+//
+// Reads don't copy: the returned tensors point into the segment's read-only
+// mapping, and hold a reference to their blob until they're garbage
+// collected. Those tensors are shared by all readers in all processes, so
+// modifying one in place faults (rather than corrupting every process's
+// copy), and in-place updates (scatter_add, atomic_add, ...) aren't
+// supported; write a new tensor instead.
 template<typename Real>
-class TorchAtomicVector : public TorchAtomicVectorIf {
-  AtomicVector<typename thpp::Tensor<Real>::THType*> m_av;
+class SharedTorchAtomicVector : public TorchAtomicVectorIf {
   typedef typename thpp::Tensor<Real>::THType Tensor;
+  typedef RawTensor<Real> Raw;
+  typedef SharedAtomicVector::Blob Blob;
 
-  virtual Tensor*
-  checkTensor(lua_State* L, int idx) {
+  // Keeps the segment mapped as long as any tensor points into it
+  std::shared_ptr<SharedAtomicVector> m_sv;
+
+  struct BlobRef {
+    std::shared_ptr<SharedAtomicVector> sv;
+    Blob blob;
+  };
+
+  static void freeBlobRef(void* /*buf*/, void* userData) {
+    auto ref = static_cast<BlobRef*>(userData);
+    ref->sv->decref(ref->blob);
+    delete ref;
+  }
+
+  static size_t dataOffset(int64_t ndims) {
+    return (sizeof(int64_t) * (ndims + 1) + 63) & ~size_t(63);
+  }
+
+  Tensor* checkTensor(lua_State* L, int idx) {
     auto t = static_cast<Tensor**>(
       luaL_checkudata(L, idx, kTensorTypeName));
     DCHECK(t);
     return *t;
   }
 
+  // Copy t into a new blob (with a refcount of 1).
+  Blob store(Tensor* t) {
+    auto c = Raw::newContiguous(t);
+    thpp::Tensor<Real> contig(c);
+    Raw::free(c);
+    auto sizes = contig.sizes();
+    auto off = dataOffset(sizes.size());
+    auto blob = m_sv->allocate(off + contig.size() * sizeof(Real));
+    auto p = m_sv->data(blob);
+    auto header = reinterpret_cast<int64_t*>(p);
+    header[0] = sizes.size();
+    for (size_t i = 0; i < sizes.size(); i++) {
+      header[i + 1] = sizes[i];
+    }
+    memcpy(p + off, contig.data(), contig.size() * sizeof(Real));
+    return blob;
+  }
+
+  // Return a tensor pointing into blob, which takes over our reference.
+  Tensor* load(Blob blob) {
+    std::unique_ptr<BlobRef> ref(new BlobRef{m_sv, blob});
+    auto p = m_sv->readOnlyData(blob);
+    auto header = reinterpret_cast<const int64_t*>(p);
+    auto off = dataOffset(header[0]);
+    thpp::ThriftTensor th;
+    th.dataType = SharedTensorType<Real>::value;
+    th.endianness = thpp::ThriftTensorEndianness::NATIVE;
+    th.sizes.assign(header + 1, header + 1 + header[0]);
+    th.data = folly::IOBuf(folly::IOBuf::TAKE_OWNERSHIP,
+                           const_cast<uint8_t*>(p + off),
+                           m_sv->length(blob) - off, freeBlobRef,
+                           ref.release());
+    return thpp::Tensor<Real>(th, thpp::SHARE_IOBUF_MANAGED).moveAsTH();
+  }
+
+  Tensor* read(size_t i) {
+    return load(m_sv->read(i));
+  }
+
+  void write(size_t i, Tensor* t) {
+    auto blob = store(t);
+    SCOPE_EXIT {
+      m_sv->decref(blob);
+    };
+    m_sv->write(i, blob);
+  }
+
+  size_t append(Tensor* t) {
+    auto blob = store(t);
+    SCOPE_EXIT {
+      m_sv->decref(blob);
+    };
+    return m_sv->append(blob);
+  }
+
  public:
   constexpr static const char* kTensorTypeName =
     thpp::Tensor<Real>::kLuaTypeName;
 
-  virtual ~TorchAtomicVector() { }
+  SharedTorchAtomicVector(const std::string& path, size_t capacity)
+    : m_sv(std::make_shared<SharedAtomicVector>(path, capacity)) { }
+
+  virtual ~SharedTorchAtomicVector() { }
+
+  static void pushTensor(lua_State* L, Tensor* t) {
+    luaT_pushudata(L, t, kTensorTypeName);
+  }
+
+  virtual int luaSize(lua_State* L) {
+    lua_pushnumber(L, m_sv->size());
+    return 1;
+  }
 
   virtual int luaRead(lua_State* L) {
     int idx = luaL_checknumber(L, 2);
+    Tensor* val = nullptr;
     try {
-      auto val = m_av.read(idx - 1);
-      luaT_pushudata(L, val, kTensorTypeName);
+      val = read(idx - 1);
     } catch (std::runtime_error &err) {
-      luaL_error(L, "atomic vector error: %s %d", err.what(),
-                 idx);
+      luaL_error(L, "atomic vector error: %s %d", err.what(), idx);
+    }
+    luaT_pushudata(L, val, kTensorTypeName);
+    return 1;
+  }
+
+  virtual int luaReadCached(lua_State* L) {
+    return luaRead(L);
+  }
+
+  virtual int luaReadInto(lua_State* L) {
+    int idx = luaL_checknumber(L, 2);
+    auto out = checkTensor(L, 3);
+    try {
+      auto t = read(idx - 1);
+      SCOPE_EXIT {
+        Raw::free(t);
+      };
+      Raw::copy(out, t);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s %d", err.what(), idx);
     }
+    lua_pushvalue(L, 3);
     return 1;
   }
 
@@ -116,33 +1613,185 @@ class TorchAtomicVector : public TorchAtomicVectorIf {
     int idx = luaL_checknumber(L, 2);
     auto val = checkTensor(L, 3);
     try {
-      m_av.write(idx - 1, val);
+      write(idx - 1, val);
     } catch (std::runtime_error &err) {
-       luaL_error(L, "bad atomic vector index: %s %d", err.what(), idx);
+      luaL_error(L, "bad atomic vector index: %s %d", err.what(), idx);
     }
     return 0;
   }
 
   virtual int luaAppend(lua_State* L) {
-    size_t sz = m_av.append(checkTensor(L, 2));
+    auto val = checkTensor(L, 2);
+    size_t sz = 0;
+    try {
+      sz = append(val);
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s", err.what());
+    }
     lua_pushnumber(L, sz + 1); // To lua
     return 1;
   }
 
-  virtual int luaSize(lua_State* L) {
-    lua_pushnumber(L, m_av.size());
-    return 1;
+  virtual int luaReadBatch(lua_State* L) {
+    return readBatch<Tensor*>(
+        L,
+        [&] (const std::vector<uint32_t>& indices, Tensor** out) {
+          for (size_t i = 0; i < indices.size(); i++) {
+            out[i] = read(indices[i]);
+          }
+        },
+        pushTensor, Raw::free);
   }
 
-  virtual int luaLoad(lua_State* L) {
+  virtual int luaWriteBatch(lua_State* L) {
+    return writeBatch<Tensor*>(
+        L, "tensors",
+        [&] (lua_State* L, int idx) { return checkTensor(L, idx); },
+        [&] (uint32_t slot, Tensor* t) { write(slot, t); },
+        [] (Tensor*) { });
+  }
+
+  virtual int luaAppendBatch(lua_State* L) {
+    return appendBatch<Tensor*>(
+        L,
+        [&] (lua_State* L, int idx) { return checkTensor(L, idx); },
+        [&] (Tensor* t) { return append(t); },
+        [] (Tensor*) { });
+  }
+
+  virtual int luaGather(lua_State* L) {
+    return gatherRows<Real>(
+        L,
+        [&] (const std::vector<uint32_t>& indices, ptrdiff_t rowSize,
+             Real* dst) {
+          for (size_t i = 0; i < indices.size(); i++) {
+            // Blob data is contiguous; copy it directly.
+            auto blob = m_sv->read(indices[i]);
+            SCOPE_EXIT {
+              m_sv->decref(blob);
+            };
+            auto p = m_sv->readOnlyData(blob);
+            auto off = dataOffset(reinterpret_cast<const int64_t*>(p)[0]);
+            checkRowSize((m_sv->length(blob) - off) / sizeof(Real), rowSize);
+            memcpy(dst + i * rowSize, p + off, rowSize * sizeof(Real));
+          }
+        });
+  }
+
+  // Same file format as regular atomic vectors. load() must be called on
+  // an empty vector, by one process; it decodes in parallel, then appends.
+  virtual int luaSave(lua_State* L) {
     auto file = luaDecodeFILE(L, 2);
-    m_av.load(file);
+    try {
+      detail::saveFramed(file, 0x04081977, m_sv->size(),
+                         [this] (size_t i, std::vector<uint8_t>& buf) {
+        auto t = read(i);
+        SCOPE_EXIT {
+          Raw::free(t);
+        };
+        StringWriter sw;
+        auto str = Serde<Tensor*>::save(t, sw);
+        size_t strsz = str.size();
+        auto pos = buf.size();
+        buf.resize(pos + sizeof(strsz) + strsz);
+        memcpy(&buf[pos], &strsz, sizeof(strsz));
+        memcpy(&buf[pos + sizeof(strsz)], str.data(), strsz);
+      });
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s", err.what());
+    }
     return 0;
   }
 
-  virtual int luaSave(lua_State* L) {
+  virtual int luaLoad(lua_State* L) {
     auto file = luaDecodeFILE(L, 2);
-    m_av.save(file);
+    if (m_sv->size() != 0) {
+      luaL_error(L, "can only load into an empty shared atomic vector");
+    }
+    std::vector<Blob> blobs;
+    try {
+      SCOPE_EXIT {
+        for (auto blob : blobs) {
+          if (blob) {
+            m_sv->decref(blob);
+          }
+        }
+      };
+      detail::loadFramed(
+        file, 0x04081977,
+        [&] (size_t n) {
+          blobs.resize(n);
+        },
+        [&] (size_t i, folly::ByteRange range) {
+          auto t = Serde<Tensor*>::load(&range);
+          SCOPE_EXIT {
+            Raw::free(t);
+          };
+          blobs[i] = store(t);
+        });
+      for (auto blob : blobs) {
+        m_sv->append(blob);
+      }
+    } catch (std::runtime_error &err) {
+      luaL_error(L, "atomic vector error: %s", err.what());
+    }
+    return 0;
+  }
+
+  virtual int luaLoadLazy(lua_State* L) {
+    return unsupported(L, "load_lazy", "shared");
+  }
+
+  virtual int luaSaveIncremental(lua_State* L) {
+    return unsupported(L, "save_incremental", "shared");
+  }
+
+  virtual int luaLoadIncremental(lua_State* L) {
+    return unsupported(L, "load_incremental", "shared");
+  }
+
+  virtual int luaScatterAdd(lua_State* L) {
+    return unsupported(L, "scatter_add", "shared");
+  }
+
+  virtual int luaAtomicAdd(lua_State* L) {
+    return unsupported(L, "atomic_add", "shared");
+  }
+
+  virtual int luaAtomicAddRows(lua_State* L) {
+    return unsupported(L, "atomic_add_rows", "shared");
+  }
+
+  virtual int luaSnapshot(lua_State* L) {
+    return unsupported(L, "snapshot", "shared");
+  }
+
+  virtual int luaParallelForEach(lua_State* L) {
+    return unsupported(L, "parallel_for_each", "shared");
+  }
+
+  virtual int luaSetAllocPolicy(lua_State* L) {
+    return unsupported(L, "set_alloc_policy", "shared");
+  }
+
+  virtual int luaReadCounts(lua_State* L) {
+    return unsupported(L, "read_counts", "shared");
+  }
+
+  virtual int luaErase(lua_State* L) {
+    return unsupported(L, "erase", "shared");
+  }
+
+  virtual int luaIsErased(lua_State* L) {
+    return unsupported(L, "is_erased", "shared");
+  }
+
+  virtual int luaCompact(lua_State* L) {
+    return unsupported(L, "compact", "shared");
+  }
+
+  // Blobs are freed as soon as their last reference goes away.
+  virtual int luaFlushRetired(lua_State* L) {
     return 0;
   }
 };
@@ -175,6 +1824,98 @@ int createInt(lua_State* L) {
   return create<int>(L);
 }
 
+// create_compressed_<type>(name, [codec, [cache_size]])
+template<typename Real>
+int createCompressed(lua_State* L) {
+  auto name = luaL_checkstring(L, 1);
+  auto codec = folly::io::CodecType(luaGetNumber<int>(L, 2).value_or(
+      int(folly::io::CodecType::LZ4)));
+  auto cacheSize = luaGetNumber<long>(L, 3).value_or(256);
+  if (cacheSize < 0) {
+    luaL_error(L, "invalid cache size %ld", cacheSize);
+  }
+  try {
+    folly::io::getCodec(codec);
+  } catch (const std::exception& e) {
+    luaL_error(L, "invalid codec: %s", e.what());
+  }
+  auto created = g_vecTab.create(name, [codec, cacheSize] {
+    return std::make_unique<CompressedTorchAtomicVector<Real>>(
+        codec, cacheSize);
+  });
+  if (created) {
+    lua_pushboolean(L, true);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+int createCompressedDouble(lua_State* L) {
+  return createCompressed<double>(L);
+}
+
+int createCompressedFloat(lua_State* L) {
+  return createCompressed<float>(L);
+}
+
+int createCompressedInt(lua_State* L) {
+  return createCompressed<int>(L);
+}
+
+int createObject(lua_State* L) {
+  auto name = luaL_checkstring(L, 1);
+  auto created = g_vecTab.create(name, [] {
+    return std::make_unique<ObjectAtomicVector>();
+  });
+  if (created) {
+    lua_pushboolean(L, true);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// create_shared_<type>(name, path, [capacity]) attaches to the shared
+// atomic vector segment at path, creating it (with the given capacity, in
+// bytes) if it doesn't exist yet.
+template<typename Real>
+int createShared(lua_State* L) {
+  auto name = luaL_checkstring(L, 1);
+  std::string path = luaL_checkstring(L, 2);
+  auto capacity = luaGetNumber<double>(L, 3).value_or(double(1UL << 30));
+  if (capacity <= 0) {
+    luaL_error(L, "invalid capacity %f", capacity);
+  }
+  bool created = false;
+  try {
+    created = g_vecTab.create(name, [&path, capacity] {
+      return std::make_unique<SharedTorchAtomicVector<Real>>(
+          path, size_t(capacity));
+    });
+  } catch (std::runtime_error &err) {
+    luaL_error(L, "atomic vector error: %s", err.what());
+  }
+  if (created) {
+    lua_pushboolean(L, true);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+int createSharedDouble(lua_State* L) {
+  return createShared<double>(L);
+}
+
+int createSharedFloat(lua_State* L) {
+  return createShared<float>(L);
+}
+
+int createSharedInt(lua_State* L) {
+  return createShared<int>(L);
+}
+
 int destroy(lua_State* L) {
   auto name = luaL_checkstring(L, 1);
   auto removed = g_vecTab.erase(name);
@@ -217,6 +1958,14 @@ int read(lua_State* L) {
   return checkAtomicVec(L, 1)->luaRead(L);
 }
 
+int readInto(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaReadInto(L);
+}
+
+int readCached(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaReadCached(L);
+}
+
 int size(lua_State* L) {
   return checkAtomicVec(L, 1)->luaSize(L);
 }
@@ -225,20 +1974,143 @@ int load(lua_State* L) {
   return checkAtomicVec(L, 1)->luaLoad(L);
 }
 
+int loadLazy(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaLoadLazy(L);
+}
+
 int save(lua_State* L) {
   return checkAtomicVec(L, 1)->luaSave(L);
 }
 
+int saveIncremental(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaSaveIncremental(L);
+}
+
+int loadIncremental(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaLoadIncremental(L);
+}
+
+int readBatch(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaReadBatch(L);
+}
+
+int writeBatch(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaWriteBatch(L);
+}
+
+int appendBatch(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaAppendBatch(L);
+}
+
+int gather(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaGather(L);
+}
+
+int scatterAdd(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaScatterAdd(L);
+}
+
+int atomicAdd(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaAtomicAdd(L);
+}
+
+int setAllocPolicy(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaSetAllocPolicy(L);
+}
+
+int readCounts(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaReadCounts(L);
+}
+
+int erase(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaErase(L);
+}
+
+int isErased(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaIsErased(L);
+}
+
+int compact(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaCompact(L);
+}
+
+int flushRetired(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaFlushRetired(L);
+}
+
+int snapshot(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaSnapshot(L);
+}
+
+int release(lua_State* L) {
+  auto snap = checkSnapshotPtr(L, 1);
+  delete *snap;
+  *snap = nullptr;
+  return 0;
+}
+
+// On a vector or a snapshot
+int parallelForEach(lua_State* L) {
+  if (isSnapshot(L, 1)) {
+    return checkSnapshot(L, 1)->luaParallelForEach(L);
+  }
+  return checkAtomicVec(L, 1)->luaParallelForEach(L);
+}
+
+int snapshotRead(lua_State* L) {
+  return checkSnapshot(L, 1)->luaRead(L);
+}
+
+int snapshotSize(lua_State* L) {
+  return checkSnapshot(L, 1)->luaSize(L);
+}
+
+int atomicAddRows(lua_State* L) {
+  return checkAtomicVec(L, 1)->luaAtomicAddRows(L);
+}
+
 const struct luaL_reg moduleFuncs[] = {
   { "create_float", createFloat },
   { "create_double", createDouble },
   { "create_int", createInt },
+  { "create_compressed_float", createCompressedFloat },
+  { "create_compressed_double", createCompressedDouble },
+  { "create_compressed_int", createCompressedInt },
+  { "create_object", createObject },
+  { "create_shared_float", createSharedFloat },
+  { "create_shared_double", createSharedDouble },
+  { "create_shared_int", createSharedInt },
   { "destroy", destroy },
   { "get", get },
   { "append", append },
+  { "read_into", readInto },
+  { "read_cached", readCached },
 
   { "load", load },
+  { "load_lazy", loadLazy },
   { "save",  save },
+  { "save_incremental", saveIncremental },
+  { "load_incremental", loadIncremental },
+
+  { "read_batch", readBatch },
+  { "write_batch", writeBatch },
+  { "append_batch", appendBatch },
+  { "gather", gather },
+  { "scatter_add", scatterAdd },
+  { "atomic_add", atomicAdd },
+  { "atomic_add_rows", atomicAddRows },
+
+  { "set_alloc_policy", setAllocPolicy },
+  { "read_counts", readCounts },
+
+  { "erase", erase },
+  { "is_erased", isErased },
+  { "compact", compact },
+  { "flush_retired", flushRetired },
+
+  { "snapshot", snapshot },
+  { "release", release },
+  { "parallel_for_each", parallelForEach },
 
   { nullptr, nullptr },
 };
@@ -247,6 +2119,14 @@ const struct luaL_reg vecOps[] = {
   { "__index", read },
   { "__newindex", write },
   { "__len" , size },
+  { nullptr, nullptr },
+};
+
+const struct luaL_reg snapshotOps[] = {
+  { "__index", snapshotRead },
+  { "__len" , snapshotSize },
+  { "__gc", release },
+  { nullptr, nullptr },
 };
 
 } // namespace
@@ -257,6 +2137,10 @@ extern "C" int LUAOPEN(lua_State* L) {
     luaL_register(L, nullptr, vecOps);
     lua_pop(L, 1);
   }
+  if (luaL_newmetatable(L, kSnapshotTypeName)) {
+    luaL_register(L, nullptr, snapshotOps);
+    lua_pop(L, 1);
+  }
 
   // Return module table.
   lua_newtable(L);
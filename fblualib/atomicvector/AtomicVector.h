@@ -10,17 +10,35 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <set>
+#include <sstream>
 #include <stdexcept>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include <folly/Bits.h>
+#include <folly/Hash.h>
+#include <folly/ScopeGuard.h>
 
 #include <fblualib/thrift/LuaObject.h>
 
@@ -29,85 +47,780 @@ template <typename T> class Serde;
 
 namespace fblualib {
 
+// Where an AtomicVector puts its slot arrays ("buckets"), and whether it
+// counts reads per NUMA node; see AtomicVector::setAllocPolicy().
+struct AllocPolicy {
+  enum class Numa {
+    FIRST_TOUCH,  // on the node of the thread that first touches each page
+    INTERLEAVE,   // page by page, round-robin across all nodes
+    BIND,         // on node
+  };
+  enum class HugePages {
+    NONE,
+    TRANSPARENT,  // madvise(MADV_HUGEPAGE)
+    EXPLICIT,     // MAP_HUGETLB, from the reserved pool; transparent huge
+                  // pages if the pool is exhausted
+  };
+
+  Numa numa = Numa::FIRST_TOUCH;
+  int node = 0;
+  HugePages hugePages = HugePages::NONE;
+  // Also move the memory owned by values (tensor storage) according to
+  // numa; see AtomicVector::placeValue().
+  bool placeValues = false;
+  // Count reads by the NUMA node of the reading thread; see
+  // AtomicVector::readCounts().
+  bool countReads = false;
+};
+
 namespace detail {
-// A SensitiveSection is a region of code that multiple threads can
-// be in, and for which other threads can wait until every other thread
-// has been observed not to be in the SensitiveSection. This is not to
-// be confused with mutual exclusion, or even RWlock semantics; nothing
-// guarantees that other threads will not enter the sensitve section
-// after a wait operation. Also beware that this provides no fairness
-// guarantees to waiters; threads entering the sensitive section are
-// given static priority.
-class SensitiveSection {
-  typedef std::atomic<uint32_t> AtomicCount;
+
+constexpr size_t kCacheLineSize = 64;
+
+// Process-wide assignment of small integer ids to threads, so that per-thread
+// state can live in arrays indexed by id. Ids are recycled when a thread
+// exits (the lowest free id is handed out first, so ids stay dense); a new
+// thread inherits whatever per-thread state its id's previous owner left
+// behind.
+class ThreadId {
 public:
-  explicit SensitiveSection(int n)
-  : m_n(n)
-  {
-    m_counts = (AtomicCount*)calloc(sizeof(AtomicCount), m_n);
+  static size_t get() {
+    static thread_local Holder holder;
+    return holder.id;
+  }
+
+private:
+  struct Holder {
+    Holder() : id(acquire()) { }
+    ~Holder() { release(id); }
+    size_t id;
+  };
+
+  struct Ids {
+    std::mutex lock;
+    size_t next = 0;
+    std::set<size_t> free;
+  };
+
+  // Leaked: threads may exit after static destructors have run.
+  static Ids& ids() {
+    static Ids* ids = new Ids;
+    return *ids;
+  }
+
+  static size_t acquire() {
+    auto& ids = ThreadId::ids();
+    std::lock_guard<std::mutex> g(ids.lock);
+    if (ids.free.empty()) {
+      return ids.next++;
+    }
+    auto id = *ids.free.begin();
+    ids.free.erase(ids.free.begin());
+    return id;
+  }
+
+  static void release(size_t id) {
+    auto& ids = ThreadId::ids();
+    std::lock_guard<std::mutex> g(ids.lock);
+    ids.free.insert(id);
+  }
+};
+
+// Epoch-based reclamation. Readers enter() / leave() around accesses to
+// shared values; writers retire() values they've unlinked, and retired
+// values are reclaimed (by calling the given reclaimer) once every reader
+// that could have seen them has left.
+//
+// Each thread publishes the epoch it observed on entry in its own
+// cache-line-sized record, so readers never write to shared cache lines,
+// and writers never wait for readers: retired values wait in the writer's
+// record. They're reclaimed as soon as it's safe: by the writer, if no
+// reader is in the way, or else by the next thread to leave a read (or
+// unpin()) while anything is waiting.
+class EpochManager {
+public:
+  typedef void (*Reclaimer)(uintptr_t);
+
+  EpochManager() : m_epoch(1), m_numRetired(0) {
+    m_tables.emplace_back(new Table(kInitialRecords));
+    m_table.store(m_tables.back().get());
   }
 
-  ~SensitiveSection() {
-    free(m_counts);
+  ~EpochManager() {
+    assert(m_pinned.empty());
+    drain();
+    for (auto rec : m_records) {
+      rec->~Record();
+      free(rec);
+    }
   }
 
+  EpochManager(const EpochManager&) = delete;
+  EpochManager& operator=(const EpochManager&) = delete;
+
   void enter() {
-    getCount()++;
+    auto& rec = self();
+    if (rec.nesting++ == 0) {
+      rec.epoch.store(m_epoch.load());
+    }
   }
 
   void leave() {
-    getCount()--;
+    auto& rec = self();
+    if (--rec.nesting == 0) {
+      rec.epoch.store(0);
+      if (m_numRetired.load()) {
+        reclaimAll();
+      }
+    }
   }
 
-  void wait() {
-    // Buyer beware: no fairness guarantees.
-    for (int i = 0; i < m_n; i++)
-      while (m_counts[i].load()) {
+  // Arrange for reclaimer(val) to be called once no reader may still be
+  // using val. Must be called after val has been unlinked.
+  void retire(uintptr_t val, Reclaimer reclaimer) {
+    auto& rec = self();
+    {
+      std::lock_guard<std::mutex> g(rec.lock);
+      rec.retired.push_back(Retired{m_epoch.fetch_add(1), reclaimer, val});
+      rec.numRetired.store(rec.retired.size());
+      m_numRetired.fetch_add(1);
+    }
+    // Inside a read, our own epoch holds up most of what we could reclaim;
+    // leave() will get to it.
+    if (rec.nesting == 0 || rec.numRetired.load() >= kReclaimBatch) {
+      reclaimAll();
+    }
+  }
+
+  // Hold off reclaiming anything retired from now on, until unpin() is
+  // called (from any thread) with the returned token. For long-lived
+  // readers, such as snapshots, that can't stay inside enter() / leave().
+  uint64_t pin() {
+    std::lock_guard<std::mutex> g(m_pinLock);
+    auto epoch = m_epoch.load();
+    m_pinned.insert(epoch);
+    return epoch;
+  }
+
+  void unpin(uint64_t token) {
+    {
+      std::lock_guard<std::mutex> g(m_pinLock);
+      auto it = m_pinned.find(token);
+      assert(it != m_pinned.end());
+      m_pinned.erase(it);
+    }
+    if (m_numRetired.load()) {
+      reclaimAll();
+    }
+  }
+
+  // Reclaim everything (retired by any thread) that no reader may still
+  // be using. Retired values are normally reclaimed promptly without this.
+  void reclaimAll() {
+    auto minActive = minActiveEpoch();
+    forEachRecord([&] (Record& rec) {
+      if (rec.numRetired.load()) {
+        std::lock_guard<std::mutex> g(rec.lock);
+        reclaim(rec, minActive);
+      }
+    });
+  }
+
+  // Reclaim everything, regardless of readers. Only safe when the caller
+  // knows that no other thread is accessing the protected values.
+  void drain() {
+    forEachRecord([&] (Record& rec) {
+      for (auto& r : rec.retired) {
+        r.reclaimer(r.val);
+      }
+      rec.retired.clear();
+      rec.numRetired.store(0);
+    });
+    m_numRetired.store(0);
+  }
+
+  // Note: racy (hence "appears"). For use in asserts where the
+  // the system is in a known state.
+  bool appearsQuiescent() const {
+    bool quiescent = true;
+    forEachRecord([&] (const Record& rec) {
+      if (rec.epoch.load()) quiescent = false;
+    });
+    return quiescent;
+  }
+
+private:
+  // Reclaim from within a read once this many values are waiting in the
+  // thread's record, to bound the garbage of long reads that write.
+  static constexpr size_t kReclaimBatch = 64;
+  static constexpr size_t kInitialRecords = 64;
+
+  struct Retired {
+    uint64_t epoch;
+    Reclaimer reclaimer;
+    uintptr_t val;
+  };
+
+  // Only the owning thread touches nesting. The lock protects retired;
+  // numRetired mirrors its size, so reclaimers can skip empty records
+  // without taking the lock.
+  struct alignas(kCacheLineSize) Record {
+    std::atomic<uint64_t> epoch{0};  // 0 = not inside a read
+    uint32_t nesting{0};
+    std::atomic<size_t> numRetired{0};
+    std::mutex lock;
+    std::vector<Retired> retired;
+  };
+
+  // Records, indexed by thread id. Tables only grow, and are kept until
+  // destruction, so a thread may keep scanning a stale one: records in it
+  // stay valid, and a thread whose record is missing from it entered
+  // after the scan started (see minActiveEpoch()).
+  struct Table {
+    explicit Table(size_t n) : size(n), records(new std::atomic<Record*>[n]) {
+      for (size_t i = 0; i < n; i++) {
+        records[i].store(nullptr);
+      }
+    }
+    const size_t size;
+    std::unique_ptr<std::atomic<Record*>[]> records;
+  };
+
+  Record& self() {
+    auto id = ThreadId::get();
+    auto table = m_table.load();
+    if (id < table->size) {
+      auto rec = table->records[id].load();
+      if (rec) {
+        return *rec;
+      }
+    }
+    return addRecord(id);
+  }
+
+  Record& addRecord(size_t id) {
+    std::lock_guard<std::mutex> g(m_growLock);
+    auto table = m_table.load();
+    if (id >= table->size) {
+      auto size = table->size;
+      while (size <= id) {
+        size *= 2;
+      }
+      std::unique_ptr<Table> grown(new Table(size));
+      for (size_t i = 0; i < table->size; i++) {
+        grown->records[i].store(table->records[i].load());
+      }
+      table = grown.get();
+      m_tables.push_back(std::move(grown));
+      m_table.store(table);
+    }
+    void* mem;
+    if (posix_memalign(&mem, kCacheLineSize, sizeof(Record))) {
+      throw std::bad_alloc();
+    }
+    auto rec = new (mem) Record();
+    m_records.push_back(rec);
+    table->records[id].store(rec);
+    return *rec;
+  }
+
+  template<typename Fn>
+  void forEachRecord(Fn&& fn) const {
+    auto table = m_table.load();
+    for (size_t i = 0; i < table->size; i++) {
+      auto rec = table->records[i].load();
+      if (rec) fn(*rec);
+    }
+  }
+
+  // Values retired at or after the returned epoch may still be in use.
+  // Start from the current epoch, so that values retired (after having
+  // been unlinked) while we scan are left alone: readers we find inactive
+  // may enter and see them before they're unlinked.
+  uint64_t minActiveEpoch() const {
+    uint64_t minActive = m_epoch.load();
+    forEachRecord([&] (const Record& rec) {
+      auto e = rec.epoch.load();
+      if (e && e < minActive) minActive = e;
+    });
+    // A pinner loads slots after releasing m_pinLock, so if we don't see
+    // its pin here, it will see whatever we've unlinked.
+    std::lock_guard<std::mutex> g(m_pinLock);
+    if (!m_pinned.empty() && *m_pinned.begin() < minActive) {
+      minActive = *m_pinned.begin();
+    }
+    return minActive;
+  }
+
+  // A reader that entered at epoch e may have seen any value retired at
+  // epoch >= e. Each record's values are retired in increasing epoch order,
+  // so we can reclaim a prefix.
+  void reclaim(Record& rec, uint64_t minActive) {
+    auto it = rec.retired.begin();
+    for (; it != rec.retired.end() && it->epoch < minActive; ++it) {
+      it->reclaimer(it->val);
+    }
+    auto n = it - rec.retired.begin();
+    rec.retired.erase(rec.retired.begin(), it);
+    rec.numRetired.store(rec.retired.size());
+    m_numRetired.fetch_sub(n);
+  }
+
+  std::atomic<uint64_t> m_epoch;
+  // Retired values, across all records, not yet reclaimed
+  std::atomic<size_t> m_numRetired;
+  std::atomic<Table*> m_table;
+  std::mutex m_growLock;  // protects m_tables, m_records
+  std::vector<std::unique_ptr<Table>> m_tables;
+  std::vector<Record*> m_records;
+  mutable std::mutex m_pinLock;
+  std::multiset<uint64_t> m_pinned;
+};
+
+inline void cpuRelax() {
 #ifdef __x86_64__
-        asm("pause");
+  asm volatile("pause");
 #else
 #error "Use your the thread relaxation primitive for your architecture."
 #endif
+}
+
+// Striped spinlocks: serialize short critical sections per key (for
+// example, in-place updates to a slot's data) without one lock per key.
+// Keys that map to the same stripe share a lock.
+class StripedSpinLock {
+public:
+  static constexpr size_t kStripes = 1024;
+
+  StripedSpinLock() {
+    for (size_t i = 0; i < kStripes; i++) {
+      m_stripes[i].locked.store(false);
+    }
+  }
+
+  StripedSpinLock(const StripedSpinLock&) = delete;
+  StripedSpinLock& operator=(const StripedSpinLock&) = delete;
+
+  void lock(size_t key) {
+    auto& locked = m_stripes[key % kStripes].locked;
+    while (locked.exchange(true, std::memory_order_acquire)) {
+      while (locked.load(std::memory_order_relaxed)) {
+        cpuRelax();
       }
+    }
   }
 
-  // Note: racy (hence "appears"). For use in asserts where the
-  // the system is in a known state.
-  bool appearsFree() const {
-    for (int i = 0; i < m_n; i++)
-      if (m_counts[i].load()) return false;
-    return true;
+  void unlock(size_t key) {
+    m_stripes[key % kStripes].locked.store(false, std::memory_order_release);
+  }
+
+private:
+  // One stripe per cache line
+  struct Stripe {
+    std::atomic<bool> locked;
+    char pad[kCacheLineSize - sizeof(std::atomic<bool>)];
+  };
+  Stripe m_stripes[kStripes];
+};
+
+// Reusable thread barrier: wait() blocks until n threads have called it.
+class Barrier {
+public:
+  explicit Barrier(size_t n) : m_n(n), m_count(0), m_generation(0) { }
+
+  Barrier(const Barrier&) = delete;
+  Barrier& operator=(const Barrier&) = delete;
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto generation = m_generation;
+    if (++m_count == m_n) {
+      m_count = 0;
+      m_generation++;
+      m_cv.notify_all();
+    } else {
+      m_cv.wait(lock, [&] { return generation != m_generation; });
+    }
   }
 
 private:
-  AtomicCount& getCount() {
-    auto self = (uintptr_t)pthread_self();
-    // Knuth multiplicative hash. pthread_t is really a pointer,
-    // and we want to spread it around the m_counts array somewhat.
-    return m_counts[(self * 2654435761) % m_n];
-  }
-
-  // Implementation note: each thread gets its own count rather than
-  // its own cacheline. The latter might be preferable, but is costly
-  // in space.
-  uint32_t m_n;
-  AtomicCount* m_counts;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  size_t m_n;
+  size_t m_count;
+  size_t m_generation;
+};
+
+// RAII guard for EpochManager reads.
+struct EpochGuard {
+  explicit EpochGuard(EpochManager* em) : m_em(em) {
+    m_em->enter();
+  }
+  ~EpochGuard() {
+    m_em->leave();
+  }
+  EpochGuard& operator=(const EpochGuard&) = delete;
+  EpochGuard(const EpochGuard&) = delete;
+private:
+  EpochManager* m_em;
 };
 
-// RAII guard for SS.
-struct SensitiveSectionGuard {
-  explicit SensitiveSectionGuard(SensitiveSection* ss) : m_ss(ss) {
-    m_ss->enter();
+// NUMA placement, with raw system calls rather than a libnuma dependency.
+constexpr int kMaxNumaNodes = 64;
+constexpr int kMpolBind = 2;        // from <numaif.h>
+constexpr int kMpolInterleave = 3;
+constexpr unsigned kMpolMfMove = 1 << 1;
+// Buckets smaller than this are calloc()ed regardless of policy; they're
+// too small to place page by page.
+constexpr size_t kMinPlacedBytes = 64 << 10;
+constexpr size_t kHugePageSize = 2 << 20;
+
+// Parse a kernel list of CPUs or nodes, such as "0-3,8,10-11".
+inline std::vector<int> parseIdList(const std::string& list) {
+  std::vector<int> ids;
+  std::istringstream in(list);
+  std::string range;
+  while (std::getline(in, range, ',')) {
+    int lo, hi;
+    auto n = sscanf(range.c_str(), "%d-%d", &lo, &hi);
+    if (n < 1) continue;
+    if (n == 1) hi = lo;
+    for (int i = lo; i <= hi; i++) {
+      ids.push_back(i);
+    }
+  }
+  return ids;
+}
+
+inline std::string readFirstLine(const std::string& path) {
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+// Bitmask of the online NUMA nodes; just node 0 if the kernel doesn't say.
+inline uint64_t onlineNumaNodes() {
+  static const uint64_t nodes = [] {
+    uint64_t mask = 0;
+    auto online = readFirstLine("/sys/devices/system/node/online");
+    for (auto n : parseIdList(online)) {
+      if (n < kMaxNumaNodes) mask |= uint64_t(1) << n;
+    }
+    return mask ? mask : 1;
+  }();
+  return nodes;
+}
+
+// NUMA node of the CPU the calling thread runs on. As threads may migrate,
+// but looking it up on every call would be too slow, it's refreshed every
+// so many calls.
+inline int currentNumaNode() {
+  static const std::vector<int> cpuToNode = [] {
+    std::vector<int> map;
+    auto nodes = onlineNumaNodes();
+    for (int n = 0; n < kMaxNumaNodes; n++) {
+      if (!(nodes & (uint64_t(1) << n))) continue;
+      auto cpus = readFirstLine("/sys/devices/system/node/node" +
+                                std::to_string(n) + "/cpulist");
+      for (auto cpu : parseIdList(cpus)) {
+        if (size_t(cpu) >= map.size()) map.resize(cpu + 1, 0);
+        map[cpu] = n;
+      }
+    }
+    return map;
+  }();
+  static thread_local int node = 0;
+  static thread_local uint32_t countdown = 0;
+  if (countdown-- == 0) {
+    countdown = 1024;
+    int cpu = sched_getcpu();
+    node = cpu >= 0 && size_t(cpu) < cpuToNode.size() ? cpuToNode[cpu] : 0;
+  }
+  return node;
+}
+
+// Apply policy's NUMA placement to the whole pages in [p, p + bytes); if
+// move, also migrate the pages that are already allocated. Best effort, as
+// placement is only a performance hint.
+inline void placeMemory(void* p, size_t bytes, const AllocPolicy& policy,
+                        bool move) {
+  if (policy.numa == AllocPolicy::Numa::FIRST_TOUCH) return;
+  uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+  auto start = (uintptr_t(p) + pageSize - 1) & ~(pageSize - 1);
+  auto end = (uintptr_t(p) + bytes) & ~(pageSize - 1);
+  if (start >= end) return;
+  bool bind = policy.numa == AllocPolicy::Numa::BIND;
+  unsigned long mask = bind ? 1UL << policy.node : onlineNumaNodes();
+  syscall(SYS_mbind, start, end - start,
+          bind ? kMpolBind : kMpolInterleave, &mask, kMaxNumaNodes + 1,
+          move ? kMpolMfMove : 0);
+}
+
+// Zero-filled memory, placed according to policy.
+class PlacedMemory {
+public:
+  PlacedMemory(size_t bytes, const AllocPolicy& policy)
+    : m_data(nullptr), m_mapped(0) {
+    if (bytes < kMinPlacedBytes ||
+        (policy.numa == AllocPolicy::Numa::FIRST_TOUCH &&
+         policy.hugePages == AllocPolicy::HugePages::NONE)) {
+      m_data = calloc(bytes, 1);
+      return;
+    }
+    void* p = MAP_FAILED;
+    if (policy.hugePages == AllocPolicy::HugePages::EXPLICIT &&
+        bytes >= kHugePageSize) {
+      m_mapped = (bytes + kHugePageSize - 1) & ~(kHugePageSize - 1);
+      p = mmap(nullptr, m_mapped, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (p == MAP_FAILED) {
+      m_mapped = bytes;
+      p = mmap(nullptr, m_mapped, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      if (policy.hugePages != AllocPolicy::HugePages::NONE) {
+        madvise(p, m_mapped, MADV_HUGEPAGE);
+      }
+    }
+    // Nothing is allocated yet, so there's nothing to move.
+    placeMemory(p, m_mapped, policy, false);
+    m_data = p;
   }
-  ~SensitiveSectionGuard() {
-    m_ss->leave();
+
+  ~PlacedMemory() {
+    if (m_mapped) {
+      munmap(m_data, m_mapped);
+    } else {
+      free(m_data);
+    }
   }
-  SensitiveSectionGuard& operator=(const SensitiveSectionGuard&) = delete;
-  SensitiveSectionGuard(const SensitiveSectionGuard&) = delete;
+
+  PlacedMemory(const PlacedMemory&) = delete;
+  PlacedMemory& operator=(const PlacedMemory&) = delete;
+
+  void* data() const { return m_data; }
+
 private:
-  SensitiveSection* m_ss;
+  void* m_data;
+  size_t m_mapped;  // 0 if calloc()ed
+};
+
+// Per-node read counter, one per cache line
+struct alignas(kCacheLineSize) NodeCounter {
+  std::atomic<uint64_t> count{0};
 };
 
+// saveFramed() block sizes, in entries
+constexpr size_t kSaveMinBlock = 64;
+constexpr size_t kSaveMaxBlock = 4096;
+constexpr size_t kSaveMinRounds = 16;
+
+inline void pwriteChecked(int fd, const void* data, size_t size,
+                          off_t offset) {
+  auto p = static_cast<const uint8_t*>(data);
+  while (size) {
+    auto n = pwrite(fd, p, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      auto msg = folly::format("pwrite failed: {}", strerror(errno));
+      throw std::runtime_error(msg.str());
+    }
+    p += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+// The file framing shared by AtomicVector and AtomicMap:
+//
+//   int magic, size_t n, size_t offsets[n] (absolute), then n entries, each
+//   a size_t length followed by that many bytes, with entry n - 1 last.
+//
+// saveFramed() writes n entries at the current position of file, calling
+// appendEntry(i, buf) to append the length-prefixed entry i to buf, and
+// leaves file positioned after the last entry.
+//
+// Entries are encoded in parallel, in rounds: in each round, every thread
+// encodes a block of consecutive entries into its own buffer; the blocks'
+// file offsets are then assigned in order (a prefix sum of their sizes),
+// and each thread pwrite()s its block. The file layout is exactly the same
+// as if the entries had been written one by one.
+template<typename AppendEntry>
+void saveFramed(FILE* file, int magic, size_t sz, AppendEntry appendEntry) {
+  fflush(file);
+  int fd = fileno(file);
+  size_t start = ftell(file);
+  size_t directoryOff = start + sizeof(magic) + sizeof(sz);
+  size_t dataStart = directoryOff + sz * sizeof(size_t);
+
+  // Next up is a directory of file offsets.
+  std::vector<size_t> offsets(sz);
+  size_t end = dataStart;
+
+  size_t nThreads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  nThreads = std::min(nThreads, (sz + kSaveMinBlock - 1) / kSaveMinBlock);
+  if (nThreads > 0) {
+    auto blockSize = std::max(
+        size_t(kSaveMinBlock),
+        std::min(size_t(kSaveMaxBlock), sz / (nThreads * kSaveMinRounds)));
+    auto roundSize = blockSize * nThreads;
+
+    std::vector<std::vector<uint8_t>> buffers(nThreads);
+    std::vector<size_t> blockOffsets(nThreads);
+    std::vector<std::exception_ptr> errors(nThreads);
+    std::atomic<bool> failed(false);
+    Barrier barrier(nThreads);
+
+    auto work = [&] (size_t tid) {
+      auto& buf = buffers[tid];
+      for (size_t roundStart = 0; roundStart < sz; roundStart += roundSize) {
+        auto first = std::min(sz, roundStart + tid * blockSize);
+        auto last = std::min(sz, first + blockSize);
+
+        // Encode; offsets are relative to the start of the block for now.
+        buf.clear();
+        if (!failed) {
+          try {
+            for (size_t i = first; i < last; i++) {
+              offsets[i] = buf.size();
+              appendEntry(i, buf);
+            }
+          } catch (...) {
+            errors[tid] = std::current_exception();
+            failed = true;
+          }
+        }
+
+        barrier.wait();
+        if (tid == 0) {
+          for (size_t t = 0; t < nThreads; t++) {
+            blockOffsets[t] = end;
+            end += buffers[t].size();
+          }
+        }
+        barrier.wait();
+
+        if (!failed) {
+          try {
+            pwriteChecked(fd, buf.data(), buf.size(), blockOffsets[tid]);
+            for (size_t i = first; i < last; i++) {
+              offsets[i] += blockOffsets[tid];
+            }
+          } catch (...) {
+            errors[tid] = std::current_exception();
+            failed = true;
+          }
+        }
+        // Don't start encoding the next round until everyone has
+        // written this one.
+        barrier.wait();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t tid = 1; tid < nThreads; tid++) {
+      threads.emplace_back(work, tid);
+    }
+    work(0);
+    for (auto& t : threads) t.join();
+
+    for (auto& e : errors) {
+      if (e) std::rethrow_exception(e);
+    }
+  }
+
+  pwriteChecked(fd, &magic, sizeof(magic), start);
+  pwriteChecked(fd, &sz, sizeof(sz), start + sizeof(magic));
+  pwriteChecked(fd, offsets.data(), sz * sizeof(size_t), directoryOff);
+  fseek(file, end, SEEK_SET);
+}
+
+// Read framed entries written by saveFramed() with the given magic value:
+// call prepare(n) once the number of entries is known, then
+// loadEntry(i, bytes) for each entry, from several threads. Leaves file
+// positioned after the last entry; returns n.
+template<typename Prepare, typename LoadEntry>
+size_t loadFramed(FILE* file, int magic, Prepare prepare,
+                  LoadEntry loadEntry) {
+  auto readChecked = [file] (void* data, size_t size) {
+    if (fread(data, size, 1, file) != 1) {
+      throw std::runtime_error("file operation failed");
+    }
+  };
+  int fileMagic;
+  size_t sz;
+  readChecked(&fileMagic, sizeof(fileMagic));
+  if (fileMagic != magic) {
+    throw std::runtime_error("bad magic value loading atomicvec");
+  }
+  readChecked(&sz, sizeof(sz));
+  std::vector<size_t> directory(sz);
+  if (sz) {
+    readChecked(directory.data(), sz * sizeof(size_t));
+  }
+  prepare(sz);
+
+  size_t nThreads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  nThreads = std::max(size_t(1), std::min(nThreads, sz));
+  std::vector<std::thread> deserThreads;
+  std::vector<std::exception_ptr> errors(nThreads);
+  // Get the UNIX fd for pread. We'll seek the FILE* manually later to
+  // fit caller expectations.
+  int fd = fileno(file);
+  fflush(file);
+  size_t finalFilePtr = ftell(file);
+  auto work = [&] (size_t tid) {
+    auto safe_pread = [&](int readFd, void* dest, size_t siz, off_t off) {
+      auto retval = pread(readFd, dest, siz, off);
+      if (retval != ssize_t(siz)) {
+        auto msg = folly::format("pread failed: {}", strerror(errno));
+        throw std::runtime_error(msg.str());
+      }
+    };
+    std::vector<uint8_t> bytes(1 << 20);
+    // Consume the file in a breadth-first fashion; thread 0 is decoding
+    // item 0 while thread 1 is decoding item 1. This way we plow through
+    // the file in roughly sequential order.
+    try {
+      for (size_t i = tid; i < sz; i += nThreads) {
+        size_t entrySz;
+        safe_pread(fd, &entrySz, sizeof(entrySz), directory[i]);
+        if (entrySz > bytes.size()) bytes.resize(entrySz);
+        safe_pread(fd, &bytes[0], entrySz, directory[i] + sizeof(entrySz));
+        if (i == sz - 1) {
+          finalFilePtr = directory[i] + entrySz + sizeof(entrySz);
+        }
+        try {
+          loadEntry(i, folly::ByteRange(&bytes[0], entrySz));
+        } catch(std::runtime_error& e) {
+          fprintf(stderr, "hmm, could not deserialize: %s\n", e.what());
+          fprintf(stderr, "at dir %zd tid %zd entry length %zd offset %zd\n",
+                  i, tid, entrySz, directory[i]);
+          throw;
+        }
+      }
+    } catch (...) {
+      errors[tid] = std::current_exception();
+    }
+  };
+  for (size_t tid = 1; tid < nThreads; tid++) {
+    deserThreads.emplace_back(work, tid);
+  }
+  work(0);
+
+  // Clean up threads and the file pointer.
+  for (auto& t: deserThreads) t.join();
+  for (auto& e : errors) {
+    if (e) std::rethrow_exception(e);
+  }
+  fseek(file, finalFilePtr, SEEK_SET);
+  return sz;
+}
+
 }
 
 // Vector-like container that can only grow, and can be randomly
@@ -132,17 +845,22 @@ class AtomicVector {
   // Buckets are the linear containers hanging off the logical
   // collection's spine in exponentially increasing sizes.
   struct Bucket {
-    explicit Bucket(size_t capac)
+    Bucket(size_t capac, const AllocPolicy& policy)
+      : m_memory(sizeof(std::atomic<T>) * capac, policy)
 #ifndef NDEBUG
-    : m_capac(capac)
+      , m_capac(capac)
 #endif
     {
-      m_items = static_cast<std::atomic<T>*>
-        (calloc(sizeof(std::atomic<T>), capac));
+      m_items = static_cast<std::atomic<T>*>(m_memory.data());
+      m_dirty = static_cast<std::atomic<uint64_t>*>
+        (calloc(sizeof(std::atomic<uint64_t>), (capac + 63) / 64));
+      m_erased = static_cast<std::atomic<uint64_t>*>
+        (calloc(sizeof(std::atomic<uint64_t>), (capac + 63) / 64));
     }
 
     ~Bucket() {
-      free(m_items);
+      free(m_dirty);
+      free(m_erased);
     }
 
     Bucket& operator=(const Bucket&) = delete;
@@ -163,7 +881,35 @@ class AtomicVector {
       return m_items[slot];
     }
 
+    void markDirty(size_t slot) {
+      assert(slot < m_capac);
+      m_dirty[slot / 64].fetch_or(uint64_t(1) << (slot % 64),
+                                  std::memory_order_acq_rel);
+    }
+
+    // Returns false if the slot was already erased.
+    bool markErased(size_t slot) {
+      assert(slot < m_capac);
+      auto bit = uint64_t(1) << (slot % 64);
+      return !(m_erased[slot / 64].fetch_or(bit) & bit);
+    }
+
+    void clearErased(size_t slot) {
+      assert(slot < m_capac);
+      m_erased[slot / 64].fetch_and(~(uint64_t(1) << (slot % 64)));
+    }
+
+    bool isErased(size_t slot) const {
+      assert(slot < m_capac);
+      return m_erased[slot / 64].load() & (uint64_t(1) << (slot % 64));
+    }
+
+    detail::PlacedMemory m_memory;
     std::atomic<T>* m_items;
+    // One bit per slot, set when the slot is modified
+    std::atomic<uint64_t>* m_dirty;
+    // One bit per slot, set while the slot is erased
+    std::atomic<uint64_t>* m_erased;
 #ifndef NDEBUG
     size_t m_capac;
 #endif
@@ -171,8 +917,11 @@ class AtomicVector {
 
  public:
   AtomicVector()
-  : m_size(0)
-  , m_sensitiveSection(128)
+  : m_size(0),
+    m_freeSlots(nullptr),
+    m_numErased(0),
+    m_compacted(false),
+    m_stopPrefetch(false)
   {
     for (BucketIndex i = 0; i < kMaxBuckets; i++) {
       m_buckets[i].store(nullptr);
@@ -182,89 +931,136 @@ class AtomicVector {
   ~AtomicVector() {
     // Decref everything in the table. Presumably, if we're destroying
     // the table, the caller knows that it is no longer reachable, so
-    // don't bother with the sensitive section.
-    assert(m_sensitiveSection.appearsFree());
+    // don't bother with the epoch guard.
+    stopPrefetch();
+    assert(m_epochs.appearsQuiescent());
+    m_epochs.drain();
+    clearFreeSlots();
     Refcount<T> rc;
     for (BucketIndex i = 0; i < m_size; i++) {
-      // Could be a bit more efficient. Is destroying AtomicVector's a
-      // common operation?
-      auto val = read(i);
-      rc.dec(val); // Once for the read
-      rc.dec(val); // Once because the table's gone
+      // Slots of lazily loaded vectors may never have been materialized,
+      // and erased slots are empty.
+      auto val = rawSlot(i);
+      if (val) {
+        rc.dec(val);
+      }
     }
     for (int i = 0; i < kMaxBuckets; i++) {
       delete m_buckets[i].load();
     }
   }
 
-  // append: returns with the value appended to the end of the
-  // vector. Since our vector can only grow, the semantic here is
-  // reasonably well-posed. Returns position of the value in the
-  // vector.
+  // append: returns with the value stored in an erased slot, if there
+  // is one (see erase()), or appended to the end of the vector. Returns
+  // position of the value in the vector.
   size_t append(T val) {
-  restart:
-    auto insertionPoint = m_size.load();
-    auto& bucket = indexToBucket(insertionPoint);
-    auto buck = bucket.load();
-    if (!buck) {
-      // Bucket allocation. Some set of inserters might be racing
-      // through the following code; tread with caution.
-      auto sz = 1 << (&bucket - &m_buckets[0]);
-      auto old = buck;
-      buck = new Bucket(sz);
-      if (!bucket.compare_exchange_weak(old, buck)) {
-        delete buck;
-        goto restart;
+    BucketIndex slot;
+    if (popFreeSlot(&slot)) {
+      Refcount<T>().inc(val);
+      auto& bucketP = indexToBucket(slot);
+      auto buck = bucketP.load();
+      auto bidx = indexToIntraBucketIndex(slot, &bucketP - &m_buckets[0]);
+      // Store before clearing the erased bit, so that the slot never looks
+      // unmaterialized (see loadSlot()). The slot should be empty, unless a
+      // racing writer or lazy reader left a value in it after the erase.
+      auto old = buck->getAtomic(bidx).exchange(val);
+      buck->clearErased(bidx);
+      buck->markDirty(bidx);
+      m_numErased.fetch_sub(1);
+      if (old) {
+        retire(old);
       }
+      return slot;
     }
-    // We can't get here if this bucket is null.
-    assert(buck);
-    // The bucket can't move.
-    assert(buck == bucket.load());
+    return appendAtEnd(val);
+  }
 
-    // OK! We know where we'd like to put this item, *and* memory that
-    // won't be going anywhere backs it. Entities we might race with
-    // include:
-    //   0. Callers to write(). We won't do a random-access-style write
-    //      to this slot yet, because m_size doesn't yet recognize the
-    //      presence of this slot. See the code in write() that reroutes
-    //      writes to the m_size slot through append.
-    //
-    //   1. Other callers to append. It's possible several writers are
-    //      attempting to append into the same slot. Here we rely on calloc
-    //      producing a unique nullptr-like representation that can never
-    //      be inserted again (since we take a reference here, and
-    //      references are never to null). If we fail the race to write
-    //      this slot, we restart.
-    auto indexInBucket = indexToIntraBucketIndex(insertionPoint,
-                                                 &bucket - &m_buckets[0]);
-    if (!buck->cmpxchg(indexInBucket, 0, val)) {
-      goto restart;
+  // Erase the value at slot: it's decref'ed (lazily, as with write()), and
+  // the slot reads as erased (read() and borrow() throw) until append()
+  // reuses it. size() doesn't change. Returns false if the slot was already
+  // erased.
+  bool erase(BucketIndex slot) {
+    if (slot >= m_size) {
+      throw std::runtime_error("erase past end of vector");
     }
+    auto& bucketP = indexToBucket(slot);
+    auto buck = bucketP.load();
+    auto bidx = indexToIntraBucketIndex(slot, &bucketP - &m_buckets[0]);
+    if (!buck->markErased(bidx)) {
+      return false;
+    }
+    auto old = buck->getAtomic(bidx).exchange(0);
+    buck->markDirty(bidx);
+    if (old) {
+      retire(old);
+    }
+    m_numErased.fetch_add(1);
+    pushFreeSlot(slot);
+    return true;
+  }
 
-    // We've written the slot. No other callers to append will do so,
-    // because it's not null so the compare_exchange_weak will fail.
-    Refcount<T> rc;
-    rc.inc(val);
-
-    // Bump m_size, making this slot visible and completing the append
-    // operation.
-    //
-    // Subtlety: do we really know m_size == insertionPoint? The algorithm
-    // is *really* broken otherwise; readers could see val before we incref
-    // it.
+  bool isErased(BucketIndex slot) const {
+    if (slot >= m_size) {
+      throw std::runtime_error("read past end of vector");
+    }
+    auto& bucket = indexToBucket(slot);
+    return bucket.load()->isErased(
+      indexToIntraBucketIndex(slot, &bucket - &m_buckets[0]));
+  }
 
-    assert(m_size.load() == insertionPoint);
+  // Number of erased slots, not yet reused
+  size_t numErased() const {
+    return m_numErased.load();
+  }
 
-    // Yes, m_size == insertionPoint. Racers through this code are
-    // invariably trying to CAS the slot at m_size from nullptr to
-    // something else, and only one can win that race. If multiple
-    // inserters race, the cas from nullptr will keep failing until the
-    // winner of that race bumps m_size here.  Upshot: this algorithm isn't
-    // quite (lock,wait,obstruction)-free; inserters essentially "lock" the
-    // right to insert by cas'ing that slot.
-    m_size.fetch_add(1);
-    return insertionPoint;
+  // Renumber the slots that aren't erased 0, 1, ..., keeping their order,
+  // and shrink the vector to fit them. Returns the mapping from old to new
+  // slots (-1 for erased slots). Offline: no other thread may be using the
+  // vector, and there must be no snapshots. Lazily loaded vectors are
+  // decoded in full. All slots become dirty, but as deltas can't express
+  // renumbering, the next checkpoint must be a full save().
+  std::vector<int64_t> compact() {
+    stopPrefetch();
+    assert(m_epochs.appearsQuiescent());
+    size_t sz = m_size.load();
+    std::vector<int64_t> mapping(sz, -1);
+    Refcount<T> rc;
+    size_t next = 0;
+    for (size_t i = 0; i < sz; i++) {
+      auto& bucketP = indexToBucket(i);
+      auto buck = bucketP.load();
+      auto bidx = indexToIntraBucketIndex(i, &bucketP - &m_buckets[0]);
+      auto& home = buck->getAtomic(bidx);
+      if (buck->isErased(bidx)) {
+        auto stray = home.exchange(0);
+        if (stray) {
+          rc.dec(stray);
+        }
+        buck->clearErased(bidx);
+        continue;
+      }
+      auto val = loadSlot(i);
+      if (next != i) {
+        // Slot next was moved out of, or erased, earlier: it's empty.
+        auto& dst = indexToBucket(next);
+        dst.load()->getAtomic(
+          indexToIntraBucketIndex(next, &dst - &m_buckets[0])).store(val);
+        home.store(0);
+      }
+      mapping[i] = next++;
+    }
+
+    m_epochs.drain();
+    clearFreeSlots();
+    m_numErased.store(0);
+    m_lazy.reset();
+    m_size.store(next);
+    takeDirty(next, sz);
+    for (size_t i = 0; i < next; i++) {
+      markDirty(i);
+    }
+    m_compacted = true;
+    return mapping;
   }
 
   T read(BucketIndex slot) const {
@@ -272,36 +1068,83 @@ class AtomicVector {
       throw std::runtime_error("read past end of vector");
     }
 
-    auto& bucket = indexToBucket(slot);
-    auto bidx = indexToIntraBucketIndex(slot, &bucket - &m_buckets[0]);
-
     Refcount<T> rc;
-    detail::SensitiveSectionGuard ssg(&m_sensitiveSection);
-    auto val = (*bucket.load())[bidx];
+    countReads(1);
+    detail::EpochGuard guard(&m_epochs);
+    auto val = loadLive(slot);
     rc.inc(val);
     return val;
   }
 
+  // Call fn(val) with the value at slot, without touching its refcount.
+  // val is guaranteed to stay alive until fn returns; retain it explicitly
+  // if you need it for longer.
+  template<typename Fn>
+  void borrow(BucketIndex slot, Fn&& fn) const {
+    if (slot >= m_size) {
+      throw std::runtime_error("read past end of vector");
+    }
+
+    countReads(1);
+    detail::EpochGuard guard(&m_epochs);
+    fn(loadLive(slot));
+  }
+
+  // Call fn(i, val) for each i in [0, n), with val the value at slots[i],
+  // without touching refcounts, under a single read guard. All slots are
+  // checked against size() before fn is called; erased slots throw when
+  // reached.
+  template<typename Fn>
+  void borrowBatch(const BucketIndex* slots, size_t n, Fn&& fn) const {
+    auto sz = m_size.load();
+    for (size_t i = 0; i < n; i++) {
+      if (slots[i] >= sz) {
+        throw std::runtime_error("read past end of vector");
+      }
+    }
+
+    countReads(n);
+    detail::EpochGuard guard(&m_epochs);
+    for (size_t i = 0; i < n; i++) {
+      fn(i, loadLive(slots[i]));
+    }
+  }
+
+  // Read n values at once; out[i] = read(slots[i]). Each value is
+  // incref'ed, as with read().
+  void readBatch(const BucketIndex* slots, size_t n, T* out) const {
+    Refcount<T> rc;
+    borrowBatch(slots, n, [&] (size_t i, T val) {
+      rc.inc(val);
+      out[i] = val;
+    });
+  }
+
   void write(BucketIndex slot, T val) {
     assert(val);
     if (slot >= m_size) {
       throw std::runtime_error("write past end of vector; use vec:append()?");
     }
 
-    Refcount<T> rc;
-    rc.inc(val);
     auto& bucketP = indexToBucket(slot);
     auto bidx = indexToIntraBucketIndex(slot, &bucketP - &m_buckets[0]);
+    // Erased slots belong to append(). (If the slot is erased concurrently,
+    // whichever value ends up in it is dropped when it's reused.)
+    if (bucketP.load()->isErased(bidx)) {
+      throw std::runtime_error("write to erased slot; use vec:append()");
+    }
+
+    Refcount<T> rc;
+    rc.inc(val);
   restart:
     auto& home = (bucketP.load())->getAtomic(bidx);
     auto old = home.load();
     if (!home.compare_exchange_weak(old, val)) goto restart;
+    bucketP.load()->markDirty(bidx);
     // We've succeeded. If we just swapped out an old value, don't decref
-    // it yet; wait to make sure nobody is in the process of
-    // reading-and-increffing it.
+    // it yet; someone may be in the process of reading-and-increffing it.
     if (old) {
-      m_sensitiveSection.wait();
-      rc.dec(old);
+      retire(old);
     }
   }
 
@@ -309,6 +1152,181 @@ class AtomicVector {
     return m_size.load();
   }
 
+  // Record that the value at slot was modified in place, so that the next
+  // saveIncremental() includes it. write() and append() do this
+  // automatically.
+  void markDirty(BucketIndex slot) {
+    if (slot >= m_size) {
+      throw std::runtime_error("markDirty past end of vector");
+    }
+    auto& bucket = indexToBucket(slot);
+    bucket.load()->markDirty(
+      indexToIntraBucketIndex(slot, &bucket - &m_buckets[0]));
+  }
+
+  // Values replaced by write() (or erased) are decref'ed once no reader
+  // can still be using them: right away if no read is in progress, or
+  // else when the last reader that may have seen them leaves (or the last
+  // snapshot that may hold them is released). Decref all such values now
+  // (except those that are still in use); normally not needed.
+  void flushRetired() {
+    m_epochs.reclaimAll();
+  }
+
+  // An immutable view of the vector as of when it was taken: taking it
+  // records the value of every slot (one pointer per slot; lazily loaded
+  // values are loaded), and later writes, erases and appends aren't part of
+  // it. Writes racing with taking the snapshot may or may not be. Reads
+  // don't touch refcounts, and may happen from any thread: the recorded
+  // values stay alive until the snapshot is destroyed, as values replaced
+  // in the meantime aren't reclaimed until then, so don't keep snapshots
+  // around longer than needed. The vector must outlive its snapshots.
+  class Snapshot {
+  public:
+    ~Snapshot() {
+      m_vec->m_epochs.unpin(m_pin);
+    }
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    size_t size() const {
+      return m_values.size();
+    }
+
+    // The value at slot, borrowed from the snapshot
+    T get(BucketIndex slot) const {
+      if (slot >= m_values.size()) {
+        throw std::runtime_error("read past end of snapshot");
+      }
+      auto val = m_values[slot];
+      if (!val) {
+        throw std::runtime_error("read of erased slot");
+      }
+      return val;
+    }
+
+    // Call fn(thread, slot, val) for every slot that isn't erased, with
+    // borrowed values, on
+    // nThreads threads (the calling thread being thread 0); thread is in
+    // [0, nThreads), for per-thread accumulators. Threads grab blocks of
+    // consecutive slots as they go. If any call throws, the remaining
+    // blocks are skipped, and the first exception is rethrown.
+    template<typename Fn>
+    void parallelForEach(size_t nThreads, Fn fn) const {
+      static constexpr size_t kBlockSize = 1024;
+      auto size = m_values.size();
+      nThreads = std::max(size_t(1), std::min(
+        nThreads, (size + kBlockSize - 1) / kBlockSize));
+      std::atomic<size_t> next(0);
+      std::atomic<bool> failed(false);
+      std::vector<std::exception_ptr> errors(nThreads);
+      auto work = [&] (size_t tid) {
+        try {
+          size_t start;
+          while (!failed.load(std::memory_order_relaxed) &&
+                 (start = next.fetch_add(kBlockSize)) < size) {
+            auto end = std::min(size, start + kBlockSize);
+            for (size_t i = start; i < end; i++) {
+              auto val = m_values[i];
+              if (val) {
+                fn(tid, BucketIndex(i), val);
+              }
+            }
+          }
+        } catch (...) {
+          errors[tid] = std::current_exception();
+          failed = true;
+        }
+      };
+      std::vector<std::thread> threads;
+      for (size_t tid = 1; tid < nThreads; tid++) {
+        threads.emplace_back(work, tid);
+      }
+      work(0);
+      for (auto& t : threads) {
+        t.join();
+      }
+      for (auto& e : errors) {
+        if (e) std::rethrow_exception(e);
+      }
+    }
+
+  private:
+    friend class AtomicVector;
+
+    // Values read after pinning stay alive until we unpin, even if they're
+    // replaced meanwhile.
+    explicit Snapshot(const AtomicVector* vec)
+      : m_vec(vec),
+        m_pin(vec->m_epochs.pin()) {
+      SCOPE_FAIL {
+        m_vec->m_epochs.unpin(m_pin);
+      };
+      m_values.resize(vec->size());
+      for (size_t i = 0; i < m_values.size(); i++) {
+        m_values[i] = vec->isErased(i) ? T(0) : vec->loadSlot(i);
+      }
+    }
+
+    const AtomicVector* m_vec;
+    uint64_t m_pin;
+    std::vector<T> m_values;  // 0 for erased slots
+  };
+
+  std::unique_ptr<Snapshot> snapshot() const {
+    return std::unique_ptr<Snapshot>(new Snapshot(this));
+  }
+
+  // Choose where new buckets are allocated (see AllocPolicy). Must be
+  // called while the vector is empty, and before it's shared with other
+  // threads. Small buckets are always allocated with calloc(), and huge
+  // pages are only used for buckets of at least one huge page.
+  void setAllocPolicy(const AllocPolicy& policy) {
+    if (m_size != 0 || m_lazy) {
+      throw std::runtime_error(
+        "allocation policy must be set on an empty vector");
+    }
+    if (policy.numa == AllocPolicy::Numa::BIND &&
+        (policy.node < 0 || policy.node >= detail::kMaxNumaNodes ||
+         !(detail::onlineNumaNodes() & (uint64_t(1) << policy.node)))) {
+      throw std::runtime_error("no such NUMA node");
+    }
+    m_policy = policy;
+    m_nodeReads.reset(
+      policy.countReads ? new detail::NodeCounter[detail::kMaxNumaNodes]
+                        : nullptr);
+  }
+
+  const AllocPolicy& allocPolicy() const {
+    return m_policy;
+  }
+
+  // Move [p, p + bytes), memory owned by a value, according to the NUMA
+  // policy, if the policy asks for values to be placed. Whole pages only;
+  // values should own their pages for this to be useful.
+  void placeValue(void* p, size_t bytes) const {
+    if (m_policy.placeValues) {
+      detail::placeMemory(p, bytes, m_policy, true);
+    }
+  }
+
+  // Number of reads (read(), borrow(), one per slot for batches) by threads
+  // running on each NUMA node, indexed by node; empty unless the policy
+  // counts reads. Counts are approximate, as threads may migrate.
+  std::vector<uint64_t> readCounts() const {
+    std::vector<uint64_t> counts;
+    if (m_nodeReads) {
+      for (int i = 0; i < detail::kMaxNumaNodes; i++) {
+        if (detail::onlineNumaNodes() & (uint64_t(1) << i)) {
+          counts.resize(i + 1);
+          counts[i] = m_nodeReads[i].count.load(std::memory_order_relaxed);
+        }
+      }
+    }
+    return counts;
+  }
+
   template<typename Lambda, typename Datum>
   static void fileOp(Lambda l, Datum* data, size_t nData, FILE* file) {
     size_t nFrobbed = l(data, sizeof(Datum), nData, file);
@@ -323,6 +1341,35 @@ class AtomicVector {
   }
 
   void load(FILE* file) {
+    auto sz = detail::loadFramed(
+      file, 0x04081977,
+      [this] (size_t n) {
+        growUnsafe(n);
+      },
+      [this] (size_t i, folly::ByteRange range) {
+        if (range.empty()) {
+          erase(i);
+          return;
+        }
+        auto data = Serde<T>::load(&range);
+        write(i, data);
+        Refcount<T>().dec(data);
+      });
+    rebuildFreeSlotsUnsafe();
+    // We're now identical to the file.
+    takeDirty(0, sz);
+    m_compacted = false;
+  }
+
+  // Like load(), but don't decode any entries yet: mmap the file, and
+  // decode each entry when it is first accessed. The file must not be
+  // modified (or truncated) for the lifetime of the vector, but it may be
+  // closed. If prefetch is true, a background thread decodes all entries,
+  // in file order.
+  void loadLazy(FILE* file, bool prefetch = false) {
+    if (m_size != 0 || m_lazy) {
+      throw std::runtime_error("can only lazily load into an empty atomicvec");
+    }
     int magic;
     size_t sz;
     fileOp(fread, &magic, file);
@@ -331,100 +1378,505 @@ class AtomicVector {
     }
     fileOp(fread, &sz, file);
     std::vector<size_t> directory(sz);
-    fileOp(fread, &directory[0], sz, file);
+    fileOp(fread, directory.data(), sz, file);
 
+    std::unique_ptr<LazySource> source(
+        new LazySource(fileno(file), std::move(directory)));
+    size_t end = ftell(file);
+    if (sz) {
+      auto last = source->entry(sz - 1);
+      end = last.data() + last.size() - source->data();
+    }
+
+    // Must be set before the slots become visible
+    m_lazy = std::move(source);
     growUnsafe(sz);
-    auto nThreads = sysconf(_SC_NPROCESSORS_ONLN);
-    std::vector<std::thread> deserThreads;
-    // Get the UNIX fd for pread. We'll seek the FILE* manually later to
-    // fit caller expectations.
-    int fd = fileno(file);
-    fflush(file);
-    size_t finalFilePtr;
-    for (int tid = 0; tid < nThreads; tid++) {
-      deserThreads.emplace_back([tid, sz, fd, nThreads, this,
-                                &directory, &finalFilePtr] {
-        auto safe_pread = [&](int readFd, void* dest, size_t siz, off_t off) {
-          auto retval = pread(readFd, dest, siz, off);
-          if (retval != siz) {
-            auto msg = folly::format("pread failed: {}", strerror(errno));
-            throw std::runtime_error(msg.str());
-          }
-        };
-        std::vector<uint8_t> bytes(1 << 20);
-        // Consume the file in a breadth-first fashion; thread 0 is decoding
-        // item 0 while thread 1 is decoding item 1. This way we plow through
-        // the file in roughly sequential order.
-        Refcount<T> rc;
-        for (size_t i = tid; i < sz; i += nThreads) {
-          size_t entrySz;
-          safe_pread(fd, &entrySz, sizeof(entrySz), directory[i]);
-          if (entrySz > bytes.size()) bytes.resize(entrySz);
-          safe_pread(fd, &bytes[0], entrySz, directory[i] + sizeof(entrySz));
-          if (i == sz - 1) {
-            finalFilePtr = directory[i] + entrySz + sizeof(entrySz);
-          }
-          folly::ByteRange range(&bytes[0], entrySz);
+    // Entries are laid out in order, so erased slots (empty entries) can
+    // be found without touching the file.
+    const auto& dir = m_lazy->directory();
+    for (size_t i = 0; i < sz; i++) {
+      auto next = i + 1 < sz ? dir[i + 1] : end;
+      if (next - dir[i] == sizeof(size_t)) {
+        erase(i);
+      }
+    }
+    rebuildFreeSlotsUnsafe();
+    takeDirty(0, sz);
+    fseek(file, end, SEEK_SET);
+
+    if (prefetch) {
+      m_prefetcher = std::thread([this, sz] {
+        for (size_t i = 0; i < sz && !m_stopPrefetch; i++) {
           try {
-            auto data = Serde<T>::load(&range);
-            write(i, data);
-            rc.dec(data);
-          } catch(std::runtime_error& e) {
-            fprintf(stderr, "hmm, could not deserialize: %s\n", e.what());
-            fprintf(stderr, "at dir %zd tid %d entry length %zd offset %zd\n",
-                   i, tid, entrySz, directory[i]);
-            throw;
+            detail::EpochGuard guard(&m_epochs);
+            loadSlot(i);
+          } catch (std::runtime_error& e) {
+            fprintf(stderr, "atomicvec prefetch failed at %zd: %s\n",
+                    i, e.what());
+            return;
           }
         }
       });
     }
-
-    // Clean up threads and the file pointer.
-    for (auto& t: deserThreads) t.join();
-    fseek(file, finalFilePtr, SEEK_SET);
   }
 
   // save() is inherently racy; if other threads are still appending we may miss
   // new entries, but all vectors visible from the calling thread's timeline
-  // will be serialized.
+  // will be serialized. Entries are encoded and written in parallel; see
+  // detail::saveFramed().
+  //
+  // Saving resets the set of dirty slots (see saveIncremental()); values
+  // modified while the save is in progress remain dirty.
   void save(FILE* file) const {
-    const int kMagic = 0x04081977;
-    fileOp(fwrite, &kMagic, file);
+    size_t sz = size();
+    auto dirty = takeDirty(0, sz);
+    SCOPE_FAIL {
+      restoreDirty(dirty);
+    };
 
+    detail::saveFramed(file, 0x04081977, sz,
+                       [this] (size_t i, std::vector<uint8_t>& buf) {
+      appendEntry(i, buf);
+    });
+    m_compacted = false;
+  }
+
+  // Incremental checkpoints. saveIncremental() writes only the slots that
+  // were modified (by write(), append(), erase() or markDirty()) since the
+  // vector was last saved (by save() or saveIncremental()) or loaded; base
+  // is the previous checkpoint (a save() or saveIncremental() file,
+  // positioned at its start), whose header and directory are read to chain
+  // the deltas together, so that loadIncremental() can check they're
+  // applied in order. Delta format:
+  //
+  //   int magic, size_t size, size_t baseSize, uint64_t baseId, size_t n,
+  //   size_t slots[n], size_t offsets[n], then n entries (length, bytes).
+  //
+  // where baseId is checkpointId() of the base. As in full checkpoints,
+  // erased slots are saved as empty entries.
+  void saveIncremental(FILE* file, FILE* base) const {
+    if (m_compacted) {
+      throw std::runtime_error(
+        "atomicvec was compacted since it was last saved; save() it in full");
+    }
+    const int kMagic = kDeltaMagic;
+    size_t baseSz;
+    uint64_t baseId = checkpointId(base, &baseSz);
     size_t sz = size();
+    auto dirty = takeDirty(0, sz);
+    SCOPE_FAIL {
+      restoreDirty(dirty);
+    };
+
+    size_t n = dirty.size();
+    size_t dataStart = sizeof(kMagic) + 3 * sizeof(size_t) +
+      sizeof(baseId) + 2 * n * sizeof(size_t);
+    std::vector<size_t> offsets(n);
+    std::vector<uint8_t> buf;
+    for (size_t i = 0; i < n; i++) {
+      offsets[i] = dataStart + buf.size();
+      appendEntry(dirty[i], buf);
+    }
+
+    size_t start = ftell(file);
+    for (auto& off : offsets) {
+      off += start;
+    }
+    fileOp(fwrite, &kMagic, file);
     fileOp(fwrite, &sz, file);
+    fileOp(fwrite, &baseSz, file);
+    fileOp(fwrite, &baseId, file);
+    fileOp(fwrite, &n, file);
+    fileOp(fwrite, dirty.data(), n, file);
+    fileOp(fwrite, offsets.data(), n, file);
+    fileOp(fwrite, buf.data(), buf.size(), file);
+  }
 
-    // Next up is a directory of file offsets.
-    std::vector<size_t> offsets(sz);
-    size_t directoryOff = ftell(file);
-    fseek(file, sz * sizeof(size_t), SEEK_CUR);
-    size_t dataStart = ftell(file);
-    size_t i;
-    for (i = 0; i < sz; i++) {
-      auto val = read(i);
-      SCOPE_EXIT {
-        Refcount<T>().dec(val);
-      };
-      offsets[i] = ftell(file);
-      fblualib::thrift::StringWriter sw;
-      auto str = Serde<T>::save(val, sw);
-      auto strsz = str.size();
-      fileOp(fwrite, &strsz, file);
-      fileOp(fwrite, str.data(), strsz, file);
-    }
-    CHECK(i == sz);
-    size_t end = ftell(file);
-    fseek(file, directoryOff, SEEK_SET);
-    fileOp(fwrite, &offsets[0], offsets.size(), file);
-    assert(ftell(file) == dataStart);
-    fseek(file, end, SEEK_SET);
+  // Load a full checkpoint (written by save()), then apply deltas (written
+  // by saveIncremental()) in order. Each file is consumed from its current
+  // position.
+  void loadIncremental(FILE* base, const std::vector<FILE*>& deltas) {
+    auto id = checkpointId(base);
+    load(base);
+    for (auto delta : deltas) {
+      auto deltaId = checkpointId(delta);
+      applyDelta(delta, id);
+      id = deltaId;
+    }
+    rebuildFreeSlotsUnsafe();
+    takeDirty(0, size());
   }
 
  protected:
   static const BucketIndex kMaxBuckets = 32;
   std::atomic<Bucket*> m_buckets[kMaxBuckets];
   std::atomic<BucketIndex> m_size;
-  mutable detail::SensitiveSection m_sensitiveSection;
+  mutable detail::EpochManager m_epochs;
+  AllocPolicy m_policy;
+  std::unique_ptr<detail::NodeCounter[]> m_nodeReads;
+
+  // Erased slots awaiting reuse by append(), as a Treiber stack. Popped
+  // nodes are freed through m_epochs, and poppers hold a read guard, so a
+  // node can't be freed and reallocated under a popper (no ABA).
+  struct FreeSlot {
+    BucketIndex slot;
+    FreeSlot* next;
+  };
+  std::atomic<FreeSlot*> m_freeSlots;
+  std::atomic<size_t> m_numErased;
+  // Set by compact(), cleared by full saves and loads
+  mutable std::atomic<bool> m_compacted;
+
+  static void deleteFreeSlot(uintptr_t node) {
+    delete reinterpret_cast<FreeSlot*>(node);
+  }
+
+  void pushFreeSlot(BucketIndex slot) {
+    auto node = new FreeSlot{slot, m_freeSlots.load()};
+    while (!m_freeSlots.compare_exchange_weak(node->next, node)) { }
+  }
+
+  bool popFreeSlot(BucketIndex* slot) {
+    if (!m_freeSlots.load()) {
+      return false;
+    }
+    detail::EpochGuard guard(&m_epochs);
+    auto head = m_freeSlots.load();
+    while (head && !m_freeSlots.compare_exchange_weak(head, head->next)) { }
+    if (!head) {
+      return false;
+    }
+    *slot = head->slot;
+    m_epochs.retire(reinterpret_cast<uintptr_t>(head), &deleteFreeSlot);
+    return true;
+  }
+
+  // Only when no other thread is using the vector
+  void clearFreeSlots() {
+    auto node = m_freeSlots.exchange(nullptr);
+    while (node) {
+      auto next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+
+  void countReads(size_t n) const {
+    if (m_nodeReads) {
+      m_nodeReads[detail::currentNumaNode()].count.fetch_add(
+        n, std::memory_order_relaxed);
+    }
+  }
+
+  static_assert(sizeof(T) <= sizeof(uintptr_t),
+                "AtomicVector values must fit in a uintptr_t");
+
+  static void decrefRetired(uintptr_t val) {
+    Refcount<T>().dec((T)val);
+  }
+
+  // Decref val once no reader may still be increffing it.
+  void retire(T val) {
+    m_epochs.retire((uintptr_t)val, &AtomicVector::decrefRetired);
+  }
+
+  // mmap()ed file backing a lazily loaded vector
+  class LazySource {
+   public:
+    LazySource(int fd, std::vector<size_t> directory)
+      : m_data(nullptr), m_length(0), m_directory(std::move(directory)) {
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        auto msg = folly::format("fstat failed: {}", strerror(errno));
+        throw std::runtime_error(msg.str());
+      }
+      m_length = st.st_size;
+      if (m_length) {
+        void* p = mmap(nullptr, m_length, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+          auto msg = folly::format("mmap failed: {}", strerror(errno));
+          throw std::runtime_error(msg.str());
+        }
+        // Accesses are expected to be sparse and skewed
+        madvise(p, m_length, MADV_RANDOM);
+        m_data = static_cast<const uint8_t*>(p);
+      }
+    }
+
+    ~LazySource() {
+      if (m_data) {
+        munmap(const_cast<uint8_t*>(m_data), m_length);
+      }
+    }
+
+    LazySource(const LazySource&) = delete;
+    LazySource& operator=(const LazySource&) = delete;
+
+    const uint8_t* data() const { return m_data; }
+    const std::vector<size_t>& directory() const { return m_directory; }
+
+    // Encoded entry i
+    folly::ByteRange entry(size_t i) const {
+      auto off = m_directory[i];
+      size_t entrySz;
+      if (off > m_length || m_length - off < sizeof(entrySz)) {
+        throw std::runtime_error("atomicvec entry out of bounds");
+      }
+      memcpy(&entrySz, m_data + off, sizeof(entrySz));
+      off += sizeof(entrySz);
+      if (m_length - off < entrySz) {
+        throw std::runtime_error("atomicvec entry out of bounds");
+      }
+      return folly::ByteRange(m_data + off, entrySz);
+    }
+
+   private:
+    const uint8_t* m_data;
+    size_t m_length;
+    std::vector<size_t> m_directory;
+  };
+
+  std::unique_ptr<LazySource> m_lazy;
+  std::thread m_prefetcher;
+  std::atomic<bool> m_stopPrefetch;
+
+  void stopPrefetch() {
+    if (m_prefetcher.joinable()) {
+      m_stopPrefetch = true;
+      m_prefetcher.join();
+      m_stopPrefetch = false;
+    }
+  }
+
+  T rawSlot(BucketIndex slot) const {
+    auto& bucket = indexToBucket(slot);
+    return (*bucket.load())[
+      indexToIntraBucketIndex(slot, &bucket - &m_buckets[0])];
+  }
+
+  // Return the value at slot, decoding it first if the vector was loaded
+  // lazily and the slot hasn't been materialized yet. Must be called under
+  // m_epochs guard (or with m_epochs pinned). Erased slots are empty (0);
+  // a lazy reader racing with erase() may still materialize one, but
+  // nobody sees the value behind the erased bit, and append() drops it.
+  T loadSlot(BucketIndex slot) const {
+    auto& bucket = indexToBucket(slot);
+    auto bidx = indexToIntraBucketIndex(slot, &bucket - &m_buckets[0]);
+    auto& home = bucket.load()->getAtomic(bidx);
+    auto val = home.load();
+    if (!val && m_lazy && !bucket.load()->isErased(bidx)) {
+      auto range = m_lazy->entry(slot);
+      val = Serde<T>::load(&range);
+      // The table takes over our reference, unless someone (a racing
+      // reader, or a writer) beat us to it.
+      T expected = 0;
+      if (!home.compare_exchange_strong(expected, val)) {
+        Refcount<T>().dec(val);
+        val = expected;
+      }
+    }
+    return val;
+  }
+
+  // loadSlot(), for slots that must not be erased
+  T loadLive(BucketIndex slot) const {
+    auto& bucket = indexToBucket(slot);
+    auto bidx = indexToIntraBucketIndex(slot, &bucket - &m_buckets[0]);
+    T val = 0;
+    if (!bucket.load()->isErased(bidx)) {
+      val = loadSlot(slot);
+    }
+    if (!val) {
+      throw std::runtime_error("read of erased slot");
+    }
+    return val;
+  }
+
+  static const int kDeltaMagic = 0x04081978;
+
+  // Atomically clear the dirty bits of slots [first, last), returning the
+  // slots that were dirty, in order.
+  std::vector<size_t> takeDirty(size_t first, size_t last) const {
+    std::vector<size_t> dirty;
+    size_t i = first;
+    while (i < last) {
+      auto& bucket = indexToBucket(i);
+      auto b = &bucket - &m_buckets[0];
+      auto bucketStart = (size_t(1) << b) - 1;
+      auto bucketEnd = std::min(last, (size_t(1) << (b + 1)) - 1);
+      auto words = bucket.load()->m_dirty;
+      for (auto word = (i - bucketStart) / 64;
+           bucketStart + word * 64 < bucketEnd; word++) {
+        auto lo = bucketStart + word * 64;
+        auto mask = ~uint64_t(0);
+        if (i > lo) {
+          mask &= ~uint64_t(0) << (i - lo);
+        }
+        if (bucketEnd - lo < 64) {
+          mask &= (uint64_t(1) << (bucketEnd - lo)) - 1;
+        }
+        auto bits = words[word].fetch_and(~mask, std::memory_order_acq_rel) &
+          mask;
+        while (bits) {
+          auto bit = folly::findFirstSet(bits) - 1;
+          dirty.push_back(lo + bit);
+          bits &= bits - 1;
+        }
+      }
+      i = bucketEnd;
+    }
+    return dirty;
+  }
+
+  // Undo takeDirty() after a failed save
+  void restoreDirty(const std::vector<size_t>& slots) const {
+    for (auto slot : slots) {
+      auto& bucket = indexToBucket(slot);
+      bucket.load()->markDirty(
+        indexToIntraBucketIndex(slot, &bucket - &m_buckets[0]));
+    }
+  }
+
+  // Identify the checkpoint (full or delta) at file's current position by
+  // hashing its header and directory; optionally return its number of
+  // entries. Doesn't move the file position.
+  static uint64_t checkpointId(FILE* file, size_t* size = nullptr) {
+    fflush(file);
+    auto fd = fileno(file);
+    off_t pos = ftell(file);
+    uint64_t hash = folly::hash::FNV_64_HASH_START;
+    auto readHashed = [&] (void* data, size_t len) {
+      if (pread(fd, data, len, pos) != ssize_t(len)) {
+        throw std::runtime_error("could not read atomicvec checkpoint");
+      }
+      pos += len;
+      hash = folly::hash::fnv64_buf(data, len, hash);
+    };
+
+    int magic;
+    size_t sz;
+    readHashed(&magic, sizeof(magic));
+    readHashed(&sz, sizeof(sz));
+    size_t dirLen;
+    if (magic == 0x04081977) {
+      dirLen = sz;
+    } else if (magic == kDeltaMagic) {
+      size_t baseSz, n;
+      uint64_t baseId;
+      readHashed(&baseSz, sizeof(baseSz));
+      readHashed(&baseId, sizeof(baseId));
+      readHashed(&n, sizeof(n));
+      dirLen = 2 * n;
+    } else {
+      throw std::runtime_error("bad magic value in atomicvec checkpoint");
+    }
+    std::vector<size_t> chunk(std::min(dirLen, size_t(1) << 16));
+    while (dirLen) {
+      auto len = std::min(dirLen, chunk.size());
+      readHashed(chunk.data(), len * sizeof(size_t));
+      dirLen -= len;
+    }
+    if (size) {
+      *size = sz;
+    }
+    return hash;
+  }
+
+  void applyDelta(FILE* file, uint64_t expectedBaseId) {
+    int magic;
+    size_t sz, baseSz, n;
+    uint64_t baseId;
+    fileOp(fread, &magic, file);
+    if (magic != kDeltaMagic) {
+      throw std::runtime_error("bad magic value loading atomicvec delta");
+    }
+    fileOp(fread, &sz, file);
+    fileOp(fread, &baseSz, file);
+    fileOp(fread, &baseId, file);
+    fileOp(fread, &n, file);
+    if (baseId != expectedBaseId) {
+      throw std::runtime_error("atomicvec delta doesn't apply to this base");
+    }
+    if (baseSz != size()) {
+      auto msg = folly::format(
+        "atomicvec delta applies to {} entries, but vector has {}",
+        baseSz, size());
+      throw std::runtime_error(msg.str());
+    }
+    std::vector<size_t> slots(n);
+    std::vector<size_t> offsets(n);
+    fileOp(fread, slots.data(), n, file);
+    fileOp(fread, offsets.data(), n, file);
+
+    // Entries are stored in order, right after the directory.
+    Refcount<T> rc;
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; i < n; i++) {
+      size_t entrySz;
+      fileOp(fread, &entrySz, file);
+      bytes.resize(entrySz);
+      fileOp(fread, bytes.data(), entrySz, file);
+      if (entrySz == 0) {
+        if (slots[i] < size()) {
+          erase(slots[i]);
+        } else if (slots[i] == size()) {
+          appendErasedUnsafe();
+        } else {
+          throw std::runtime_error("atomicvec delta has a gap");
+        }
+        continue;
+      }
+      folly::ByteRange range(bytes.data(), entrySz);
+      auto val = Serde<T>::load(&range);
+      SCOPE_EXIT {
+        rc.dec(val);
+      };
+      if (slots[i] < size()) {
+        // Revive the slot, if erased; it's not reused until we're done.
+        reviveUnsafe(slots[i]);
+        write(slots[i], val);
+      } else if (slots[i] == size()) {
+        appendAtEnd(val);
+      } else {
+        throw std::runtime_error("atomicvec delta has a gap");
+      }
+    }
+    if (size() != sz) {
+      throw std::runtime_error("atomicvec delta is truncated");
+    }
+  }
+
+  // Append the on-disk form of entry i (length, then encoded value; empty
+  // if erased) to buf
+  void appendEntry(BucketIndex i, std::vector<uint8_t>& buf) const {
+    detail::EpochGuard guard(&m_epochs);
+    if (isErased(i)) {
+      size_t strsz = 0;
+      auto pos = buf.size();
+      buf.resize(pos + sizeof(strsz));
+      memcpy(&buf[pos], &strsz, sizeof(strsz));
+      return;
+    }
+    if (m_lazy && !rawSlot(i)) {
+      // Not materialized; copy the encoded entry as is
+      auto range = m_lazy->entry(i);
+      size_t strsz = range.size();
+      auto pos = buf.size();
+      buf.resize(pos + sizeof(strsz) + strsz);
+      memcpy(&buf[pos], &strsz, sizeof(strsz));
+      memcpy(&buf[pos + sizeof(strsz)], range.data(), strsz);
+      return;
+    }
+    // No need to incref: we hold a read guard.
+    auto val = loadLive(i);
+    fblualib::thrift::StringWriter sw;
+    auto str = Serde<T>::save(val, sw);
+    size_t strsz = str.size();
+    auto pos = buf.size();
+    buf.resize(pos + sizeof(strsz) + strsz);
+    memcpy(&buf[pos], &strsz, sizeof(strsz));
+    memcpy(&buf[pos + sizeof(strsz)], str.data(), strsz);
+  }
 
   static int highOrderBit(BucketIndex val) {
     return folly::findLastSet(val);
@@ -451,13 +1903,116 @@ class AtomicVector {
   }
 
  private:
+  // Append val at the end, never reusing erased slots. Since the end of
+  // the vector can only grow, the semantic here is reasonably well-posed.
+  size_t appendAtEnd(T val) {
+  restart:
+    auto insertionPoint = m_size.load();
+    auto& bucket = indexToBucket(insertionPoint);
+    auto buck = bucket.load();
+    if (!buck) {
+      // Bucket allocation. Some set of inserters might be racing
+      // through the following code; tread with caution.
+      auto sz = 1 << (&bucket - &m_buckets[0]);
+      auto old = buck;
+      buck = new Bucket(sz, m_policy);
+      if (!bucket.compare_exchange_weak(old, buck)) {
+        delete buck;
+        goto restart;
+      }
+    }
+    // We can't get here if this bucket is null.
+    assert(buck);
+    // The bucket can't move.
+    assert(buck == bucket.load());
+
+    // OK! We know where we'd like to put this item, *and* memory that
+    // won't be going anywhere backs it. Entities we might race with
+    // include:
+    //   0. Callers to write(). We won't do a random-access-style write
+    //      to this slot yet, because m_size doesn't yet recognize the
+    //      presence of this slot. See the code in write() that reroutes
+    //      writes to the m_size slot through append.
+    //
+    //   1. Other callers to append. It's possible several writers are
+    //      attempting to append into the same slot. Here we rely on calloc
+    //      producing a unique nullptr-like representation that can never
+    //      be inserted again (since we take a reference here, and
+    //      references are never to null). If we fail the race to write
+    //      this slot, we restart.
+    auto indexInBucket = indexToIntraBucketIndex(insertionPoint,
+                                                 &bucket - &m_buckets[0]);
+    if (!buck->cmpxchg(indexInBucket, 0, val)) {
+      goto restart;
+    }
+    buck->markDirty(indexInBucket);
+
+    // We've written the slot. No other callers to append will do so,
+    // because it's not null so the compare_exchange_weak will fail.
+    Refcount<T> rc;
+    rc.inc(val);
+
+    // Bump m_size, making this slot visible and completing the append
+    // operation.
+    //
+    // Subtlety: do we really know m_size == insertionPoint? The algorithm
+    // is *really* broken otherwise; readers could see val before we incref
+    // it.
+
+    assert(m_size.load() == insertionPoint);
+
+    // Yes, m_size == insertionPoint. Racers through this code are
+    // invariably trying to CAS the slot at m_size from nullptr to
+    // something else, and only one can win that race. If multiple
+    // inserters race, the cas from nullptr will keep failing until the
+    // winner of that race bumps m_size here.  Upshot: this algorithm isn't
+    // quite (lock,wait,obstruction)-free; inserters essentially "lock" the
+    // right to insert by cas'ing that slot.
+    m_size.fetch_add(1);
+    return insertionPoint;
+  }
+
+  // Append an erased slot, when loading
+  void appendErasedUnsafe() {
+    auto slot = m_size.load();
+    auto& bucket = indexToBucket(slot);
+    if (!bucket.load()) {
+      bucket.store(new Bucket(size_t(1) << (&bucket - &m_buckets[0]),
+                              m_policy));
+    }
+    m_size.store(slot + 1);
+    erase(slot);
+  }
+
+  // Un-erase slot (leaving it empty, for write()), when loading. It's
+  // still on the free list; see rebuildFreeSlotsUnsafe().
+  void reviveUnsafe(BucketIndex slot) {
+    auto& bucket = indexToBucket(slot);
+    bucket.load()->clearErased(
+      indexToIntraBucketIndex(slot, &bucket - &m_buckets[0]));
+  }
+
+  // Rebuild the free list (and count) from the erased bits, when loading
+  void rebuildFreeSlotsUnsafe() {
+    clearFreeSlots();
+    size_t n = 0;
+    // In reverse, so that lower slots are reused first
+    for (size_t i = size(); i-- > 0; ) {
+      if (isErased(i)) {
+        pushFreeSlot(i);
+        n++;
+      }
+    }
+    m_numErased.store(n);
+  }
+
   void growUnsafe(size_t size) {
     assert(m_size.load() == 0);
     m_size.store(size);
     auto targetBucketIndex = indexToBucketIndex(size);
     for (int i = 0; i <= targetBucketIndex; i++) {
       assert(!m_buckets[i].load());
-      m_buckets[i].store(new Bucket(1 << i));
+      m_buckets[i].store(new Bucket(1 << i, m_policy));
     }
   }
 };
@@ -13,6 +13,9 @@
 
 #include <unistd.h>
 
+#include <cstdio>
+#include <cstring>
+
 #include <iostream>
 #include <unordered_map>
 #include <thread>
@@ -59,6 +62,22 @@ struct Refcount<int> {
 
 atomic<int> Refcount<int>::m_counts[Refcount<int>::kMaxInt];
 
+template<>
+struct Serde<int> {
+  static folly::StringPiece save(int i, thrift::StringWriter& sw) {
+    sw(folly::IOBuf::copyBuffer(&i, sizeof(i)));
+    return folly::StringPiece(sw.finish());
+  }
+
+  static int load(folly::ByteRange* br) {
+    int i;
+    assert(br->size() == sizeof(i));
+    memcpy(&i, br->data(), sizeof(i));
+    Refcount<int>().inc(i);  // caller's job to decref
+    return i;
+  }
+};
+
 TEST(AtomicVector, append) {
   AtomicVector<int> vec;
   Refcount<int> rc;
@@ -146,6 +165,313 @@ TEST(AtomicVector, mpAppend) {
   rc.assertClear();
 }
 
+TEST(AtomicVector, borrow) {
+  AtomicVector<int> vec;
+  Refcount<int> rc;
+  vec.append(7);
+  ASSERT_EQ(rc.get(7), 1);
+  vec.borrow(0, [&](int val) {
+    ASSERT_EQ(val, 7);
+    ASSERT_EQ(rc.get(7), 1);  // no incref
+    // Replaced while borrowed; stays alive until the borrow ends
+    vec.write(0, 8);
+    vec.flushRetired();
+    ASSERT_EQ(rc.get(7), 1);
+  });
+  ASSERT_EQ(rc.get(7), 0);
+  ASSERT_EQ(rc.get(8), 1);
+}
+
+TEST(AtomicVector, allocPolicy) {
+  Refcount<int> rc;
+  {
+    AtomicVector<int> vec;
+    AllocPolicy policy;
+    policy.numa = AllocPolicy::Numa::INTERLEAVE;
+    policy.hugePages = AllocPolicy::HugePages::EXPLICIT;
+    policy.countReads = true;
+    vec.setAllocPolicy(policy);
+    // Large enough for mmap()ed and huge-page-sized buckets
+    const int N = 1 << 20;
+    for (int i = 0; i < N; i++) {
+      vec.append(i % Refcount<int>::kMaxInt + 1);
+    }
+    for (int i = 0; i < N; i += 1000) {
+      auto val = vec.read(i);
+      ASSERT_EQ(val, i % Refcount<int>::kMaxInt + 1);
+      rc.dec(val);
+    }
+    vec.borrow(N - 1, [] (int) { });
+
+    auto counts = vec.readCounts();
+    ASSERT_FALSE(counts.empty());
+    uint64_t total = 0;
+    for (auto c : counts) {
+      total += c;
+    }
+    ASSERT_EQ(total, (N + 999) / 1000 + 1);
+
+    // Too late to change it
+    EXPECT_THROW(vec.setAllocPolicy(AllocPolicy()), runtime_error);
+    AtomicVector<int> bad;
+    policy.numa = AllocPolicy::Numa::BIND;
+    policy.node = detail::kMaxNumaNodes;
+    EXPECT_THROW(bad.setAllocPolicy(policy), runtime_error);
+    ASSERT_TRUE(bad.readCounts().empty());
+  }
+  rc.assertClear();
+}
+
+TEST(AtomicVector, snapshot) {
+  Refcount<int> rc;
+  {
+    AtomicVector<int> vec;
+    const int N = 10000;
+    for (int i = 0; i < N; i++) {
+      vec.append(i % Refcount<int>::kMaxInt + 1);
+    }
+    auto snap = vec.snapshot();
+    vec.append(1);
+    ASSERT_EQ(snap->size(), N);
+    EXPECT_THROW(snap->get(N), runtime_error);
+
+    // Replaced or erased after the snapshot was taken; the snapshot still
+    // sees (and keeps alive) the old values
+    vec.write(0, 2);
+    vec.erase(1);
+    ASSERT_EQ(rc.get(1), N / Refcount<int>::kMaxInt + 1);
+    ASSERT_EQ(snap->get(0), 1);
+    ASSERT_EQ(snap->get(1), 2);
+
+    vector<int64_t> sums(4);
+    vector<int> counts(4);
+    snap->parallelForEach(4, [&] (size_t tid, uint32_t i, int val) {
+      ASSERT_LT(i, N);
+      sums[tid] += val;
+      counts[tid]++;
+    });
+    int64_t sum = 0;
+    int count = 0;
+    for (int t = 0; t < 4; t++) {
+      sum += sums[t];
+      count += counts[t];
+    }
+    ASSERT_EQ(count, N);
+    // All values as of the snapshot
+    int64_t expected = int64_t(N / Refcount<int>::kMaxInt) *
+      Refcount<int>::kMaxInt * (Refcount<int>::kMaxInt + 1) / 2;
+    ASSERT_EQ(sum, expected);
+
+    EXPECT_THROW(snap->parallelForEach(2, [] (size_t, uint32_t i, int) {
+      if (i == 5000) throw runtime_error("stop");
+    }), runtime_error);
+
+    snap.reset();
+    ASSERT_EQ(rc.get(1), N / Refcount<int>::kMaxInt);
+  }
+  rc.assertClear();
+}
+
+TEST(AtomicVector, erase) {
+  Refcount<int> rc;
+  {
+    AtomicVector<int> vec;
+    for (int i = 0; i < 10; i++) {
+      vec.append(i + 1);
+    }
+    ASSERT_TRUE(vec.erase(3));
+    ASSERT_FALSE(vec.erase(3));
+    ASSERT_TRUE(vec.isErased(3));
+    ASSERT_EQ(vec.numErased(), 1);
+    ASSERT_EQ(vec.size(), 10);
+    EXPECT_THROW(vec.read(3), runtime_error);
+    EXPECT_THROW(vec.borrow(3, [] (int) { }), runtime_error);
+    EXPECT_THROW(vec.write(3, 5), runtime_error);
+    ASSERT_EQ(rc.get(4), 0);
+
+    // Reused by the next append
+    ASSERT_EQ(vec.append(42), 3);
+    ASSERT_FALSE(vec.isErased(3));
+    ASSERT_EQ(vec.numErased(), 0);
+    auto val = vec.read(3);
+    ASSERT_EQ(val, 42);
+    rc.dec(val);
+    ASSERT_EQ(vec.append(43), 10);
+  }
+  rc.assertClear();
+}
+
+TEST(AtomicVector, mpEraseAppend) {
+  Refcount<int> rc;
+  // Every thread appends and erases its own entries over and over, while
+  // reading everybody else's; freed slots are shared among threads.
+  {
+    AtomicVector<int> vec;
+    auto numThreads = mptest([&](int idx) {
+      for (int i = 0; i < 5000; i++) {
+        auto slot = vec.append(idx % Refcount<int>::kMaxInt + 1);
+        auto other = (slot + i) % vec.size();
+        try {
+          auto val = vec.read(other);
+          ASSERT_GT(rc.get(val), 0);
+          rc.dec(val);
+        } catch (const runtime_error&) {
+          // erased
+        }
+        ASSERT_TRUE(vec.erase(slot));
+      }
+    });
+    ASSERT_LE(vec.size(), numThreads);
+    ASSERT_EQ(vec.numErased(), vec.size());
+  }
+  rc.assertClear();
+}
+
+TEST(AtomicVector, compact) {
+  Refcount<int> rc;
+  {
+    AtomicVector<int> vec;
+    const int N = 100;
+    for (int i = 0; i < N; i++) {
+      vec.append(i + 1);
+    }
+    for (int i = 0; i < N; i += 3) {
+      vec.erase(i);
+    }
+    auto mapping = vec.compact();
+    ASSERT_EQ(mapping.size(), N);
+    ASSERT_EQ(vec.size(), N - (N + 2) / 3);
+    ASSERT_EQ(vec.numErased(), 0);
+    for (int i = 0; i < N; i++) {
+      if (i % 3 == 0) {
+        ASSERT_EQ(mapping[i], -1);
+      } else {
+        ASSERT_EQ(mapping[i], i - i / 3 - 1);
+        auto val = vec.read(mapping[i]);
+        ASSERT_EQ(val, i + 1);
+        rc.dec(val);
+      }
+    }
+    // Appends go at the (new) end
+    auto size = vec.size();
+    ASSERT_EQ(vec.append(1), size);
+
+    // Deltas can't express compaction
+    auto base = tmpfile();
+    auto delta = tmpfile();
+    ASSERT_TRUE(base && delta);
+    EXPECT_THROW(vec.saveIncremental(delta, base), runtime_error);
+    vec.save(base);
+    rewind(base);
+    vec.saveIncremental(delta, base);
+    fclose(base);
+    fclose(delta);
+  }
+  rc.assertClear();
+}
+
+TEST(AtomicVector, saveErased) {
+  Refcount<int> rc;
+  const int N = 1000;
+  auto base = tmpfile();
+  auto delta = tmpfile();
+  ASSERT_TRUE(base && delta);
+  auto value = [] (int i) { return i % Refcount<int>::kMaxInt + 1; };
+  auto check = [&] (AtomicVector<int>& vec, int erasedMod, int revived) {
+    ASSERT_EQ(vec.size(), N);
+    size_t numErased = 0;
+    for (int i = 0; i < N; i++) {
+      bool erased = i % erasedMod == 0 && i != revived;
+      ASSERT_EQ(vec.isErased(i), erased);
+      if (erased) {
+        numErased++;
+      } else {
+        auto val = vec.read(i);
+        ASSERT_EQ(val, value(i));
+        rc.dec(val);
+      }
+    }
+    ASSERT_EQ(vec.numErased(), numErased);
+  };
+  int revived;
+  {
+    AtomicVector<int> vec;
+    for (int i = 0; i < N; i++) {
+      vec.append(value(i));
+    }
+    for (int i = 0; i < N; i += 6) {
+      vec.erase(i);
+    }
+    vec.save(base);
+    // Erase some more, and reuse one of them (the last one erased)
+    for (int i = 3; i < N; i += 6) {
+      vec.erase(i);
+    }
+    revived = (N - 4) / 6 * 6 + 3;
+    ASSERT_EQ(vec.append(value(revived)), revived);
+    rewind(base);
+    vec.saveIncremental(delta, base);
+  }
+  rc.assertClear();
+
+  {
+    rewind(base);
+    AtomicVector<int> vec;
+    vec.load(base);
+    check(vec, 6, -1);
+    // Lowest erased slots are reused first
+    ASSERT_EQ(vec.append(1), 0);
+    ASSERT_EQ(vec.append(1), 6);
+  }
+  rc.assertClear();
+
+  {
+    rewind(base);
+    AtomicVector<int> lazy;
+    lazy.loadLazy(base);
+    check(lazy, 6, -1);
+  }
+  rc.assertClear();
+
+  {
+    rewind(base);
+    rewind(delta);
+    AtomicVector<int> vec;
+    vec.loadIncremental(base, {delta});
+    check(vec, 3, revived);
+    ASSERT_EQ(vec.append(1), 0);
+    ASSERT_EQ(vec.append(1), 3);
+  }
+  rc.assertClear();
+  fclose(base);
+  fclose(delta);
+}
+
+TEST(AtomicVector, mpReadWrite) {
+  Refcount<int> rc;
+  // Concurrent readers and writers; no value may be freed while being read.
+  {
+    AtomicVector<int> lval;
+    const int N = 16;
+    for (int i = 0; i < N; i++) {
+      lval.append(i + 1);
+    }
+    (void) mptest([&](int idx) {
+      for (int i = 0; i < 20000; i++) {
+        auto slot = (idx + i) % N;
+        if (i % 4 == 0) {
+          lval.write(slot, (i + idx) % Refcount<int>::kMaxInt + 1);
+        } else {
+          auto val = lval.read(slot);
+          ASSERT_GT(rc.get(val), 0);
+          rc.dec(val);
+        }
+      }
+    });
+  }
+  rc.assertClear();
+}
+
 TEST(AtomicVector, mpRefcount) {
   Refcount<int> rc;
   // Test refcount reasoning.
@@ -165,3 +491,191 @@ TEST(AtomicVector, mpRefcount) {
   }
   rc.assertClear();
 }
+
+TEST(AtomicVector, stripedSpinLock) {
+  detail::StripedSpinLock locks;
+  const int M = 10000;
+  int counters[4] = { 0 };
+  auto numThreads = mptest([&](int idx) {
+    for (int i = 0; i < M; i++) {
+      auto key = (idx + i) % 4;
+      locks.lock(key);
+      counters[key]++;
+      locks.unlock(key);
+    }
+  });
+  ASSERT_EQ(counters[0] + counters[1] + counters[2] + counters[3],
+            M * numThreads);
+}
+
+TEST(AtomicVector, saveLoad) {
+  Refcount<int> rc;
+  {
+    // Enough entries for several parallel save rounds
+    const int N = 100000;
+    AtomicVector<int> vec;
+    for (int i = 0; i < N; i++) {
+      vec.append(i % Refcount<int>::kMaxInt + 1);
+    }
+
+    auto file = tmpfile();
+    ASSERT_TRUE(file);
+    fputs("prefix", file);
+    vec.save(file);
+    auto end = ftell(file);
+    fputs("suffix", file);
+
+    fseek(file, 6, SEEK_SET);
+    AtomicVector<int> loaded;
+    loaded.load(file);
+    ASSERT_EQ(ftell(file), end);
+    ASSERT_EQ(loaded.size(), N);
+    for (int i = 0; i < N; i++) {
+      auto val = loaded.read(i);
+      ASSERT_EQ(val, i % Refcount<int>::kMaxInt + 1);
+      rc.dec(val);
+    }
+    fclose(file);
+  }
+  rc.assertClear();
+}
+
+TEST(AtomicVector, lazyLoad) {
+  Refcount<int> rc;
+  const int N = Refcount<int>::kMaxInt;
+  auto file = tmpfile();
+  ASSERT_TRUE(file);
+  {
+    AtomicVector<int> vec;
+    for (int i = 0; i < N; i++) {
+      vec.append(i + 1);
+    }
+    vec.save(file);
+  }
+  rc.assertClear();
+  auto end = ftell(file);
+
+  {
+    fseek(file, 0, SEEK_SET);
+    AtomicVector<int> lazy;
+    lazy.loadLazy(file);
+    ASSERT_EQ(ftell(file), end);
+    ASSERT_EQ(lazy.size(), N);
+    // Nothing decoded yet
+    rc.assertClear();
+
+    auto val = lazy.read(10);
+    ASSERT_EQ(val, 11);
+    ASSERT_EQ(rc.get(11), 2);
+    rc.dec(val);
+    ASSERT_EQ(rc.get(12), 0);
+
+    // Overwriting an unmaterialized slot doesn't decode it
+    lazy.write(20, 5);
+    ASSERT_EQ(rc.get(21), 0);
+    ASSERT_EQ(rc.get(5), 1);
+
+    // Saving copies unmaterialized entries as is
+    auto copy = tmpfile();
+    ASSERT_TRUE(copy);
+    lazy.save(copy);
+    fseek(copy, 0, SEEK_SET);
+    AtomicVector<int> loaded;
+    loaded.load(copy);
+    fclose(copy);
+    for (int i = 0; i < N; i++) {
+      val = loaded.read(i);
+      ASSERT_EQ(val, i == 20 ? 5 : i + 1);
+      rc.dec(val);
+    }
+  }
+  rc.assertClear();
+
+  {
+    fseek(file, 0, SEEK_SET);
+    AtomicVector<int> lazy;
+    lazy.loadLazy(file, true /* prefetch */);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&lazy, t] {
+        Refcount<int> rc;
+        for (int i = t; i < N; i += 4) {
+          auto val = lazy.read(i);
+          ASSERT_EQ(val, i + 1);
+          rc.dec(val);
+        }
+      });
+    }
+    for (auto& t : threads) t.join();
+  }
+  rc.assertClear();
+  fclose(file);
+}
+
+TEST(AtomicVector, incrementalSave) {
+  Refcount<int> rc;
+  const int N = 500;
+  auto base = tmpfile();
+  auto delta1 = tmpfile();
+  auto delta2 = tmpfile();
+  ASSERT_TRUE(base && delta1 && delta2);
+  {
+    AtomicVector<int> vec;
+    for (int i = 0; i < N; i++) {
+      vec.append(i + 1);
+    }
+    vec.save(base);
+
+    vec.write(3, 700);
+    vec.write(130, 701);
+    vec.write(3, 702);
+    rewind(base);
+    vec.saveIncremental(delta1, base);
+
+    vec.append(703);
+    vec.markDirty(64);
+    rewind(delta1);
+    vec.saveIncremental(delta2, delta1);
+
+    // Nothing changed since the last save
+    auto empty = tmpfile();
+    rewind(delta2);
+    vec.saveIncremental(empty, delta2);
+    ASSERT_EQ(ftell(empty), sizeof(int) + 4 * sizeof(size_t));
+    fclose(empty);
+  }
+  rc.assertClear();
+
+  auto check = [&] (AtomicVector<int>& vec, size_t size) {
+    ASSERT_EQ(vec.size(), size);
+    for (size_t i = 0; i < size; i++) {
+      auto val = vec.read(i);
+      int expected = i == 3 ? 702 : i == 130 ? 701 : i == N ? 703 : i + 1;
+      ASSERT_EQ(val, expected);
+      rc.dec(val);
+    }
+  };
+
+  {
+    rewind(base);
+    rewind(delta1);
+    rewind(delta2);
+    AtomicVector<int> vec;
+    vec.loadIncremental(base, {delta1, delta2});
+    check(vec, N + 1);
+  }
+  rc.assertClear();
+
+  {
+    // Deltas must be applied in order
+    rewind(base);
+    rewind(delta2);
+    AtomicVector<int> vec;
+    ASSERT_THROW(vec.loadIncremental(base, {delta2}), std::runtime_error);
+  }
+  rc.assertClear();
+
+  fclose(base);
+  fclose(delta1);
+  fclose(delta2);
+}
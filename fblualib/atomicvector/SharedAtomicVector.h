@@ -0,0 +1,409 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <folly/Bits.h>
+#include <folly/Format.h>
+#include <folly/Range.h>
+
+namespace fblualib {
+
+// An append-only vector of immutable byte strings ("blobs"), living in a
+// file mapped by several processes (typically in /dev/shm, or on a
+// hugetlbfs mount such as /dev/hugepages for huge pages), so that workers
+// on the same host share one copy of it. It has the semantics of
+// AtomicVector: any process may append, read or write concurrently, and
+// reads are lock-free.
+//
+// Everything in the segment is addressed by offset, as each process maps it
+// at a different address. Blobs are refcounted, with the counts in the
+// segment, and freed when the last reference (from a slot, or from a
+// reader in any process) goes away. There are no epochs: readers increment
+// the count of the blob they found in a slot, unless it's already 0, then
+// check that the slot still holds it (otherwise, they back off and retry).
+// That's safe because memory in the segment is type-stable: it's carved in
+// power-of-two sized chunks, each starting with a chunk header (with the
+// refcount), and chunks are never split, merged or returned, only reused
+// for blobs of the same size class. Allocation takes a process-shared
+// (robust) mutex.
+//
+// The segment is created with a fixed capacity (address space only; pages
+// are allocated as they're touched), and persists until its file is
+// removed. A process dying mid-operation may leak blobs (references it
+// held are never dropped), or, if it dies in the middle of an append, block
+// other appenders; the vector is meant for cooperating workers.
+//
+// The segment is mapped twice: writable, for our own bookkeeping and to
+// fill in new blobs, and read-only, for readers (readOnlyData()), so that a
+// reader modifying a blob faults instead of corrupting it for every process.
+class SharedAtomicVector {
+ public:
+  // Offset of a blob in the segment; 0 = none.
+  typedef uint64_t Blob;
+
+  static const int kMagic = 0x04081979;
+
+  // Map the segment at path, creating it with the given capacity (in bytes)
+  // if it doesn't exist. If it does, capacity is ignored.
+  SharedAtomicVector(const std::string& path, size_t capacity)
+    : m_base(nullptr), m_readOnlyBase(nullptr), m_length(0) {
+    bool created = true;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1 && errno == EEXIST) {
+      created = false;
+      fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    }
+    if (fd == -1) {
+      throwErrno("open");
+    }
+
+    try {
+      if (created) {
+        if (capacity < kMinCapacity) {
+          capacity = kMinCapacity;
+        }
+        if (ftruncate(fd, capacity) != 0) {
+          throwErrno("ftruncate");
+        }
+        map(fd, capacity);
+        init();
+      } else {
+        // The creator may still be setting it up.
+        m_length = waitForSize(fd);
+        map(fd, m_length);
+        waitForMagic();
+      }
+    } catch (...) {
+      unmap();
+      close(fd);
+      if (created) {
+        unlink(path.c_str());
+      }
+      throw;
+    }
+    close(fd);  // The mapping stays.
+  }
+
+  ~SharedAtomicVector() {
+    unmap();
+  }
+
+  SharedAtomicVector(const SharedAtomicVector&) = delete;
+  SharedAtomicVector& operator=(const SharedAtomicVector&) = delete;
+
+  size_t size() const {
+    return header()->size.load();
+  }
+
+  size_t capacity() const {
+    return m_length;
+  }
+
+  // Allocate a blob with room for n bytes, with a refcount of 1. Fill it
+  // in (through data()) before publishing it with append() or write(),
+  // then decref it.
+  Blob allocate(size_t n) {
+    auto sizeClass = sizeClassFor(n);
+    auto chunkSize = kChunkHeaderSize << sizeClass;
+    Blob b;
+    {
+      Lock l(this);
+      auto& freeList = header()->freeLists[sizeClass];
+      if (freeList) {
+        b = freeList;
+        freeList = chunk(b)->nextFree;
+      } else {
+        auto& top = header()->top;
+        if (chunkSize > m_length - top) {
+          throw std::runtime_error(folly::format(
+              "shared atomic vector full ({} bytes)", m_length).str());
+        }
+        b = top;
+        top += chunkSize;
+        chunk(b)->sizeClass = sizeClass;
+      }
+      chunk(b)->length = n;
+      // Never a plain store: a reader may have transiently increffed a
+      // stale reference to this chunk (see read()).
+      chunk(b)->refs.fetch_add(1);
+    }
+    return b;
+  }
+
+  // Writable; only for blobs that haven't been published yet.
+  uint8_t* data(Blob b) const {
+    return m_base + b + kChunkHeaderSize;
+  }
+
+  // Read-only view of the same bytes; writing through it faults.
+  const uint8_t* readOnlyData(Blob b) const {
+    return m_readOnlyBase + b + kChunkHeaderSize;
+  }
+
+  size_t length(Blob b) const {
+    return chunk(b)->length;
+  }
+
+  void incref(Blob b) {
+    chunk(b)->refs.fetch_add(1);
+  }
+
+  void decref(Blob b) {
+    auto c = chunk(b);
+    if (c->refs.fetch_sub(1) == 1) {
+      Lock l(this);
+      auto& freeList = header()->freeLists[c->sizeClass];
+      c->nextFree = freeList;
+      freeList = b;
+    }
+  }
+
+  // Return the (increffed) blob at slot i.
+  Blob read(size_t i) const {
+    if (i >= size()) {
+      throw std::runtime_error("read past end of vector");
+    }
+    auto& s = slot(i);
+    for (;;) {
+      auto b = s.load();
+      // Appended slots are never empty again.
+      assert(b);
+      if (tryIncref(b)) {
+        if (s.load() == b) {
+          return b;
+        }
+        const_cast<SharedAtomicVector*>(this)->decref(b);
+      }
+    }
+  }
+
+  // Store b at slot i (taking a new reference; the caller keeps its own).
+  void write(size_t i, Blob b) {
+    assert(b);
+    if (i >= size()) {
+      throw std::runtime_error("write past end of vector; use vec:append()?");
+    }
+    incref(b);
+    decref(slot(i).exchange(b));
+  }
+
+  // Append b (taking a new reference) and return its position. As in
+  // AtomicVector, appenders claim the slot at size() by CASing it from 0,
+  // then bump the size.
+  size_t append(Blob b) {
+    assert(b);
+    incref(b);
+    for (;;) {
+      auto i = header()->size.load();
+      auto bucket = indexToBucket(i);
+      auto& spine = header()->buckets[bucket];
+      if (!spine.load()) {
+        auto buck = allocate(sizeof(std::atomic<uint64_t>) << bucket);
+        memset(data(buck), 0, length(buck));
+        uint64_t expected = 0;
+        if (!spine.compare_exchange_strong(expected, buck)) {
+          decref(buck);
+          continue;
+        }
+      }
+      uint64_t expected = 0;
+      if (slot(i).compare_exchange_strong(expected, b)) {
+        header()->size.fetch_add(1);
+        return i;
+      }
+      sched_yield();  // another appender owns slot i
+    }
+  }
+
+ private:
+  static constexpr size_t kChunkHeaderSize = 64;
+  static constexpr size_t kNumClasses = 48;
+  static constexpr size_t kMaxBuckets = 48;
+  static constexpr size_t kMinCapacity = 1 << 20;
+
+  struct alignas(64) Chunk {
+    std::atomic<uint32_t> refs;
+    uint32_t sizeClass;   // chunk size is kChunkHeaderSize << sizeClass
+    uint64_t length;      // blob size
+    Blob nextFree;        // when on a free list
+  };
+  static_assert(sizeof(Chunk) == kChunkHeaderSize, "bad chunk header");
+
+  struct Header {
+    std::atomic<int> magic;  // set last by the creator
+    pthread_mutex_t mutex;   // protects top and freeLists
+    uint64_t top;
+    Blob freeLists[kNumClasses];
+    std::atomic<uint64_t> size;
+    std::atomic<Blob> buckets[kMaxBuckets];  // bucket k has 2^k slots
+  };
+
+  class Lock {
+   public:
+    explicit Lock(const SharedAtomicVector* v)
+      : m_mutex(&v->header()->mutex) {
+      int r = pthread_mutex_lock(m_mutex);
+      if (r == EOWNERDEAD) {
+        // The allocator's state is consistent between any two stores.
+        pthread_mutex_consistent(m_mutex);
+      } else if (r != 0) {
+        errno = r;
+        throwErrno("pthread_mutex_lock");
+      }
+    }
+    ~Lock() {
+      pthread_mutex_unlock(m_mutex);
+    }
+    Lock(const Lock&) = delete;
+    Lock& operator=(const Lock&) = delete;
+   private:
+    pthread_mutex_t* m_mutex;
+  };
+
+  [[noreturn]] static void throwErrno(const char* what) {
+    throw std::runtime_error(
+        folly::format("{} failed: {}", what, strerror(errno)).str());
+  }
+
+  void map(int fd, size_t length) {
+    void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      throwErrno("mmap");
+    }
+    // Best effort; on hugetlbfs, the pages are huge anyway.
+    madvise(p, length, MADV_HUGEPAGE);
+    m_base = static_cast<uint8_t*>(p);
+    m_length = length;
+
+    p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      throwErrno("mmap");
+    }
+    madvise(p, length, MADV_HUGEPAGE);
+    m_readOnlyBase = static_cast<const uint8_t*>(p);
+  }
+
+  void unmap() {
+    if (m_readOnlyBase) {
+      munmap(const_cast<uint8_t*>(m_readOnlyBase), m_length);
+    }
+    if (m_base) {
+      munmap(m_base, m_length);
+    }
+  }
+
+  void init() {
+    // The file is zero-filled, so all counts, lists and slots start empty.
+    auto h = header();
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int r = pthread_mutex_init(&h->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (r != 0) {
+      errno = r;
+      throwErrno("pthread_mutex_init");
+    }
+    h->top = (sizeof(Header) + kChunkHeaderSize - 1) & ~(kChunkHeaderSize - 1);
+    h->magic.store(kMagic);
+  }
+
+  static size_t waitForSize(int fd) {
+    for (int i = 0; i < kMaxWaits; i++) {
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        throwErrno("fstat");
+      }
+      if (size_t(st.st_size) >= kMinCapacity) {
+        return st.st_size;
+      }
+      usleep(kWaitUs);
+    }
+    throw std::runtime_error("shared atomic vector segment not initialized");
+  }
+
+  void waitForMagic() const {
+    for (int i = 0; i < kMaxWaits; i++) {
+      if (header()->magic.load() == kMagic) {
+        return;
+      }
+      usleep(kWaitUs);
+    }
+    throw std::runtime_error("not a shared atomic vector segment");
+  }
+
+  static constexpr int kMaxWaits = 1000;
+  static constexpr int kWaitUs = 1000;
+
+  static size_t sizeClassFor(size_t n) {
+    auto total = kChunkHeaderSize + n;
+    size_t sizeClass = 0;
+    while ((kChunkHeaderSize << sizeClass) < total) {
+      sizeClass++;
+    }
+    if (sizeClass >= kNumClasses) {
+      throw std::runtime_error("blob too large for shared atomic vector");
+    }
+    return sizeClass;
+  }
+
+  bool tryIncref(Blob b) const {
+    auto& refs = chunk(b)->refs;
+    auto r = refs.load();
+    do {
+      if (r == 0) {
+        return false;  // being freed (or reused); re-read the slot
+      }
+    } while (!refs.compare_exchange_weak(r, r + 1));
+    return true;
+  }
+
+  static size_t indexToBucket(size_t i) {
+    return folly::findLastSet(uint64_t(i + 1)) - 1;
+  }
+
+  std::atomic<uint64_t>& slot(size_t i) const {
+    auto bucket = indexToBucket(i);
+    auto slots = reinterpret_cast<std::atomic<uint64_t>*>(
+        data(header()->buckets[bucket].load()));
+    return slots[i + 1 - (size_t(1) << bucket)];
+  }
+
+  Header* header() const {
+    return reinterpret_cast<Header*>(m_base);
+  }
+
+  Chunk* chunk(Blob b) const {
+    assert(b >= sizeof(Header) && b < m_length);
+    return reinterpret_cast<Chunk*>(m_base + b);
+  }
+
+  uint8_t* m_base;
+  const uint8_t* m_readOnlyBase;
+  size_t m_length;
+};
+
+} // namespace fblualib
@@ -0,0 +1,181 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "SharedAtomicVector.h"
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace fblualib;
+
+namespace {
+
+string tmpPath() {
+  char path[] = "/tmp/sharedatomicvectorXXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  unlink(path);  // recreated by SharedAtomicVector
+  return path;
+}
+
+SharedAtomicVector::Blob makeBlob(SharedAtomicVector& vec, int val,
+                                  size_t n = sizeof(int)) {
+  auto b = vec.allocate(n);
+  memset(vec.data(b), 0, n);
+  memcpy(vec.data(b), &val, sizeof(val));
+  return b;
+}
+
+int blobValue(SharedAtomicVector& vec, SharedAtomicVector::Blob b) {
+  int val;
+  memcpy(&val, vec.data(b), sizeof(val));
+  return val;
+}
+
+}  // namespace
+
+TEST(SharedAtomicVector, appendReadWrite) {
+  auto path = tmpPath();
+  SharedAtomicVector vec(path, 1 << 20);
+  const int N = 1000;
+  for (int i = 0; i < N; i++) {
+    auto b = makeBlob(vec, i);
+    ASSERT_EQ(vec.append(b), i);
+    vec.decref(b);
+  }
+  ASSERT_EQ(vec.size(), N);
+  for (int i = 0; i < N; i++) {
+    auto b = vec.read(i);
+    ASSERT_EQ(blobValue(vec, b), i);
+    vec.decref(b);
+  }
+  EXPECT_THROW(vec.read(N), runtime_error);
+
+  // Overwriting frees the old blob, whose chunk is reused for the next
+  // blob of the same size class.
+  auto old = vec.read(7);
+  vec.decref(old);
+  auto b = makeBlob(vec, 42);
+  vec.write(7, b);
+  vec.decref(b);
+  auto reused = makeBlob(vec, 43);
+  ASSERT_EQ(reused, old);
+  vec.decref(reused);
+
+  b = vec.read(7);
+  ASSERT_EQ(blobValue(vec, b), 42);
+  vec.decref(b);
+
+  // Different size class
+  b = makeBlob(vec, 44, 1000);
+  ASSERT_GE(vec.length(b), 1000);
+  vec.write(8, b);
+  vec.decref(b);
+  unlink(path.c_str());
+}
+
+TEST(SharedAtomicVector, full) {
+  auto path = tmpPath();
+  SharedAtomicVector vec(path, 1 << 20);
+  EXPECT_THROW(vec.allocate(1 << 20), runtime_error);
+  unlink(path.c_str());
+}
+
+TEST(SharedAtomicVector, multiProcess) {
+  auto path = tmpPath();
+  const int kProcs = 4;
+  const int M = 500;
+  {
+    SharedAtomicVector vec(path, 16 << 20);
+    auto b = makeBlob(vec, -1);
+    vec.append(b);
+    vec.decref(b);
+  }
+
+  vector<pid_t> children;
+  for (int p = 0; p < kProcs; p++) {
+    auto pid = fork();
+    ASSERT_NE(pid, -1);
+    if (pid == 0) {
+      // Attach, append, and overwrite slot 0 a lot.
+      SharedAtomicVector vec(path, 0);
+      for (int i = 0; i < M; i++) {
+        auto b = makeBlob(vec, p * M + i);
+        vec.append(b);
+        vec.write(0, b);
+        vec.decref(b);
+        vec.decref(vec.read(0));
+      }
+      _exit(0);
+    }
+    children.push_back(pid);
+  }
+  for (auto pid : children) {
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  SharedAtomicVector vec(path, 0);
+  ASSERT_EQ(vec.size(), kProcs * M + 1);
+  vector<bool> seen(kProcs * M);
+  for (size_t i = 1; i < vec.size(); i++) {
+    auto b = vec.read(i);
+    auto val = blobValue(vec, b);
+    ASSERT_TRUE(val >= 0 && val < kProcs * M);
+    ASSERT_FALSE(seen[val]);
+    seen[val] = true;
+    vec.decref(b);
+  }
+  unlink(path.c_str());
+}
+
+TEST(SharedAtomicVector, mpReadWrite) {
+  // Concurrent readers and writers; readers never see a freed (or
+  // reused) blob.
+  auto path = tmpPath();
+  SharedAtomicVector vec(path, 16 << 20);
+  const int N = 16;
+  for (int i = 0; i < N; i++) {
+    auto b = makeBlob(vec, i);
+    vec.append(b);
+    vec.decref(b);
+  }
+  vector<thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 20000; i++) {
+        auto slot = (t + i) % N;
+        if (i % 4 == 0) {
+          auto b = makeBlob(vec, slot + N * (i % 7));
+          vec.write(slot, b);
+          vec.decref(b);
+        } else {
+          auto b = vec.read(slot);
+          ASSERT_EQ(blobValue(vec, b) % N, slot);
+          vec.decref(b);
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  unlink(path.c_str());
+}
@@ -0,0 +1,99 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+// Refcount, Serde and raw access traits for TH tensors, shared by the
+// atomicvector and atomicmap Lua modules.
+
+#pragma once
+
+#include "AtomicVector.h"
+
+#include <fblualib/thrift/LuaObject.h>
+#include <thpp/Tensor.h>
+
+namespace fblualib {
+
+// Raw (refcount-free) access to TH tensors, by element type.
+template<typename Real> struct RawTensor;
+
+// Teach AtomicVector and AtomicMap how to refcount and serialize our tensors.
+#define TENSOR_IMPL(T, Real)                          \
+template<> struct Refcount<T*> {                      \
+  void inc(T* t) {                                    \
+    T ## _retain(t);                                  \
+  }                                                   \
+  void dec(T* t) {                                    \
+    T ## _free(t);                                    \
+  }                                                   \
+};                                                    \
+                                                      \
+template<> struct Serde<T*> {                         \
+  static folly::StringPiece save(T* t, thrift::StringWriter& sw) { \
+    auto thpp = thpp::Tensor<Real>(t);                \
+    auto luaObj = thrift::make(thpp);                 \
+    const auto codec = thpp.size() > 1024 ?           \
+      folly::io::CodecType::LZ4 :                     \
+      folly::io::CodecType::NO_COMPRESSION;           \
+    thrift::cppEncode(luaObj, codec, sw);             \
+    return folly::StringPiece(sw.finish());           \
+  }                                                   \
+  static T* load(folly::ByteRange* br) {              \
+    thrift::StringReader sr(br);                      \
+    auto decoded = thrift::cppDecode(sr);             \
+    auto thppTensor = thrift::getTensor<Real>(std::move(decoded)); \
+    auto retval = thppTensor.moveAsTH();              \
+    /* refcount=1; caller's job to decref. */         \
+    return retval;                                    \
+  }                                                   \
+};                                                    \
+                                                      \
+template<> struct RawTensor<Real> {                   \
+  static ptrdiff_t nElement(T* t) {                   \
+    return T ## _nElement(t);                         \
+  }                                                   \
+  static bool isContiguous(T* t) {                    \
+    return T ## _isContiguous(t);                     \
+  }                                                   \
+  static Real* data(T* t) {                           \
+    return T ## _data(t);                             \
+  }                                                   \
+  /* retained, or a new copy; caller's job to free */ \
+  static T* newContiguous(T* t) {                     \
+    return T ## _newContiguous(t);                    \
+  }                                                   \
+  static T* newClone(T* t) {                          \
+    return T ## _newClone(t);                         \
+  }                                                   \
+  /* resize dst like src, and copy src into it */     \
+  static void copy(T* dst, T* src) {                  \
+    T ## _resizeAs(dst, src);                         \
+    T ## _copy(dst, src);                             \
+  }                                                   \
+  static void free(T* t) {                            \
+    T ## _free(t);                                    \
+  }                                                   \
+  /* the memory backing t, if any */                  \
+  static folly::MutableByteRange storage(T* t) {      \
+    if (!t->storage) {                                \
+      return folly::MutableByteRange();               \
+    }                                                 \
+    return folly::MutableByteRange(                   \
+      reinterpret_cast<uint8_t*>(t->storage->data),   \
+      t->storage->size * sizeof(Real));               \
+  }                                                   \
+}
+
+TENSOR_IMPL(THFloatTensor, float);
+TENSOR_IMPL(THDoubleTensor, double);
+TENSOR_IMPL(THIntTensor, int);
+
+#undef TENSOR_IMPL
+
+} // namespace fblualib
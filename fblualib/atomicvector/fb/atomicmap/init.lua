@@ -0,0 +1,57 @@
+--
+--  Copyright (c) 2014, Facebook, Inc.
+--  All rights reserved.
+--
+--  This source code is licensed under the BSD-style license found in the
+--  LICENSE file in the root directory of this source tree. An additional grant
+--  of patent rights can be found in the PATENTS file in the same directory.
+--
+
+-- Named, concurrent hash maps from keys to tensors, shared by all Lua states
+-- (threads) in the process; the companion of fb.atomicvector.
+--
+-- local am = require('fb.atomicmap')
+-- am.create_float('embeddings', 'string')
+-- local map = am.get('embeddings')
+-- map['foo'] = torch.FloatTensor(10)
+-- print(map['foo'], map['bar'] --[[ nil ]], #map)
+--
+-- Keys are either numbers (key type 'int64', the default), or strings (key
+-- type 'string'). Reads are lock-free; there is no removal.
+
+local clib = require('fb.atomicmap.clib')
+local thrift = require('fb.thrift')
+
+local M = {
+    -- create_<type>(name, [key_type]) returns true if created, nil if
+    -- a map with this name already exists
+    create_float = clib.create_float,
+    create_double = clib.create_double,
+    create_int = clib.create_int,
+    destroy = clib.destroy,
+    get = clib.get,
+    -- get_or_create(map, key, init) returns the tensor at key, first
+    -- setting it to init(key) if absent. init is called without holding
+    -- any locks; if several threads race to create the same key, each may
+    -- call init, but they all get the same tensor.
+    get_or_create = clib.get_or_create,
+    -- read_batch(map, keys) returns a table of the tensors at keys (a
+    -- table, or a LongTensor for int64 keys); missing keys leave holes.
+    read_batch = clib.read_batch,
+    -- keys(map) returns a table of all keys, in no particular order
+    keys = clib.keys,
+}
+
+-- save() and load() take an atomic map and a Lua file as inputs. The file
+-- format is that of atomic vectors (entries are encoded and decoded in
+-- parallel), but the files aren't interchangeable. load() adds to the
+-- map's current contents.
+function M.save(atom_map, f)
+    return clib.save(atom_map, thrift.encode_file(f))
+end
+
+function M.load(atom_map, f)
+    return clib.load(atom_map, thrift.encode_file(f))
+end
+
+return M
@@ -8,6 +8,7 @@
 --
 
 local clib = require('fb.atomicvector.clib')
+local ffi = require('ffi')
 local torch = require('torch')
 local thrift = require('fb.thrift')
 
@@ -15,11 +16,137 @@ local M = {
     create_float = clib.create_float,
     create_double = clib.create_double,
     create_int = clib.create_int,
+    -- create_compressed_<type>(name, [codec, [cache_size]]) creates a
+    -- vector that keeps its tensors serialized and compressed with the given
+    -- thrift.codec (default LZ4; ZLIB and LZMA2 compress more, but more
+    -- slowly), with a cache of the cache_size (default 256, 0 for none) most
+    -- recently read tensors in front. Reads return copies, so in-place
+    -- updates (scatter_add, atomic_add, atomic_add_rows) aren't supported.
+    -- Compressed and regular vectors of the same type use the same file
+    -- format.
+    create_compressed_float = clib.create_compressed_float,
+    create_compressed_double = clib.create_compressed_double,
+    create_compressed_int = clib.create_compressed_int,
+    -- create_object(name) creates a vector of arbitrary Lua values (tables,
+    -- strings, tensors, ...; anything fb.thrift can serialize). Values are
+    -- serialized when written and deserialized on every read, so reads
+    -- return new copies. read_cached(vec, i) saves the deserialization: it
+    -- caches decoded values per vector handle (per get()), and returns the
+    -- cached value until the slot is overwritten; such values are shared,
+    -- so don't modify them. Only read, write, append, read_batch,
+    -- write_batch, append_batch and the file functions are supported.
+    create_object = clib.create_object,
+    -- create_shared_<type>(name, path, [capacity]) creates a vector whose
+    -- tensors live in the shared memory segment at path (in /dev/shm, or
+    -- on a hugetlbfs mount for huge pages), so that all processes on the
+    -- host that create a vector with the same path share one copy. The
+    -- segment is created (with the given capacity, in bytes; default 1GB,
+    -- allocated as used) by the first process, and persists until the file
+    -- is removed. Reads don't copy, and return tensors that point into a
+    -- read-only mapping of the segment; modifying them faults, and in-place
+    -- updates aren't supported. load() must be called on an empty vector,
+    -- by one process.
+    create_shared_float = clib.create_shared_float,
+    create_shared_double = clib.create_shared_double,
+    create_shared_int = clib.create_shared_int,
     get = clib.get,
+    read_cached = clib.read_cached,
     destroy = clib.destroy,
     append = clib.append,
+    -- read_into(vec, i, out) copies the tensor at index i into out
+    -- (resizing it), and returns out
+    read_into = clib.read_into,
+
+    -- Batch operations; indices are a table of numbers or a LongTensor.
+    -- read_batch(vec, indices) returns a table of tensors
+    read_batch = clib.read_batch,
+    -- write_batch(vec, indices, tensors)
+    write_batch = clib.write_batch,
+    -- append_batch(vec, tensors) returns a table of positions
+    append_batch = clib.append_batch,
+    -- gather(vec, indices, out) copies the tensors into consecutive rows
+    -- of the contiguous tensor out, and returns out
+    gather = clib.gather,
+    -- scatter_add(vec, indices, src, [scale]) adds scale * (consecutive
+    -- rows of src) into the tensors, in place (racy, Hogwild-style)
+    scatter_add = clib.scatter_add,
+
+    -- In-place accumulation for asynchronous SGD; src must be contiguous.
+    -- atomic_add(vec, i, src, [scale, [locked]]) adds scale * src into the
+    -- tensor at index i. If locked is true, concurrent locked updates of
+    -- the same slot are serialized (by striped spinlocks); otherwise they
+    -- race (Hogwild).
+    atomic_add = clib.atomic_add,
+    -- atomic_add_rows(vec, indices, src, [scale, [locked]]) is scatter_add,
+    -- optionally locked.
+    atomic_add_rows = clib.atomic_add_rows,
+
+    -- set_alloc_policy(vec, policy) chooses where the vector's slot arrays
+    -- are allocated; vec must be empty. policy is a table with optional
+    -- fields:
+    --   numa: 'first_touch' (default), 'interleave' (across all NUMA
+    --         nodes) or 'bind' (to node)
+    --   node: NUMA node for 'bind'
+    --   huge_pages: 'none' (default), 'transparent' or 'explicit' (from the
+    --         hugetlb pool, falling back to transparent)
+    --   place_tensors: also move the storage of tensors stored in the
+    --         vector according to numa (plain vectors only)
+    --   count_reads: count reads by NUMA node, for read_counts()
+    -- Not supported on shared vectors.
+    set_alloc_policy = clib.set_alloc_policy,
+    -- read_counts(vec) returns a table of read counts keyed by (0-based)
+    -- NUMA node of the reading thread, if the policy counts reads
+    read_counts = clib.read_counts,
+
+    -- erase(vec, i) drops the element at index i, leaving a hole: reading
+    -- or writing it is an error, and the next append() reuses it (the
+    -- lowest holes first after loading from a file). Returns false if it
+    -- was already erased. is_erased(vec, i) tells.
+    erase = clib.erase,
+    is_erased = clib.is_erased,
+    -- compact(vec) moves the remaining elements down over the holes, and
+    -- returns a table mapping old indices to new ones (0 for erased
+    -- elements). It must not run concurrently with anything else on vec.
+    -- Holes are saved (and loaded) with the vector, but deltas can't
+    -- express compaction: save() a new base after compact().
+    compact = clib.compact,
+    -- flush_retired(vec) frees the values replaced by writes and erases
+    -- that no reader can still be using. They're normally freed as soon as
+    -- the last such reader is done, so this is rarely needed.
+    flush_retired = clib.flush_retired,
+
+    -- snapshot(vec) returns an immutable view of vec as it is now: snap[i]
+    -- and #snap work as on vec, but later writes, erases and appends aren't
+    -- part of it. Taking it records every element (a pointer each), and
+    -- the recorded values are kept alive until it's released (by
+    -- release(snap), or when it's garbage collected), so release
+    -- snapshots promptly. vec must not be destroyed before its snapshots.
+    -- Only supported on plain (non-compressed, non-shared) tensor vectors,
+    -- as is parallel_for_each.
+    snapshot = clib.snapshot,
+    release = clib.release,
 }
 
+-- parallel_for_each(vec_or_snapshot, op, [nthreads, [arg]]) visits every
+-- element (of a snapshot, taken for the occasion if given a vector) on
+-- nthreads threads (default: one per core), without going through Lua.
+-- op is either a reduction over all elements of all tensors, whose result
+-- is returned: 'sum', 'norm' (L2), 'max' or 'min' (nil if there are no
+-- elements); or a C function pointer (ffi cdata) of type
+--   void (*)(void* arg, long index, THFloatTensor* tensor)
+-- (with the vector's tensor type), called concurrently from all threads
+-- with arg (a cdata pointer), a 1-based index, and a borrowed tensor.
+function M.parallel_for_each(v, op, nthreads, arg)
+    -- the C side reads pointers out of void* cdata
+    if type(op) == 'cdata' then
+        op = ffi.cast('void*', op)
+    end
+    if arg ~= nil then
+        arg = ffi.cast('void*', arg)
+    end
+    return clib.parallel_for_each(v, op, nthreads, arg)
+end
+
 -- save() and load() take an atomic vector and a Lua file as inputs.
 function M.save(atom_vec, f)
     return clib.save(atom_vec, thrift.encode_file(f))
@@ -29,6 +156,37 @@ function M.load(atom_vec, f)
     return clib.load(atom_vec, thrift.encode_file(f))
 end
 
+-- load_lazy() is like load(), but only reads the file's directory; each
+-- element is decoded from a mmap()ed view of the file the first time it's
+-- accessed. atom_vec must be empty, and the file must not be modified for
+-- as long as atom_vec exists (it may be closed, though). If prefetch is
+-- true, a background thread decodes all elements in file order.
+function M.load_lazy(atom_vec, f, prefetch)
+    return clib.load_lazy(atom_vec, thrift.encode_file(f), prefetch)
+end
+
+-- save_incremental() writes only the elements that changed since atom_vec
+-- was last saved or loaded: those that were set or appended, or modified
+-- in place with atomic_add / atomic_add_rows / scatter_add (in-place
+-- modifications through other means aren't tracked). base is the previous
+-- checkpoint file (from save() or save_incremental()), positioned at its
+-- start; it's only read to chain the checkpoints together.
+--
+-- load_incremental() loads the full checkpoint in base, then applies a
+-- list of incremental checkpoints, in order.
+function M.save_incremental(atom_vec, f, base)
+    return clib.save_incremental(atom_vec, thrift.encode_file(f),
+                                 thrift.encode_file(base))
+end
+
+function M.load_incremental(atom_vec, base, deltas)
+    local encoded = {}
+    for i, f in ipairs(deltas) do
+        encoded[i] = thrift.encode_file(f)
+    end
+    return clib.load_incremental(atom_vec, thrift.encode_file(base), encoded)
+end
+
 -- load_legacy() reads the old file format.
 function M.load_legacy(atom_vec, f)
     local SerializationFormatVersionMajor = 1
@@ -0,0 +1,109 @@
+--
+--  Copyright (c) 2014, Facebook, Inc.
+--  All rights reserved.
+--
+--  This source code is licensed under the BSD-style license found in the
+--  LICENSE file in the root directory of this source tree. An additional grant
+--  of patent rights can be found in the PATENTS file in the same directory.
+--
+
+require('fb.luaunit')
+
+local am = require('fb.atomicmap')
+require('torch')
+
+function testSmoke()
+    local name = "mapbert" .. math.random(320)
+    assertEquals(am.create_double(name), true)
+    assertEquals(am.create_double(name), nil)
+    local map = am.get(name)
+    assertEquals(#map, 0)
+    assertEquals(map[12], nil)
+
+    local t = torch.randn(3, 4)
+    map[12] = t
+    assertEquals(#map, 1)
+    assertEquals(map[12], t)
+
+    local t2 = torch.randn(5)
+    map[12] = t2
+    assertEquals(#map, 1)
+    assertEquals(map[12], t2)
+
+    map = nil
+    am.destroy(name)
+    collectgarbage()
+end
+
+function testStringKeys()
+    local name = "mapbert" .. math.random(320)
+    am.create_float(name, 'string')
+    local map = am.get(name)
+    local t = torch.FloatTensor(4):fill(2)
+    map['foo'] = t
+    assertEquals(map['foo'], t)
+    assertEquals(map['bar'], nil)
+    assertError(function() return map[1] end)
+
+    local created = am.get_or_create(map, 'bar', function(key)
+        assertEquals(key, 'bar')
+        return torch.FloatTensor(2):fill(1)
+    end)
+    assertEquals(created:sum(), 2)
+    local again = am.get_or_create(map, 'bar', function() error('called') end)
+    assertEquals(again, created)
+
+    local got = am.read_batch(map, {'bar', 'baz', 'foo'})
+    assertEquals(got[1], created)
+    assertEquals(got[2], nil)
+    assertEquals(got[3], t)
+
+    local keys = am.keys(map)
+    table.sort(keys)
+    assertEquals(keys, {'bar', 'foo'})
+
+    map = nil
+    am.destroy(name)
+    collectgarbage()
+end
+
+function testBadKeyType()
+    assertError(function() am.create_float('badmap', 'float') end)
+end
+
+function testSaveLoad()
+    local name = "mapbert" .. math.random(320)
+    am.create_int(name)
+    local map = am.get(name)
+    for i = 1, 100 do
+        map[i * 1000] = torch.IntTensor(i):fill(i)
+    end
+
+    local path = os.tmpname()
+    local f = io.open(path, 'wb')
+    am.save(map, f)
+    f:close()
+
+    local loadedName = name .. 'loaded'
+    am.create_int(loadedName)
+    local loaded = am.get(loadedName)
+    f = io.open(path, 'rb')
+    am.load(loaded, f)
+    f:close()
+    os.remove(path)
+
+    assertEquals(#loaded, 100)
+    for i = 1, 100 do
+        assertEquals(loaded[i * 1000], map[i * 1000])
+    end
+    local got = am.read_batch(loaded, torch.LongTensor({1000, 5000}))
+    assertEquals(got[2]:sum(), 25)
+
+    map = nil
+    loaded = nil
+    am.destroy(name)
+    am.destroy(loadedName)
+    collectgarbage()
+end
+
+LuaUnit:main()
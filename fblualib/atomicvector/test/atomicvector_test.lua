@@ -176,6 +176,464 @@ function testLoadAndSave()
     os.remove(filename)
 end
 
+function testLoadLazy()
+    local av = require('fb.atomicvector')
+    require('torch')
+    local os = require 'os'
+
+    local name = "ldLazy" .. math.random(320)
+    av.create_double(name)
+    local vec = av.get(name)
+    for i = 1, 100 do
+        av.append(vec, torch.randn(i, 3))
+    end
+
+    local filename = os.tmpname()
+    local f = assert(io.open(filename, 'w'))
+    av.save(vec, f)
+    f:close()
+
+    for _, prefetch in ipairs({false, true}) do
+        local name2 = "ldLazy_loaded" .. math.random(320)
+        av.create_double(name2)
+        local vec2 = av.get(name2)
+        f = assert(io.open(filename, 'r'))
+        av.load_lazy(vec2, f, prefetch)
+        f:close()
+
+        assertEquals(#vec, #vec2)
+        for i = #vec, 1, -1 do
+            assertEquals((vec[i] - vec2[i]):abs():max(), 0)
+        end
+
+        -- Loading into a non-empty vector is an error
+        f = assert(io.open(filename, 'r'))
+        assertFalse(pcall(av.load_lazy, vec2, f))
+        f:close()
+
+        vec2 = nil
+        av.destroy(name2)
+    end
+
+    vec = nil
+    av.destroy(name)
+    collectgarbage()
+    os.remove(filename)
+end
+
+function testIncrementalSave()
+    local av = require('fb.atomicvector')
+    require('torch')
+    local os = require 'os'
+
+    local name = "incSave" .. math.random(320)
+    av.create_double(name)
+    local vec = av.get(name)
+    for i = 1, 50 do
+        av.append(vec, torch.randn(4))
+    end
+
+    local basename = os.tmpname()
+    local deltaname = os.tmpname()
+    local f = assert(io.open(basename, 'w'))
+    av.save(vec, f)
+    f:close()
+
+    vec[7] = torch.randn(4)
+    av.atomic_add(vec, 9, torch.ones(4))
+    av.append(vec, torch.randn(4))
+    local base = assert(io.open(basename, 'r'))
+    f = assert(io.open(deltaname, 'w'))
+    av.save_incremental(vec, f, base)
+    f:close()
+    base:close()
+
+    local name2 = "incSave_loaded" .. math.random(320)
+    av.create_double(name2)
+    local vec2 = av.get(name2)
+    base = assert(io.open(basename, 'r'))
+    f = assert(io.open(deltaname, 'r'))
+    av.load_incremental(vec2, base, {f})
+    f:close()
+    base:close()
+
+    assertEquals(#vec, #vec2)
+    for i = 1, #vec do
+        assertEquals((vec[i] - vec2[i]):abs():max(), 0)
+    end
+
+    vec = nil
+    vec2 = nil
+    av.destroy(name)
+    av.destroy(name2)
+    collectgarbage()
+    os.remove(basename)
+    os.remove(deltaname)
+end
+
+function testCompressed()
+    local av = require('fb.atomicvector')
+    local thrift = require('fb.thrift')
+    require('torch')
+    local os = require 'os'
+
+    local name = "compressed" .. math.random(320)
+    av.create_compressed_double(name, thrift.codec.ZLIB, 4)
+    local vec = av.get(name)
+    local orig = {}
+    for i = 1, 20 do
+        orig[i] = torch.randn(i, 5)
+        av.append(vec, orig[i])
+    end
+    vec[3] = torch.ones(2, 2)
+    orig[3] = torch.ones(2, 2)
+
+    -- Twice, to hit the cache
+    for _ = 1, 2 do
+        for i = 1, #vec do
+            assertEquals((vec[i] - orig[i]):abs():max(), 0)
+        end
+    end
+
+    -- Reads are copies
+    vec[5]:zero()
+    assertEquals((vec[5] - orig[5]):abs():max(), 0)
+
+    local out = torch.DoubleTensor()
+    assertEquals(av.read_into(vec, 7, out), out)
+    assertEquals((out - orig[7]):abs():max(), 0)
+
+    local rows = av.gather(vec, {3, 3}, torch.DoubleTensor(2, 4))
+    assertEquals(rows:sum(), 8)
+
+    assertFalse(pcall(av.atomic_add, vec, 1, torch.ones(5)))
+
+    -- Regular vectors can load compressed vectors' files
+    local filename = os.tmpname()
+    local f = assert(io.open(filename, 'w'))
+    av.save(vec, f)
+    f:close()
+    local name2 = "compressed_loaded" .. math.random(320)
+    av.create_double(name2)
+    local vec2 = av.get(name2)
+    f = assert(io.open(filename, 'r'))
+    av.load(vec2, f)
+    f:close()
+    for i = 1, #vec do
+        assertEquals((vec2[i] - orig[i]):abs():max(), 0)
+    end
+
+    vec = nil
+    vec2 = nil
+    av.destroy(name)
+    av.destroy(name2)
+    collectgarbage()
+    os.remove(filename)
+end
+
+function testShared()
+    local av = require('fb.atomicvector')
+    require('torch')
+    local os = require 'os'
+
+    local path = os.tmpname()
+    os.remove(path)
+    -- Two vectors on the same segment, as two processes would have
+    local name = "shared" .. math.random(320)
+    local name2 = "shared_attached" .. math.random(320)
+    assertEquals(av.create_shared_float(name, path, 16 * 1024 * 1024), true)
+    assertEquals(av.create_shared_float(name2, path), true)
+    local vec = av.get(name)
+    local vec2 = av.get(name2)
+
+    local orig = {}
+    for i = 1, 10 do
+        orig[i] = torch.FloatTensor(i, 3):uniform()
+        assertEquals(av.append(vec, orig[i]), i)
+    end
+    assertEquals(#vec2, 10)
+    for i = 1, 10 do
+        assertEquals((vec2[i] - orig[i]):abs():max(), 0)
+    end
+
+    -- Reads outlive overwrites
+    local old = vec2[4]
+    vec[4] = torch.FloatTensor(2, 2):fill(3)
+    assertEquals((old - orig[4]):abs():max(), 0)
+    assertEquals(vec2[4]:sum(), 12)
+
+    local batch = av.read_batch(vec2, {1, 2})
+    assertEquals((batch[2] - orig[2]):abs():max(), 0)
+    local rows = av.gather(vec2, {4, 4}, torch.FloatTensor(2, 4))
+    assertEquals(rows:sum(), 24)
+    assertFalse(pcall(av.atomic_add, vec, 1, torch.ones(3)))
+
+    -- Regular vectors load shared vectors' files
+    local filename = os.tmpname()
+    local f = assert(io.open(filename, 'w'))
+    av.save(vec, f)
+    f:close()
+    local name3 = "shared_loaded" .. math.random(320)
+    av.create_float(name3)
+    local vec3 = av.get(name3)
+    f = assert(io.open(filename, 'r'))
+    av.load(vec3, f)
+    f:close()
+    assertEquals(#vec3, 10)
+    assertEquals((vec3[10] - orig[10]):abs():max(), 0)
+
+    vec = nil
+    vec2 = nil
+    vec3 = nil
+    old = nil
+    batch = nil
+    av.destroy(name)
+    av.destroy(name2)
+    av.destroy(name3)
+    collectgarbage()
+    os.remove(filename)
+    os.remove(path)
+end
+
+function testObject()
+    local av = require('fb.atomicvector')
+    require('torch')
+    local os = require 'os'
+
+    local name = "objects" .. math.random(320)
+    av.create_object(name)
+    local vec = av.get(name)
+    av.append(vec, {id = 1, tags = {'a', 'b'}})
+    av.append(vec, 'hello')
+    av.append(vec, {t = torch.ones(3)})
+    assertEquals(#vec, 3)
+    assertEquals(vec[1].tags[2], 'b')
+    assertEquals(vec[2], 'hello')
+    assertEquals(vec[3].t:sum(), 3)
+
+    -- Reads are copies
+    vec[1].id = 2
+    assertEquals(vec[1].id, 1)
+
+    local cached = av.read_cached(vec, 1)
+    assertEquals(cached.id, 1)
+    assertEquals(av.read_cached(vec, 1), cached)
+    vec[1] = {id = 3}
+    assertEquals(av.read_cached(vec, 1).id, 3)
+
+    local vals = av.read_batch(vec, {2, 1})
+    assertEquals(vals[1], 'hello')
+    assertEquals(vals[2].id, 3)
+    assertFalse(pcall(av.atomic_add, vec, 1, torch.ones(3)))
+
+    local filename = os.tmpname()
+    local f = assert(io.open(filename, 'w'))
+    av.save(vec, f)
+    f:close()
+    local name2 = "objects_loaded" .. math.random(320)
+    av.create_object(name2)
+    local vec2 = av.get(name2)
+    f = assert(io.open(filename, 'r'))
+    av.load(vec2, f)
+    f:close()
+    assertEquals(vec2[1].id, 3)
+    assertEquals(vec2[2], 'hello')
+    assertEquals(vec2[3].t:sum(), 3)
+
+    vec = nil
+    vec2 = nil
+    av.destroy(name)
+    av.destroy(name2)
+    collectgarbage()
+    os.remove(filename)
+end
+
+function testBatch()
+    local av = require('fb.atomicvector')
+    require('torch')
+
+    local name = "batch" .. math.random(320)
+    av.create_double(name)
+    local vec = av.get(name)
+
+    local ts = {}
+    for i = 1, 5 do
+        ts[i] = torch.Tensor(3):fill(i)
+    end
+    local pos = av.append_batch(vec, ts)
+    assertEquals(#vec, 5)
+    for i = 1, 5 do
+        assertEquals(vec[pos[i]], ts[i])
+    end
+
+    local got = av.read_batch(vec, torch.LongTensor({5, 1}))
+    assertEquals(got[1], ts[5])
+    assertEquals(got[2], ts[1])
+
+    av.write_batch(vec, {1, 2}, {ts[3], ts[4]})
+    assertEquals(vec[1], ts[3])
+    assertEquals(vec[2], ts[4])
+
+    -- gather copies rows; scatter_add adds in place
+    local out = av.gather(vec, {3, 5}, torch.Tensor(2, 3))
+    assertEquals(out[1][1], 3)
+    assertEquals(out[2][3], 5)
+    av.scatter_add(vec, {3, 3}, torch.Tensor(2, 3):fill(1), 0.5)
+    assertEquals(vec[3][2], 4)
+
+    local ok = pcall(av.gather, vec, {1, 6}, torch.Tensor(2, 3))
+    assertEquals(ok, false)
+    ok = pcall(av.gather, vec, {1}, torch.Tensor(2))
+    assertEquals(ok, false)
+    -- indices past the 32-bit slot range don't wrap around
+    ok = pcall(av.read_batch, vec, {2^32 + 2})
+    assertEquals(ok, false)
+    ok = pcall(av.atomic_add, vec, 2^32 + 1, torch.Tensor(3))
+    assertEquals(ok, false)
+
+    vec = nil
+    av.destroy(name)
+    collectgarbage()
+end
+
+function testAtomicAdd()
+    local av = require('fb.atomicvector')
+    require('torch')
+
+    local name = "atomic_add" .. math.random(320)
+    av.create_float(name)
+    local vec = av.get(name)
+    local t = torch.FloatTensor(2, 2):zero()
+    av.append(vec, t)
+    av.append(vec, torch.FloatTensor(4):zero())
+
+    av.atomic_add(vec, 1, torch.FloatTensor(2, 2):fill(1))
+    av.atomic_add(vec, 1, torch.FloatTensor(4):fill(1), 2, true)
+    assertEquals(t[1][1], 3)
+    assertEquals(t[2][2], 3)
+
+    av.atomic_add_rows(vec, {1, 2, 2}, torch.FloatTensor(3, 4):fill(1), 1,
+                       true)
+    assertEquals(t[1][2], 4)
+    assertEquals(vec[2][3], 2)
+
+    local ok = pcall(av.atomic_add, vec, 1, torch.FloatTensor(3))
+    assertEquals(ok, false)
+
+    vec = nil
+    av.destroy(name)
+    collectgarbage()
+end
+
+function testAllocPolicy()
+    local av = require('fb.atomicvector')
+    require('torch')
+
+    local name = "alloc_policy" .. math.random(320)
+    av.create_float(name)
+    local vec = av.get(name)
+    av.set_alloc_policy(vec, {numa = 'interleave', huge_pages = 'transparent',
+                              place_tensors = true, count_reads = true})
+    for i = 1, 100 do
+        av.append(vec, torch.FloatTensor(16):fill(i))
+    end
+    for i = 1, 100 do
+        assertEquals(vec[i][1], i)
+    end
+    av.read_batch(vec, {1, 2, 3})
+
+    local total = 0
+    for _, count in pairs(av.read_counts(vec)) do
+        total = total + count
+    end
+    assertEquals(total, 103)
+
+    -- Only on an empty vector
+    local ok = pcall(av.set_alloc_policy, vec, {numa = 'bind', node = 0})
+    assertEquals(ok, false)
+
+    vec = nil
+    av.destroy(name)
+    collectgarbage()
+end
+
+function testSnapshot()
+    local av = require('fb.atomicvector')
+    require('torch')
+
+    local name = "snapshot" .. math.random(320)
+    av.create_float(name)
+    local vec = av.get(name)
+    for i = 1, 3000 do
+        av.append(vec, torch.FloatTensor(2):fill(i))
+    end
+    av.append(vec, torch.FloatTensor(4, 2):fill(-1):select(2, 1))
+
+    local snap = av.snapshot(vec)
+    av.append(vec, torch.FloatTensor(1):fill(1e6))
+    assertEquals(#snap, 3001)
+    assertEquals(snap[3000][1], 3000)
+
+    -- later writes aren't part of the snapshot
+    vec[1] = torch.FloatTensor(2):fill(100)
+    assertEquals(snap[1][1], 1)
+
+    assertEquals(av.parallel_for_each(snap, 'sum', 4), 3000 * 3001 - 4)
+    assertEquals(av.parallel_for_each(snap, 'max'), 3000)
+    assertEquals(av.parallel_for_each(snap, 'min', 2), -1)
+    assertEquals(av.parallel_for_each(vec, 'max'), 1e6)
+    local ok = pcall(av.parallel_for_each, snap, 'median')
+    assertEquals(ok, false)
+
+    av.release(snap)
+    ok = pcall(function() return snap[1] end)
+    assertEquals(ok, false)
+
+    snap = nil
+    vec = nil
+    av.destroy(name)
+    collectgarbage()
+end
+
+function testErase()
+    local av = require('fb.atomicvector')
+    require('torch')
+
+    local name = "erase" .. math.random(320)
+    av.create_float(name)
+    local vec = av.get(name)
+    for i = 1, 10 do
+        av.append(vec, torch.FloatTensor(1):fill(i))
+    end
+    assertEquals(av.erase(vec, 3), true)
+    assertEquals(av.erase(vec, 3), false)
+    assertEquals(av.is_erased(vec, 3), true)
+    assertEquals(av.is_erased(vec, 4), false)
+    assertEquals(#vec, 10)
+    local ok = pcall(function() return vec[3] end)
+    assertEquals(ok, false)
+
+    -- Reused by append
+    assertEquals(av.append(vec, torch.FloatTensor(1):fill(42)), 3)
+    assertEquals(vec[3][1], 42)
+    av.flush_retired(vec)
+
+    av.erase(vec, 1)
+    av.erase(vec, 5)
+    local mapping = av.compact(vec)
+    assertEquals(#vec, 8)
+    assertEquals(mapping[1], 0)
+    assertEquals(mapping[2], 1)
+    assertEquals(mapping[5], 0)
+    assertEquals(mapping[10], 8)
+    assertEquals(vec[mapping[3]][1], 42)
+    assertEquals(vec[8][1], 10)
+
+    vec = nil
+    av.destroy(name)
+    collectgarbage()
+end
+
 function testErrorClib()
     local av = require('fb.atomicvector')
 
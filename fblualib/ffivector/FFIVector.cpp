@@ -8,52 +8,281 @@
  *
  */
 
+#include "FFIVector.h"
+
 #include <algorithm>
 #include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <folly/Hash.h>
 #include <folly/Malloc.h>
+#include <folly/ScopeGuard.h>
 #include <glog/logging.h>
 
-extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Large vectors live in mmap()ed memory, so that they grow by remapping
+// pages (mremap) rather than copying. File-backed vectors map their file,
+// which starts with a header (padded to a page, so the data stays aligned)
+// that records the element size and the vector's size; reopening it is
+// just mapping it again.
+
+namespace {
+
+constexpr size_t kMmapThreshold = 1 << 20;
+constexpr size_t kMappedHeaderSize = 4096;
+constexpr uint64_t kMappedMagic = 0x4646495645433031;  // "FFIVEC01"
+
+struct MappedHeader {
+  uint64_t magic;
+  uint64_t elementSize;
+  uint64_t size;
+};
+
+size_t headerSize(const FFIVector* v) {
+  return (v->flags & FFIVECTOR_FILE) ? kMappedHeaderSize : 0;
+}
+
+char* mappedBase(const FFIVector* v) {
+  return static_cast<char*>(v->data) - headerSize(v);
+}
+
+MappedHeader* mappedHeader(const FFIVector* v) {
+  DCHECK(v->flags & FFIVECTOR_FILE);
+  return reinterpret_cast<MappedHeader*>(mappedBase(v));
+}
+
+size_t roundToPage(size_t n) {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  return (n + pageSize - 1) & ~(pageSize - 1);
+}
+
+void setMapping(FFIVector* v, void* base, size_t length) {
+  v->data = static_cast<char*>(base) + headerSize(v);
+  v->mappedLength = length;
+  v->capacity = (length - headerSize(v)) / v->elementSize;
+}
+
+// Grow the mapping (and the file, if any) to length bytes
+int remap(FFIVector* v, size_t length) {
+  if ((v->flags & FFIVECTOR_FILE) && ftruncate(v->fd, length) != 0) {
+    return -errno;
+  }
+  void* p = mremap(mappedBase(v), v->mappedLength, length, MREMAP_MAYMOVE);
+  if (p == MAP_FAILED) {
+    return -errno;
+  }
+  setMapping(v, p, length);
+  return 0;
+}
+
+// Move a malloc()ed vector to an anonymous mapping with room for n elements
+int moveToMapping(FFIVector* v, size_t n) {
+  size_t length = roundToPage(n * v->elementSize);
+  void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return -ENOMEM;
+  }
+  if (v->data) {
+    memcpy(p, v->data, v->size * v->elementSize);
+    free(v->data);
+  }
+  v->flags |= FFIVECTOR_MAPPED;
+  setMapping(v, p, length);
+  return 0;
+}
+
+// The pins on a vector's data. Pins are taken by the vector's owner, but
+// may be released from any thread (by whoever frees the last tensor).
+struct Pins {
+  std::mutex mutex;
+  size_t count = 0;
+  bool orphaned = false;  // the vector is gone, and left us its data
+  FFIVector data;
+};
+
+bool pinned(const FFIVector* v) {
+  if (!v->pins) {
+    return false;
+  }
+  auto pins = static_cast<Pins*>(v->pins);
+  std::lock_guard<std::mutex> lock(pins->mutex);
+  return pins->count != 0;
+}
+
+void release(FFIVector* v) {
+  if (v->flags & FFIVECTOR_BORROWED) {
+    return;
+  }
+  if (v->flags & FFIVECTOR_MAPPED) {
+    munmap(mappedBase(v), v->mappedLength);
+    if (v->flags & FFIVECTOR_FILE) {
+      close(v->fd);
+    }
+  } else {
+    free(v->data);
+  }
+}
 
-// NOTE: this must match the ffi.cdef in ffivector.lua
+// Copy the elements of a borrowed vector to memory of its own, with room
+// for n elements
+int unborrow(FFIVector* v, size_t n) {
+  FFIVector copy;
+  int r = ffivector_create(&copy, v->elementSize, n);
+  if (r != 0) {
+    return r;
+  }
+  memcpy(copy.data, v->data, v->size * v->elementSize);
+  copy.size = v->size;
+  copy.pins = v->pins;
+  *v = copy;
+  return 0;
+}
 
-typedef struct {
-  size_t elementSize;
-  size_t size;
-  size_t capacity;
-  void* data;
-} FFIVector;
+void* thMalloc(void* /*ctx*/, ptrdiff_t /*size*/) {
+  return nullptr;
+}
 
-int ffivector_create(FFIVector* v, size_t elementSize, size_t initialCapacity);
-void ffivector_destroy(FFIVector* v);
-int ffivector_reserve(FFIVector* v, size_t n);
-int ffivector_resize(FFIVector* v, size_t n);
+void* thRealloc(void* /*ctx*/, void* /*ptr*/, ptrdiff_t /*size*/) {
+  return nullptr;
+}
 
+void thFree(void* ctx, void* /*ptr*/) {
+  ffivector_unpin(ctx);
 }
 
+const FFIVectorTHAllocator kTHAllocator = {&thMalloc, &thRealloc, &thFree};
+
+}  // namespace
+
 int ffivector_create(FFIVector* v, size_t elementSize, size_t initialCapacity) {
   v->elementSize = elementSize;
   v->size = 0;
-  v->capacity = initialCapacity;
-  if (initialCapacity != 0) {
-    v->data = malloc(initialCapacity * elementSize);
-    if (!v->data) {
-      return -ENOMEM;
-    }
+  v->capacity = 0;
+  v->data = nullptr;
+  v->flags = 0;
+  v->fd = -1;
+  v->mappedLength = 0;
+  v->pins = nullptr;
+  return ffivector_reserve(v, initialCapacity);
+}
+
+int ffivector_open(FFIVector* v, size_t elementSize, const char* path,
+                   int mode) {
+  int r = ffivector_create(v, elementSize, 0);
+  if (r != 0) {
+    return r;
+  }
+
+  bool readOnly = (mode == FFIVECTOR_OPEN_READ_ONLY);
+  int oflags = O_CLOEXEC;
+  if (readOnly) {
+    oflags |= O_RDONLY;
   } else {
-    v->data = nullptr;
+    oflags |= O_RDWR | O_CREAT;
+    if (mode == FFIVECTOR_OPEN_TRUNCATE) {
+      oflags |= O_TRUNC;
+    }
+  }
+  int fd = open(path, oflags, 0644);
+  if (fd == -1) {
+    return -errno;
+  }
+
+  void* p = MAP_FAILED;
+  size_t length = 0;
+  auto guard = folly::makeGuard([&] {
+    if (p != MAP_FAILED) {
+      munmap(p, length);
+    }
+    close(fd);
+  });
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return -errno;
+  }
+  length = st.st_size;
+  bool created = false;
+  if (length == 0 && !readOnly) {
+    created = true;
+    length = kMappedHeaderSize;
+    if (ftruncate(fd, length) != 0) {
+      return -errno;
+    }
+  }
+  if (length < kMappedHeaderSize) {
+    return -EINVAL;
+  }
+
+  p = mmap(nullptr, length, readOnly ? PROT_READ : PROT_READ | PROT_WRITE,
+           MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    return -errno;
+  }
+
+  auto header = static_cast<MappedHeader*>(p);
+  if (created) {
+    header->elementSize = elementSize;
+    header->size = 0;
+    header->magic = kMappedMagic;
+  } else if (header->magic != kMappedMagic ||
+             header->elementSize != elementSize ||
+             header->size > (length - kMappedHeaderSize) / elementSize) {
+    return -EINVAL;
   }
+
+  guard.dismiss();
+  v->flags = FFIVECTOR_MAPPED | FFIVECTOR_FILE |
+    (readOnly ? FFIVECTOR_READ_ONLY : 0);
+  v->fd = fd;
+  setMapping(v, p, length);
+  v->size = header->size;
   return 0;
 }
 
 void ffivector_destroy(FFIVector* v) {
-  free(v->data);
+  if (v->pins) {
+    auto pins = static_cast<Pins*>(v->pins);
+    std::unique_lock<std::mutex> lock(pins->mutex);
+    if (pins->count != 0) {
+      // The last unpin will release the data
+      pins->data = *v;
+      pins->data.pins = nullptr;
+      pins->orphaned = true;
+      return;
+    }
+    lock.unlock();
+    delete pins;
+  }
+  release(v);
 }
 
 int ffivector_reserve(FFIVector* v, size_t n) {
   if (n <= v->capacity) {
     return 0;
   }
+  if (v->flags & FFIVECTOR_READ_ONLY) {
+    return -EROFS;
+  }
+  if (pinned(v)) {
+    return -EBUSY;
+  }
+  if (v->flags & FFIVECTOR_BORROWED) {
+    return unborrow(v, n);
+  }
+  if (v->flags & FFIVECTOR_MAPPED) {
+    return remap(v, headerSize(v) + roundToPage(n * v->elementSize));
+  }
+  if (n * v->elementSize >= kMmapThreshold) {
+    return moveToMapping(v, n);
+  }
 
   try {
     if (v->data) {
@@ -75,6 +304,9 @@ int ffivector_reserve(FFIVector* v, size_t n) {
 }
 
 int ffivector_resize(FFIVector* v, size_t n) {
+  if (v->flags & FFIVECTOR_READ_ONLY) {
+    return -EROFS;
+  }
   if (n > v->capacity) {
     // 1.5x growth factor
     size_t newCapacity = std::max(n, 1 + v->size * 3 / 2);
@@ -91,5 +323,583 @@ int ffivector_resize(FFIVector* v, size_t n) {
   }
 
   v->size = n;
+  if (v->flags & FFIVECTOR_FILE) {
+    mappedHeader(v)->size = n;
+  }
+  return 0;
+}
+
+int ffivector_flush(FFIVector* v, int async) {
+  if (!(v->flags & FFIVECTOR_FILE) || (v->flags & FFIVECTOR_READ_ONLY)) {
+    return 0;
+  }
+  if (msync(mappedBase(v), v->mappedLength, async ? MS_ASYNC : MS_SYNC)
+      != 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+int ffivector_refresh(FFIVector* v) {
+  if (!(v->flags & FFIVECTOR_FILE)) {
+    return 0;
+  }
+  struct stat st;
+  if (fstat(v->fd, &st) != 0) {
+    return -errno;
+  }
+  size_t length = st.st_size;
+  if (length > v->mappedLength) {
+    if (pinned(v)) {
+      return -EBUSY;
+    }
+    void* p = mremap(mappedBase(v), v->mappedLength, length, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED) {
+      return -errno;
+    }
+    setMapping(v, p, length);
+  }
+  v->size = std::min<size_t>(mappedHeader(v)->size, v->capacity);
+  return 0;
+}
+
+void* ffivector_pin(FFIVector* v) {
+  if (!v->pins) {
+    v->pins = new (std::nothrow) Pins;
+    if (!v->pins) {
+      return nullptr;
+    }
+  }
+  auto pins = static_cast<Pins*>(v->pins);
+  std::lock_guard<std::mutex> lock(pins->mutex);
+  ++pins->count;
+  return pins;
+}
+
+void ffivector_unpin(void* p) {
+  auto pins = static_cast<Pins*>(p);
+  std::unique_lock<std::mutex> lock(pins->mutex);
+  DCHECK_GT(pins->count, 0);
+  if (--pins->count != 0 || !pins->orphaned) {
+    return;
+  }
+  lock.unlock();
+  release(&pins->data);
+  delete pins;
+}
+
+int ffivector_adopt(FFIVector* v, void* data, size_t size) {
+  if (v->capacity != 0 || v->flags != 0) {
+    return -EINVAL;
+  }
+  v->data = data;
+  v->size = size;
+  v->capacity = size;
+  v->flags = FFIVECTOR_BORROWED;
+  return 0;
+}
+
+const FFIVectorTHAllocator* ffivector_th_allocator() {
+  return &kTHAllocator;
+}
+
+// FFIStringVector: strings packed one after the other in one byte vector,
+// with a vector of size + 1 offsets into it (the first one is always 0);
+// string i spans [offsets[i], offsets[i + 1]).
+
+namespace {
+
+int appendOffset(FFIStringVector* v, uint64_t offset) {
+  auto n = v->offsets.size;
+  int r = ffivector_resize(&v->offsets, n + 1);
+  if (r != 0) {
+    return r;
+  }
+  static_cast<uint64_t*>(v->offsets.data)[n] = offset;
   return 0;
 }
+
+// Make room for n more bytes, growing by at least 1.5x
+int growBytes(FFIVector* bytes, size_t n) {
+  if (bytes->size + n <= bytes->capacity) {
+    return 0;
+  }
+  return ffivector_reserve(
+      bytes, std::max(bytes->size + n, 1 + bytes->capacity * 3 / 2));
+}
+
+}  // namespace
+
+int ffistringvector_create(FFIStringVector* v, size_t initialCapacity,
+                           size_t initialBytes) {
+  int r = ffivector_create(&v->offsets, sizeof(uint64_t), initialCapacity + 1);
+  if (r != 0) {
+    return r;
+  }
+  r = ffivector_create(&v->bytes, 1, initialBytes);
+  if (r != 0) {
+    ffivector_destroy(&v->offsets);
+    return r;
+  }
+  return appendOffset(v, 0);
+}
+
+void ffistringvector_destroy(FFIStringVector* v) {
+  ffivector_destroy(&v->offsets);
+  ffivector_destroy(&v->bytes);
+}
+
+int ffistringvector_reserve(FFIStringVector* v, size_t n, size_t bytes) {
+  int r = ffivector_reserve(&v->offsets, n + 1);
+  if (r != 0) {
+    return r;
+  }
+  return ffivector_reserve(&v->bytes, bytes);
+}
+
+int ffistringvector_append(FFIStringVector* v, const char* s, size_t len) {
+  int r = growBytes(&v->bytes, len);
+  if (r != 0) {
+    return r;
+  }
+  auto end = v->bytes.size;
+  memcpy(static_cast<char*>(v->bytes.data) + end, s, len);
+  r = appendOffset(v, end + len);
+  if (r != 0) {
+    return r;
+  }
+  v->bytes.size = end + len;
+  return 0;
+}
+
+// Append the lines of a file (without their newlines). The file is read
+// in chunks straight into the byte vector, then the newlines are squeezed
+// out in place.
+int ffistringvector_load(FFIStringVector* v, const char* path) {
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    return -errno;
+  }
+  SCOPE_EXIT {
+    fclose(f);
+  };
+
+  constexpr size_t kChunkSize = 1 << 20;
+  auto lineStart = v->bytes.size;
+  for (;;) {
+    int r = growBytes(&v->bytes, kChunkSize);
+    if (r != 0) {
+      return r;
+    }
+    auto data = static_cast<char*>(v->bytes.data);
+    auto end = v->bytes.size;
+    auto n = fread(data + end, 1, kChunkSize, f);
+    if (n == 0) {
+      break;
+    }
+    // out <= in: everything before in has been moved to before out.
+    auto out = end;
+    for (auto in = end; in < end + n; ) {
+      auto nl = static_cast<char*>(memchr(data + in, '\n', end + n - in));
+      size_t segmentEnd = nl ? nl - data : end + n;
+      memmove(data + out, data + in, segmentEnd - in);
+      out += segmentEnd - in;
+      in = segmentEnd;
+      if (nl) {
+        r = appendOffset(v, out);
+        if (r != 0) {
+          v->bytes.size = lineStart;
+          return r;
+        }
+        lineStart = out;
+        ++in;
+      }
+    }
+    v->bytes.size = out;
+  }
+  if (ferror(f)) {
+    v->bytes.size = lineStart;
+    return -EIO;
+  }
+  // Last line, without a newline
+  if (v->bytes.size > lineStart) {
+    int r = appendOffset(v, v->bytes.size);
+    if (r != 0) {
+      v->bytes.size = lineStart;
+      return r;
+    }
+  }
+  return 0;
+}
+
+// FFIMap: open addressing with Robin Hood hashing and backward-shift
+// deletion, so there are no tombstones. Each slot stores a 32-bit hash of
+// its key (0 for an empty slot), which gives the slot's probe distance and
+// filters out most mismatches without touching the keys. Keys are compared
+// bytewise.
+//
+// String keys (keySize 0 at creation) live in an arena, each as a 32-bit
+// length followed by the bytes; their key slots hold 64-bit offsets into
+// the arena. Space freed by erasing keys is reclaimed by compacting the
+// arena once it's mostly garbage.
+
+namespace {
+
+constexpr size_t kMinMapCapacity = 8;
+constexpr size_t kMinArenaGarbage = 1 << 16;
+constexpr size_t kNotFound = size_t(-1);
+
+// Keep at most 80% of the slots full
+bool overloaded(size_t size, size_t capacity) {
+  return size * 5 > capacity * 4;
+}
+
+uint32_t hashKey(const FFIMap* m, const void* key, size_t keyLen) {
+  uint64_t h;
+  if (m->stringKeys) {
+    h = folly::hash::SpookyHashV2::Hash64(key, keyLen, 0);
+  } else if (m->keySize == sizeof(uint64_t)) {
+    uint64_t k;
+    memcpy(&k, key, sizeof(k));
+    h = folly::hash::twang_mix64(k);
+  } else if (m->keySize == sizeof(uint32_t)) {
+    uint32_t k;
+    memcpy(&k, key, sizeof(k));
+    h = folly::hash::twang_mix64(k);
+  } else {
+    h = folly::hash::SpookyHashV2::Hash64(key, m->keySize, 0);
+  }
+  uint32_t h32 = uint32_t(h ^ (h >> 32));
+  return h32 ? h32 : 1;
+}
+
+char* keyAt(const FFIMap* m, size_t slot) {
+  return static_cast<char*>(m->keys) + slot * m->keySize;
+}
+
+char* valueAt(const FFIMap* m, size_t slot) {
+  return static_cast<char*>(m->values) + slot * m->valueSize;
+}
+
+const char* stringAt(const FFIMap* m, size_t slot, size_t* len) {
+  uint64_t offset;
+  memcpy(&offset, keyAt(m, slot), sizeof(offset));
+  uint32_t n;
+  memcpy(&n, m->arena + offset, sizeof(n));
+  *len = n;
+  return m->arena + offset + sizeof(n);
+}
+
+bool keyEquals(const FFIMap* m, size_t slot, const void* key, size_t keyLen) {
+  if (!m->stringKeys) {
+    return memcmp(keyAt(m, slot), key, m->keySize) == 0;
+  }
+  size_t n;
+  auto s = stringAt(m, slot, &n);
+  return n == keyLen && memcmp(s, key, n) == 0;
+}
+
+size_t probeDistance(const FFIMap* m, size_t slot, uint32_t hash) {
+  return (slot - hash) & (m->capacity - 1);
+}
+
+size_t findSlot(const FFIMap* m, uint32_t hash, const void* key,
+                size_t keyLen) {
+  if (m->size == 0) {
+    return kNotFound;
+  }
+  size_t mask = m->capacity - 1;
+  size_t slot = hash & mask;
+  for (size_t dist = 0; ; ++dist) {
+    uint32_t h = m->hashes[slot];
+    // Robin Hood: our key would have displaced any entry closer to home.
+    if (h == 0 || probeDistance(m, slot, h) < dist) {
+      return kNotFound;
+    }
+    if (h == hash && keyEquals(m, slot, key, keyLen)) {
+      return slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
+void moveSlot(FFIMap* m, size_t to, size_t from) {
+  m->hashes[to] = m->hashes[from];
+  memcpy(keyAt(m, to), keyAt(m, from), m->keySize);
+  memcpy(valueAt(m, to), valueAt(m, from), m->valueSize);
+}
+
+// Claim a slot for a new key with the given hash (there must be room): the
+// first slot whose entry is closer to its home than we'd be, after moving
+// the run of entries from there to the next empty slot over by one. That
+// moves each of them one step further from home, as the chain of swaps of
+// textbook Robin Hood insertion would.
+size_t claimSlot(FFIMap* m, uint32_t hash) {
+  size_t mask = m->capacity - 1;
+  size_t slot = hash & mask;
+  for (size_t dist = 0;
+       m->hashes[slot] != 0 &&
+       probeDistance(m, slot, m->hashes[slot]) >= dist;
+       ++dist) {
+    slot = (slot + 1) & mask;
+  }
+  if (m->hashes[slot] != 0) {
+    size_t end = slot;
+    while (m->hashes[end] != 0) {
+      end = (end + 1) & mask;
+    }
+    for (size_t i = end; i != slot; ) {
+      size_t prev = (i - 1) & mask;
+      moveSlot(m, i, prev);
+      i = prev;
+    }
+  }
+  m->hashes[slot] = hash;
+  return slot;
+}
+
+int rehash(FFIMap* m, size_t capacity) {
+  FFIMap n = *m;
+  n.capacity = capacity;
+  n.hashes = static_cast<uint32_t*>(calloc(capacity, sizeof(uint32_t)));
+  n.keys = malloc(capacity * n.keySize);
+  n.values = malloc(capacity * n.valueSize);
+  if (!n.hashes || !n.keys || (!n.values && n.valueSize != 0)) {
+    free(n.hashes);
+    free(n.keys);
+    free(n.values);
+    return -ENOMEM;
+  }
+
+  for (size_t i = 0; i < m->capacity; ++i) {
+    if (m->hashes[i] != 0) {
+      auto slot = claimSlot(&n, m->hashes[i]);
+      memcpy(keyAt(&n, slot), keyAt(m, i), n.keySize);
+      memcpy(valueAt(&n, slot), valueAt(m, i), n.valueSize);
+    }
+  }
+
+  free(m->hashes);
+  free(m->keys);
+  free(m->values);
+  *m = n;
+  return 0;
+}
+
+int appendString(FFIMap* m, const void* key, size_t keyLen,
+                 uint64_t* offset) {
+  if (keyLen > UINT32_MAX) {
+    return -EINVAL;
+  }
+  size_t n = sizeof(uint32_t) + keyLen;
+  if (m->arenaSize + n > m->arenaCapacity) {
+    // 1.5x growth factor
+    size_t newCapacity = std::max(m->arenaSize + n,
+                                  64 + m->arenaCapacity * 3 / 2);
+    try {
+      if (m->arena) {
+        m->arena = static_cast<char*>(folly::smartRealloc(
+            m->arena, m->arenaSize, m->arenaCapacity, newCapacity));
+      } else {
+        m->arena = static_cast<char*>(folly::checkedMalloc(newCapacity));
+      }
+    } catch (const std::bad_alloc&) {
+      return -ENOMEM;
+    }
+    m->arenaCapacity = newCapacity;
+  }
+  uint32_t n32 = keyLen;
+  memcpy(m->arena + m->arenaSize, &n32, sizeof(n32));
+  memcpy(m->arena + m->arenaSize + sizeof(n32), key, keyLen);
+  *offset = m->arenaSize;
+  m->arenaSize += n;
+  return 0;
+}
+
+int compactArena(FFIMap* m) {
+  size_t live = m->arenaSize - m->arenaGarbage;
+  auto arena = static_cast<char*>(malloc(std::max(live, size_t(1))));
+  if (!arena) {
+    return -ENOMEM;
+  }
+  uint64_t top = 0;
+  for (size_t i = 0; i < m->capacity; ++i) {
+    if (m->hashes[i] != 0) {
+      size_t n;
+      auto s = stringAt(m, i, &n);
+      memcpy(arena + top, s - sizeof(uint32_t), sizeof(uint32_t) + n);
+      memcpy(keyAt(m, i), &top, sizeof(top));
+      top += sizeof(uint32_t) + n;
+    }
+  }
+  DCHECK_EQ(top, live);
+  free(m->arena);
+  m->arena = arena;
+  m->arenaSize = live;
+  m->arenaCapacity = std::max(live, size_t(1));
+  m->arenaGarbage = 0;
+  return 0;
+}
+
+}  // namespace
+
+int ffimap_create(FFIMap* m, size_t keySize, size_t valueSize,
+                  size_t initialCapacity) {
+  memset(m, 0, sizeof(FFIMap));
+  m->stringKeys = (keySize == 0);
+  m->keySize = m->stringKeys ? sizeof(uint64_t) : keySize;
+  m->valueSize = valueSize;
+  return ffimap_reserve(m, initialCapacity);
+}
+
+void ffimap_destroy(FFIMap* m) {
+  free(m->hashes);
+  free(m->keys);
+  free(m->values);
+  free(m->arena);
+}
+
+int ffimap_reserve(FFIMap* m, size_t n) {
+  size_t capacity = kMinMapCapacity;
+  while (overloaded(n, capacity)) {
+    capacity *= 2;
+  }
+  if (n == 0 || capacity <= m->capacity) {
+    return 0;
+  }
+  return rehash(m, capacity);
+}
+
+void* ffimap_find(const FFIMap* m, const void* key, size_t keyLen) {
+  auto slot = findSlot(m, hashKey(m, key, keyLen), key, keyLen);
+  return slot == kNotFound ? nullptr : valueAt(m, slot);
+}
+
+void* ffimap_insert(FFIMap* m, const void* key, size_t keyLen,
+                    int* inserted) {
+  auto hash = hashKey(m, key, keyLen);
+  auto slot = findSlot(m, hash, key, keyLen);
+  if (slot != kNotFound) {
+    *inserted = 0;
+    return valueAt(m, slot);
+  }
+
+  if (m->capacity == 0 || overloaded(m->size + 1, m->capacity)) {
+    if (ffimap_reserve(m, m->size + 1) != 0) {
+      return nullptr;
+    }
+  }
+  uint64_t offset;
+  if (m->stringKeys && appendString(m, key, keyLen, &offset) != 0) {
+    return nullptr;
+  }
+
+  slot = claimSlot(m, hash);
+  if (m->stringKeys) {
+    memcpy(keyAt(m, slot), &offset, sizeof(offset));
+  } else {
+    memcpy(keyAt(m, slot), key, m->keySize);
+  }
+  memset(valueAt(m, slot), 0, m->valueSize);
+  ++m->size;
+  *inserted = 1;
+  return valueAt(m, slot);
+}
+
+int ffimap_erase(FFIMap* m, const void* key, size_t keyLen) {
+  auto slot = findSlot(m, hashKey(m, key, keyLen), key, keyLen);
+  if (slot == kNotFound) {
+    return 0;
+  }
+  if (m->stringKeys) {
+    size_t n;
+    stringAt(m, slot, &n);
+    m->arenaGarbage += sizeof(uint32_t) + n;
+  }
+
+  // Shift the following entries back by one, until one that's at home
+  size_t mask = m->capacity - 1;
+  for (size_t next = (slot + 1) & mask;
+       m->hashes[next] != 0 && probeDistance(m, next, m->hashes[next]) != 0;
+       next = (next + 1) & mask) {
+    moveSlot(m, slot, next);
+    slot = next;
+  }
+  m->hashes[slot] = 0;
+  --m->size;
+
+  if (m->arenaGarbage >= kMinArenaGarbage &&
+      m->arenaGarbage * 2 > m->arenaSize) {
+    compactArena(m);  // best effort
+  }
+  return 1;
+}
+
+size_t ffimap_next(const FFIMap* m, size_t slot) {
+  while (slot < m->capacity && m->hashes[slot] == 0) {
+    ++slot;
+  }
+  return slot;
+}
+
+const char* ffimap_key(const FFIMap* m, size_t slot, size_t* keyLen) {
+  DCHECK(slot < m->capacity && m->hashes[slot] != 0);
+  if (m->stringKeys) {
+    return stringAt(m, slot, keyLen);
+  }
+  *keyLen = m->keySize;
+  return keyAt(m, slot);
+}
+
+int ffimap_insert_batch(FFIMap* m, const void* keys, const void* values,
+                        size_t n) {
+  DCHECK(!m->stringKeys);
+  auto k = static_cast<const char*>(keys);
+  auto v = static_cast<const char*>(values);
+  for (size_t i = 0; i < n; ++i) {
+    int inserted;
+    auto p = ffimap_insert(m, k + i * m->keySize, m->keySize, &inserted);
+    if (!p) {
+      return -ENOMEM;
+    }
+    memcpy(p, v + i * m->valueSize, m->valueSize);
+  }
+  return 0;
+}
+
+size_t ffimap_find_batch(const FFIMap* m, const void* keys, void* values,
+                         size_t n, uint8_t* found) {
+  DCHECK(!m->stringKeys);
+  // Hash a block of keys and prefetch their home slots before probing, so
+  // that the cache misses overlap.
+  constexpr size_t kBlockSize = 16;
+  uint32_t hashes[kBlockSize];
+  auto k = static_cast<const char*>(keys);
+  auto v = static_cast<char*>(values);
+  size_t count = 0;
+  for (size_t start = 0; start < n; start += kBlockSize) {
+    size_t end = std::min(n, start + kBlockSize);
+    for (size_t i = start; i < end; ++i) {
+      hashes[i - start] = hashKey(m, k + i * m->keySize, m->keySize);
+      if (m->capacity != 0) {
+        __builtin_prefetch(
+            &m->hashes[hashes[i - start] & (m->capacity - 1)]);
+      }
+    }
+    for (size_t i = start; i < end; ++i) {
+      auto slot = findSlot(m, hashes[i - start], k + i * m->keySize,
+                           m->keySize);
+      auto out = v + i * m->valueSize;
+      if (slot != kNotFound) {
+        memcpy(out, valueAt(m, slot), m->valueSize);
+        ++count;
+      } else {
+        memset(out, 0, m->valueSize);
+      }
+      if (found) {
+        found[i] = (slot != kNotFound);
+      }
+    }
+  }
+  return count;
+}
@@ -0,0 +1,161 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern "C" {
+
+// NOTE: this must match the ffi.cdef in fb/ffivector/init.lua
+
+typedef struct {
+  size_t elementSize;
+  size_t size;
+  size_t capacity;
+  void* data;
+  int flags;
+  int fd;
+  size_t mappedLength;
+  void* pins;  // see ffivector_pin
+} FFIVector;
+
+// FFIVector flags
+enum {
+  FFIVECTOR_MAPPED = 1,     // data is in a mmap()ed region
+  FFIVECTOR_FILE = 2,       // ... of fd, after a header
+  FFIVECTOR_READ_ONLY = 4,
+  FFIVECTOR_BORROWED = 8,   // data belongs to someone else (ffivector_adopt)
+};
+
+// ffivector_open modes
+enum {
+  FFIVECTOR_OPEN_READ_WRITE = 0,  // creating the file if needed
+  FFIVECTOR_OPEN_READ_ONLY = 1,
+  FFIVECTOR_OPEN_TRUNCATE = 2,
+};
+
+int ffivector_create(FFIVector* v, size_t elementSize, size_t initialCapacity);
+int ffivector_open(FFIVector* v, size_t elementSize, const char* path,
+                   int mode);
+void ffivector_destroy(FFIVector* v);
+int ffivector_reserve(FFIVector* v, size_t n);
+int ffivector_resize(FFIVector* v, size_t n);
+int ffivector_flush(FFIVector* v, int async);
+int ffivector_refresh(FFIVector* v);
+
+// Sharing memory with other owners (torch tensors).
+//
+// ffivector_pin() returns a pin on v's data, which keeps the data alive and
+// in place until ffivector_unpin(): while v is pinned, operations that would
+// move the data fail with -EBUSY, and, if v is destroyed, the last unpin
+// frees the data. Returns nullptr if out of memory.
+//
+// ffivector_adopt() makes an empty v use (size elements of) data that
+// belongs to someone else, without copying; the owner must keep it alive.
+// When v grows, it copies the elements to memory of its own.
+void* ffivector_pin(FFIVector* v);
+void ffivector_unpin(void* pins);
+int ffivector_adopt(FFIVector* v, void* data, size_t size);
+
+// Same layout as TH's THAllocator; its free() unpins (the context is the
+// result of ffivector_pin), and it doesn't allocate. A THStorage wrapping
+// a vector's data with this allocator keeps the vector pinned until freed.
+typedef struct {
+  void* (*malloc)(void* ctx, ptrdiff_t size);
+  void* (*realloc)(void* ctx, void* ptr, ptrdiff_t size);
+  void (*free)(void* ctx, void* ptr);
+} FFIVectorTHAllocator;
+
+const FFIVectorTHAllocator* ffivector_th_allocator(void);
+
+// Element types, for the kernels (FFIVectorKernels.cpp)
+enum {
+  FFIVECTOR_INT8 = 0,
+  FFIVECTOR_UINT8 = 1,
+  FFIVECTOR_INT16 = 2,
+  FFIVECTOR_UINT16 = 3,
+  FFIVECTOR_INT32 = 4,
+  FFIVECTOR_UINT32 = 5,
+  FFIVECTOR_INT64 = 6,
+  FFIVECTOR_UINT64 = 7,
+  FFIVECTOR_FLOAT = 8,
+  FFIVECTOR_DOUBLE = 9,
+};
+
+// ffivector_reduce ops
+enum {
+  FFIVECTOR_SUM = 0,
+  FFIVECTOR_MIN = 1,
+  FFIVECTOR_MAX = 2,
+};
+
+// Kernels on numeric vectors. They return 0 or a negative errno. Indices
+// (for argsort, gather and scatter) are offset by base (1 from Lua). The
+// value for lower_bound points to an int64_t, uint64_t or double, as given
+// by valueType (FFIVECTOR_INT64, FFIVECTOR_UINT64 or FFIVECTOR_DOUBLE);
+// integral elements are compared with it exactly.
+void ffivector_set_num_threads(int n);
+int ffivector_sort(FFIVector* v, int type);
+int ffivector_argsort(const FFIVector* v, int type, FFIVector* out,
+                      int64_t base);
+int ffivector_lower_bound(const FFIVector* v, int type, int valueType,
+                          const void* value, int upper, size_t* result);
+int ffivector_unique(FFIVector* v, int type);
+int ffivector_reduce(const FFIVector* v, int type, int op, double* result);
+int ffivector_prefix_sum(FFIVector* v, int type);
+int ffivector_gather(const FFIVector* src, const FFIVector* indices,
+                     int indexType, int64_t base, FFIVector* out);
+int ffivector_scatter(FFIVector* dst, const FFIVector* indices,
+                      int indexType, int64_t base, const FFIVector* src);
+
+typedef struct {
+  FFIVector offsets;
+  FFIVector bytes;
+} FFIStringVector;
+
+int ffistringvector_create(FFIStringVector* v, size_t initialCapacity,
+                           size_t initialBytes);
+void ffistringvector_destroy(FFIStringVector* v);
+int ffistringvector_reserve(FFIStringVector* v, size_t n, size_t bytes);
+int ffistringvector_append(FFIStringVector* v, const char* s, size_t len);
+int ffistringvector_load(FFIStringVector* v, const char* path);
+
+typedef struct {
+  size_t keySize;
+  size_t valueSize;
+  size_t size;
+  size_t capacity;
+  uint32_t* hashes;
+  void* keys;
+  void* values;
+  int stringKeys;
+  char* arena;
+  size_t arenaSize;
+  size_t arenaCapacity;
+  size_t arenaGarbage;
+} FFIMap;
+
+int ffimap_create(FFIMap* m, size_t keySize, size_t valueSize,
+                  size_t initialCapacity);
+void ffimap_destroy(FFIMap* m);
+int ffimap_reserve(FFIMap* m, size_t n);
+void* ffimap_find(const FFIMap* m, const void* key, size_t keyLen);
+void* ffimap_insert(FFIMap* m, const void* key, size_t keyLen, int* inserted);
+int ffimap_erase(FFIMap* m, const void* key, size_t keyLen);
+size_t ffimap_next(const FFIMap* m, size_t slot);
+const char* ffimap_key(const FFIMap* m, size_t slot, size_t* keyLen);
+int ffimap_insert_batch(FFIMap* m, const void* keys, const void* values,
+                        size_t n);
+size_t ffimap_find_batch(const FFIMap* m, const void* keys, void* values,
+                         size_t n, uint8_t* found);
+
+}
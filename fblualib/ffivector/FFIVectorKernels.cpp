@@ -0,0 +1,685 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "FFIVector.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Kernels on numeric vectors, dispatched on the element type from Lua.
+// The inner loops are written over independent lanes (or plain element-wise
+// loops), which the compiler vectorizes; this file is built with -O3. Large
+// reductions, prefix sums, gathers and scatters are split among threads
+// (see ffivector_set_num_threads).
+
+namespace {
+
+std::atomic<int> gNumThreads(1);
+constexpr size_t kParallelThreshold = 1 << 20;
+constexpr size_t kLanes = 8;
+
+// Number of chunks (threads) to split n elements in
+size_t numChunks(size_t n) {
+  if (n < kParallelThreshold) {
+    return 1;
+  }
+  return std::min<size_t>(gNumThreads.load(), n / (kParallelThreshold / 2));
+}
+
+// Worker threads for parallelFor, shared by all calls. They're started as
+// needed (as many as the most chunks asked for, minus one) and never
+// stopped; the state is leaked, as they may outlive static destruction.
+struct Workers {
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<std::function<void()>> queue;
+  size_t numThreads = 0;
+};
+
+Workers& workers() {
+  static auto w = new Workers;
+  return *w;
+}
+
+void workerLoop(Workers& w) {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(w.mutex);
+      w.ready.wait(lock, [&] { return !w.queue.empty(); });
+      task = std::move(w.queue.front());
+      w.queue.pop_front();
+    }
+    task();
+  }
+}
+
+// Run task on a worker, first starting workers until there are numThreads
+void runOnWorker(std::function<void()> task, size_t numThreads) {
+  auto& w = workers();
+  std::lock_guard<std::mutex> lock(w.mutex);
+  for (; w.numThreads < numThreads; ++w.numThreads) {
+    std::thread(workerLoop, std::ref(w)).detach();
+  }
+  w.queue.push_back(std::move(task));
+  w.ready.notify_one();
+}
+
+// Call fn(chunk, begin, end) for each of numChunks chunks of [0, n), in
+// parallel: chunk 0 on the calling thread, the others on workers.
+template <class F>
+void parallelFor(size_t n, size_t chunks, F fn) {
+  if (chunks <= 1) {
+    fn(0, 0, n);
+    return;
+  }
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t pending = chunks - 1;
+  for (size_t c = 1; c < chunks; ++c) {
+    runOnWorker([&, c] {
+      fn(c, n * c / chunks, n * (c + 1) / chunks);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--pending == 0) {
+        done.notify_one();
+      }
+    }, chunks - 1);
+  }
+  fn(0, 0, n / chunks);
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&] { return pending == 0; });
+}
+
+#define FFIVECTOR_DISPATCH(type, fn, ...) \
+  switch (type) { \
+  case FFIVECTOR_INT8: return fn<int8_t>(__VA_ARGS__); \
+  case FFIVECTOR_UINT8: return fn<uint8_t>(__VA_ARGS__); \
+  case FFIVECTOR_INT16: return fn<int16_t>(__VA_ARGS__); \
+  case FFIVECTOR_UINT16: return fn<uint16_t>(__VA_ARGS__); \
+  case FFIVECTOR_INT32: return fn<int32_t>(__VA_ARGS__); \
+  case FFIVECTOR_UINT32: return fn<uint32_t>(__VA_ARGS__); \
+  case FFIVECTOR_INT64: return fn<int64_t>(__VA_ARGS__); \
+  case FFIVECTOR_UINT64: return fn<uint64_t>(__VA_ARGS__); \
+  case FFIVECTOR_FLOAT: return fn<float>(__VA_ARGS__); \
+  case FFIVECTOR_DOUBLE: return fn<double>(__VA_ARGS__); \
+  default: return -EINVAL; \
+  }
+
+template <class T>
+T* elements(const FFIVector* v) {
+  return static_cast<T*>(v->data);
+}
+
+template <class T>
+bool checkType(const FFIVector* v) {
+  return v->elementSize == sizeof(T);
+}
+
+bool writable(const FFIVector* v) {
+  return !(v->flags & FFIVECTOR_READ_ONLY);
+}
+
+// Sums of integers are exact modulo 2^64 (they're computed unsigned, so that
+// overflow wraps); floats are summed in double.
+template <class T>
+struct Accumulator {
+  typedef typename std::conditional<std::is_floating_point<T>::value,
+                                    double,
+                                    uint64_t>::type type;
+
+  static double toDouble(type sum) {
+    return std::is_integral<T>::value && std::is_signed<T>::value ?
+      double(int64_t(sum)) : double(sum);
+  }
+};
+
+// Floats sort with NaNs last.
+template <class T>
+bool lessWithNaN(T a, T b) {
+  return std::isnan(b) ? !std::isnan(a) : a < b;
+}
+
+// LSD radix sort of n integer keys (and, if idx isn't null, their indices
+// along), 8 bits at a time, through the scratch buffers. Signed keys have
+// their sign bit flipped, so that they sort as unsigned. Passes in which
+// all keys have the same digit are skipped.
+template <class T>
+void radixSort(T* keys, T* keysTmp, int64_t* idx, int64_t* idxTmp,
+               size_t n) {
+  typedef typename std::make_unsigned<T>::type U;
+  const U flip = std::is_signed<T>::value ? U(U(1) << (sizeof(T) * 8 - 1)) : 0;
+  if (n == 0) {
+    return;
+  }
+  T* src = keys;
+  T* dst = keysTmp;
+  int64_t* isrc = idx;
+  int64_t* idst = idxTmp;
+  for (size_t shift = 0; shift < sizeof(T) * 8; shift += 8) {
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < n; ++i) {
+      ++counts[((U(src[i]) ^ flip) >> shift) & 0xff];
+    }
+    if (counts[((U(src[0]) ^ flip) >> shift) & 0xff] == n) {
+      continue;
+    }
+    size_t total = 0;
+    for (auto& c : counts) {
+      auto tmp = c;
+      c = total;
+      total += tmp;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      auto pos = counts[((U(src[i]) ^ flip) >> shift) & 0xff]++;
+      dst[pos] = src[i];
+      if (isrc) {
+        idst[pos] = isrc[i];
+      }
+    }
+    std::swap(src, dst);
+    std::swap(isrc, idst);
+  }
+  if (src != keys) {
+    memcpy(keys, src, n * sizeof(T));
+    if (idx) {
+      memcpy(idx, isrc, n * sizeof(int64_t));
+    }
+  }
+}
+
+template <class T>
+typename std::enable_if<std::is_integral<T>::value>::type
+sortImpl(T* p, size_t n) {
+  if (n < 256) {
+    std::sort(p, p + n);
+    return;
+  }
+  std::vector<T> tmp(n);
+  radixSort<T>(p, tmp.data(), nullptr, nullptr, n);
+}
+
+template <class T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+sortImpl(T* p, size_t n) {
+  std::sort(p, p + n, lessWithNaN<T>);
+}
+
+template <class T>
+int sort(FFIVector* v) {
+  if (!checkType<T>(v)) {
+    return -EINVAL;
+  }
+  if (!writable(v)) {
+    return -EROFS;
+  }
+  sortImpl(elements<T>(v), v->size);
+  return 0;
+}
+
+// Stable: equal elements keep their order.
+template <class T>
+typename std::enable_if<std::is_integral<T>::value>::type
+argsortImpl(const T* p, int64_t* idx, size_t n) {
+  std::vector<T> keys(p, p + n);
+  std::vector<T> keysTmp(n);
+  std::vector<int64_t> idxTmp(n);
+  radixSort<T>(keys.data(), keysTmp.data(), idx, idxTmp.data(), n);
+}
+
+template <class T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+argsortImpl(const T* p, int64_t* idx, size_t n) {
+  std::stable_sort(idx, idx + n, [p] (int64_t a, int64_t b) {
+    return lessWithNaN(p[a], p[b]);
+  });
+}
+
+template <class T>
+int argsort(const FFIVector* v, FFIVector* out, int64_t base) {
+  if (!checkType<T>(v) || out->elementSize != sizeof(int64_t)) {
+    return -EINVAL;
+  }
+  size_t n = v->size;
+  int r = ffivector_resize(out, n);
+  if (r != 0) {
+    return r;
+  }
+  auto idx = elements<int64_t>(out);
+  for (size_t i = 0; i < n; ++i) {
+    idx[i] = i;
+  }
+  argsortImpl(elements<T>(v), idx, n);
+  if (base != 0) {
+    for (size_t i = 0; i < n; ++i) {
+      idx[i] += base;
+    }
+  }
+  return 0;
+}
+
+// Branchless binary search for value (of type U) among the n elements at p
+template <class T, class U>
+size_t search(const T* p, size_t n, U value, int upper) {
+  size_t lo = 0;
+  while (n > 0) {
+    size_t half = n / 2;
+    U x = p[lo + half];
+    bool right = upper ? !(value < x) : x < value;
+    lo = right ? lo + half + 1 : lo;
+    n = right ? n - half - 1 : half;
+  }
+  return lo;
+}
+
+// Convert the search value to the integral type T, so that we compare
+// elements exactly (rather than as doubles, which would lose precision past
+// 2^53). Returns -1 if the value is below every T (and so the search finds
+// 0), 1 if it's above every T (the search finds the end), and 0 otherwise.
+template <class T>
+int toElement(double value, int upper, T* out) {
+  if (std::isnan(value)) {
+    return upper ? 1 : -1;  // as if compared as doubles
+  }
+  // the first element >= value is the first element >= ceil(value), and
+  // the first element > value is the first element > floor(value)
+  value = upper ? std::floor(value) : std::ceil(value);
+  double limit = std::ldexp(1.0, std::numeric_limits<T>::digits);
+  if (value >= limit) {
+    return 1;
+  }
+  if (value < (std::is_signed<T>::value ? -limit : 0.0)) {
+    return -1;
+  }
+  *out = static_cast<T>(value);
+  return 0;
+}
+
+template <class T, class P>
+int toElementInt(P value, T* out) {
+  if (std::is_signed<P>::value && value < 0) {
+    if (!std::is_signed<T>::value ||
+        int64_t(value) < int64_t(std::numeric_limits<T>::min())) {
+      return -1;
+    }
+  } else if (uint64_t(value) > uint64_t(std::numeric_limits<T>::max())) {
+    return 1;
+  }
+  *out = static_cast<T>(value);
+  return 0;
+}
+
+template <class T>
+int toElement(int64_t value, int /*upper*/, T* out) {
+  return toElementInt(value, out);
+}
+
+template <class T>
+int toElement(uint64_t value, int /*upper*/, T* out) {
+  return toElementInt(value, out);
+}
+
+template <class T, class V>
+typename std::enable_if<std::is_integral<T>::value, size_t>::type
+searchValue(const T* p, size_t n, V value, int upper) {
+  T x;
+  int r = toElement(value, upper, &x);
+  return r < 0 ? 0 : r > 0 ? n : search(p, n, x, upper);
+}
+
+// Floating-point elements are compared as doubles
+template <class T, class V>
+typename std::enable_if<!std::is_integral<T>::value, size_t>::type
+searchValue(const T* p, size_t n, V value, int upper) {
+  return search(p, n, static_cast<double>(value), upper);
+}
+
+template <class T>
+int lowerBound(const FFIVector* v, int valueType, const void* value,
+               int upper, size_t* result) {
+  if (!checkType<T>(v)) {
+    return -EINVAL;
+  }
+  auto p = elements<T>(v);
+  switch (valueType) {
+  case FFIVECTOR_INT64:
+    *result = searchValue(p, v->size, *static_cast<const int64_t*>(value),
+                          upper);
+    return 0;
+  case FFIVECTOR_UINT64:
+    *result = searchValue(p, v->size, *static_cast<const uint64_t*>(value),
+                          upper);
+    return 0;
+  case FFIVECTOR_DOUBLE:
+    *result = searchValue(p, v->size, *static_cast<const double*>(value),
+                          upper);
+    return 0;
+  default:
+    return -EINVAL;
+  }
+}
+
+template <class T>
+int unique(FFIVector* v) {
+  if (!checkType<T>(v)) {
+    return -EINVAL;
+  }
+  if (!writable(v)) {
+    return -EROFS;
+  }
+  auto p = elements<T>(v);
+  return ffivector_resize(v, std::unique(p, p + v->size) - p);
+}
+
+template <class T>
+typename Accumulator<T>::type sumRange(const T* p, size_t n) {
+  typedef typename Accumulator<T>::type A;
+  A lanes[kLanes] = {0};
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (size_t j = 0; j < kLanes; ++j) {
+      lanes[j] += p[i + j];
+    }
+  }
+  A sum = 0;
+  for (size_t j = 0; j < kLanes; ++j) {
+    sum += lanes[j];
+  }
+  for (; i < n; ++i) {
+    sum += p[i];
+  }
+  return sum;
+}
+
+// NaNs never compare less (or greater), so they're ignored; the result is
+// then the initial value (see extremum()).
+template <class T, bool kMax>
+T extremumRange(const T* p, size_t n) {
+  const T init = kMax ? std::numeric_limits<T>::lowest() :
+    std::numeric_limits<T>::max();
+  T lanes[kLanes];
+  std::fill(lanes, lanes + kLanes, init);
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (size_t j = 0; j < kLanes; ++j) {
+      T x = p[i + j];
+      lanes[j] = (kMax ? lanes[j] < x : x < lanes[j]) ? x : lanes[j];
+    }
+  }
+  T result = init;
+  for (size_t j = 0; j < kLanes; ++j) {
+    result = (kMax ? result < lanes[j] : lanes[j] < result) ? lanes[j] : result;
+  }
+  for (; i < n; ++i) {
+    result = (kMax ? result < p[i] : p[i] < result) ? p[i] : result;
+  }
+  return result;
+}
+
+// Extremum of the per-chunk extrema of the n elements at p: NaN if all
+// elements are NaN, as all chunks then return the initial value.
+template <class T, bool kMax>
+double extremum(const T* p, size_t n, const std::vector<T>& extrema) {
+  const T init = kMax ? std::numeric_limits<T>::lowest() :
+    std::numeric_limits<T>::max();
+  T result = kMax ? *std::max_element(extrema.begin(), extrema.end()) :
+    *std::min_element(extrema.begin(), extrema.end());
+  if (std::is_floating_point<T>::value && result == init &&
+      std::all_of(p, p + n, [] (T x) { return std::isnan(x); })) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  return result;
+}
+
+template <class T>
+int reduce(const FFIVector* v, int op, double* result) {
+  typedef typename Accumulator<T>::type A;
+  if (!checkType<T>(v)) {
+    return -EINVAL;
+  }
+  auto p = elements<T>(v);
+  size_t n = v->size;
+  if (n == 0 && op != FFIVECTOR_SUM) {
+    return -EDOM;
+  }
+  size_t chunks = numChunks(n);
+  std::vector<A> sums(chunks);
+  std::vector<T> extrema(chunks);
+  switch (op) {
+  case FFIVECTOR_SUM:
+    parallelFor(n, chunks, [&] (size_t c, size_t begin, size_t end) {
+      sums[c] = sumRange(p + begin, end - begin);
+    });
+    *result = Accumulator<T>::toDouble(
+        std::accumulate(sums.begin(), sums.end(), A(0)));
+    return 0;
+  case FFIVECTOR_MIN:
+    parallelFor(n, chunks, [&] (size_t c, size_t begin, size_t end) {
+      extrema[c] = extremumRange<T, false>(p + begin, end - begin);
+    });
+    *result = extremum<T, false>(p, n, extrema);
+    return 0;
+  case FFIVECTOR_MAX:
+    parallelFor(n, chunks, [&] (size_t c, size_t begin, size_t end) {
+      extrema[c] = extremumRange<T, true>(p + begin, end - begin);
+    });
+    *result = extremum<T, true>(p, n, extrema);
+    return 0;
+  default:
+    return -EINVAL;
+  }
+}
+
+// In place, inclusive. In parallel, each chunk first sums its elements,
+// then scans them starting from the sum of the chunks before it.
+template <class T>
+int prefixSum(FFIVector* v) {
+  typedef typename Accumulator<T>::type A;
+  if (!checkType<T>(v)) {
+    return -EINVAL;
+  }
+  if (!writable(v)) {
+    return -EROFS;
+  }
+  auto p = elements<T>(v);
+  size_t n = v->size;
+  size_t chunks = numChunks(n);
+  std::vector<A> offsets(chunks, A(0));
+  if (chunks > 1) {
+    parallelFor(n, chunks, [&] (size_t c, size_t begin, size_t end) {
+      offsets[c] = sumRange(p + begin, end - begin);
+    });
+    A total = 0;
+    for (auto& o : offsets) {
+      auto sum = o;
+      o = total;
+      total += sum;
+    }
+  }
+  parallelFor(n, chunks, [&] (size_t c, size_t begin, size_t end) {
+    A acc = offsets[c];
+    for (size_t i = begin; i < end; ++i) {
+      acc += p[i];
+      p[i] = T(acc);
+    }
+  });
+  return 0;
+}
+
+// Gather and scatter copy elements of any size; E is an integer type of
+// the element size, or char for other sizes (copied with memcpy).
+template <class E>
+void copyElement(char* dst, const char* src, size_t elementSize) {
+  if (std::is_same<E, char>::value) {
+    memcpy(dst, src, elementSize);
+  } else {
+    *reinterpret_cast<E*>(dst) = *reinterpret_cast<const E*>(src);
+  }
+}
+
+// Check that all indices are in range first, so that errors don't leave
+// the destination half-written.
+template <class I>
+bool indicesInRange(const I* idx, size_t n, int64_t base, size_t size) {
+  bool ok = true;
+  for (size_t i = 0; i < n; ++i) {
+    int64_t j = int64_t(idx[i]) - base;
+    ok &= (j >= 0 && uint64_t(j) < size && idx[i] == I(j + base));
+  }
+  return ok;
+}
+
+template <class I, class E>
+void gatherRange(char* out, const char* src, const I* idx, int64_t base,
+                 size_t elementSize, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    copyElement<E>(out + i * elementSize,
+                   src + (int64_t(idx[i]) - base) * elementSize,
+                   elementSize);
+  }
+}
+
+template <class I, class E>
+void scatterRange(char* dst, const char* src, const I* idx, int64_t base,
+                  size_t elementSize, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    copyElement<E>(dst + (int64_t(idx[i]) - base) * elementSize,
+                   src + i * elementSize,
+                   elementSize);
+  }
+}
+
+template <class I, class E>
+void gatherAll(const FFIVector* src, const I* idx, int64_t base,
+               FFIVector* out) {
+  auto o = static_cast<char*>(out->data);
+  auto s = static_cast<const char*>(src->data);
+  auto es = src->elementSize;
+  size_t n = out->size;
+  parallelFor(n, numChunks(n), [&] (size_t, size_t begin, size_t end) {
+    gatherRange<I, E>(o, s, idx, base, es, begin, end);
+  });
+}
+
+template <class I, class E>
+void scatterAll(FFIVector* dst, const I* idx, int64_t base,
+                const FFIVector* src) {
+  auto d = static_cast<char*>(dst->data);
+  auto s = static_cast<const char*>(src->data);
+  auto es = src->elementSize;
+  size_t n = src->size;
+  parallelFor(n, numChunks(n), [&] (size_t, size_t begin, size_t end) {
+    scatterRange<I, E>(d, s, idx, base, es, begin, end);
+  });
+}
+
+template <class I>
+int gather(const FFIVector* src, const FFIVector* indices, int64_t base,
+           FFIVector* out) {
+  if (!checkType<I>(indices) || out->elementSize != src->elementSize) {
+    return -EINVAL;
+  }
+  auto idx = elements<I>(indices);
+  size_t n = indices->size;
+  if (!indicesInRange(idx, n, base, src->size)) {
+    return -ERANGE;
+  }
+  int r = ffivector_resize(out, n);
+  if (r != 0) {
+    return r;
+  }
+  switch (src->elementSize) {
+  case 1: gatherAll<I, uint8_t>(src, idx, base, out); break;
+  case 2: gatherAll<I, uint16_t>(src, idx, base, out); break;
+  case 4: gatherAll<I, uint32_t>(src, idx, base, out); break;
+  case 8: gatherAll<I, uint64_t>(src, idx, base, out); break;
+  default: gatherAll<I, char>(src, idx, base, out); break;
+  }
+  return 0;
+}
+
+// With repeated indices, which of the elements ends up in the slot is
+// unspecified.
+template <class I>
+int scatter(FFIVector* dst, const FFIVector* indices, int64_t base,
+            const FFIVector* src) {
+  if (!checkType<I>(indices) || dst->elementSize != src->elementSize ||
+      indices->size != src->size) {
+    return -EINVAL;
+  }
+  if (!writable(dst)) {
+    return -EROFS;
+  }
+  auto idx = elements<I>(indices);
+  if (!indicesInRange(idx, indices->size, base, dst->size)) {
+    return -ERANGE;
+  }
+  switch (src->elementSize) {
+  case 1: scatterAll<I, uint8_t>(dst, idx, base, src); break;
+  case 2: scatterAll<I, uint16_t>(dst, idx, base, src); break;
+  case 4: scatterAll<I, uint32_t>(dst, idx, base, src); break;
+  case 8: scatterAll<I, uint64_t>(dst, idx, base, src); break;
+  default: scatterAll<I, char>(dst, idx, base, src); break;
+  }
+  return 0;
+}
+
+}  // namespace
+
+void ffivector_set_num_threads(int n) {
+  gNumThreads = std::max(n, 1);
+}
+
+int ffivector_sort(FFIVector* v, int type) {
+  FFIVECTOR_DISPATCH(type, sort, v)
+}
+
+int ffivector_argsort(const FFIVector* v, int type, FFIVector* out,
+                      int64_t base) {
+  FFIVECTOR_DISPATCH(type, argsort, v, out, base)
+}
+
+int ffivector_lower_bound(const FFIVector* v, int type, int valueType,
+                          const void* value, int upper, size_t* result) {
+  FFIVECTOR_DISPATCH(type, lowerBound, v, valueType, value, upper, result)
+}
+
+int ffivector_unique(FFIVector* v, int type) {
+  FFIVECTOR_DISPATCH(type, unique, v)
+}
+
+int ffivector_reduce(const FFIVector* v, int type, int op, double* result) {
+  FFIVECTOR_DISPATCH(type, reduce, v, op, result)
+}
+
+int ffivector_prefix_sum(FFIVector* v, int type) {
+  FFIVECTOR_DISPATCH(type, prefixSum, v)
+}
+
+int ffivector_gather(const FFIVector* src, const FFIVector* indices,
+                     int indexType, int64_t base, FFIVector* out) {
+  FFIVECTOR_DISPATCH(indexType, gather, src, indices, base, out)
+}
+
+int ffivector_scatter(FFIVector* dst, const FFIVector* indices,
+                      int indexType, int64_t base, const FFIVector* src) {
+  FFIVECTOR_DISPATCH(indexType, scatter, dst, indices, base, src)
+}
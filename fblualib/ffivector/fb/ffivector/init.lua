@@ -56,9 +56,22 @@
 -- new_float, etc. The vectors such created have "tonumber" as the index
 -- function, and so precision is limited by Lua numbers.
 --
+-- Vectors of numeric types also have methods implemented in C (with
+-- vectorized loops, and, on large vectors, multiple threads; see
+-- ffivector.set_num_threads): sort(), argsort(), lower_bound(x),
+-- upper_bound(x), unique(), sum(), min(), max(), mean(), prefix_sum(),
+-- gather(indices) and scatter(indices, src).
+--
+-- vec:as_tensor() returns a torch tensor sharing the memory of a numeric
+-- vector (which can't grow meanwhile), and ffivector.from_tensor(t)
+-- returns a vector sharing the memory of a contiguous tensor; neither
+-- copies.
+--
 -- We also provide new_string, which creates a vector of strings. The strings
 -- are stored outside the Lua heap, and a new Lua string is created on demand
--- whenever you access an element.
+-- whenever you access an element. new_string_arena(initial_capacity,
+-- initial_bytes) creates an append-only vector of strings instead, packed
+-- in one buffer (see below).
 --
 -- local ffivector = require('fb.ffivector')
 --
@@ -68,7 +81,39 @@
 -- -- assigning to one past the end is supported as a special case and will
 -- -- grow the vector, as this is a common pattern for Lua tables
 -- -- (vec[43] = 'foo')
+--
+-- ffivector.new_mapped(ctype, path, mode, index)
+--
+-- creates a vector backed by the file at path, mapped in memory, so that
+-- it persists, and reopening it doesn't read (or copy) anything. mode is
+-- 'rw' (default; read-write, creating the file if needed), 'w' (read-write,
+-- emptying the file) or 'r' (read-only; processes sharing a file this way
+-- share its pages). The vector grows the file, and its mapping, without
+-- copying. vec:flush([async]) writes changes back to the file (msync), and
+-- vec:refresh() picks up growth by the (one) writer. Elements must not
+-- contain pointers.
+--
+-- ffivector.new_map(key_ctype, value_ctype, initial_capacity, index,
+--                   newindex, destructor)
+--
+-- creates a hash map from keys to values, also stored outside of the Lua
+-- heap. value_ctype and the hooks work as for ffivector.new. Keys are
+-- cdata of key_ctype (compared bytewise, so struct keys must have zeroed
+-- padding), or Lua strings if key_ctype is 'string'; string keys are
+-- packed into one buffer. initial_capacity is the number of entries to
+-- make room for. map:get(k) returns nil for missing keys, map:set(k, v)
+-- inserts or overwrites, and map:erase(k) erases; with cdata keys,
+-- map[k] and map[k] = v (nil to erase) work too. (With string keys,
+-- they're an error: strings index methods.) #map is the number of
+-- entries, and pairs(map) iterates over them in no particular order
+-- (don't add or erase entries meanwhile).
+--
+-- local map = ffivector.new_map('int64_t', 'double', 0, tonumber)
+-- map[42] = 0.5
+-- local ids = ffivector.new_map('string', 'int32_t', 0, tonumber)
+-- ids:set('hello', 1)
 
+local bit = require('bit')
 local ffi = require('ffi')
 local lib_path = package.searchpath('libfbffivector', package.cpath)
 if not lib_path then
@@ -78,24 +123,123 @@ local lib = ffi.load(lib_path)
 
 local M = {}
 
--- NOTE: this must match ffivector.h
+-- NOTE: this must match FFIVector.h
 ffi.cdef([[
 typedef struct {
   size_t elementSize;
   size_t size;
   size_t capacity;
   void* data;
+  int flags;
+  int fd;
+  size_t mappedLength;
+  void* pins;
 } FFIVector;
 
 int ffivector_create(FFIVector* v, size_t elementSize, size_t initialCapacity);
+int ffivector_open(FFIVector* v, size_t elementSize, const char* path,
+                   int mode);
 void ffivector_destroy(FFIVector* v);
 int ffivector_reserve(FFIVector* v, size_t n);
 int ffivector_resize(FFIVector* v, size_t n);
+int ffivector_flush(FFIVector* v, int async);
+int ffivector_refresh(FFIVector* v);
+
+void* ffivector_pin(FFIVector* v);
+void ffivector_unpin(void* pins);
+int ffivector_adopt(FFIVector* v, void* data, size_t size);
+
+typedef struct {
+  void* (*malloc)(void* ctx, ptrdiff_t size);
+  void* (*realloc)(void* ctx, void* ptr, ptrdiff_t size);
+  void (*free)(void* ctx, void* ptr);
+} FFIVectorTHAllocator;
+
+const FFIVectorTHAllocator* ffivector_th_allocator(void);
+
+void ffivector_set_num_threads(int n);
+int ffivector_sort(FFIVector* v, int type);
+int ffivector_argsort(const FFIVector* v, int type, FFIVector* out,
+                      int64_t base);
+int ffivector_lower_bound(const FFIVector* v, int type, int valueType,
+                          const void* value, int upper, size_t* result);
+int ffivector_unique(FFIVector* v, int type);
+int ffivector_reduce(const FFIVector* v, int type, int op, double* result);
+int ffivector_prefix_sum(FFIVector* v, int type);
+int ffivector_gather(const FFIVector* src, const FFIVector* indices,
+                     int indexType, int64_t base, FFIVector* out);
+int ffivector_scatter(FFIVector* dst, const FFIVector* indices,
+                      int indexType, int64_t base, const FFIVector* src);
+
+typedef struct {
+  FFIVector offsets;
+  FFIVector bytes;
+} FFIStringVector;
+
+int ffistringvector_create(FFIStringVector* v, size_t initialCapacity,
+                           size_t initialBytes);
+void ffistringvector_destroy(FFIStringVector* v);
+int ffistringvector_reserve(FFIStringVector* v, size_t n, size_t bytes);
+int ffistringvector_append(FFIStringVector* v, const char* s, size_t len);
+int ffistringvector_load(FFIStringVector* v, const char* path);
+
+typedef struct {
+  size_t keySize;
+  size_t valueSize;
+  size_t size;
+  size_t capacity;
+  uint32_t* hashes;
+  void* keys;
+  void* values;
+  int stringKeys;
+  char* arena;
+  size_t arenaSize;
+  size_t arenaCapacity;
+  size_t arenaGarbage;
+} FFIMap;
+
+int ffimap_create(FFIMap* m, size_t keySize, size_t valueSize,
+                  size_t initialCapacity);
+void ffimap_destroy(FFIMap* m);
+int ffimap_reserve(FFIMap* m, size_t n);
+void* ffimap_find(const FFIMap* m, const void* key, size_t keyLen);
+void* ffimap_insert(FFIMap* m, const void* key, size_t keyLen, int* inserted);
+int ffimap_erase(FFIMap* m, const void* key, size_t keyLen);
+size_t ffimap_next(const FFIMap* m, size_t slot);
+const char* ffimap_key(const FFIMap* m, size_t slot, size_t* keyLen);
+int ffimap_insert_batch(FFIMap* m, const void* keys, const void* values,
+                        size_t n);
+size_t ffimap_find_batch(const FFIMap* m, const void* keys, void* values,
+                         size_t n, uint8_t* found);
 
 void* malloc(size_t size);
 void free(void* ptr);
+char* strerror(int errnum);
 ]])
 
+-- NOTE: these must match the enums in FFIVector.h
+local READ_ONLY = 4  -- FFIVECTOR_READ_ONLY
+local BORROWED = 8  -- FFIVECTOR_BORROWED
+local open_modes = {
+    rw = 0,  -- FFIVECTOR_OPEN_READ_WRITE
+    r = 1,   -- FFIVECTOR_OPEN_READ_ONLY
+    w = 2,   -- FFIVECTOR_OPEN_TRUNCATE
+}
+local INT64 = 6  -- FFIVECTOR_INT64
+local UINT64 = 7  -- FFIVECTOR_UINT64
+local FLOAT = 8  -- FFIVECTOR_FLOAT; integer types come before it
+local DOUBLE = 9  -- FFIVECTOR_DOUBLE
+local SUM = 0  -- FFIVECTOR_SUM
+local MIN = 1  -- FFIVECTOR_MIN
+local MAX = 2  -- FFIVECTOR_MAX
+
+-- raise an error for a (negative errno) failure of a C function
+local function check(r, what)
+    if r < 0 then
+        error(what .. ': ' .. ffi.string(ffi.C.strerror(-r)))
+    end
+end
+
 -- iterator returned by pairs() and ipairs()
 local function iter(vec, idx)
     if idx and idx < #vec then
@@ -112,7 +256,200 @@ end
 local cachedTypes = {}
 setmetatable(cachedTypes, {__mode = 'v'})  -- weak values
 
-local function new(ctype, initial_capacity, index, newindex, destructor)
+-- FFIVECTOR_* element type of the numeric ctypes, by tostring(ctype);
+-- filled in below, along with the new_X functions
+local numeric_kinds = {}
+
+-- ... and of the vectors of numeric ctypes, by tostring(ffi.typeof(vec)),
+-- for fb.thrift
+local vector_kinds = {}
+
+local reduce_result = ffi.new('double[1]')
+local bound_result = ffi.new('size_t[1]')
+local int64_type = ffi.typeof('int64_t')
+local uint64_type = ffi.typeof('uint64_t')
+local bound_int64 = ffi.new('int64_t[1]')
+local bound_uint64 = ffi.new('uint64_t[1]')
+local bound_double = ffi.new('double[1]')
+
+-- Kernels (FFIVectorKernels.cpp) for vectors of numeric type kind
+local function add_kernels(methods, factory, kind)
+    methods._kind = kind
+
+    -- sort in place (NaNs last)
+    function methods:sort()
+        check(lib.ffivector_sort(self._v, kind), 'Failed to sort')
+    end
+
+    -- the (1-based) indices that would sort the vector, as a vector of
+    -- int64_t; equal elements keep their order
+    function methods:argsort()
+        local out = M.new_int64_t()
+        check(lib.ffivector_argsort(self._v, kind, out._v, 1),
+              'Failed to sort')
+        return out
+    end
+
+    -- in a sorted vector, the first index at which x could be inserted
+    -- keeping it sorted (lower_bound), or the last one (upper_bound). x is
+    -- a number, or an int64_t or uint64_t cdata (for values past 2^53,
+    -- which integral vectors compare exactly)
+    local function bound(self, x, upper)
+        local value_type, value
+        if ffi.istype(int64_type, x) then
+            bound_int64[0] = x
+            value_type, value = INT64, bound_int64
+        elseif ffi.istype(uint64_type, x) then
+            bound_uint64[0] = x
+            value_type, value = UINT64, bound_uint64
+        else
+            bound_double[0] = x
+            value_type, value = DOUBLE, bound_double
+        end
+        check(lib.ffivector_lower_bound(self._v, kind, value_type, value,
+                                        upper, bound_result),
+              'Failed to search')
+        return tonumber(bound_result[0]) + 1
+    end
+
+    function methods:lower_bound(x)
+        return bound(self, x, 0)
+    end
+
+    function methods:upper_bound(x)
+        return bound(self, x, 1)
+    end
+
+    -- remove consecutive duplicates (all duplicates, if sorted)
+    function methods:unique()
+        check(lib.ffivector_unique(self._v, kind), 'Failed to unique')
+    end
+
+    -- min() and max() ignore NaNs, and return nil for empty vectors (and
+    -- vectors of NaNs, for which the kernel returns NaN)
+    local function reduce(self, op)
+        if op ~= SUM and self._v.size == 0 then
+            return nil
+        end
+        check(lib.ffivector_reduce(self._v, kind, op, reduce_result),
+              'Failed to reduce')
+        local result = reduce_result[0]
+        if op ~= SUM and result ~= result then
+            return nil
+        end
+        return result
+    end
+
+    function methods:sum()
+        return reduce(self, SUM)
+    end
+
+    function methods:min()
+        return reduce(self, MIN)
+    end
+
+    function methods:max()
+        return reduce(self, MAX)
+    end
+
+    function methods:mean()
+        local n = tonumber(self._v.size)
+        if n == 0 then
+            return nil
+        end
+        return reduce(self, SUM) / n
+    end
+
+    -- replace each element with the sum of the elements up to it
+    function methods:prefix_sum()
+        check(lib.ffivector_prefix_sum(self._v, kind), 'Failed to sum')
+    end
+
+    local function index_kind(indices)
+        local k = indices._kind
+        if not k or k >= FLOAT then
+            error('Indices must be a vector of integers')
+        end
+        return k
+    end
+
+    -- a new vector out, with out[i] = self[indices[i]]
+    function methods:gather(indices)
+        local out = factory(#indices)
+        check(lib.ffivector_gather(self._v, indices._v, index_kind(indices),
+                                   1, out._v),
+              'Failed to gather')
+        return out
+    end
+
+    -- self[indices[i]] = src[i]
+    function methods:scatter(indices, src)
+        check(lib.ffivector_scatter(self._v, indices._v, index_kind(indices),
+                                    1, src._v),
+              'Failed to scatter')
+    end
+end
+
+-- Torch type names (as in torch.FloatTensor) of the kinds that have one
+local tensor_types = {
+    [0] = 'Char',  -- FFIVECTOR_INT8
+    [1] = 'Byte',  -- FFIVECTOR_UINT8
+    [2] = 'Short',  -- FFIVECTOR_INT16
+    [4] = 'Int',  -- FFIVECTOR_INT32
+    [6] = 'Long',  -- FFIVECTOR_INT64
+    [FLOAT] = 'Float',
+    [DOUBLE] = 'Double',
+}
+
+-- THStorage flags
+local TH_STORAGE_REFCOUNTED = 1
+local TH_STORAGE_FREEMEM = 4
+
+-- Storages (and their offsets) of the vectors created by from_tensor, to
+-- keep them alive
+local adopted_storages = {}
+setmetatable(adopted_storages, {__mode = 'k'})  -- weak keys
+
+local function add_tensor_methods(methods, kind)
+    local name = tensor_types[kind]
+
+    -- A 1-dimensional tensor sharing the vector's memory. The tensor (and
+    -- any view of it) pins the vector: until they're all garbage
+    -- collected, the vector can't grow past its capacity (resize() and
+    -- reserve() raise an error), and, if the vector is garbage collected
+    -- first, its memory is only freed along with them.
+    function methods:as_tensor()
+        local torch = require('torch')
+        local tensor_type = torch[name .. 'Tensor']
+        local n = tonumber(self._v.size)
+        if n == 0 then
+            return tensor_type()
+        end
+        if bit.band(self._v.flags, BORROWED) ~= 0 then
+            local adopted = adopted_storages[self]
+            return tensor_type(adopted[1], adopted[2], n)
+        end
+        if bit.band(self._v.flags, READ_ONLY) ~= 0 then
+            error('Read-only vector')
+        end
+
+        local pins = lib.ffivector_pin(self._v)
+        if pins == nil then
+            error('Out of memory')
+        end
+        local storage = torch[name .. 'Storage']()
+        local s = storage:cdata()
+        s.data = self._v.data
+        s.size = n
+        s.allocator = ffi.cast(ffi.typeof(s.allocator),
+                               lib.ffivector_th_allocator())
+        s.allocatorContext = pins
+        s.flag = bit.bor(TH_STORAGE_REFCOUNTED, TH_STORAGE_FREEMEM)
+        return tensor_type(storage)
+    end
+end
+
+local function vector_type(ctype, index, newindex, destructor)
     ctype = ffi.typeof(ctype)  -- support both ctype and C declaration
     local factory = cachedTypes[ctype]
 
@@ -129,28 +466,46 @@ local function new(ctype, initial_capacity, index, newindex, destructor)
                 end
             end
 
-            if lib.ffivector_resize(self._v, n) < 0 then
-                error('Out of memory')
-            end
+            check(lib.ffivector_resize(self._v, n), 'Failed to resize vector')
         end
 
         function methods:reserve(n)
-            if lib.ffivector_reserve(self._v, n) < 0 then
-                error('Out of memory')
-            end
+            check(lib.ffivector_reserve(self._v, n), 'Failed to reserve')
         end
 
         function methods:capacity()
             return self._v.capacity
         end
 
+        -- pointer to the first element; invalidated when the vector grows
+        function methods:data()
+            return ffi.cast(pointerType, self._v.data)
+        end
+
+        -- for file-backed vectors (no-ops otherwise): write changes back
+        -- to the file (asynchronously, if async is true) ...
+        function methods:flush(async)
+            check(lib.ffivector_flush(self._v, async and 1 or 0),
+                  'Failed to flush vector')
+        end
+
+        -- ... and pick up changes (growth) made by other processes
+        function methods:refresh()
+            check(lib.ffivector_refresh(self._v), 'Failed to refresh vector')
+        end
+
+        local kind = numeric_kinds[tostring(ctype)]
+
         -- a ffi metatype is faster than a table here...
         factory = ffi.metatype('struct { FFIVector _v; }', {
-            __new = function(ct, initial_capacity)
-                initial_capacity = initial_capacity or 0
+            __new = function(ct, initial_capacity, path, mode)
                 local self = ffi.new(ct)
-                if lib.ffivector_create(self._v, ffi.sizeof(ctype),
-                                        initial_capacity) ~= 0 then
+                if path then
+                    check(lib.ffivector_open(self._v, ffi.sizeof(ctype), path,
+                                             mode),
+                          'Failed to open ' .. path)
+                elseif lib.ffivector_create(self._v, ffi.sizeof(ctype),
+                                            initial_capacity or 0) ~= 0 then
                     error('Failed to create vector')
                 end
                 return self
@@ -192,6 +547,9 @@ local function new(ctype, initial_capacity, index, newindex, destructor)
             __newindex = function(self, k, v)
                 local kn = tonumber(k)
                 if kn then
+                    if bit.band(self._v.flags, READ_ONLY) ~= 0 then
+                        error('Read-only vector')
+                    end
                     local ptr
                     if kn >= 1 and kn <= self._v.size then
                         ptr = ffi.cast(pointerType, self._v.data)
@@ -217,13 +575,75 @@ local function new(ctype, initial_capacity, index, newindex, destructor)
             __pairs = ipairs_fn,
         })
 
+        if kind then
+            vector_kinds[tostring(factory)] = kind
+            add_kernels(methods, factory, kind)
+            if tensor_types[kind] then
+                add_tensor_methods(methods, kind)
+            end
+        end
+
         cachedTypes[ctype] = factory
     end
 
-    return factory(initial_capacity)
+    return factory
+end
+
+local function new(ctype, initial_capacity, index, newindex, destructor)
+    return vector_type(ctype, index, newindex, destructor)(initial_capacity)
 end
 M.new = new
 
+local function new_mapped(ctype, path, mode, index)
+    mode = mode or 'rw'
+    local open_mode = open_modes[mode]
+    if not open_mode then
+        error('Invalid mode ' .. tostring(mode))
+    end
+    return vector_type(ctype, index)(0, path, open_mode)
+end
+M.new_mapped = new_mapped
+
+-- Tensor types, and the ctypes of their elements
+local tensor_ctypes = {
+    ['torch.CharTensor'] = 'int8_t',
+    ['torch.ByteTensor'] = 'uint8_t',
+    ['torch.ShortTensor'] = 'int16_t',
+    ['torch.IntTensor'] = 'int32_t',
+    ['torch.LongTensor'] = 'int64_t',
+    ['torch.FloatTensor'] = 'float',
+    ['torch.DoubleTensor'] = 'double',
+}
+
+-- A vector sharing the memory of the contiguous tensor t (and keeping its
+-- storage alive), without copying. If the vector grows past the tensor's
+-- size, it copies the elements to memory of its own, and stops sharing.
+local function from_tensor(t)
+    local torch = require('torch')
+    local ctype = tensor_ctypes[torch.typename(t)]
+    if not ctype then
+        error('Invalid tensor type ' .. tostring(torch.typename(t)))
+    end
+    if not t:isContiguous() then
+        error('Tensor must be contiguous')
+    end
+    local vec = vector_type(ctype, tonumber)()
+    local n = t:nElement()
+    if n == 0 then
+        return vec
+    end
+    check(lib.ffivector_adopt(vec._v, t:data(), n), 'Failed to adopt tensor')
+    adopted_storages[vec] = {t:storage(), t:storageOffset()}
+    return vec
+end
+M.from_tensor = from_tensor
+
+-- number of threads the kernels may use on large vectors (default 1)
+local function set_num_threads(n)
+    lib.ffivector_set_num_threads(n)
+end
+M.set_num_threads = set_num_threads
+
 local string_type = ffi.typeof('struct { char* data; size_t size; }')
 local voidptr_type = ffi.typeof('void*')
 local null = voidptr_type()
@@ -249,8 +669,21 @@ for _, t in ipairs(c99_int_types) do
     table.insert(types, 'u' .. t)
 end
 
+local int_kinds = {[1] = 0, [2] = 2, [4] = 4, [8] = 6}  -- FFIVECTOR_INT8...
+
 for _, t in ipairs(types) do
     local ctype = ffi.typeof(t)
+    if t == 'float' then
+        numeric_kinds[tostring(ctype)] = FLOAT
+    elseif t == 'double' then
+        numeric_kinds[tostring(ctype)] = DOUBLE
+    else
+        -- unsigned types follow their signed counterparts
+        local unsigned = tonumber(ffi.new(ctype, -1)) > 0
+        numeric_kinds[tostring(ctype)] =
+            int_kinds[ffi.sizeof(ctype)] + (unsigned and 1 or 0)
+    end
+
     t = t:gsub(' ', '_')
     M[t] = ctype
 
@@ -283,4 +716,448 @@ local function new_string(initial_capacity)
 end
 M.new_string = new_string
 
+local offsets_type = ffi.typeof('uint64_t*')
+local chars_type = ffi.typeof('const char*')
+
+local function string_range(self, k)
+    local kn = tonumber(k)
+    if not kn or kn < 1 or kn >= self._s.offsets.size then
+        error('Index out of range')
+    end
+    local offsets = ffi.cast(offsets_type, self._s.offsets.data)
+    local start = offsets[kn - 1]
+    return ffi.cast(chars_type, self._s.bytes.data) + start,
+           tonumber(offsets[kn] - start)
+end
+
+local function string_at(self, k)
+    return ffi.string(string_range(self, k))
+end
+
+local arena_methods = {}
+
+function arena_methods:append(s)
+    check(lib.ffistringvector_append(self._s, s, #s),
+          'Failed to append string')
+end
+
+-- zero-copy access: pointer to the bytes of element k (not 0-terminated,
+-- and invalidated when the vector grows), and their length
+arena_methods.pointer = string_range
+
+function arena_methods:reserve(n, bytes)
+    check(lib.ffistringvector_reserve(self._s, n, bytes or 0),
+          'Failed to reserve')
+end
+
+-- total length of the strings
+function arena_methods:bytes()
+    return tonumber(self._s.bytes.size)
+end
+
+-- append the lines of a file; returns the number of lines
+function arena_methods:load(path)
+    local size = #self
+    check(lib.ffistringvector_load(self._s, path), 'Failed to load ' .. path)
+    return #self - size
+end
+
+local string_arena_type = ffi.metatype('struct { FFIStringVector _s; }', {
+    __new = function(ct, initial_capacity, initial_bytes)
+        local self = ffi.new(ct)
+        check(lib.ffistringvector_create(self._s, initial_capacity or 0,
+                                         initial_bytes or 0),
+              'Failed to create vector')
+        return self
+    end,
+
+    __gc = function(self)
+        lib.ffistringvector_destroy(self._s)
+    end,
+
+    __len = function(self)
+        return tonumber(self._s.offsets.size) - 1
+    end,
+
+    __index = function(self, k)
+        if type(k) == 'string' then
+            return arena_methods[k]
+        end
+        return string_at(self, k)
+    end,
+
+    __newindex = function(self, k, v)
+        if tonumber(k) == #self + 1 then
+            self:append(v)
+        else
+            error('Strings can only be appended')
+        end
+    end,
+
+    __ipairs = ipairs_fn,
+    __pairs = ipairs_fn,
+})
+
+-- A vector of strings packed in one buffer, with a vector of offsets into
+-- it: two allocations in all, rather than one per string. Strings may only
+-- be appended (by assigning one past the end, or with append()), not
+-- modified.
+local function new_string_arena(initial_capacity, initial_bytes)
+    return string_arena_type(initial_capacity, initial_bytes)
+end
+M.new_string_arena = new_string_arena
+
+local cachedMapTypes = {}
+setmetatable(cachedMapTypes, {__mode = 'v'})  -- weak values
+
+-- Pointer and count for the batch functions: either an explicit pointer
+-- (or array) and count, or a ffivector and its size.
+local function batch_arg(x, ptrtype, n)
+    if n then
+        return ffi.cast(ptrtype, x), n
+    end
+    return x:data(), #x
+end
+
+local function new_map(key_ctype, value_ctype, initial_capacity, index,
+                       newindex, destructor)
+    local string_keys = (key_ctype == 'string')
+    if not string_keys then
+        key_ctype = ffi.typeof(key_ctype)
+    end
+    value_ctype = ffi.typeof(value_ctype)
+    local type_key = table.concat({
+        tostring(key_ctype), tostring(value_ctype), tostring(index),
+        tostring(newindex), tostring(destructor)}, ' ')
+    local factory = cachedMapTypes[type_key]
+
+    if not factory then
+        local valuePtrType = ffi.typeof('$*', value_ctype)
+        local keyPtrType, keySize, keyBuf
+        if string_keys then
+            keySize = 0
+        else
+            keyPtrType = ffi.typeof('$*', key_ctype)
+            keySize = ffi.sizeof(key_ctype)
+            keyBuf = ffi.new(ffi.typeof('$[1]', key_ctype))
+        end
+        local keyLen = ffi.new('size_t[1]')
+        local inserted = ffi.new('int[1]')
+
+        -- pointer to the key's bytes, and their length
+        local function key_arg(k)
+            if string_keys then
+                if type(k) ~= 'string' then
+                    error('Invalid key')
+                end
+                return k, #k
+            end
+            keyBuf[0] = k
+            return keyBuf, keySize
+        end
+
+        local function get(self, k)
+            local p = lib.ffimap_find(self._m, key_arg(k))
+            if p == nil then
+                return nil
+            end
+            local v = ffi.cast(valuePtrType, p)[0]
+            if index then
+                return index(v)
+            else
+                return v
+            end
+        end
+
+        local function set(self, k, v)
+            if newindex then
+                v = newindex(v)
+            end
+            local kp, kn = key_arg(k)
+            local p = lib.ffimap_insert(self._m, kp, kn, inserted)
+            if p == nil then
+                error('Out of memory')
+            end
+            p = ffi.cast(valuePtrType, p)
+            if destructor and inserted[0] == 0 then
+                destructor(p[0])
+            end
+            p[0] = v
+        end
+
+        local function erase(self, k)
+            local kp, kn = key_arg(k)
+            if destructor then
+                local p = lib.ffimap_find(self._m, kp, kn)
+                if p == nil then
+                    return false
+                end
+                destructor(ffi.cast(valuePtrType, p)[0])
+                kp, kn = key_arg(k)  -- the destructor may have reused keyBuf
+            end
+            return lib.ffimap_erase(self._m, kp, kn) ~= 0
+        end
+
+        local function key_at(self, slot)
+            if string_keys then
+                local p = lib.ffimap_key(self._m, slot, keyLen)
+                return ffi.string(p, tonumber(keyLen[0]))
+            end
+            return ffi.cast(keyPtrType, self._m.keys)[slot]
+        end
+
+        local function value_at(self, slot)
+            local v = ffi.cast(valuePtrType, self._m.values)[slot]
+            if index then
+                return index(v)
+            else
+                return v
+            end
+        end
+
+        local function pairs_fn(self)
+            local slot = -1
+            return function()
+                slot = tonumber(lib.ffimap_next(self._m, slot + 1))
+                if slot < self._m.capacity then
+                    return key_at(self, slot), value_at(self, slot)
+                end
+            end
+        end
+
+        local methods = {get = get, set = set, erase = erase, pairs = pairs_fn}
+
+        function methods:reserve(n)
+            if lib.ffimap_reserve(self._m, n) < 0 then
+                error('Out of memory')
+            end
+        end
+
+        function methods:capacity()
+            return tonumber(self._m.capacity)
+        end
+
+        function methods:insert_batch(keys, values, n)
+            if type(keys) == 'table' then
+                for i = 1, #keys do
+                    set(self, keys[i], values[i])
+                end
+                return
+            end
+            if string_keys then
+                error('String keys must be given as a table')
+            end
+            local kp, nk = batch_arg(keys, keyPtrType, n)
+            local vp, nv = batch_arg(values, valuePtrType, n)
+            if nv < nk then
+                error('Not enough values')
+            end
+            if newindex or destructor then
+                for i = 0, nk - 1 do
+                    set(self, kp[i], vp[i])
+                end
+            elseif lib.ffimap_insert_batch(self._m, kp, vp, nk) < 0 then
+                error('Out of memory')
+            end
+        end
+
+        function methods:find_batch(keys, out, n, found)
+            if type(keys) == 'table' then
+                out = out or {}
+                local count = 0
+                for i = 1, #keys do
+                    local v = get(self, keys[i])
+                    if v ~= nil then
+                        count = count + 1
+                    end
+                    out[i] = v
+                end
+                return out, count
+            end
+            if string_keys then
+                error('String keys must be given as a table')
+            end
+            local kp, nk = batch_arg(keys, keyPtrType, n)
+            if not n then
+                out:resize(nk)
+                if found then
+                    found:resize(nk)
+                end
+            end
+            local vp = batch_arg(out, valuePtrType, n)
+            local fp = found and batch_arg(found, 'uint8_t*', n)
+            return out, tonumber(lib.ffimap_find_batch(self._m, kp, vp, nk, fp))
+        end
+
+        factory = ffi.metatype('struct { FFIMap _m; }', {
+            __new = function(ct, initial_capacity)
+                initial_capacity = initial_capacity or 0
+                local self = ffi.new(ct)
+                if lib.ffimap_create(self._m, keySize, ffi.sizeof(value_ctype),
+                                     initial_capacity) ~= 0 then
+                    error('Failed to create map')
+                end
+                return self
+            end,
+
+            __gc = function(self)
+                if destructor then
+                    local slot = tonumber(lib.ffimap_next(self._m, 0))
+                    local ptr = ffi.cast(valuePtrType, self._m.values)
+                    while slot < self._m.capacity do
+                        destructor(ptr[slot])
+                        slot = tonumber(lib.ffimap_next(self._m, slot + 1))
+                    end
+                end
+                lib.ffimap_destroy(self._m)
+            end,
+
+            __len = function(self)
+                return tonumber(self._m.size)
+            end,
+
+            -- Strings index methods. Keys of other types are cdata (or
+            -- numbers), so map[k] can't be confused with a method; string
+            -- keys must go through get() and set().
+            __index = function(self, k)
+                if type(k) == 'string' then
+                    local method = methods[k]
+                    if method then
+                        return method
+                    end
+                    if string_keys then
+                        error('Use get() and set() with string-keyed maps')
+                    end
+                end
+                return get(self, k)
+            end,
+
+            __newindex = function(self, k, v)
+                if string_keys then
+                    error('Use get() and set() with string-keyed maps')
+                end
+                if v == nil then
+                    erase(self, k)
+                else
+                    set(self, k, v)
+                end
+            end,
+
+            __pairs = pairs_fn,
+        })
+
+        cachedMapTypes[type_key] = factory
+    end
+
+    return factory(initial_capacity)
+end
+M.new_map = new_map
+
+-- Serialization with fb.thrift, which calls these for cdata objects (see
+-- setCDataSerializationCallbacks in fb/thrift/Serialization.h). Vectors of
+-- numbers and string arenas are serialized as a type key and the addresses,
+-- lengths and owners of their buffers. The owners pin the vectors until
+-- fb.thrift is done with the buffers, so it doesn't need to copy them;
+-- borrowed vectors (from_tensor) have no owner, and are copied. Other
+-- cdata aren't supported.
+
+local kind_names = {
+    [0] = 'int8_t', 'uint8_t', 'int16_t', 'uint16_t', 'int32_t', 'uint32_t',
+    'int64_t', 'uint64_t', 'float', 'double',
+}
+local numeric_names = {}
+for kind = 0, #kind_names do
+    numeric_names[kind_names[kind]] = true
+end
+local STRING_ARENA_KEY = 'ffivector:string_arena'
+
+-- NOTE: this must match LuaCDataOwner in fb/thrift/Serialization.h
+local owner_type = ffi.typeof(
+    'struct { void (*release)(void*); void* context; }')
+
+-- fb.thrift only reads owners for which this returns true
+function M._thrift_is_owner(x)
+    return ffi.istype(owner_type, x)
+end
+
+-- address, length and owner (if v can be pinned) of the first n bytes of
+-- v's data
+local function buffer(v, n)
+    local owner
+    if n ~= 0 and bit.band(v.flags, BORROWED) == 0 then
+        local pins = lib.ffivector_pin(v)
+        if pins ~= nil then
+            owner = owner_type(lib.ffivector_unpin, pins)
+        end
+    end
+    return tonumber(ffi.cast('intptr_t', v.data)), n, owner
+end
+
+function M._thrift_serialize(obj)
+    if ffi.istype(string_arena_type, obj) then
+        local s = obj._s
+        local offsets_addr, offsets_len, offsets_owner =
+            buffer(s.offsets, tonumber(s.offsets.size) * 8)
+        return STRING_ARENA_KEY, offsets_addr, offsets_len, offsets_owner,
+               buffer(s.bytes, tonumber(s.bytes.size))
+    end
+    local kind = vector_kinds[tostring(ffi.typeof(obj))]
+    if not kind then
+        return nil
+    end
+    local v = obj._v
+    return 'ffivector:' .. kind_names[kind],
+           buffer(v, tonumber(v.size * v.elementSize))
+end
+
+-- copy len bytes at address addr to the end of v, which has room for them
+local function append_bytes(v, addr, len)
+    ffi.copy(ffi.cast('char*', v.data) + v.size * v.elementSize,
+             ffi.cast('const char*', addr), len)
+    v.size = v.size + len / v.elementSize
+end
+
+function M._thrift_deserialize(key, ...)
+    if key == STRING_ARENA_KEY then
+        local offsets_addr, offsets_len, bytes_addr, bytes_len = ...
+        local n = offsets_len / 8 - 1
+        if n < 0 or n ~= math.floor(n) then
+            error('Invalid serialized string arena')
+        end
+        local vec = string_arena_type(0, 0)
+        local s = vec._s
+        -- ffistringvector_create stores the initial 0 offset
+        check(lib.ffistringvector_reserve(s, n, bytes_len),
+              'Failed to reserve')
+        s.offsets.size = 0
+        append_bytes(s.offsets, offsets_addr, offsets_len)
+        append_bytes(s.bytes, bytes_addr, bytes_len)
+        local offsets = ffi.cast(offsets_type, s.offsets.data)
+        if offsets[0] ~= 0 or offsets[n] ~= bytes_len then
+            error('Invalid serialized string arena')
+        end
+        for i = 1, n do
+            if offsets[i] < offsets[i - 1] then
+                error('Invalid serialized string arena')
+            end
+        end
+        return vec
+    end
+
+    local name = key:match('^ffivector:(.*)$')
+    if not numeric_names[name] then
+        error('Unknown serialized cdata type ' .. key)
+    end
+    local addr, len = ...
+    local vec = vector_type(name, tonumber)()
+    local v = vec._v
+    local element_size = tonumber(v.elementSize)
+    if len % element_size ~= 0 then
+        error('Invalid serialized ' .. key)
+    end
+    check(lib.ffivector_reserve(v, len / element_size), 'Failed to reserve')
+    append_bytes(v, addr, len)
+    return vec
+end
+
 return M
@@ -9,6 +9,7 @@
 
 require('fb.luaunit')
 
+local ffi = require('ffi')
 local ffivector = require('fb.ffivector')
 
 function testIntFFIVector()
@@ -103,4 +104,342 @@ function testFFIVectorDestruction()
     assertEquals(52, destructor_count)
 end
 
+function testMappedFFIVector()
+    local path = os.tmpname()
+    do
+        local v = ffivector.new_mapped('int', path, 'w', tonumber)
+        assertEquals(0, #v)
+        for i = 1, 100000 do
+            v[i] = i
+        end
+        v:flush()
+
+        local r = ffivector.new_mapped('int', path, 'r', tonumber)
+        assertEquals(100000, #r)
+        assertEquals(42, r[42])
+        assertError(function() r[1] = 2 end)
+        assertError(function() r:resize(10) end)
+
+        v:resize(200000)
+        v[200000] = 7
+        r:refresh()
+        assertEquals(200000, #r)
+        assertEquals(7, r[200000])
+    end
+    collectgarbage()
+
+    -- Reopening doesn't load anything
+    local v = ffivector.new_mapped('int', path, 'rw', tonumber)
+    assertEquals(200000, #v)
+    assertEquals(100000, v[100000])
+    assertEquals(0, v[100001])
+    v = nil
+    collectgarbage()
+
+    assertError(function() ffivector.new_mapped('double', path) end)
+    assertError(function() ffivector.new_mapped('int', path, 'x') end)
+    os.remove(path)
+end
+
+function testStringArena()
+    local v = ffivector.new_string_arena()
+    for i = 1, 1000 do
+        v[i] = 'hello ' .. tostring(i)
+    end
+    v:append('')
+    assertEquals(1001, #v)
+    assertError(function() v[1] = 'foo' end)
+    assertError(function() return v[1002] end)
+    collectgarbage()
+
+    for i, s in ipairs(v) do
+        if i <= 1000 then
+            assertEquals('hello ' .. tostring(i), s)
+        end
+    end
+    assertEquals('', v[1001])
+    local p, n = v:pointer(12)
+    assertEquals(8, n)
+    assertEquals('hello 12', ffi.string(p, n))
+
+    local path = os.tmpname()
+    local f = io.open(path, 'w')
+    f:write('foo\n\nbar\nbaz')
+    f:close()
+    assertEquals(4, v:load(path))
+    os.remove(path)
+    assertEquals(1005, #v)
+    assertEquals('foo', v[1002])
+    assertEquals('', v[1003])
+    assertEquals('baz', v[1005])
+end
+
+function testKernels()
+    local v = ffivector.new_int()
+    local values = {5, -3, 8, 8, 0, -3, 7}
+    for i, x in ipairs(values) do
+        v[i] = x
+    end
+    assertEquals(22, v:sum())
+    assertEquals(-3, v:min())
+    assertEquals(8, v:max())
+    assertEquals(22 / 7, v:mean())
+
+    local order = v:argsort()
+    assertEquals(7, #order)
+    assertEquals(2, order[1])
+    assertEquals(6, order[2])  -- stable
+    local sorted = v:gather(order)
+    v:sort()
+    for i = 1, #v do
+        assertEquals(v[i], sorted[i])
+    end
+    assertEquals(3, v:lower_bound(0))
+    assertEquals(4, v:upper_bound(0))
+    assertEquals(8, v:lower_bound(100))
+    assertEquals(3, v:lower_bound(-0.5))
+    assertEquals(1, v:lower_bound(-1e30))
+
+    -- 64-bit values are compared exactly
+    local ids = ffivector.new_int64_t()
+    local big = 2LL ^ 60
+    for i, x in ipairs({big, big + 1, big + 1, big + 2}) do
+        ids[i] = x
+    end
+    assertEquals(2, ids:lower_bound(big + 1))
+    assertEquals(4, ids:upper_bound(big + 1))
+    assertEquals(5, ids:lower_bound(2ULL ^ 63))
+
+    local w = ffivector.new_int(#v)
+    w:resize(#v)
+    w:scatter(order, sorted)
+    for i, x in ipairs(values) do
+        assertEquals(x, w[i])
+    end
+
+    v:unique()
+    assertEquals(5, #v)
+    v:prefix_sum()
+    assertEquals(-3, v[1])
+    assertEquals(9, v[4])
+    assertEquals(17, v[5])
+
+    local bad = ffivector.new_int64_t()
+    bad[1] = 0
+    assertError(function() v:gather(bad) end)
+    assertError(function() v:gather(ffivector.new_double()) end)
+
+    local d = ffivector.new_double()
+    assertEquals(0, d:sum())
+    assertEquals(nil, d:min())
+    assertEquals(nil, d:mean())
+    d[1] = 2.5
+    d[2] = 0 / 0
+    d[3] = -1
+    assertEquals(-1, d:min())
+    d:sort()
+    assertEquals(-1, d[1])
+    assertEquals(2.5, d[2])
+    assertTrue(d[3] ~= d[3])
+
+    local nans = ffivector.new_float()
+    nans[1] = 0 / 0
+    nans[2] = 0 / 0
+    assertEquals(nil, nans:min())
+    assertEquals(nil, nans:max())
+
+    local big = ffivector.new_uint8_t()
+    big:resize(3000000)
+    ffi.fill(big:data(), #big, 1)
+    ffivector.set_num_threads(4)
+    assertEquals(3000000, big:sum())
+    big:prefix_sum()
+    assertEquals(3000000 % 256, big[#big])  -- wraps around
+    ffivector.set_num_threads(1)
+end
+
+function testTensor()
+    local ok, torch = pcall(require, 'torch')
+    if not ok then
+        return
+    end
+
+    local v = ffivector.new_float()
+    for i = 1, 10 do
+        v[i] = i
+    end
+    local t = v:as_tensor()
+    assertEquals('torch.FloatTensor', torch.typename(t))
+    assertEquals(10, t:nElement())
+    assertEquals(55, t:sum())
+    t[3] = 42
+    assertEquals(42, v[3])
+    v[4] = 43
+    assertEquals(43, t[4])
+
+    -- pinned until the tensor, and its views, are gone
+    local view = t:narrow(1, 2, 4)
+    t = nil
+    collectgarbage()
+    assertError(function() v:reserve(1000) end)
+    v[5] = 44
+    assertEquals(44, view[4])
+    view = nil
+    collectgarbage()
+    v:reserve(1000)
+
+    -- the memory outlives the vector while the tensor lives
+    t = v:as_tensor()
+    v = nil
+    collectgarbage()
+    assertEquals(44, t[5])
+    t = nil
+    collectgarbage()
+
+    local src = torch.range(1, 6):resize(2, 3)
+    local w = ffivector.from_tensor(src)
+    assertEquals(6, #w)
+    assertEquals(4, w[4])
+    w[1] = 7
+    assertEquals(7, src[1][1])
+    local u = w:as_tensor()
+    assertEquals(7, u[1])
+    src = nil
+    u = nil
+    collectgarbage()
+    assertEquals(21 + 6, w:sum())
+    w[7] = 8  -- copies
+    assertEquals(8, w[7])
+    assertEquals(6, w[6])
+
+    assertError(function() ffivector.from_tensor(torch.rand(3, 3):t()) end)
+end
+
+function testFFIMap()
+    local m = ffivector.new_map('int64_t', 'double', 0, tonumber)
+    assertEquals(0, #m)
+    assertEquals(nil, m[42])
+
+    -- enough to grow a few times
+    for i = 1, 1000 do
+        m[i * 7] = i / 2
+    end
+    assertEquals(1000, #m)
+    assertTrue(m:capacity() >= 1000)
+    for i = 1, 1000 do
+        assertEquals(i / 2, m[i * 7])
+    end
+    assertEquals(nil, m[8])
+
+    m[7] = 10
+    assertEquals(10, m[7])
+    for i = 1, 1000, 2 do
+        m[i * 7] = nil
+    end
+    assertEquals(500, #m)
+    assertEquals(false, m:erase(7))
+    assertEquals(true, m:erase(14))
+    assertEquals(nil, m[14])
+    assertEquals(2, m[28])
+
+    local count = 0
+    local sum = 0
+    for k, v in m:pairs() do
+        count = count + 1
+        sum = sum + v
+        assertEquals(tonumber(k) / 14, v)
+    end
+    assertEquals(499, count)
+    assertEquals(250 * 501 - 1, sum)
+end
+
+function testStringFFIMap()
+    local m = ffivector.new_map('string', 'int', 0, tonumber)
+    for i = 1, 1000 do
+        m:set('key ' .. i, i)
+    end
+    collectgarbage()
+    for i = 1, 1000 do
+        assertEquals(i, m:get('key ' .. i))
+    end
+    assertEquals(nil, m:get('key 0'))
+
+    -- keys and methods don't mix
+    m:set('erase', 5)
+    assertEquals(5, m:get('erase'))
+    assertEquals('function', type(m.erase))
+    assertEquals(nil, m:get('_m'))
+    assertError(function() return m['key 1'] end)
+    assertError(function() m['key 1'] = 2 end)
+
+    for i = 1, 1000 do
+        assertEquals(true, m:erase('key ' .. i))
+    end
+    assertEquals(1, #m)
+    for k, v in m:pairs() do
+        assertEquals('erase', k)
+        assertEquals(5, v)
+    end
+end
+
+function testFFIMapBatch()
+    local m = ffivector.new_map('int32_t', 'float', 0, tonumber)
+    local keys = ffivector.new_int32_t()
+    local values = ffivector.new_float()
+    for i = 1, 100 do
+        keys[i] = i
+        values[i] = i * 2
+    end
+    m:insert_batch(keys, values)
+    assertEquals(100, #m)
+
+    keys[101] = 1000
+    local out = ffivector.new_float()
+    local found = ffivector.new_uint8_t()
+    local _, count = m:find_batch(keys, out, nil, found)
+    assertEquals(100, count)
+    assertEquals(101, #out)
+    assertEquals(40, out[20])
+    assertEquals(0, out[101])
+    assertEquals(1, found[100])
+    assertEquals(0, found[101])
+
+    local buf = ffi.new('float[2]')
+    _, count = m:find_batch(ffi.new('int32_t[2]', {3, 5000}), buf, 2)
+    assertEquals(1, count)
+    assertEquals(6, buf[0])
+
+    local vals
+    vals, count = m:find_batch({1, 2, 5000})
+    assertEquals(2, count)
+    assertEquals(4, vals[2])
+    assertEquals(nil, vals[3])
+
+    m:insert_batch({7, 8000}, {1, 2})
+    assertEquals(101, #m)
+    assertEquals(1, m[7])
+end
+
+function testFFIMapDestruction()
+    local destructor_count = 0
+
+    do
+        local m = ffivector.new_map(
+            'int', 'int', 0, tonumber, nil,
+            function(x) destructor_count = destructor_count + 1 end)
+        for i = 1, 10 do
+            m[i] = i
+        end
+        m[1] = 2
+        assertEquals(1, destructor_count)
+        m[2] = nil
+        assertEquals(2, destructor_count)
+        m:insert_batch({3, 11}, {1, 1})
+        assertEquals(3, destructor_count)
+    end
+    collectgarbage()
+
+    assertEquals(13, destructor_count)
+end
+
 LuaUnit:main()
@@ -0,0 +1,97 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+// Lookup contention: 64 threads looking up a handful of names, as worker
+// threads calling atomicvector.get() (or util's get_once / get_mutex) per
+// batch do. Compares CrossThreadRegistry with the mutex-protected map it
+// replaced.
+
+#include <fblualib/CrossThreadRegistry.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <folly/Benchmark.h>
+#include <folly/MapUtil.h>
+#include <gflags/gflags.h>
+
+namespace {
+
+constexpr int kThreads = 64;
+constexpr int kNames = 8;
+
+// The previous implementation: every operation takes the lock.
+template<typename Key, typename Val>
+class MutexRegistry {
+  std::mutex m_mutex;
+  std::unordered_map<Key, std::unique_ptr<Val>> m_registry;
+
+public:
+  template<typename Lambda>
+  bool create(const Key& key, Lambda factory) {
+    std::lock_guard<std::mutex> l(m_mutex);
+    if (folly::get_ptr(m_registry, key)) {
+      return false;
+    }
+    m_registry[key] = factory();
+    return true;
+  }
+
+  Val* get(const Key& key) {
+    std::lock_guard<std::mutex> l(m_mutex);
+    if (auto valp = folly::get_ptr(m_registry, key)) {
+      return valp->get();
+    }
+    return nullptr;
+  }
+};
+
+template<typename Registry>
+void runLookups(size_t iters) {
+  Registry reg;
+  std::vector<std::string> names;
+  BENCHMARK_SUSPEND {
+    for (int i = 0; i < kNames; ++i) {
+      names.push_back("atomicvector" + std::to_string(i));
+      reg.create(names.back(), [i] { return std::make_unique<int>(i); });
+    }
+  }
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      for (size_t i = t; i < iters; i += kThreads) {
+        folly::doNotOptimizeAway(reg.get(names[i % kNames]));
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+}  // namespace
+
+BENCHMARK(MutexLookup64Threads, iters) {
+  runLookups<MutexRegistry<std::string, int>>(iters);
+}
+
+BENCHMARK_RELATIVE(LockFreeLookup64Threads, iters) {
+  runLookups<CrossThreadRegistry<std::string, int>>(iters);
+}
+
+int main(int argc, char *argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  folly::runBenchmarks();
+  return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <fblualib/CrossThreadRegistry.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace fblualib { namespace test {
+
+namespace {
+
+struct Counted {
+  explicit Counted(int v) : value(v) { ++live; }
+  ~Counted() { --live; }
+  const int value;
+  static std::atomic<int> live;
+};
+
+std::atomic<int> Counted::live(0);
+
+}  // namespace
+
+TEST(CrossThreadRegistry, Simple) {
+  {
+    CrossThreadRegistry<std::string, Counted> reg;
+    EXPECT_EQ(nullptr, reg.get("foo"));
+    EXPECT_FALSE(reg.erase("foo"));
+
+    EXPECT_TRUE(reg.create("foo", [] { return std::make_unique<Counted>(1); }));
+    EXPECT_FALSE(reg.create("foo", [] {
+      ADD_FAILURE();
+      return std::make_unique<Counted>(2);
+    }));
+    EXPECT_EQ(1, reg.get("foo")->value);
+    EXPECT_EQ(1, reg.getOrCreate("foo", [] {
+      ADD_FAILURE();
+      return std::make_unique<Counted>(3);
+    })->value);
+
+    EXPECT_TRUE(reg.erase("foo"));
+    EXPECT_EQ(0, Counted::live);
+    EXPECT_EQ(nullptr, reg.get("foo"));
+    EXPECT_FALSE(reg.erase("foo"));
+
+    // Reuse the erased key
+    EXPECT_EQ(4, reg.getOrCreate("foo", [] {
+      return std::make_unique<Counted>(4);
+    })->value);
+
+    // Grow the table a few times
+    for (int i = 0; i < 1000; ++i) {
+      EXPECT_TRUE(reg.create(std::to_string(i), [i] {
+        return std::make_unique<Counted>(i);
+      }));
+    }
+    for (int i = 0; i < 1000; ++i) {
+      EXPECT_EQ(i, reg.get(std::to_string(i))->value);
+    }
+    EXPECT_EQ(4, reg.get("foo")->value);
+    EXPECT_EQ(1001, Counted::live);
+  }
+  EXPECT_EQ(0, Counted::live);
+}
+
+TEST(CrossThreadRegistry, Concurrent) {
+  // Readers look up existing keys while writers create (and grow the
+  // table) and erasers create and erase keys of their own, disjoint from
+  // everyone else's.
+  constexpr int kThreads = 16;
+  constexpr int kKeys = 2000;
+  {
+    CrossThreadRegistry<int, Counted> reg;
+    for (int i = 0; i < kKeys; i += 2) {
+      reg.create(i, [i] { return std::make_unique<Counted>(i); });
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&reg, t] {
+        for (int i = 0; i < kKeys; ++i) {
+          if (t % 4 == 1) {
+            int key = kKeys * (t + 1) + i;
+            EXPECT_TRUE(reg.create(key, [key] {
+              return std::make_unique<Counted>(key);
+            }));
+            EXPECT_EQ(key, reg.get(key)->value);
+            EXPECT_TRUE(reg.erase(key));
+            EXPECT_EQ(nullptr, reg.get(key));
+          }
+          if (t % 4 == 0 && i % 2 == 1) {
+            auto v = reg.getOrCreate(i, [i] {
+              return std::make_unique<Counted>(i);
+            });
+            EXPECT_EQ(i, v->value);
+          } else if (i % 2 == 0) {
+            auto v = reg.get(i);
+            ASSERT_NE(nullptr, v);
+            EXPECT_EQ(i, v->value);
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    for (int i = 0; i < kKeys; ++i) {
+      EXPECT_EQ(i, reg.get(i)->value);
+    }
+    EXPECT_EQ(kKeys, Counted::live);
+  }
+  EXPECT_EQ(0, Counted::live);
+}
+
+}}  // namespaces
+
+int main(int argc, char *argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -46,7 +46,6 @@ std::unique_ptr<folly::IOBuf> uncompressChunked(
     const ChunkList& chunks) {
   folly::io::Cursor cursor(compressed);
   folly::IOBufQueue uncompressed(folly::IOBufQueue::cacheChainLength());
-  uint64_t uncompressedLength = 0;
 
   for (auto& chunk : chunks.chunks) {
     std::unique_ptr<folly::IOBuf> compressedChunk;
@@ -55,20 +54,32 @@ std::unique_ptr<folly::IOBuf> uncompressChunked(
       throw std::runtime_error("underflow");
     }
 
-    uncompressed.append(codec->uncompress(compressedChunk.get(),
-                                          chunk.uncompressedLength));
-
-    // Don't walk the IOBuf chain twice, let IOBufQueue::append do the
-    // job, we'll compute the current length as the difference of
-    // (queue new length) - (queue old length)
-    auto newLength = uncompressed.chainLength();
-    if (newLength - uncompressedLength != chunk.uncompressedLength) {
-      throw std::runtime_error("decompression error");
-    }
-    uncompressedLength = newLength;
+    uncompressed.append(uncompressChunk(codec, compressedChunk.get(), chunk));
   }
 
   return uncompressed.move();
 }
 
+std::unique_ptr<folly::IOBuf> uncompressChunk(
+    folly::io::Codec* codec,
+    const folly::IOBuf* compressedChunk,
+    const Chunk& chunk) {
+  if (chunk.compressedLength < 0 || chunk.uncompressedLength < 0) {
+    throw std::runtime_error("negative chunk length");
+  }
+  if (compressedChunk->computeChainDataLength() !=
+      static_cast<uint64_t>(chunk.compressedLength)) {
+    throw std::runtime_error("underflow");
+  }
+
+  auto uncompressedChunk = codec->uncompress(compressedChunk,
+                                             chunk.uncompressedLength);
+  if (uncompressedChunk->computeChainDataLength() !=
+      static_cast<uint64_t>(chunk.uncompressedLength)) {
+    throw std::runtime_error("decompression error");
+  }
+
+  return uncompressedChunk;
+}
+
 }}  // namespaces
@@ -43,6 +43,15 @@ std::unique_ptr<folly::IOBuf> uncompressChunked(
     const folly::IOBuf* compressed,
     const ChunkList& chunks);
 
+// Uncompress one chunk, checking that the lengths match those recorded in
+// the chunk list. This lets callers read and uncompress the data one chunk
+// at a time (when reading from a stream) rather than holding the entire
+// compressed payload in memory.
+std::unique_ptr<folly::IOBuf> uncompressChunk(
+    folly::io::Codec* codec,
+    const folly::IOBuf* compressedChunk,
+    const Chunk& chunk);
+
 }}  // namespaces
 
 #endif /* FBLUALIB_THRIFT_CHUNKEDCOMPRESSION_H_ */
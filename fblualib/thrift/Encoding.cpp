@@ -16,6 +16,7 @@
 #include <folly/Portability.h>
 #include <folly/Range.h>
 #include <folly/io/IOBuf.h>
+#include <folly/io/IOBufQueue.h>
 #include <fblualib/thrift/ChunkedCompression.h>
 #include <thrift/lib/cpp2/protocol/Serializer.h>
 
@@ -24,7 +25,7 @@ namespace fblualib { namespace thrift {
 namespace {
 
 constexpr uint32_t kMagic = 0x5441554c;  // "LUAT", little-endian
-constexpr int kMaxSupportedVersion = 4;
+constexpr int kMaxSupportedVersion = 5;
 
 FOLLY_PACK_PUSH
 struct Header {
@@ -41,14 +42,180 @@ bool bumpVersion(int& hwm, int v) {
   return v == kMaxSupportedVersion;
 }
 
+// Compact protocol type ids, for the parts of LuaObject that
+// LuaObjectReader parses itself
+constexpr uint8_t kCompactStop = 0;
+constexpr uint8_t kCompactList = 9;
+constexpr uint8_t kCompactStruct = 12;
+
+// Parses a LuaObject from uncompressed data that arrives a chunk at a time,
+// without holding all of it. The Compact reader needs its whole input up
+// front, so we parse LuaObject's own framing (its fields, and the header
+// of the refs list) here, and hand the Compact reader one element (value,
+// or one ref) at a time. Data is dropped as soon as it's been parsed, so
+// the decoder holds about one element's (or chunk's) worth of data rather
+// than the whole message; buffers shared by the decoded object (such as
+// tensor data) stay alive as long as it needs them.
+//
+// nextChunk() returns the next chunk of uncompressed data, or null at the
+// end.
+template <class NextChunk>
+class LuaObjectReader {
+ public:
+  LuaObjectReader(NextChunk nextChunk, SerializationStats* stats)
+    : nextChunk_(std::move(nextChunk)),
+      stats_(stats),
+      queue_(folly::IOBufQueue::cacheChainLength()) { }
+
+  // Parse obj, then consume the rest of the data (so that the underlying
+  // reader is positioned after it).
+  void read(LuaObject& obj) {
+    int16_t fieldId = 0;
+    for (;;) {
+      auto header = readByte();
+      uint8_t type = header & 0x0f;
+      if (type == kCompactStop) {
+        break;
+      }
+      auto delta = header >> 4;
+      fieldId = delta ? static_cast<int16_t>(fieldId + delta) : readZigzag16();
+      if (fieldId == 1 && type == kCompactStruct) {
+        readElement(obj.value);
+      } else if (fieldId == 2 && type == kCompactList) {
+        readRefs(obj.refs);
+      } else {
+        throw std::runtime_error(folly::sformat(
+            "unexpected LuaObject field {} of type {}", fieldId, int(type)));
+      }
+    }
+
+    queue_.move();
+    while (fill()) {
+      queue_.move();
+    }
+    if (stats_ && maxBuffered_ > stats_->maxBufferedBytes) {
+      stats_->maxBufferedBytes = maxBuffered_;
+    }
+  }
+
+ private:
+  void readRefs(LuaRefList& refs) {
+    auto header = readByte();
+    uint64_t size = header >> 4;
+    if (size == 15) {
+      size = readVarint();
+    }
+    if (size != 0 && (header & 0x0f) != kCompactStruct) {
+      throw std::runtime_error("bad LuaObject refs list");
+    }
+    for (uint64_t i = 0; i < size; ++i) {
+      refs.emplace_back();
+      readElement(refs.back());
+    }
+  }
+
+  // We don't know how long an element is until we've parsed it, so we try
+  // with what's buffered, and on running out of data, at least double it
+  // and start over. Each element is parsed at most about twice, amortized.
+  template <class T>
+  void readElement(T& out) {
+    using detail::StatsTimer;
+    using detail::statsCounter;
+
+    for (;;) {
+      if (!queue_.empty()) {
+        try {
+          T element;
+          size_t n;
+          {
+            StatsTimer timer(
+                statsCounter(stats_, &SerializationStats::decodeUs));
+            n = apache::thrift::CompactSerializer::deserialize(
+                queue_.front(), element);
+          }
+          queue_.trimStart(n);
+          out = std::move(element);
+          return;
+        } catch (const std::exception&) {
+          if (done_) {
+            throw;
+          }
+        }
+      } else if (done_) {
+        throw std::runtime_error("LuaObject data truncated");
+      }
+      fill(2 * queue_.chainLength());
+    }
+  }
+
+  uint8_t readByte() {
+    if (queue_.empty()) {
+      fill(1);
+      if (queue_.empty()) {
+        throw std::runtime_error("LuaObject data truncated");
+      }
+    }
+    folly::io::Cursor cursor(queue_.front());
+    auto b = cursor.read<uint8_t>();
+    queue_.trimStart(1);
+    return b;
+  }
+
+  uint64_t readVarint() {
+    uint64_t val = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      auto b = readByte();
+      val |= uint64_t(b & 0x7f) << shift;
+      if (!(b & 0x80)) {
+        return val;
+      }
+    }
+    throw std::runtime_error("bad varint in LuaObject data");
+  }
+
+  int16_t readZigzag16() {
+    auto n = static_cast<uint16_t>(readVarint());
+    return static_cast<int16_t>((n >> 1) ^ -(n & 1));
+  }
+
+  // Buffer chunks until at least target bytes are buffered (and at least
+  // one more chunk, if any are left). Returns false if there was none left.
+  bool fill(size_t target = 0) {
+    bool added = false;
+    while (!done_ && (!added || queue_.chainLength() < target)) {
+      auto chunk = nextChunk_();
+      if (!chunk) {
+        done_ = true;
+        break;
+      }
+      queue_.append(std::move(chunk));
+      added = true;
+      maxBuffered_ = std::max<uint64_t>(maxBuffered_, queue_.chainLength());
+    }
+    return added;
+  }
+
+  NextChunk nextChunk_;
+  SerializationStats* stats_;
+  folly::IOBufQueue queue_;
+  bool done_ = false;
+  uint64_t maxBuffered_ = 0;
+};
+
 }  // namespace
 
 template <class Writer>
 void encode(const LuaObject& input, folly::io::CodecType codecType,
             LuaVersionInfo versionInfo, Writer&& writer, int maxVersion,
-            uint64_t chunkLength) {
+            uint64_t chunkLength, SerializationStats* stats) {
+  using detail::StatsTimer;
+  using detail::statsCounter;
+
   folly::IOBufQueue dataQueue(folly::IOBufQueue::cacheChainLength());
-  apache::thrift::CompactSerializer::serialize(input, &dataQueue);
+  {
+    StatsTimer timer(statsCounter(stats, &SerializationStats::encodeUs));
+    apache::thrift::CompactSerializer::serialize(input, &dataQueue);
+  }
   auto codec = folly::io::getCodec(codecType);
 
   // Determine minimum version required for reading
@@ -69,6 +236,12 @@ void encode(const LuaObject& input, folly::io::CodecType codecType,
 
   if (!versionDone) {
     for (auto& ref : input.refs) {
+      if (ref.__isset.cdataVal) {
+        // Version 5: cdata
+        if (bumpVersion(version, 5)) {
+          break;  // reached max
+        }
+      }
       if (ref.__isset.customUserDataVal) {
         // Version 4: custom userdata
         if (bumpVersion(version, 4)) {
@@ -110,15 +283,22 @@ void encode(const LuaObject& input, folly::io::CodecType codecType,
 
   auto uncompressed = dataQueue.move();
   std::unique_ptr<folly::IOBuf> compressed;
-  if (needChunking) {
-    th.__isset.chunks = true;
-    compressed = compressChunked(
-        codec.get(), uncompressed.get(), chunkLength,
-        th.chunks);
-  } else {
-    compressed = codec->compress(uncompressed.get());
+  {
+    StatsTimer timer(statsCounter(stats, &SerializationStats::compressUs));
+    if (needChunking) {
+      th.__isset.chunks = true;
+      compressed = compressChunked(
+          codec.get(), uncompressed.get(), chunkLength,
+          th.chunks);
+    } else {
+      compressed = codec->compress(uncompressed.get());
+    }
   }
   th.compressedLength = compressed->computeChainDataLength();
+  if (stats) {
+    stats->uncompressedBytes += th.uncompressedLength;
+    stats->compressedBytes += th.compressedLength;
+  }
 
   folly::IOBufQueue queue(folly::IOBufQueue::cacheChainLength());
   apache::thrift::CompactSerializer::serialize(th, &queue);
@@ -127,6 +307,7 @@ void encode(const LuaObject& input, folly::io::CodecType codecType,
   header.magic = folly::Endian::little(kMagic);
   header.thriftHeaderLength = folly::Endian::little(queue.chainLength());
 
+  StatsTimer timer(statsCounter(stats, &SerializationStats::writeUs));
   writer(folly::IOBuf::copyBuffer(&header, sizeof(header)));
   writer(queue.move());
   writer(std::move(compressed));
@@ -138,14 +319,24 @@ template void encode(const LuaObject& input, \
                      LuaVersionInfo info, \
                      T& writer, \
                      int minVersion, \
-                     uint64_t chunkLength);
+                     uint64_t chunkLength, \
+                     SerializationStats* stats);
 X(StringWriter)
 X(FILEWriter)
 #undef X
 
 template <class Reader>
-DecodedObject decode(Reader&& reader) {
-  auto headerBuf = reader(sizeof(Header));
+DecodedObject decode(Reader&& reader, SerializationStats* stats) {
+  using detail::StatsTimer;
+  using detail::statsCounter;
+
+  // Wrap the reader to keep track of the time spent reading
+  auto timedReader = [&reader, stats] (size_t n) {
+    StatsTimer timer(statsCounter(stats, &SerializationStats::readUs));
+    return reader(n);
+  };
+
+  auto headerBuf = timedReader(sizeof(Header));
   auto header = reinterpret_cast<const Header*>(headerBuf->data());
 
   auto magic = folly::Endian::little(header->magic);
@@ -154,7 +345,7 @@ DecodedObject decode(Reader&& reader) {
     throw std::runtime_error(
         folly::sformat("bad magic {:x}, expected {:x}", magic, kMagic));
   }
-  auto thriftHeaderBuf = reader(thriftHeaderLength);
+  auto thriftHeaderBuf = timedReader(thriftHeaderLength);
   ThriftHeader th;
   apache::thrift::CompactSerializer::deserialize(thriftHeaderBuf.get(), th);
 
@@ -163,27 +354,71 @@ DecodedObject decode(Reader&& reader) {
   }
 
   auto codec = folly::io::getCodec(static_cast<folly::io::CodecType>(th.codec));
-  auto compressedBuf = reader(th.compressedLength);
+
+  if (th.uncompressedLength < 0 || th.compressedLength < 0) {
+    throw std::runtime_error("negative length in header");
+  }
+
+  // Read and uncompress one chunk at a time, as the LuaObjectReader needs
+  // it, so that neither the compressed nor the uncompressed data is ever
+  // in memory in full. This matters when decoding from a non-seekable
+  // stream (such as a pipe), where the reader must copy the data into
+  // memory. Unchunked data is one big chunk.
+  int64_t compressedLength = 0;
+  uint64_t uncompressedLength = 0;
+  size_t nextChunk = 0;
+  auto readChunk = [&] () -> std::unique_ptr<folly::IOBuf> {
+    std::unique_ptr<folly::IOBuf> buf;
+    if (th.__isset.chunks) {
+      if (nextChunk == th.chunks.chunks.size()) {
+        return nullptr;
+      }
+      auto& chunk = th.chunks.chunks[nextChunk++];
+      if (chunk.compressedLength < 0 || chunk.uncompressedLength < 0) {
+        throw std::runtime_error("negative chunk length");
+      }
+      compressedLength += chunk.compressedLength;
+      if (compressedLength > th.compressedLength) {
+        throw std::runtime_error("chunk list exceeds compressed length");
+      }
+      auto compressedChunk = timedReader(chunk.compressedLength);
+      StatsTimer timer(statsCounter(stats, &SerializationStats::uncompressUs));
+      buf = uncompressChunk(codec.get(), compressedChunk.get(), chunk);
+    } else {
+      if (nextChunk++ != 0) {
+        return nullptr;
+      }
+      compressedLength = th.compressedLength;
+      auto compressedBuf = timedReader(th.compressedLength);
+      StatsTimer timer(statsCounter(stats, &SerializationStats::uncompressUs));
+      buf = codec->uncompress(compressedBuf.get(), th.uncompressedLength);
+    }
+    uncompressedLength += buf->computeChainDataLength();
+    return buf;
+  };
 
   DecodedObject decodedObject;
-  std::unique_ptr<folly::IOBuf> buf;
+  LuaObjectReader<decltype(readChunk)> objectReader(readChunk, stats);
+  objectReader.read(decodedObject.output);
 
-  if (th.__isset.chunks) {
-    buf = uncompressChunked(codec.get(), compressedBuf.get(), th.chunks);
-  } else {
-    buf = codec->uncompress(compressedBuf.get(), th.uncompressedLength);
+  if (compressedLength != th.compressedLength ||
+      uncompressedLength != static_cast<uint64_t>(th.uncompressedLength)) {
+    throw std::runtime_error("encoded length mismatch");
+  }
+  if (stats) {
+    stats->uncompressedBytes += th.uncompressedLength;
+    stats->compressedBytes += th.compressedLength;
   }
-  apache::thrift::CompactSerializer::deserialize(buf.get(),
-                                                 decodedObject.output);
 
   decodedObject.luaVersionInfo = std::move(th.luaVersionInfo);
   return decodedObject;
 }
 
 #define X(T) \
-template DecodedObject decode(T& reader);
+template DecodedObject decode(T& reader, SerializationStats* stats);
 X(StringReader)
 X(FILEReader)
+X(IOBufReader)
 #undef X
 
 void FILEWriter::operator()(std::unique_ptr<folly::IOBuf> data) {
@@ -222,4 +457,10 @@ std::unique_ptr<folly::IOBuf> StringReader::operator()(size_t n) {
   return buf;
 }
 
+std::unique_ptr<folly::IOBuf> IOBufReader::operator()(size_t n) {
+  std::unique_ptr<folly::IOBuf> buf;
+  cursor_.clone(buf, n);
+  return buf;
+}
+
 }}  // namespaces
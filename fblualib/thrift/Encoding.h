@@ -12,7 +12,9 @@
 #define FBLUA_THRIFT_ENCODING_H_
 
 #include <folly/io/Compression.h>
+#include <folly/io/Cursor.h>
 #include <folly/io/IOBuf.h>
+#include <fblualib/thrift/SerializationStats.h>
 #include <fblualib/thrift/if/gen-cpp2/LuaObject_types.h>
 
 namespace fblualib { namespace thrift {
@@ -20,11 +22,14 @@ namespace fblualib { namespace thrift {
 // void writer(std::unique_ptr<folly::IOBuf> data);
 constexpr int kAnyVersion = std::numeric_limits<int>::max();
 
+// If stats is not null, record encoding, compression, and write times,
+// and the encoded sizes.
 template <class Writer>
 void encode(const LuaObject& input, folly::io::CodecType codec,
             LuaVersionInfo versionInfo, Writer&& writer,
             int maxVersion = kAnyVersion,
-            uint64_t chunkLength = std::numeric_limits<uint64_t>::max());
+            uint64_t chunkLength = std::numeric_limits<uint64_t>::max(),
+            SerializationStats* stats = nullptr);
 
 struct DecodedObject {
   LuaObject output;
@@ -32,8 +37,11 @@ struct DecodedObject {
 };
 
 // std::unique_ptr<folly::IOBuf> reader(size_t n);
+//
+// If stats is not null, record read, decompression, and decoding times,
+// and the encoded sizes.
 template <class Reader>
-DecodedObject decode(Reader&& reader);
+DecodedObject decode(Reader&& reader, SerializationStats* stats = nullptr);
 
 class FILEWriter {
  public:
@@ -74,6 +82,18 @@ class StringReader {
   folly::ByteRange* str_;
 };
 
+class IOBufReader {
+ public:
+  // The IOBufs inside DecodedObject will share buf's memory; if buf is
+  // managed (refcounted), they keep it alive, so buf needn't outlive them.
+  explicit IOBufReader(const folly::IOBuf* buf) : cursor_(buf) { }
+
+  std::unique_ptr<folly::IOBuf> operator()(size_t n);
+
+ private:
+  folly::io::Cursor cursor_;
+};
+
 }}  // namespaces
 
 #endif /* FBLUA_THRIFT_ENCODING_H_ */
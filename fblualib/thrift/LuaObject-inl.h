@@ -11,8 +11,54 @@ namespace fblualib { namespace thrift {
 
 namespace detail {
 LuaVersionInfo cppVersionInfo();
+
+template <class Range>
+void reserveForRange(std::vector<LuaPrimitiveObject>& v, const Range& r,
+                     std::forward_iterator_tag) {
+  v.reserve(v.size() + std::distance(std::begin(r), std::end(r)));
+}
+
+// Can't compute the size of input ranges without consuming them
+template <class Range>
+void reserveForRange(std::vector<LuaPrimitiveObject>& /*v*/,
+                     const Range& /*r*/,
+                     std::input_iterator_tag) { }
+
+template <class Range>
+void reserveForRange(std::vector<LuaPrimitiveObject>& v, const Range& r) {
+  reserveForRange(
+      v, r,
+      typename std::iterator_traits<
+          decltype(std::begin(r))>::iterator_category());
+}
+
 }  // namespace detail
 
+template <class Range>
+TableBuilder& TableBuilder::appendNumbers(const Range& values) {
+  auto& t = table();
+  t.__isset.listKeys = true;
+  detail::reserveForRange(t.listKeys, values);
+  for (auto& v : values) {
+    t.listKeys.push_back(makePrimitive(double(v)));
+  }
+  return *this;
+}
+
+template <class Range>
+TableBuilder& TableBuilder::appendStrings(const Range& values, bool dedup) {
+  // Look up the table after each string, as builder_->string() may
+  // reallocate the list of references.
+  detail::reserveForRange(table().listKeys, values);
+  for (auto& v : values) {
+    auto pobj = dedup ?
+      builder_->string(folly::StringPiece(v)) :
+      makePrimitive(folly::StringPiece(v));
+    append(std::move(pobj));
+  }
+  return *this;
+}
+
 template <class Writer>
 void cppEncode(const LuaObject& input, folly::io::CodecType codec,
                Writer&& writer) {
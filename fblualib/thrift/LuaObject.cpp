@@ -5,6 +5,11 @@
 
 #include <fblualib/thrift/LuaObject.h>
 
+#include <typeinfo>
+
+#include <folly/Conv.h>
+#include <folly/Hash.h>
+
 namespace fblualib { namespace thrift {
 
 LuaObjectType getType(const LuaPrimitiveObject& pobj,
@@ -25,6 +30,7 @@ LuaObjectType getType(const LuaPrimitiveObject& pobj,
   if (ref.__isset.storageVal) return LuaObjectType::STORAGE;
   if (ref.__isset.envLocation) return LuaObjectType::EXTERNAL;
   if (ref.__isset.customUserDataVal) return LuaObjectType::USERDATA;
+  if (ref.__isset.cdataVal) return LuaObjectType::CDATA;
 
   throw std::invalid_argument("Invalid LuaObject");
 }
@@ -177,6 +183,144 @@ X(float)
 X(double)
 #undef X
 
+namespace {
+
+LuaPrimitiveObject makeRef(int64_t index) {
+  LuaPrimitiveObject r;
+  r.__isset.refVal = true;
+  r.refVal = index;
+  return r;
+}
+
+}  // namespace
+
+LuaPrimitiveObject TableBuilder::ref() const {
+  return makeRef(index_);
+}
+
+LuaTable& TableBuilder::table() const {
+  return builder_->refs_[index_].tableVal;
+}
+
+TableBuilder& TableBuilder::reserve(size_t listSize, size_t stringKeys,
+                                    size_t intKeys) {
+  auto& t = table();
+  if (listSize) {
+    t.listKeys.reserve(t.listKeys.size() + listSize);
+  }
+  if (stringKeys) {
+    t.stringKeys.reserve(t.stringKeys.size() + stringKeys);
+  }
+  if (intKeys) {
+    t.intKeys.reserve(t.intKeys.size() + intKeys);
+  }
+  return *this;
+}
+
+TableBuilder& TableBuilder::append(LuaPrimitiveObject value) {
+  auto& t = table();
+  t.__isset.listKeys = true;
+  t.listKeys.push_back(std::move(value));
+  return *this;
+}
+
+TableBuilder& TableBuilder::set(folly::StringPiece key,
+                                LuaPrimitiveObject value) {
+  auto& t = table();
+  t.__isset.stringKeys = true;
+  t.stringKeys[key.str()] = std::move(value);
+  return *this;
+}
+
+TableBuilder& TableBuilder::set(int64_t key, LuaPrimitiveObject value) {
+  auto& t = table();
+  t.__isset.intKeys = true;
+  t.intKeys[key] = std::move(value);
+  return *this;
+}
+
+LuaObjectBuilder::LuaObjectBuilder(thpp::SharingMode sharing)
+  : sharing_(sharing) { }
+
+void LuaObjectBuilder::reserveRefs(size_t n) {
+  refs_.reserve(n);
+}
+
+LuaPrimitiveObject LuaObjectBuilder::addRef(LuaRefObject&& ref) {
+  return appendRef(std::move(ref), refs_);
+}
+
+TableBuilder LuaObjectBuilder::newTable(size_t listSize, size_t stringKeys,
+                                        size_t intKeys) {
+  LuaRefObject ref;
+  ref.__isset.tableVal = true;
+  TableBuilder table(this, addRef(std::move(ref)).refVal);
+  table.reserve(listSize, stringKeys, intKeys);
+  return table;
+}
+
+LuaPrimitiveObject LuaObjectBuilder::string(folly::StringPiece val) {
+  auto hash = folly::hash::fnv64_buf(val.data(), val.size());
+  auto range = strings_.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (folly::StringPiece(refs_[it->second].stringVal) == val) {
+      return makeRef(it->second);
+    }
+  }
+
+  LuaRefObject ref;
+  ref.__isset.stringVal = true;
+  ref.stringVal.assign(val.data(), val.size());
+  auto r = addRef(std::move(ref));
+  strings_.emplace(hash, r.refVal);
+  return r;
+}
+
+template <class T>
+LuaPrimitiveObject LuaObjectBuilder::tensor(const thpp::Tensor<T>& val) {
+  auto key = folly::to<std::string>(
+      typeid(T).name(), ':', reinterpret_cast<uintptr_t>(val.data()));
+  for (auto s : val.sizes()) {
+    folly::toAppend(',', s, &key);
+  }
+  key.push_back(':');
+  for (auto s : val.strides()) {
+    folly::toAppend(',', s, &key);
+  }
+
+  auto pos = tensors_.find(key);
+  if (pos != tensors_.end()) {
+    return makeRef(pos->second);
+  }
+
+  auto r = append(val, refs_, sharing_);
+  tensors_.emplace(std::move(key), r.refVal);
+  // Keep the data alive, so the address can't be reused by a different
+  // tensor while we're building.
+  pinnedTensors_.push_back(std::make_shared<thpp::Tensor<T>>(val));
+  return r;
+}
+
+#define X(T) template LuaPrimitiveObject LuaObjectBuilder::tensor( \
+    const thpp::Tensor<T>&);
+X(unsigned char)
+X(int32_t)
+X(int64_t)
+X(float)
+X(double)
+#undef X
+
+LuaObject LuaObjectBuilder::finish(LuaPrimitiveObject value) {
+  LuaObject obj;
+  obj.value = std::move(value);
+  obj.refs = std::move(refs_);
+  refs_.clear();
+  strings_.clear();
+  tensors_.clear();
+  pinnedTensors_.clear();
+  return obj;
+}
+
 TableIterator tableBegin(const LuaPrimitiveObject& pobj,
                          const LuaRefList& refs) {
   return TableIterator(getTable(pobj, refs));
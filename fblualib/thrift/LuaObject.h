@@ -14,6 +14,12 @@
 #ifndef FBLUA_THRIFT_LUAOBJECT_H_
 #define FBLUA_THRIFT_LUAOBJECT_H_
 
+#include <iterator>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include <boost/iterator.hpp>
 #include <fblualib/thrift/Encoding.h>
 #include <fblualib/thrift/if/gen-cpp2/LuaObject_types.h>
@@ -33,6 +39,7 @@ enum class LuaObjectType {
   STORAGE,
   EXTERNAL,  // not encoded -- assumed to exist in environment
   USERDATA,  // (custom) userdata (not tensor / storage)
+  CDATA,     // LuaJIT cdata (ffivector)
 };
 
 // Readers
@@ -200,6 +207,105 @@ inline LuaObject make(const thpp::Tensor<T>& val,
   return r;
 }
 
+// Builders
+//
+// For constructing large objects (tables with many elements, or many
+// tables), use LuaObjectBuilder rather than assembling LuaTable structs by
+// hand. The builder owns the list of references for the object being built,
+// lets you presize tables, and deduplicates repeated strings and tensors
+// (storing each only once, as a shared reference).
+//
+// LuaObjectBuilder builder;
+// auto root = builder.newTable(0, 2);  // 2 string keys
+// auto vocab = builder.newTable(words.size());
+// vocab.appendStrings(words);
+// root.set("vocab", vocab.ref());
+// root.set("weights", builder.tensor(weights));
+// LuaObject obj = builder.finish(root.ref());
+
+class LuaObjectBuilder;
+
+// Handle to a table being built by a LuaObjectBuilder. Cheap to copy; valid
+// until the builder's finish() is called.
+class TableBuilder {
+  friend class LuaObjectBuilder;
+ public:
+  // Reference to this table, to be stored as a value in other tables
+  // (or passed to LuaObjectBuilder::finish())
+  LuaPrimitiveObject ref() const;
+
+  // Reserve space for the given number of additional elements
+  TableBuilder& reserve(size_t listSize, size_t stringKeys = 0,
+                        size_t intKeys = 0);
+
+  // Append to the list part of the table (Lua indices 1, 2, ...)
+  TableBuilder& append(LuaPrimitiveObject value);
+
+  // Append all numbers in a range (std::vector<double>, etc)
+  template <class Range>
+  TableBuilder& appendNumbers(const Range& values);
+
+  // Append all strings in a range (std::vector<std::string>, etc). If dedup
+  // is true, the strings are stored as deduplicated references (see
+  // LuaObjectBuilder::string()); otherwise, they are stored inline.
+  template <class Range>
+  TableBuilder& appendStrings(const Range& values, bool dedup = false);
+
+  // Set table[key] = value. Use append() for the list part of the table.
+  TableBuilder& set(folly::StringPiece key, LuaPrimitiveObject value);
+  TableBuilder& set(int64_t key, LuaPrimitiveObject value);
+
+ private:
+  TableBuilder(LuaObjectBuilder* builder, int64_t index)
+    : builder_(builder), index_(index) { }
+
+  LuaTable& table() const;
+
+  LuaObjectBuilder* builder_;
+  int64_t index_;
+};
+
+class LuaObjectBuilder {
+  friend class TableBuilder;
+ public:
+  explicit LuaObjectBuilder(
+      thpp::SharingMode sharing = thpp::SHARE_IOBUF_MANAGED);
+
+  // Reserve space for the given number of references (tables, deduplicated
+  // strings, tensors)
+  void reserveRefs(size_t n);
+
+  // Create a new (empty) table, with space reserved for the given number
+  // of elements.
+  TableBuilder newTable(size_t listSize = 0, size_t stringKeys = 0,
+                        size_t intKeys = 0);
+
+  // Return a reference to a string. Equal strings share the same
+  // reference.
+  LuaPrimitiveObject string(folly::StringPiece val);
+
+  // Return a reference to a tensor. Tensors that are identical views of
+  // the same data (same data pointer, type, sizes, and strides) share the
+  // same reference. The builder keeps the tensors alive until finish().
+  template <class T>
+  LuaPrimitiveObject tensor(const thpp::Tensor<T>& val);
+
+  // Return the object (with the given value) and reset the builder, which
+  // may then be used to build another object.
+  LuaObject finish(LuaPrimitiveObject value);
+
+ private:
+  LuaPrimitiveObject addRef(LuaRefObject&& ref);
+
+  thpp::SharingMode sharing_;
+  LuaRefList refs_;
+  // Hash of string -> indexes in refs_ of strings with that hash
+  std::unordered_multimap<uint64_t, int64_t> strings_;
+  // Tensor identity (see tensor()) -> index in refs_
+  std::unordered_map<std::string, int64_t> tensors_;
+  std::vector<std::shared_ptr<void>> pinnedTensors_;
+};
+
 // Serialize to string or file, see Encoding.h
 template <class Writer>
 void cppEncode(const LuaObject& input, folly::io::CodecType codec,
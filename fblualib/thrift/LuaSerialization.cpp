@@ -8,11 +8,26 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
 #include <lua.hpp>
 #include <fblualib/LuaUtils.h>
 #include "Encoding.h"
 #include "Serialization.h"
+#include "SharedMemory.h"
+#include <folly/executors/CPUThreadPoolExecutor.h>
 #include <folly/io/Compression.h>
+#include <glog/logging.h>
 
 using namespace fblualib;
 using namespace fblualib::thrift;
@@ -35,6 +50,91 @@ CodecInfo gCodecs[] = {
 
 constexpr size_t kCodecCount = sizeof(gCodecs) / sizeof(gCodecs[0]);
 
+constexpr size_t kDefaultLargestSubtrees = 10;
+
+// Decode the optional "stats" argument at the given index: nil or false
+// means that no statistics are collected; true means that statistics are
+// collected, together with the kDefaultLargestSubtrees largest subtrees;
+// a number n means that statistics are collected, together with the
+// n largest subtrees.
+std::unique_ptr<SerializationStats> getStatsArg(lua_State* L, int index) {
+  int type = lua_type(L, index);
+  if (type == LUA_TNONE || type == LUA_TNIL ||
+      (type == LUA_TBOOLEAN && !lua_toboolean(L, index))) {
+    return nullptr;
+  }
+  auto stats = std::make_unique<SerializationStats>();
+  if (type == LUA_TBOOLEAN) {
+    stats->maxLargestSubtrees = kDefaultLargestSubtrees;
+  } else {
+    stats->maxLargestSubtrees = luaGetNumberChecked<size_t>(L, index);
+  }
+  return stats;
+}
+
+// Push statistics as a Lua table:
+// {
+//   time = { traverse = seconds, make_portable = ..., encode = ...,
+//            compress = ..., write = ..., read = ..., uncompress = ...,
+//            decode = ..., deserialize = ... },
+//   uncompressed_bytes = n,
+//   compressed_bytes = n,
+//   max_buffered_bytes = n,
+//   kinds = { [kind] = { count = n, bytes = n }, ... },
+//   largest_subtrees = { { path = 'a.b[3]', bytes = n }, ... },
+// }
+int pushStats(lua_State* L, const SerializationStats& stats) {
+  lua_newtable(L);
+
+  lua_newtable(L);
+  auto setTime = [L] (const char* name, int64_t us) {
+    lua_pushnumber(L, double(us) / 1e6);
+    lua_setfield(L, -2, name);
+  };
+  setTime("traverse", stats.traverseUs);
+  setTime("make_portable", stats.makePortableUs);
+  setTime("encode", stats.encodeUs);
+  setTime("compress", stats.compressUs);
+  setTime("write", stats.writeUs);
+  setTime("read", stats.readUs);
+  setTime("uncompress", stats.uncompressUs);
+  setTime("decode", stats.decodeUs);
+  setTime("deserialize", stats.deserializeUs);
+  lua_setfield(L, -2, "time");
+
+  lua_pushnumber(L, stats.uncompressedBytes);
+  lua_setfield(L, -2, "uncompressed_bytes");
+  lua_pushnumber(L, stats.compressedBytes);
+  lua_setfield(L, -2, "compressed_bytes");
+  lua_pushnumber(L, stats.maxBufferedBytes);
+  lua_setfield(L, -2, "max_buffered_bytes");
+
+  lua_newtable(L);
+  for (auto& p : stats.kinds) {
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, p.second.count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, p.second.bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_setfield(L, -2, p.first.c_str());
+  }
+  lua_setfield(L, -2, "kinds");
+
+  lua_createtable(L, stats.largestSubtrees.size(), 0);
+  for (size_t i = 0; i < stats.largestSubtrees.size(); ++i) {
+    auto& p = stats.largestSubtrees[i];
+    lua_createtable(L, 0, 2);
+    lua_pushlstring(L, p.first.data(), p.first.size());
+    lua_setfield(L, -2, "path");
+    lua_pushnumber(L, p.second);
+    lua_setfield(L, -2, "bytes");
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "largest_subtrees");
+
+  return 1;
+}
+
 LuaVersionInfo getVersion(lua_State* L) {
   int origTop = lua_gettop(L);
   lua_getglobal(L, "jit");
@@ -76,14 +176,21 @@ int serializeToString(lua_State* L) {
   auto luaChunkSize = luaGetNumber<uint64_t>(L, 4);
   uint64_t chunkSize =
     luaChunkSize ? *luaChunkSize : std::numeric_limits<uint64_t>::max();
+  auto stats = getStatsArg(L, 5);
 
-  auto obj = Serializer::toThrift(L, 1, 3);
+  Serializer::Options options;
+  options.stats = stats.get();
+  auto obj = Serializer::toThrift(L, 1, 3, std::move(options));
 
   StringWriter writer;
-  encode(obj, codecType, getVersion(L), writer, kAnyVersion, chunkSize);
+  encode(obj, codecType, getVersion(L), writer, kAnyVersion, chunkSize,
+         stats.get());
 
   auto str = folly::StringPiece(writer.finish());
   lua_pushlstring(L, str.data(), str.size());
+  if (stats) {
+    return 1 + pushStats(L, *stats);
+  }
   return 1;
 }
 
@@ -95,21 +202,30 @@ int serializeToFile(lua_State* L) {
   auto luaChunkSize = luaGetNumber<uint64_t>(L, 5);
   uint64_t chunkSize =
     luaChunkSize ? *luaChunkSize : std::numeric_limits<uint64_t>::max();
+  auto stats = getStatsArg(L, 6);
 
   auto fp = luaDecodeFILE(L, 2);
 
-  auto obj = Serializer::toThrift(L, 1, 4);
+  Serializer::Options options;
+  options.stats = stats.get();
+  auto obj = Serializer::toThrift(L, 1, 4, std::move(options));
 
   FILEWriter writer(fp);
-  encode(obj, codecType, getVersion(L),  writer, kAnyVersion, chunkSize);
+  encode(obj, codecType, getVersion(L),  writer, kAnyVersion, chunkSize,
+         stats.get());
 
+  if (stats) {
+    return pushStats(L, *stats);
+  }
   return 0;
 }
 
-int doDeserialize(lua_State* L, DecodedObject&& decodedObject, int envIdx) {
+int doDeserialize(lua_State* L, DecodedObject&& decodedObject, int envIdx,
+                  SerializationStats* stats) {
   auto version = getVersion(L);
 
   Deserializer::Options options;
+  options.stats = stats;
   // Check for bytecode version compatibility
   auto& decodedBytecodeVersion = decodedObject.luaVersionInfo.bytecodeVersion;
   if (decodedBytecodeVersion.empty() ||
@@ -117,20 +233,173 @@ int doDeserialize(lua_State* L, DecodedObject&& decodedObject, int envIdx) {
     options.allowBytecode = false;
   }
 
-  return Deserializer::fromThrift(L, std::move(decodedObject.output),
-                                  envIdx, std::move(options));
+  int n = Deserializer::fromThrift(L, std::move(decodedObject.output),
+                                   envIdx, std::move(options));
+  if (stats) {
+    n += pushStats(L, *stats);
+  }
+  return n;
 }
 
 int deserializeFromString(lua_State* L) {
   folly::ByteRange br(luaGetStringChecked(L, 1));
+  auto stats = getStatsArg(L, 3);
   StringReader reader(&br);
-  return doDeserialize(L, decode(reader), 2);
+  auto decoded = decode(reader, stats.get());
+  return doDeserialize(L, std::move(decoded), 2, stats.get());
 }
 
 int deserializeFromFile(lua_State* L) {
   auto fp = luaDecodeFILE(L, 1);
+  auto stats = getStatsArg(L, 3);
   FILEReader reader(fp);
-  return doDeserialize(L, decode(reader), 2);
+  auto decoded = decode(reader, stats.get());
+  return doDeserialize(L, std::move(decoded), 2, stats.get());
+}
+
+// Below this many input bytes in total, starting workers costs more than
+// decoding serially.
+constexpr size_t kParallelDecodeMinBytes = 1 << 20;
+
+// Worker threads for decodeParallel, shared by all calls (and Lua states),
+// started on first use and never destroyed, as they may be in use during
+// static destruction.
+folly::CPUThreadPoolExecutor& decodePool() {
+  static auto pool = new folly::CPUThreadPoolExecutor(
+      std::max(1U, std::thread::hardware_concurrency()));
+  return *pool;
+}
+
+// Decode (parse and decompress) the given serialized objects, on the calling
+// thread and up to numThreads - 1 workers from decodePool(). This doesn't
+// touch Lua, so it may run concurrently with other threads; the IOBufs in
+// the returned objects point into the input strings, which must outlive
+// them.
+std::vector<DecodedObject> decodeParallel(
+    const std::vector<folly::ByteRange>& inputs,
+    size_t numThreads) {
+  std::vector<DecodedObject> outputs(inputs.size());
+  size_t totalBytes = 0;
+  for (auto& br : inputs) {
+    totalBytes += br.size();
+  }
+  if (totalBytes < kParallelDecodeMinBytes) {
+    numThreads = 1;
+  } else {
+    numThreads = std::min(numThreads, decodePool().numThreads() + 1);
+  }
+  numThreads = std::max(size_t(1), std::min(numThreads, inputs.size()));
+
+  std::atomic<size_t> next(0);
+  std::vector<std::exception_ptr> errors(numThreads);
+
+  auto work = [&] (size_t tid) {
+    try {
+      size_t i;
+      while ((i = next++) < inputs.size()) {
+        auto br = inputs[i];
+        StringReader reader(&br);
+        outputs[i] = decode(reader);
+      }
+    } catch (...) {
+      errors[tid] = std::current_exception();
+      next = inputs.size();  // stop the other threads early
+    }
+  };
+
+  // The workers may start late if the pool is busy; the calling thread
+  // takes whatever they haven't, but must wait for all of them, as they
+  // refer to this frame.
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t pending = numThreads - 1;
+  for (size_t tid = 1; tid < numThreads; ++tid) {
+    decodePool().add([&, tid] {
+      work(tid);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--pending == 0) {
+        done.notify_one();
+      }
+    });
+  }
+  work(0);
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return pending == 0; });
+  }
+
+  for (auto& e : errors) {
+    if (e) {
+      std::rethrow_exception(e);
+    }
+  }
+
+  return outputs;
+}
+
+// Deserialize a list of strings; returns a list of objects. The Thrift
+// decoding and decompression happen in parallel (on up to num_threads
+// threads, default: number of CPUs; serially for small inputs); only the
+// creation of Lua objects happens on the calling thread.
+int deserializeFromStrings(lua_State* L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  auto luaNumThreads = luaGetNumber<size_t>(L, 3);
+  size_t numThreads =
+    luaNumThreads ? *luaNumThreads : std::thread::hardware_concurrency();
+
+  // The strings are kept alive by the table at index 1 for the duration of
+  // this call.
+  auto n = lua_objlen(L, 1);
+  std::vector<folly::ByteRange> inputs;
+  inputs.reserve(n);
+  for (size_t i = 1; i <= n; ++i) {
+    lua_rawgeti(L, 1, i);
+    inputs.emplace_back(luaGetStringChecked(L, -1));
+    lua_pop(L, 1);
+  }
+
+  auto decoded = decodeParallel(inputs, numThreads);
+
+  auto version = getVersion(L);
+  lua_createtable(L, n, 0);
+  for (size_t i = 0; i < n; ++i) {
+    Deserializer::Options options;
+    auto& decodedBytecodeVersion =
+      decoded[i].luaVersionInfo.bytecodeVersion;
+    if (decodedBytecodeVersion.empty() ||
+        decodedBytecodeVersion != version.bytecodeVersion) {
+      options.allowBytecode = false;
+    }
+    int r = Deserializer::fromThrift(L, std::move(decoded[i].output), 2,
+                                     std::move(options));
+    DCHECK_EQ(r, 1);
+    lua_rawseti(L, -2, i + 1);
+    // Release the decoded IOBufs as we go
+    decoded[i] = DecodedObject();
+  }
+
+  return 1;
+}
+
+int serializeToSharedMemory(lua_State* L) {
+  auto obj = Serializer::toThrift(L, 1, 2);
+  int fd = writeSharedMemory(std::move(obj), getVersion(L));
+  lua_pushinteger(L, fd);
+  return 1;
+}
+
+int deserializeFromSharedMemory(lua_State* L) {
+  int fd = luaL_checkinteger(L, 1);
+  auto decoded = readSharedMemory(fd);
+  return doDeserialize(L, std::move(decoded), 2, nullptr);
+}
+
+int closeSharedMemory(lua_State* L) {
+  int fd = luaL_checkinteger(L, 1);
+  if (close(fd) != 0) {
+    luaL_error(L, "close(%d) failed: %s", fd, strerror(errno));
+  }
+  return 0;
 }
 
 int setCallbacks(lua_State* L) {
@@ -142,12 +411,26 @@ int setCallbacks(lua_State* L) {
   return 0;
 }
 
+int setCDataCallbacks(lua_State* L) {
+  // Set serialization and deserialization callbacks for cdata (ffivectors)
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  setCDataSerializationCallbacks(L, 1, 2, 3);
+  return 0;
+}
+
 const struct luaL_reg gFuncs[] = {
   {"_to_string", serializeToString},
   {"_to_file", serializeToFile},
   {"_from_string", deserializeFromString},
   {"_from_file", deserializeFromFile},
+  {"_from_strings", deserializeFromStrings},
+  {"_to_shm", serializeToSharedMemory},
+  {"_from_shm", deserializeFromSharedMemory},
+  {"_close_shm", closeSharedMemory},
   {"_set_callbacks", setCallbacks},
+  {"_set_cdata_callbacks", setCDataCallbacks},
   {nullptr, nullptr},  // sentinel
 };
 
@@ -9,6 +9,10 @@
  */
 
 #include "Serialization.h"
+
+#include <algorithm>
+#include <functional>
+
 #include <fblualib/LuaUtils.h>
 #include <fblualib/UserData.h>
 #include <thrift/lib/cpp2/protocol/Serializer.h>
@@ -24,6 +28,9 @@ namespace {
 char kSpecialSerializationCallbackKey;
 char kSpecialDeserializationCallbackKey;
 char kUserDataCallbackKey;
+char kCDataSerializationCallbackKey;
+char kCDataDeserializationCallbackKey;
+char kCDataOwnerCheckKey;
 
 }  // namespace
 
@@ -41,6 +48,22 @@ void setSpecialDeserializationCallback(lua_State* L, int index) {
   lua_settable(L, LUA_REGISTRYINDEX);
 }
 
+void setCDataSerializationCallbacks(lua_State* L, int serializeIndex,
+                                    int deserializeIndex, int isOwnerIndex) {
+  serializeIndex = luaRealIndex(L, serializeIndex);
+  deserializeIndex = luaRealIndex(L, deserializeIndex);
+  isOwnerIndex = luaRealIndex(L, isOwnerIndex);
+  lua_pushlightuserdata(L, &kCDataSerializationCallbackKey);
+  lua_pushvalue(L, serializeIndex);
+  lua_settable(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, &kCDataDeserializationCallbackKey);
+  lua_pushvalue(L, deserializeIndex);
+  lua_settable(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, &kCDataOwnerCheckKey);
+  lua_pushvalue(L, isOwnerIndex);
+  lua_settable(L, LUA_REGISTRYINDEX);
+}
+
 namespace {
 
 int constructUserDataCallbackTable(lua_State* L) {
@@ -361,6 +384,8 @@ LuaObject Serializer::toThrift(lua_State* L, int index, int invEnvIdx,
 }
 
 LuaPrimitiveObject Serializer::serialize(int index) {
+  detail::StatsTimer timer(
+      detail::statsCounter(options_.stats, &SerializationStats::traverseUs));
   int top = lua_gettop(L_);
   index = luaRealIndex(L_, index);
 
@@ -389,9 +414,114 @@ MemSerializedData Serializer::finishLocal() {
   lua_newtable(L_);
   lua_rawseti(L_, -2, 1);
   lua_pop(L_, 1);
+  flushLargestSubtrees();
   return std::move(refs_);
 }
 
+void Serializer::recordStats(folly::StringPiece kind, uint64_t bytes) {
+  if (!options_.stats) {
+    return;
+  }
+  statsBytes_ += bytes;
+  auto& count = options_.stats->kinds[kind.str()];
+  ++count.count;
+  count.bytes += bytes;
+}
+
+void Serializer::recordSubtree(uint64_t startBytes) {
+  if (!options_.stats) {
+    return;
+  }
+  size_t maxSubtrees = options_.stats->maxLargestSubtrees;
+  if (maxSubtrees == 0) {
+    return;
+  }
+  auto bytes = statsBytes_ - startBytes;
+  // largestSubtrees_ is a min-heap, so the smallest recorded subtree is
+  // at the front.
+  if (largestSubtrees_.size() >= maxSubtrees) {
+    if (bytes <= largestSubtrees_.front().first) {
+      return;
+    }
+    std::pop_heap(largestSubtrees_.begin(), largestSubtrees_.end(),
+                  std::greater<>());
+    largestSubtrees_.pop_back();
+  }
+  largestSubtrees_.emplace_back(
+      bytes, statsPath_.empty() ? std::string("<root>") : statsPath_);
+  std::push_heap(largestSubtrees_.begin(), largestSubtrees_.end(),
+                 std::greater<>());
+}
+
+void Serializer::pushStatsPathKey(int keyIndex) {
+  if (!options_.stats) {
+    return;
+  }
+  switch (lua_type(L_, keyIndex)) {
+  case LUA_TSTRING: {
+    size_t len;
+    const char* data = lua_tolstring(L_, keyIndex, &len);
+    statsPathLengths_.push_back(statsPath_.size());
+    if (!statsPath_.empty()) {
+      statsPath_.push_back('.');
+    }
+    statsPath_.append(data, len);
+    break;
+  }
+  case LUA_TNUMBER:
+    pushStatsPath(folly::sformat("[{}]", lua_tonumber(L_, keyIndex)));
+    break;
+  case LUA_TBOOLEAN:
+    pushStatsPath(lua_toboolean(L_, keyIndex) ? "[true]" : "[false]");
+    break;
+  default:
+    pushStatsPath("[?]");
+  }
+}
+
+void Serializer::pushStatsPathIndex(int64_t i) {
+  if (!options_.stats) {
+    return;
+  }
+  pushStatsPath(folly::sformat("[{}]", i));
+}
+
+void Serializer::pushStatsPath(folly::StringPiece component) {
+  if (!options_.stats) {
+    return;
+  }
+  statsPathLengths_.push_back(statsPath_.size());
+  statsPath_.append(component.data(), component.size());
+}
+
+void Serializer::popStatsPath() {
+  if (!options_.stats) {
+    return;
+  }
+  DCHECK(!statsPathLengths_.empty());
+  statsPath_.resize(statsPathLengths_.back());
+  statsPathLengths_.pop_back();
+}
+
+void Serializer::flushLargestSubtrees() {
+  if (!options_.stats || largestSubtrees_.empty()) {
+    return;
+  }
+  auto& out = options_.stats->largestSubtrees;
+  for (auto& p : largestSubtrees_) {
+    out.emplace_back(std::move(p.second), p.first);
+  }
+  largestSubtrees_.clear();
+  std::sort(out.begin(), out.end(),
+            [] (const std::pair<std::string, uint64_t>& a,
+                const std::pair<std::string, uint64_t>& b) {
+              return a.second > b.second;
+            });
+  if (out.size() > options_.stats->maxLargestSubtrees) {
+    out.resize(options_.stats->maxLargestSubtrees);
+  }
+}
+
 LuaRefList& MemSerializedData::makePortable(const SerializerOptions& options) {
   if (!isPortable_) {
     for (auto& ref : luaRefs_) {
@@ -405,6 +535,11 @@ LuaRefList& MemSerializedData::makePortable(const SerializerOptions& options) {
   return luaRefs_;
 }
 
+const LuaRefList& MemSerializedData::portableRefs() const {
+  CHECK(isPortable_);
+  return luaRefs_;
+}
+
 #define XLOG DVLOG(XLOG_LEVEL) << "S: " << indent(level)
 
 namespace {
@@ -534,15 +669,127 @@ bool Serializer::doSerializeUserData(
 
   if (options_.localMode) {
     XLOG << "custom mem userdata [" << key << "]";
+    recordStats(folly::to<std::string>("userdata:", key), 0);
     doSerializeMemUserData(ref, std::move(obj));
   } else {
     XLOG << "custom userdata [" << key << "]";
     ref = obj->serializeObject(options_);
+    recordStats(folly::to<std::string>("userdata:", key),
+                ref.customUserDataVal.value.computeChainDataLength());
   }
 
   return true;
 }
 
+bool Serializer::doSerializeCData(LuaRefObject& ref, int index) {
+  LuaStackGuard guard(L_);
+
+  lua_pushlightuserdata(L_, &kCDataSerializationCallbackKey);
+  lua_gettable(L_, LUA_REGISTRYINDEX);
+  if (lua_isnil(L_, -1)) {
+    return false;
+  }
+
+  // key, address1, length1, owner1, ... = callback(obj)
+  int top = lua_gettop(L_) - 1;
+  lua_pushvalue(L_, index);
+  lua_call(L_, 1, LUA_MULTRET);
+  int n = lua_gettop(L_) - top;
+  if (n == 0 || lua_isnil(L_, top + 1)) {
+    return false;
+  }
+
+  // Is the value at idx a LuaCDataOwner? Only then may we read it.
+  auto isOwner = [this] (int idx) {
+    if (lua_type(L_, idx) != kLuaTypeCData) {
+      return false;
+    }
+    lua_pushlightuserdata(L_, &kCDataOwnerCheckKey);
+    lua_gettable(L_, LUA_REGISTRYINDEX);
+    if (lua_isnil(L_, -1)) {
+      lua_pop(L_, 1);
+      return false;
+    }
+    lua_pushvalue(L_, idx);
+    // An error counts as "no"; we must still release the other owners.
+    bool ok = lua_pcall(L_, 1, 1, 0) == 0 && lua_toboolean(L_, -1);
+    lua_pop(L_, 1);
+    return ok;
+  };
+
+  // Collect the owners first, so that we can release them all if the
+  // results are invalid.
+  struct Buffer {
+    const void* data;
+    uint64_t size;
+    LuaCDataOwner owner;
+  };
+  std::vector<Buffer> buffers;
+  bool valid = (n % 3 == 1 && lua_type(L_, top + 1) == LUA_TSTRING);
+  for (int i = top + 2; i <= top + n - 2; i += 3) {
+    Buffer buf{nullptr, 0, {nullptr, nullptr}};
+    if (isOwner(i + 2)) {
+      buf.owner = *static_cast<const LuaCDataOwner*>(lua_topointer(L_, i + 2));
+    } else if (!lua_isnil(L_, i + 2)) {
+      valid = false;
+      continue;
+    }
+    if (lua_type(L_, i) != LUA_TNUMBER || lua_type(L_, i + 1) != LUA_TNUMBER) {
+      valid = false;
+    } else {
+      buf.data = reinterpret_cast<const void*>(
+          static_cast<uintptr_t>(lua_tonumber(L_, i)));
+      buf.size = static_cast<uint64_t>(lua_tonumber(L_, i + 1));
+    }
+    buffers.push_back(buf);
+  }
+
+  auto release = [] (const LuaCDataOwner& owner) {
+    if (owner.release) {
+      owner.release(owner.context);
+    }
+  };
+  if (!valid) {
+    for (auto& buf : buffers) {
+      release(buf.owner);
+    }
+    luaL_error(L_, "invalid cdata serialization");
+  }
+
+  ref.__isset.cdataVal = true;
+  auto& cdata = ref.cdataVal;
+  size_t len;
+  auto key = lua_tolstring(L_, top + 1, &len);
+  cdata.key.assign(key, len);
+
+  // Buffers with an owner are wrapped, and released along with the IOBuf;
+  // the others are copied.
+  auto freeOwned = [] (void* /*buf*/, void* userData) {
+    std::unique_ptr<LuaCDataOwner> owner(
+        static_cast<LuaCDataOwner*>(userData));
+    owner->release(owner->context);
+  };
+  uint64_t bytes = 0;
+  for (auto& buf : buffers) {
+    if (buf.size == 0) {
+      cdata.buffers.emplace_back();
+      release(buf.owner);
+    } else if (!buf.owner.release || options_.sharing == thpp::SHARE_NONE) {
+      cdata.buffers.emplace_back(folly::IOBuf::COPY_BUFFER, buf.data,
+                                 buf.size);
+      release(buf.owner);
+    } else {
+      cdata.buffers.emplace_back(folly::IOBuf::TAKE_OWNERSHIP,
+                                 const_cast<void*>(buf.data), buf.size,
+                                 freeOwned, new LuaCDataOwner(buf.owner));
+    }
+    bytes += buf.size;
+  }
+
+  recordStats(folly::to<std::string>("cdata:", cdata.key), bytes);
+  return true;
+}
+
 void Serializer::doSerialize(LuaPrimitiveObject& obj, int index,
                              const SerializationContext& ctx,
                              int level, bool allowRefs) {
@@ -550,6 +797,7 @@ void Serializer::doSerialize(LuaPrimitiveObject& obj, int index,
 
   LuaRefObject ref;
   int64_t refIdx = -1;
+  uint64_t statsStartBytes = statsBytes_;
 
   // Check if we've encountered it before, record if not
   const void* luaPtr = nullptr;
@@ -598,6 +846,7 @@ void Serializer::doSerialize(LuaPrimitiveObject& obj, int index,
     }
 
     if (found) {
+      recordStats("external", 0);
       refs_.luaRefs_[refIdx] = std::move(ref);
       return;
     }
@@ -615,17 +864,20 @@ void Serializer::doSerialize(LuaPrimitiveObject& obj, int index,
     obj.doubleVal = lua_tonumber(L_, index);
     XLOG << "number " << obj.doubleVal;
     obj.__isset.doubleVal = true;
+    recordStats("number", sizeof(double));
     break;
   case LUA_TBOOLEAN:
     DCHECK_EQ(refIdx, -1);
     obj.boolVal = lua_toboolean(L_, index);
     XLOG << "boolean " << obj.boolVal;
     obj.__isset.boolVal = true;
+    recordStats("boolean", sizeof(bool));
     break;
   case LUA_TSTRING: {
     size_t len;
     const char* data = lua_tolstring(L_, index, &len);
     XLOG << "string [" << folly::StringPiece(data, len) << "]";
+    recordStats("string", len);
     // Strings may be references or not, depending on whether they're interned
     if (refIdx == -1) {
       obj.stringVal.assign(data, len);
@@ -644,7 +896,9 @@ void Serializer::doSerialize(LuaPrimitiveObject& obj, int index,
     DCHECK_GE(refIdx, 0);
     ref.__isset.tableVal = true;
     XLOG << "table";
+    recordStats("table", 0);
     doSerializeTable(ref.tableVal, index, ctx, level);
+    recordSubtree(statsStartBytes);
     break;
   case LUA_TUSERDATA:
     if (!allowRefs) {
@@ -656,6 +910,7 @@ void Serializer::doSerialize(LuaPrimitiveObject& obj, int index,
       auto tensor = luaGetTensor<TYPE>(L_, index); \
       if (tensor) { \
         XLOG << "Tensor<" #TYPE ">"; \
+        recordStats("tensor:" #TYPE, (*tensor)->size() * sizeof(TYPE)); \
         if (options_.localMode) { \
           doSerializeMemUserData( \
               ref, \
@@ -682,6 +937,7 @@ void Serializer::doSerialize(LuaPrimitiveObject& obj, int index,
       auto storage = luaGetStorage<TYPE>(L_, index); \
       if (storage) { \
         XLOG << "Storage<" #TYPE ">"; \
+        recordStats("storage:" #TYPE, storage->size() * sizeof(TYPE)); \
         if (options_.localMode) { \
           doSerializeMemUserData( \
               ref, \
@@ -722,6 +978,16 @@ void Serializer::doSerialize(LuaPrimitiveObject& obj, int index,
     XLOG << "function";
     doSerializeFunction(ref.functionVal, index, ctx, level);
     break;
+  case kLuaTypeCData:
+    if (!allowRefs) {
+      luaL_error(L_, "references not allowed (cdata)");
+    }
+    DCHECK_GE(refIdx, 0);
+    XLOG << "cdata";
+    if (!doSerializeCData(ref, index)) {
+      luaL_error(L_, "invalid cdata");
+    }
+    break;
   default:
     luaL_error(L_, "invalid type %d", type);
   }
@@ -786,7 +1052,9 @@ void Serializer::doSerializeTable(LuaTable& obj,
     if (metatableIdx) {
       obj.__isset.metatable = true;
       XLOG << "metatable";
+      pushStatsPath("<metatable>");
       doSerialize(obj.metatable, metatableIdx, ctx, level + 1);
+      popStatsPath();
     }
   }
 
@@ -808,7 +1076,9 @@ void Serializer::doSerializeTable(LuaTable& obj,
       XLOG << "(list) [" << i << "]";
       obj.__isset.listKeys = true;
       obj.listKeys.emplace_back();
+      pushStatsPathIndex(i);
       doSerialize(obj.listKeys.back(), -1, ctx, level + 1);
+      popStatsPath();
       lua_pop(L_, 1);
     }
   }
@@ -817,6 +1087,9 @@ void Serializer::doSerializeTable(LuaTable& obj,
   lua_pushnil(L_);
   while (lua_next(L_, index)) {
     int keyType = lua_type(L_, -2);
+    // Note that pushStatsPathKey must not convert the key (numbers to
+    // strings, for example), as that would confuse lua_next.
+    pushStatsPathKey(-2);
 
     switch (keyType) {
     case LUA_TSTRING: {
@@ -860,6 +1133,7 @@ void Serializer::doSerializeTable(LuaTable& obj,
       XLOG << "(other) value";
       doSerialize(obj.otherKeys.back().value, -1, ctx, level + 1);
     }
+    popStatsPath();
     lua_pop(L_, 1);  // pop value
   }
 
@@ -886,12 +1160,15 @@ void Serializer::doSerializeFunction(LuaFunction& obj,
   }
   lua_pop(L_, 1);
   obj.bytecode = std::move(*queue.move());
+  recordStats("function", obj.bytecode.computeChainDataLength());
 
   const char* name;
   for (int i = 1; (name = lua_getupvalue(L_, index, i)) != nullptr; ++i) {
     obj.upvalues.emplace_back();
     XLOG << "upvalue " << i << " (" << name << ")";
+    pushStatsPath(folly::to<std::string>("<upvalue ", name, ">"));
     doSerialize(obj.upvalues.back(), -1, ctx, level + 1);
+    popStatsPath();
     lua_pop(L_, 1);
   }
 }
@@ -913,6 +1190,8 @@ Deserializer::Deserializer(lua_State* L, Options options)
 }
 
 void Deserializer::start(const LuaRefList* refs) {
+  detail::StatsTimer timer(
+      detail::statsCounter(options_.stats, &SerializationStats::deserializeUs));
   DCHECK(!refs_);
   DCHECK(refs);
   DCHECK(!memUserData_);
@@ -922,6 +1201,8 @@ void Deserializer::start(const LuaRefList* refs) {
 }
 
 void Deserializer::start(const MemSerializedData* serializedData) {
+  detail::StatsTimer timer(
+      detail::statsCounter(options_.stats, &SerializationStats::deserializeUs));
   DCHECK(!refs_);
   DCHECK(!memUserData_);
   DCHECK(serializedData);
@@ -979,6 +1260,8 @@ int Deserializer::fromThrift(lua_State* L, const LuaObject& obj,
 }
 
 int Deserializer::deserialize(const LuaPrimitiveObject& obj) {
+  detail::StatsTimer timer(
+      detail::statsCounter(options_.stats, &SerializationStats::deserializeUs));
   int top = lua_gettop(L_);
   lua_pushlightuserdata(L_, this);
   lua_gettable(L_, LUA_REGISTRYINDEX);
@@ -1054,6 +1337,33 @@ bool deserializeUserData(lua_State* L, const LuaUserData& cud) {
   return true;
 }
 
+// Push the object created by the cdata deserialization callback
+void deserializeCData(lua_State* L, const LuaCData& cdata) {
+  lua_pushlightuserdata(L, &kCDataDeserializationCallbackKey);
+  lua_gettable(L, LUA_REGISTRYINDEX);
+  if (lua_isnil(L, -1)) {
+    luaL_error(L, "no cdata deserializer (is fb.ffivector installed?)");
+  }
+  luaL_checkstack(L, 1 + 2 * cdata.buffers.size(), "too many buffers");
+  lua_pushlstring(L, cdata.key.data(), cdata.key.size());
+
+  // The callback gets each buffer as one range; decoding may have split
+  // some (across chunks), so gather those first.
+  std::vector<std::unique_ptr<folly::IOBuf>> coalesced;
+  for (auto& buf : cdata.buffers) {
+    const folly::IOBuf* contiguous = &buf;
+    if (buf.isChained()) {
+      coalesced.push_back(buf.clone());
+      coalesced.back()->coalesce();
+      contiguous = coalesced.back().get();
+    }
+    lua_pushnumber(L, reinterpret_cast<uintptr_t>(contiguous->data()));
+    lua_pushnumber(L, contiguous->length());
+  }
+
+  lua_call(L, 1 + 2 * cdata.buffers.size(), 1);
+}
+
 }  // namespace
 
 void Deserializer::doDeserializeRefs() {
@@ -1141,6 +1451,10 @@ void Deserializer::doDeserializeRefs() {
         luaL_error(L_, "Invalid custom userdata");
       }
       record();
+    } else if (ref.__isset.cdataVal) {
+      XLOG << "cdata [" << ref.cdataVal.key << "]";
+      deserializeCData(L_, ref.cdataVal);
+      record();
     } else if (ref.__isset.envLocation) {
       XLOG << "external env value";
       if (envIdx == 0) {
@@ -18,6 +18,7 @@
 
 #include <folly/Optional.h>
 #include <folly/io/IOBuf.h>
+#include <fblualib/thrift/SerializationStats.h>
 #include <fblualib/thrift/if/gen-cpp2/LuaObject_types.h>
 #include <thpp/Storage.h>
 
@@ -92,10 +93,45 @@ void setSpecialSerializationCallback(lua_State* L, int index);
 // end
 void setSpecialDeserializationCallback(lua_State* L, int index);
 
+// Set the Lua functions at the given stack indices as the cdata
+// serialization and deserialization callbacks. LuaJIT cdata objects (in
+// practice, ffivectors; fb/thrift/init.lua sets callbacks from
+// fb.ffivector) are serialized as a string key and a list of buffers, given
+// as addresses (Lua numbers), lengths, and owners:
+//
+// key, address1, length1, owner1, ... = serialize(obj)
+// obj = deserialize(key, address1, length1, address2, length2, ...)
+//
+// serialize returns nil for cdata that it doesn't support (and we raise an
+// error). deserialize must copy the buffers, as they're only valid during
+// the call.
+//
+// An owner is either nil, in which case we copy the buffer, or a cdata
+// LuaCDataOwner holding a reference (such as a pin) that keeps the buffer
+// alive and in place; we don't copy the buffer then (unless
+// SerializerOptions::sharing is SHARE_NONE), and call release(context) from
+// the free callback of the IOBuf that wraps it, possibly on another thread.
+// We always call release exactly once, even if serialization fails.
+//
+// We can't check the ctype of a cdata from C, so isOwner(x) must return
+// true iff x is a cdata of the ctype that matches LuaCDataOwner; any other
+// owner is rejected (and never read).
+void setCDataSerializationCallbacks(lua_State* L, int serializeIndex,
+                                    int deserializeIndex, int isOwnerIndex);
+
+// Layout of the owners returned by cdata serialization callbacks
+struct LuaCDataOwner {
+  void (*release)(void* context);
+  void* context;
+};
+
 struct SerializerOptions {
   constexpr SerializerOptions() { }
   thpp::SharingMode sharing = thpp::SHARE_IOBUF_MANAGED;
   bool localMode = false;
+  // If not null, record traversal time, makePortable() time, and per-kind
+  // counts and sizes of serialized values; see SerializationStats.h.
+  SerializationStats* stats = nullptr;
 };
 
 // You may register callbacks to serialize custom full userdata types.
@@ -186,12 +222,20 @@ class MemSerializedData {
  public:
   MemSerializedData() { }
 
+  // Wrap a fully-serialized list of references (as in LuaObject.refs)
+  explicit MemSerializedData(LuaRefList refs) : luaRefs_(std::move(refs)) { }
+
   LuaRefList& makePortable(
       const SerializerOptions& options = SerializerOptions());
   bool isPortable() const {
     return isPortable_;
   }
 
+  // The fully-serialized references; only valid if isPortable(). Unlike
+  // makePortable(), doesn't modify the object, so it's safe to call while
+  // other threads deserialize from it.
+  const LuaRefList& portableRefs() const;
+
  private:
   LuaRefList luaRefs_;
   std::vector<std::unique_ptr<detail::MemUserDataBase>> memRefs_;
@@ -308,7 +352,11 @@ class Serializer {
 
   LuaPrimitiveObject serialize(int index);
   LuaRefList finish() {
-    return std::move(finishLocal().makePortable(options_));
+    auto data = finishLocal();
+    detail::StatsTimer timer(
+        detail::statsCounter(options_.stats,
+                             &SerializationStats::makePortableUs));
+    return std::move(data.makePortable(options_));
   }
 
   MemSerializedData finishLocal();
@@ -330,14 +378,34 @@ class Serializer {
                            const SerializationContext& ctx, int level);
   bool doSerializeUserData(LuaRefObject& ref,
                            int index, int mtIndex, int level);
+  bool doSerializeCData(LuaRefObject& ref, int index);
   void doSerializeMemUserData(
       LuaRefObject& ref,
       std::unique_ptr<detail::MemUserDataBase> memRef);
 
+  // Statistics helpers; no-ops unless options_.stats is set
+  void recordStats(folly::StringPiece kind, uint64_t bytes);
+  void recordSubtree(uint64_t startBytes);
+  void pushStatsPathKey(int keyIndex);
+  void pushStatsPathIndex(int64_t i);
+  void pushStatsPath(folly::StringPiece component);
+  void popStatsPath();
+  void flushLargestSubtrees();
+
   lua_State* L_;
 
   MemSerializedData refs_;
   Options options_;
+
+  // Payload bytes serialized so far; subtree sizes are computed as
+  // differences
+  uint64_t statsBytes_ = 0;
+  // Key path of the object currently being serialized, and the lengths of
+  // statsPath_ before each component was pushed
+  std::string statsPath_;
+  std::vector<size_t> statsPathLengths_;
+  // Min-heap of the largest subtrees seen since the last finish()
+  std::vector<std::pair<uint64_t, std::string>> largestSubtrees_;
 };
 
 struct DeserializerOptions {
@@ -346,6 +414,8 @@ struct DeserializerOptions {
   bool allowBytecode = true;
   // Memory sharing
   thpp::SharingMode sharing = thpp::SHARE_IOBUF_MANAGED;
+  // If not null, record the time spent creating Lua objects
+  SerializationStats* stats = nullptr;
 };
 
 // In the common case of deserializing only one object,
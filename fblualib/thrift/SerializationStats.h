@@ -0,0 +1,120 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef FBLUA_THRIFT_SERIALIZATIONSTATS_H_
+#define FBLUA_THRIFT_SERIALIZATIONSTATS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fblualib { namespace thrift {
+
+// Optional statistics collected during serialization and deserialization.
+//
+// Pass a pointer to a SerializationStats object to Serializer (through
+// SerializerOptions::stats), encode(), decode(), or Deserializer (through
+// DeserializerOptions::stats). Each of these only fills in the fields for the
+// phases it performs, and all counters accumulate, so the same object may be
+// passed to all of them (and reused across multiple objects).
+struct SerializationStats {
+  // Wall time per phase, in microseconds
+
+  // Serialization
+  int64_t traverseUs = 0;       // Lua traversal (Serializer::serialize)
+  int64_t makePortableUs = 0;   // MemSerializedData::makePortable
+  int64_t encodeUs = 0;         // Thrift encoding (in encode())
+  int64_t compressUs = 0;       // compression (in encode())
+  int64_t writeUs = 0;          // calls to the writer (in encode())
+
+  // Deserialization
+  int64_t readUs = 0;           // calls to the reader (in decode())
+  int64_t uncompressUs = 0;     // decompression (in decode())
+  int64_t decodeUs = 0;         // Thrift decoding (in decode())
+  int64_t deserializeUs = 0;    // creating Lua objects (Deserializer)
+
+  // Size of the Thrift-encoded data, before and after compression
+  uint64_t uncompressedBytes = 0;
+  uint64_t compressedBytes = 0;
+
+  // Most uncompressed data decode() held at once, in bytes (not counting
+  // buffers shared by the decoded object, such as tensor data). A maximum
+  // rather than a sum.
+  uint64_t maxBufferedBytes = 0;
+
+  // Number and total payload size of serialized values, by kind:
+  // "number", "boolean", "string", "table", "function" (bytecode),
+  // "tensor:<type>", "storage:<type>", "userdata:<key>", "external".
+  //
+  // Payload sizes are those of the data itself (string length, bytecode
+  // length, tensor elements); the Thrift encoding overhead is not included.
+  // The size of custom userdata serialized in local mode is not known
+  // (as it's not serialized until makePortable() is called) and is recorded
+  // as 0.
+  struct Count {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+  };
+  std::map<std::string, Count> kinds;
+
+  // If non-zero, the Serializer records the maxLargestSubtrees largest tables,
+  // as (key path, payload bytes) pairs, in decreasing order of size. The size
+  // of a table includes everything reachable from it that wasn't already
+  // serialized (objects reachable from multiple places are counted the first
+  // time they're encountered).
+  //
+  // Key paths look like "model.layers[3].weight"; "<root>" is the
+  // serialized object itself.
+  size_t maxLargestSubtrees = 0;
+  std::vector<std::pair<std::string, uint64_t>> largestSubtrees;
+};
+
+namespace detail {
+
+// RAII timer: add the wall time (in microseconds) between construction and
+// destruction to *counter. Does nothing if counter is null.
+class StatsTimer {
+ public:
+  explicit StatsTimer(int64_t* counter) : counter_(counter) {
+    if (counter_) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~StatsTimer() {
+    if (counter_) {
+      *counter_ += std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start_).count();
+    }
+  }
+
+  StatsTimer(const StatsTimer&) = delete;
+  StatsTimer& operator=(const StatsTimer&) = delete;
+
+ private:
+  int64_t* counter_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Return a pointer to the given counter, or null if stats is null; to be
+// passed to StatsTimer.
+inline int64_t* statsCounter(SerializationStats* stats,
+                             int64_t SerializationStats::* counter) {
+  return stats ? &(stats->*counter) : nullptr;
+}
+
+}  // namespace detail
+
+}}  // namespaces
+
+#endif /* FBLUA_THRIFT_SERIALIZATIONSTATS_H_ */
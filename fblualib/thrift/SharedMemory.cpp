@@ -0,0 +1,242 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "SharedMemory.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <folly/Exception.h>
+#include <folly/FileUtil.h>
+#include <folly/Portability.h>
+#include <folly/ScopeGuard.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+namespace fblualib { namespace thrift {
+
+namespace {
+
+constexpr uint32_t kMagic = 0x5341554c;  // "LUAS", little-endian
+constexpr uint64_t kAlignment = 4096;
+
+// Segment layout (all values in native byte order, as the segment never
+// leaves the host):
+//
+// Header
+// BufferEntry[bufferCount]
+// encoded object (see encode() in Encoding.h), without tensor / storage /
+// cdata buffers
+// tensor / storage / cdata buffers, each starting at a kAlignment boundary
+
+FOLLY_PACK_PUSH
+struct Header {
+  uint32_t magic;           // kMagic
+  uint32_t bufferCount;     // number of BufferEntry records
+  uint64_t encodedLength;   // length of the encoded object
+} FOLLY_PACK_ATTR;
+
+struct BufferEntry {
+  uint64_t refIndex;        // index in LuaObject.refs of tensor / storage
+  uint64_t bufferIndex;     // index in the reference's buffers (refBuffers)
+  uint64_t offset;          // offset of data in segment
+  uint64_t length;          // length of data
+} FOLLY_PACK_ATTR;
+FOLLY_PACK_POP
+
+// Return pointers to the data buffers of a reference: the data of a tensor
+// or storage, or the buffers of a cdata object
+std::vector<folly::IOBuf*> refBuffers(LuaRefObject& ref) {
+  std::vector<folly::IOBuf*> buffers;
+  if (ref.__isset.tensorVal) {
+    buffers.push_back(&ref.tensorVal.data);
+  } else if (ref.__isset.storageVal) {
+    buffers.push_back(&ref.storageVal.data);
+  } else if (ref.__isset.cdataVal) {
+    for (auto& buf : ref.cdataVal.buffers) {
+      buffers.push_back(&buf);
+    }
+  }
+  return buffers;
+}
+
+int createMemFd() {
+  int fd = syscall(__NR_memfd_create, "fblualib_thrift", MFD_CLOEXEC);
+  folly::checkUnixError(fd, "memfd_create");
+  return fd;
+}
+
+void pwriteChecked(int fd, const void* data, size_t size, off_t offset) {
+  if (folly::pwriteFull(fd, data, size, offset) != ssize_t(size)) {
+    folly::throwSystemError("writeSharedMemory: pwrite");
+  }
+}
+
+class Mapping {
+ public:
+  Mapping(void* data, size_t size) : data_(data), size_(size) { }
+  ~Mapping() { munmap(data_, size_); }
+
+  Mapping(const Mapping&) = delete;
+  Mapping& operator=(const Mapping&) = delete;
+
+  uint8_t* data() const { return static_cast<uint8_t*>(data_); }
+  size_t size() const { return size_; }
+
+ private:
+  void* data_;
+  size_t size_;
+};
+
+// Return a managed IOBuf pointing to [offset, offset + length) in the
+// mapping, which keeps the mapping alive.
+folly::IOBuf wrapMapping(const std::shared_ptr<Mapping>& mapping,
+                         uint64_t offset, uint64_t length) {
+  if (offset > mapping->size() || length > mapping->size() - offset) {
+    throw std::runtime_error("Invalid shared memory segment: out of bounds");
+  }
+  return folly::IOBuf(
+      folly::IOBuf::TAKE_OWNERSHIP,
+      mapping->data() + offset,
+      length,
+      [] (void* /*buf*/, void* userData) {
+        delete static_cast<std::shared_ptr<Mapping>*>(userData);
+      },
+      new std::shared_ptr<Mapping>(mapping));
+}
+
+}  // namespace
+
+int writeSharedMemory(LuaObject&& obj, LuaVersionInfo versionInfo) {
+  std::vector<BufferEntry> entries;
+  std::vector<folly::IOBuf> buffers;
+  for (size_t i = 0; i < obj.refs.size(); ++i) {
+    auto refBufs = refBuffers(obj.refs[i]);
+    for (size_t j = 0; j < refBufs.size(); ++j) {
+      auto data = refBufs[j];
+      if (data->empty()) {
+        continue;
+      }
+      entries.push_back(BufferEntry{i, j, 0, data->computeChainDataLength()});
+      buffers.push_back(std::move(*data));
+      *data = folly::IOBuf();
+    }
+  }
+
+  StringWriter writer;
+  encode(obj, folly::io::CodecType::NO_COMPRESSION, std::move(versionInfo),
+         writer);
+  auto encoded = writer.finish();
+
+  Header header;
+  header.magic = kMagic;
+  header.bufferCount = entries.size();
+  header.encodedLength = encoded.size();
+
+  uint64_t offset = sizeof(Header) + entries.size() * sizeof(BufferEntry) +
+    encoded.size();
+  for (auto& e : entries) {
+    offset = (offset + kAlignment - 1) & ~(kAlignment - 1);
+    e.offset = offset;
+    offset += e.length;
+  }
+
+  int fd = createMemFd();
+  SCOPE_FAIL {
+    close(fd);
+  };
+
+  folly::checkUnixError(ftruncate(fd, offset), "ftruncate");
+
+  offset = 0;
+  pwriteChecked(fd, &header, sizeof(Header), offset);
+  offset += sizeof(Header);
+  if (!entries.empty()) {
+    pwriteChecked(fd, entries.data(), entries.size() * sizeof(BufferEntry),
+                  offset);
+    offset += entries.size() * sizeof(BufferEntry);
+  }
+  pwriteChecked(fd, encoded.data(), encoded.size(), offset);
+
+  for (size_t i = 0; i < entries.size(); ++i) {
+    offset = entries[i].offset;
+    for (auto range : buffers[i]) {
+      pwriteChecked(fd, range.data(), range.size(), offset);
+      offset += range.size();
+    }
+  }
+
+  return fd;
+}
+
+DecodedObject readSharedMemory(int fd) {
+  struct stat st;
+  folly::checkUnixError(fstat(fd, &st), "fstat");
+  size_t size = st.st_size;
+  if (size < sizeof(Header)) {
+    throw std::runtime_error("Invalid shared memory segment: too short");
+  }
+
+  // Private mapping: pages are shared with the writer (and all other
+  // readers) until written to, so modifying the decoded tensors doesn't
+  // affect anyone else.
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) {
+    folly::throwSystemError("readSharedMemory: mmap");
+  }
+  auto mapping = std::make_shared<Mapping>(p, size);
+
+  Header header;
+  memcpy(&header, mapping->data(), sizeof(Header));
+  if (header.magic != kMagic) {
+    throw std::runtime_error("Invalid shared memory segment: bad magic");
+  }
+
+  uint64_t offset = sizeof(Header);
+  if (header.bufferCount > (size - offset) / sizeof(BufferEntry)) {
+    throw std::runtime_error("Invalid shared memory segment: too short");
+  }
+  std::vector<BufferEntry> entries(header.bufferCount);
+  if (!entries.empty()) {
+    memcpy(entries.data(), mapping->data() + offset,
+           entries.size() * sizeof(BufferEntry));
+    offset += entries.size() * sizeof(BufferEntry);
+  }
+
+  auto encoded = wrapMapping(mapping, offset, header.encodedLength);
+  IOBufReader reader(&encoded);
+  auto decoded = decode(reader);
+
+  auto& refs = decoded.output.refs;
+  for (auto& e : entries) {
+    std::vector<folly::IOBuf*> refBufs;
+    if (e.refIndex < refs.size()) {
+      refBufs = refBuffers(refs[e.refIndex]);
+    }
+    if (e.bufferIndex >= refBufs.size()) {
+      throw std::runtime_error(
+          "Invalid shared memory segment: bad buffer entry");
+    }
+    *refBufs[e.bufferIndex] = wrapMapping(mapping, e.offset, e.length);
+  }
+
+  return decoded;
+}
+
+}}  // namespaces
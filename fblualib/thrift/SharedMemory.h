@@ -0,0 +1,50 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+// Shared-memory transport for serialized Lua objects between processes on
+// the same host.
+//
+// writeSharedMemory() places a serialized object in a new anonymous shared
+// memory segment (memfd) and returns its file descriptor; pass the fd to
+// another process (by fork(), or over a Unix domain socket with
+// SCM_RIGHTS), which calls readSharedMemory() on it. The data of all tensors
+// and storages is stored page-aligned in the segment; on the receiving side,
+// the decoded tensors and storages point directly into a (copy-on-write)
+// mapping of the segment, so they share the same physical pages rather than
+// being copied. ffivector (cdata) buffers are also page-aligned, and
+// deserializing copies them straight from the mapping into the new
+// vectors.
+//
+// The segment's lifetime is refcounted by the kernel: it is freed when all
+// file descriptors referring to it are closed and all mappings are gone
+// (that is, when all tensors created from it have been freed). Both sides
+// may close their fd as soon as they're done with writeSharedMemory() /
+// readSharedMemory().
+
+#ifndef FBLUA_THRIFT_SHAREDMEMORY_H_
+#define FBLUA_THRIFT_SHAREDMEMORY_H_
+
+#include <fblualib/thrift/Encoding.h>
+#include <fblualib/thrift/if/gen-cpp2/LuaObject_types.h>
+
+namespace fblualib { namespace thrift {
+
+// Write obj to a new shared memory segment and return its file
+// descriptor, which the caller must close. Tensor and storage data is
+// moved out of obj.
+int writeSharedMemory(LuaObject&& obj, LuaVersionInfo versionInfo);
+
+// Decode an object from the shared memory segment referred to by fd.
+// The fd is not closed.
+DecodedObject readSharedMemory(int fd);
+
+}}  // namespaces
+
+#endif /* FBLUA_THRIFT_SHAREDMEMORY_H_ */
@@ -11,7 +11,8 @@
 --
 -- Supports all Lua types except coroutines (including functions, which are
 -- serialized as bytecode, together with their upvalues), as well as torch
--- Tensor and Storage objects.
+-- Tensor and Storage objects, and fb.ffivector vectors of numbers (and
+-- string arenas), if fb.ffivector is installed.
 --
 -- The core functions are to_file / to_string for serialization,
 -- from_file / from_string for deserialization.
@@ -38,6 +39,40 @@
 -- thrift.from_string(str, [envs])
 --   Deserialize an object from the string and return it.
 --
+-- All four functions above accept an optional last argument, "stats"; if it is
+-- true (or a number), they also return a table of statistics: time spent
+-- in each phase (in seconds), encoded sizes, the number and payload size of
+-- serialized values of each kind ("string", "table", "function",
+-- "tensor:float", "userdata:<key>", ...), when deserializing, the most
+-- uncompressed data held at once (max_buffered_bytes), and, when
+-- serializing, the largest tables reachable from obj, by key path (10 by
+-- default, or as many as "stats" if it's a number). For example:
+--
+-- local str, stats = thrift.to_string(obj, thrift.codec.LZ4, nil, nil, true)
+-- print(stats.time.compress, stats.kinds['tensor:float'].bytes)
+-- for _, s in ipairs(stats.largest_subtrees) do print(s.path, s.bytes) end
+--
+-- thrift.from_strings(strs, [envs, [num_threads]])
+--   Deserialize a list of strings and return a list of objects. The Thrift
+--   decoding and decompression run in parallel, on up to num_threads threads
+--   (default: the number of CPUs) from a pool shared by all calls, or
+--   serially if there's less than 1MB of input; only creating the Lua
+--   objects happens on the calling thread.
+--
+-- thrift.to_shm(obj, [envs])
+--   Serialize obj into a new shared memory segment (memfd) and return its
+--   file descriptor. Tensor and storage data is stored page-aligned, so
+--   that it can be mapped (rather than copied) by the receiver. Pass the
+--   fd to another process on the same host (by fork(), or over a Unix
+--   domain socket) and close it with thrift.close_shm(fd) when done.
+--
+-- thrift.from_shm(fd, [envs])
+--   Deserialize an object from a shared memory segment created by to_shm.
+--   Tensors and storages point directly into a copy-on-write mapping of
+--   the segment; modifying them doesn't affect the sender (or other
+--   receivers). The segment is freed once all fds referring to it are
+--   closed and all such tensors are garbage collected.
+--
 -- Torch and Penlight classes are handled specially (see below):
 -- - Torch classes only serialize data members, not methods. They serialize
 --   the (globally unique, as Torch requires) type name instead of the
@@ -118,41 +153,61 @@ M.invert_envs = invert_envs
 -- Similar to to_string (below), but you are responsible for calling
 -- invert_envs directly; this is useful if you want to cache the same
 -- envs across calls.
-local function to_string_inv(obj, codec, inverted_envs, chunk_size)
-    return lib._to_string(obj, codec, inverted_envs, chunk_size)
+local function to_string_inv(obj, codec, inverted_envs, chunk_size, stats)
+    return lib._to_string(obj, codec, inverted_envs, chunk_size, stats)
 end
 M.to_string_inv = to_string_inv
 
 -- Serialize to a Lua string
 -- str = to_string(obj)
-local function to_string(obj, codec, envs, chunk_size)
-    return to_string_inv(obj, codec, invert_envs(envs), chunk_size)
+local function to_string(obj, codec, envs, chunk_size, stats)
+    return to_string_inv(obj, codec, invert_envs(envs), chunk_size, stats)
 end
 M.to_string = to_string
 
 -- Similar to to_file (below), but you are responsible for calling
 -- invert_envs directly; this is useful if you want to cache the same
 -- envs across calls.
-local function to_file_inv(obj, f, codec, inverted_envs, chunk_size)
-    return lib._to_file(obj, encode_file(f), codec, inverted_envs, chunk_size)
+local function to_file_inv(obj, f, codec, inverted_envs, chunk_size, stats)
+    return lib._to_file(obj, encode_file(f), codec, inverted_envs, chunk_size,
+                        stats)
 end
 M.to_file_inv = to_file_inv
 
 -- Serialize to a Lua open file
-local function to_file(obj, f, codec, envs, chunk_size)
-    return to_file_inv(obj, f, codec, invert_envs(envs), chunk_size)
+local function to_file(obj, f, codec, envs, chunk_size, stats)
+    return to_file_inv(obj, f, codec, invert_envs(envs), chunk_size, stats)
 end
 M.to_file = to_file
 
 -- Deserialize from a Lua string
-local function from_string(s, envs)
-    return lib._from_string(s, envs)
+local function from_string(s, envs, stats)
+    return lib._from_string(s, envs, stats)
 end
 M.from_string = from_string
 
+-- Deserialize a list of Lua strings, decoding in parallel
+local function from_strings(strs, envs, num_threads)
+    return lib._from_strings(strs, envs, num_threads)
+end
+M.from_strings = from_strings
+
+-- Serialize to / deserialize from a shared memory segment
+local function to_shm(obj, envs)
+    return lib._to_shm(obj, invert_envs(envs))
+end
+M.to_shm = to_shm
+
+local function from_shm(fd, envs)
+    return lib._from_shm(fd, envs)
+end
+M.from_shm = from_shm
+
+M.close_shm = lib._close_shm
+
 -- Deserialize from a Lua open file; the file pointer is moved past the data.
-local function from_file(f, envs)
-    return lib._from_file(encode_file(f), envs)
+local function from_file(f, envs, stats)
+    return lib._from_file(encode_file(f), envs, stats)
 end
 M.from_file = from_file
 
@@ -299,6 +354,14 @@ end
 -- Register our callbacks with the C library.
 lib._set_callbacks(serialize_callback, deserialize_callback)
 
+-- ffivectors are cdata, which fb.ffivector knows how to serialize
+local ok, ffivector = pcall(require, 'fb.ffivector')
+if ok then
+    lib._set_cdata_callbacks(ffivector._thrift_serialize,
+                             ffivector._thrift_deserialize,
+                             ffivector._thrift_is_owner)
+end
+
 -- Is this a Penlight class?  this is the best we can do...
 local function is_penlight_class(v)
     return type(v) == 'table' and getmetatable(v) and v._class == v
@@ -10,10 +10,11 @@
 // Thrift serialization for arbitrary Lua objects.
 //
 // We support primitive types (nil, number, boolean, string) and
-// reference types (string, table, function, userdata). The only
-// supported userdata is torch tensors. Note that string may be either
-// a primitive type or a reference type, depending on whether it's interned
-// or not.
+// reference types (string, table, function, userdata, cdata). The only
+// supported userdata is torch tensors (and custom userdata with registered
+// callbacks); the only supported cdata is fb.ffivector vectors. Note that
+// string may be either a primitive type or a reference type, depending on
+// whether it's interned or not.
 //
 // We store all objects of reference types in LuaObject.refs. LuaPrimitive
 // represents an object of a primitive type, or the index of a reference
@@ -81,6 +82,13 @@ struct LuaUserData {
   2: required IOBuf value,
 }
 
+// A LuaJIT cdata object (an ffivector), as a type key and the contents of
+// its buffers; see setCDataSerializationCallbacks
+struct LuaCData {
+  1: required string key,
+  2: required list<IOBuf> buffers,
+}
+
 struct LuaRefObject {
   1: optional binary stringVal,
   2: optional LuaTable tableVal,
@@ -90,6 +98,7 @@ struct LuaRefObject {
   6: optional LuaExternalEnvLocation envLocation,
   7: optional LuaUserData customUserDataVal,
   8: optional i64 memRefVal,
+  9: optional LuaCData cdataVal,
 }
 
 typedef list<LuaRefObject> LuaRefList
@@ -113,6 +122,7 @@ struct ThriftHeader {
   // 2 = support for chunked encoding
   // 3 = support for external environments
   // 4 = support for custom userdata
+  // 5 = support for cdata (ffivectors)
   1: i32 version,
   2: i32 codec,
   3: i64 uncompressedLength,
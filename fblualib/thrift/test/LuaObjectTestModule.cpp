@@ -42,6 +42,28 @@ int writeTensor(lua_State* L) {
   return pushAsString(L, make(*p));
 }
 
+int writeBuiltTable(lua_State* L) {
+  auto p = luaGetTensorChecked<double>(L, 1);
+
+  LuaObjectBuilder builder;
+  auto root = builder.newTable(0, 4, 1);
+
+  auto numbers = builder.newTable(3);
+  numbers.appendNumbers(std::vector<double>{10, 20, 30});
+
+  auto words = builder.newTable(3);
+  words.appendStrings(std::vector<std::string>{"hello", "world", "hello"},
+                      true);
+
+  root.set("numbers", numbers.ref());
+  root.set("words", words.ref());
+  root.set("t1", builder.tensor(*p));
+  root.set("t2", builder.tensor(*p));
+  root.set(100, builder.string("hello"));
+
+  return pushAsString(L, builder.finish(root.ref()));
+}
+
 LuaObject getFromString(lua_State* L, int /*index*/) {
   folly::ByteRange br(luaGetStringChecked(L, 1));
   StringReader reader(&br);
@@ -210,6 +232,7 @@ const struct luaL_reg gFuncs[] = {
   {"write_double", writeDouble},
   {"write_string", writeString},
   {"write_tensor", writeTensor},
+  {"write_built_table", writeBuiltTable},
   // read_ functions read a string representing a Thrift-encoded value,
   // decode it, check that the type matches, and return the decoded value
   {"read_nil", readNil},
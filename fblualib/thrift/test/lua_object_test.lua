@@ -83,4 +83,21 @@ function testTableIteration()
     lib.check_table_iteration(thrift.to_string(t))
 end
 
+function testTableBuilder()
+    local t = torch.DoubleTensor():rand(5, 10)
+    local obj = thrift.from_string(lib.write_built_table(t))
+    assertEquals(3, #obj.numbers)
+    for i = 1, 3 do
+        assertEquals(i * 10, obj.numbers[i])
+    end
+    assertEquals(3, #obj.words)
+    assertEquals('hello', obj.words[1])
+    assertEquals('world', obj.words[2])
+    assertEquals('hello', obj.words[3])
+    assertEquals('hello', obj[100])
+    assertTensorEquals(t, obj.t1)
+    -- deduplicated: same tensor object
+    assertTrue(obj.t1 == obj.t2)
+end
+
 LuaUnit:main()
@@ -116,6 +116,156 @@ function testThriftSerializationToFile()
     assertEquals(42, thrift.from_file(file))
 end
 
+function testThriftSerializationFromPipe()
+    local filename = os.tmpname()
+    local file = io.open(filename, 'wb')
+    local t = torch.randn(100, 100)
+    -- Small chunk size, so that decoding happens one chunk at a time
+    thrift.to_file({'hello', t}, file, thrift.codec.LZ4, nil, 1000)
+    thrift.to_file(42, file, thrift.codec.LZ4, nil, 1000)
+    file:close()
+
+    local pipe = io.popen('cat ' .. filename)
+    local obj = thrift.from_file(pipe)
+    assertEquals('hello', obj[1])
+    assertTensorEquals(t, obj[2])
+    assertEquals(42, thrift.from_file(pipe))
+    pipe:close()
+    os.remove(filename)
+end
+
+function testThriftDecodingBuffersLittle()
+    local obj = {}
+    for i = 1, 100 do
+        obj[i] = torch.DoubleTensor(1000):fill(i)
+    end
+    local str = thrift.to_string(obj, thrift.codec.LZ4, nil, 4096)
+    local decoded, stats = thrift.from_string(str, nil, true)
+    for i = 1, 100 do
+        assertTensorEquals(obj[i], decoded[i])
+    end
+    -- About one tensor's worth, rather than all of them
+    assertTrue(stats.max_buffered_bytes > 0)
+    assertTrue(stats.max_buffered_bytes < stats.uncompressed_bytes / 10)
+
+    -- Unchunked data is decompressed in one piece
+    _, stats = thrift.from_string(thrift.to_string(obj), nil, true)
+    assertEquals(stats.uncompressed_bytes, stats.max_buffered_bytes)
+end
+
+function testThriftSerializationStats()
+    local obj = {
+        a = {x = torch.FloatTensor(100):zero(), y = 'hello'},
+        b = {1, 2, 3},
+    }
+    local str, stats = thrift.to_string(obj, thrift.codec.LZ4, nil, nil, 2)
+    assertEquals(obj.b, thrift.from_string(str).b)
+    assertEquals(1, stats.kinds['tensor:float'].count)
+    assertEquals(400, stats.kinds['tensor:float'].bytes)
+    assertEquals(3, stats.kinds.table.count)
+    assertEquals(3, stats.kinds.number.count)
+    assertTrue(stats.compressed_bytes < #str)
+    assertEquals(2, #stats.largest_subtrees)
+    assertEquals('<root>', stats.largest_subtrees[1].path)
+    assertEquals('a', stats.largest_subtrees[2].path)
+    assertEquals(405, stats.largest_subtrees[2].bytes)
+    assertTrue(stats.time.traverse >= 0)
+
+    local decoded, dstats = thrift.from_string(str, nil, true)
+    assertEquals('hello', decoded.a.y)
+    assertEquals(stats.compressed_bytes, dstats.compressed_bytes)
+    assertEquals(stats.uncompressed_bytes, dstats.uncompressed_bytes)
+end
+
+function testThriftSerializationFromStrings()
+    local objs = {}
+    local strs = {}
+    for i = 1, 50 do
+        objs[i] = {i, tostring(i), t = torch.DoubleTensor(10):fill(i)}
+        strs[i] = thrift.to_string(objs[i], codec, nil, 100)
+    end
+    for _, num_threads in ipairs({1, 4}) do
+        local decoded = thrift.from_strings(strs, nil, num_threads)
+        assertEquals(#objs, #decoded)
+        for i = 1, #objs do
+            assertEquals(objs[i][1], decoded[i][1])
+            assertEquals(objs[i][2], decoded[i][2])
+            assertTensorEquals(objs[i].t, decoded[i].t)
+        end
+    end
+    assertEquals(0, #thrift.from_strings({}))
+end
+
+function testThriftSerializationSharedMemory()
+    local obj = {
+        a = torch.FloatTensor(1000):fill(42),
+        b = {1, 2, 'hello'},
+    }
+    obj.c = obj.a
+    local fd = thrift.to_shm(obj)
+    local obj1 = thrift.from_shm(fd)
+    local obj2 = thrift.from_shm(fd)
+    thrift.close_shm(fd)
+
+    assertTensorEquals(obj.a, obj1.a)
+    assertEquals(obj.b, obj1.b)
+    assertTrue(obj1.a == obj1.c)
+
+    -- copy-on-write: receivers don't see each other's changes
+    obj1.a:zero()
+    assertTensorEquals(obj.a, obj2.a)
+end
+
+function testThriftSerializationFFIVector()
+    local ok, ffivector = pcall(require, 'fb.ffivector')
+    if not ok then
+        return
+    end
+
+    local ints = ffivector.new_int64_t()
+    local floats = ffivector.new_float()
+    local strs = ffivector.new_string_arena()
+    for i = 1, 1000 do
+        ints[i] = i * i
+        floats[i] = i / 2
+        strs[i] = tostring(i)
+    end
+    strs[1001] = ''
+    local obj = {ints = ints, floats = floats, strs = strs,
+                 empty = ffivector.new_double(),
+                 borrowed = ffivector.from_tensor(torch.IntTensor(10):fill(3))}
+    obj.same = ints
+
+    local function verify(obj1)
+        assertEquals(1000, #obj1.ints)
+        assertEquals(1000, #obj1.floats)
+        assertEquals(1001, #obj1.strs)
+        for i = 1, 1000 do
+            assertEquals(i * i, obj1.ints[i])
+            assertEquals(i / 2, obj1.floats[i])
+            assertEquals(tostring(i), obj1.strs[i])
+        end
+        assertEquals('', obj1.strs[1001])
+        assertEquals(0, #obj1.empty)
+        assertEquals(30, obj1.borrowed:sum())
+        assertTrue(rawequal(obj1.ints, obj1.same))
+        assertEquals(1000 * 1001 * 2001 / 6, obj1.ints:sum())
+        obj1.ints[1001] = 42  -- a vector of its own
+        assertEquals(1000, #obj.ints)
+    end
+
+    verify(thrift.from_string(thrift.to_string(obj, codec)))
+    verify(thrift.from_string(thrift.to_string(obj, codec, nil, 1000)))
+    ints:reserve(100000)  -- no longer pinned by the serializer
+
+    local fd = thrift.to_shm(obj)
+    local obj1 = thrift.from_shm(fd)
+    thrift.close_shm(fd)
+    verify(obj1)
+
+    assertError(thrift.to_string, {ffi = ffivector.new_string()})
+end
+
 function testThriftSerializationFunction()
     local u1 = 10
     local f1 = function(x) return u1 + x end